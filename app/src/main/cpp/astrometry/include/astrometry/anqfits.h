@@ -9,6 +9,7 @@
 #define ANQFITS_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "astrometry/qfits_header.h"
 #include "astrometry/qfits_table.h"
@@ -77,6 +78,10 @@ typedef struct {
     int Nexts;    // # of extensions in file
     anqfits_ext_t* exts;
     off_t filesize ; // File size in FITS blocks
+    // For anqfits_open_fd(): our own copy of the descriptor, and the byte
+    // offset of the FITS data within it.  fd is -1 for named files.
+    int fd;
+    off_t offset;
 } anqfits_t;
 
 
@@ -87,6 +92,28 @@ anqfits_t* anqfits_open(const char* filename);
 // number of HDUs the file is reported to contain will be hdu+1.
 anqfits_t* anqfits_open_hdu(const char* filename, int hdu);
 
+// Reads "length" bytes of FITS data starting at byte "offset" of the open
+// file "fd" -- for example, a file stored uncompressed inside a larger
+// container.  If "length" < 0, the data extend to the end of the file.
+// "name" is used in messages and may be NULL.  "fd" is dup()ed, so the
+// caller may close it, but its file position is changed.
+anqfits_t* anqfits_open_fd(int fd, off_t offset, off_t length,
+                           const char* name);
+
+// Builds an anqfits_t from a known extension layout (the block offsets
+// and sizes in "exts", eg from an earlier anqfits_open()) without reading
+// the file.  Headers are read when first asked for.  "fd" is -1 to read
+// "filename", or a descriptor to dup(), with the FITS data starting at
+// byte "offset", as for anqfits_open_fd().
+anqfits_t* anqfits_open_layout(const char* filename, int fd, off_t offset,
+                               off_t filesize, int Nexts,
+                               const anqfits_ext_t* exts);
+
+// Opens a new FILE* on the file "qf" was read from.  Offsets from
+// anqfits_header_start(), anqfits_data_start() etc. are relative to the
+// start of the FITS data: add qf->offset before seeking or mmapping.
+FILE* anqfits_reopen(const anqfits_t* qf);
+
 void anqfits_close(anqfits_t* qf);
 
 int anqfits_n_ext(const anqfits_t* qf);
@@ -93,6 +93,18 @@ int fit_tan_wcs(const double* starxyz,
                 tan_t* wcstan,
                 double* p_scale);
 
+/*
+ Same as fit_tan_wcs(), specialized for the handful of stars in a quad
+ (2 <= nobjs <= DQMAX).  Does no heap allocation and does not use GSL;
+ returns -1 for degenerate inputs.
+ */
+int fit_tan_wcs_quad(const double* starxyz,
+                     const double* fieldxy,
+                     int nobjs,
+                     // output:
+                     tan_t* wcstan,
+                     double* p_scale);
+
 int fit_tan_wcs_weighted(const double* starxyz,
                          const double* fieldxy,
                          const double* weights,
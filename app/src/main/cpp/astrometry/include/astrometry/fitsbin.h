@@ -104,6 +104,9 @@ struct fitsbin_chunk_t {
 
     qfits_header* header;
 
+    // The FITS extension the table was read from.
+    int ext;
+
     // Writing:
     off_t header_start;
     off_t header_end;
@@ -202,6 +205,29 @@ fitsbin_chunk_t* fitsbin_add_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk);
  */
 int fitsbin_read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk);
 
+/**
+ Maps the data of FITS extension "ext" as the table "chunk", whose
+ "itemsize" and "nrows" must be set, and adds it to "fb" -- like
+ fitsbin_read_chunk(), but for a table whose location is already known
+ (eg, from the "ext" of a chunk read earlier).  No FITS headers are read;
+ "chunk->header" is left NULL and "callback_read_header" is not called.
+ */
+int fitsbin_map_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk, int ext);
+
+/**
+ Passes "advice" (one of the MADV_* constants) to madvise() for each
+ chunk that has been mmapped from the file.  Returns -1 if any call
+ failed.
+ */
+int fitsbin_madvise(fitsbin_t* fb, int advice);
+
+/**
+ Reads one byte from each page of each mmapped chunk, so that the
+ chunks are resident when this returns.  Returns the number of mapped
+ bytes covered.
+ */
+size_t fitsbin_touch(fitsbin_t* fb);
+
 FILE* fitsbin_get_fid(fitsbin_t* fb);
 
 int fitsbin_close(fitsbin_t* fb);
@@ -110,6 +110,9 @@ char* index_get_quad_filename(const char* indexname);
 char* index_get_qidx_filename(const char* indexname);
 
 #define INDEX_ONLY_LOAD_METADATA 2
+// Rearrange the star and code kd-tree nodes for cache-friendly searching
+// (see kdtree_reorder_nodes()); costs a copy of their node arrays.
+#define INDEX_REORDER_TREES 4
 
 int index_get_quad_dim(const index_t* index);
 
@@ -132,7 +135,8 @@ index_t* index_build_from(codetree_t* codekd, quadfile_t* quads, startree_t* sta
  *               'myindex'
  *
  *   flags - If INDEX_ONLY_LOAD_METADATA, then only metadata will be
- *               loaded.
+ *               loaded.  If INDEX_REORDER_TREES, the kd-trees' nodes
+ *               are rearranged after loading.
  *
  *   dest - If NULL, a new index_t will be allocated and returned;
  *               otherwise, the results will be put in this index_t
@@ -145,6 +149,28 @@ index_t* index_build_from(codetree_t* codekd, quadfile_t* quads, startree_t* sta
  */
 index_t* index_load(const char* indexname, int flags, index_t* dest);
 
+/**
+ Like index_load(), but reads a single-file index stored as "length"
+ bytes starting at byte "offset" of the open file "fd" (eg, an
+ uncompressed asset inside an APK, or one member of a bundle of
+ concatenated index files).  The tables are mmapped from "fd" in place;
+ nothing is copied.  "fd" is dup()ed, so the caller may close it.
+ "length" < 0 means "to the end of the file"; "name" is used in messages
+ and may be NULL.
+ */
+index_t* index_load_fd(int fd, off_t offset, off_t length, const char* name,
+                       int flags, index_t* dest);
+
+/**
+ Makes index_load() and index_load_fd() (with a "name") keep a small
+ binary metadata file for each index in directory "dir" (see
+ index_meta.h), so that later loads skip parsing the FITS headers.
+ NULL (the default) turns this off.  Safe to call while other threads
+ load indexes (a load in progress may still use the old directory);
+ setting the same directory again does nothing.
+ */
+void index_set_meta_cache_dir(const char* dir);
+
 /**
  Close the quad, skdt, and ckdt files; makes it as though you did
  INDEX_ONLY_LOAD_METADATA.  You can re-load the files with
@@ -154,6 +180,26 @@ void index_unload(index_t* index);
 
 int index_reload(index_t* index);
 
+// Levels for index_prefetch(); each includes the ones before it.
+// Only mark the mmapped data as randomly accessed (no read-ahead).
+#define INDEX_PREFETCH_RANDOM 0
+// Also start reading the star and code kd-trees in the background.
+#define INDEX_PREFETCH_TREES  1
+// Also start reading the quads.
+#define INDEX_PREFETCH_ALL    2
+// Read everything (with read-ahead) before returning.
+#define INDEX_PREFETCH_TOUCH  3
+
+/**
+ Gives the kernel paging hints for the mmapped parts of a loaded
+ index, so that the first solve does not stall on page faults while
+ walking the kd-trees.  "level" is one of INDEX_PREFETCH_*.
+
+ Returns 0 on success, -1 if the index is not loaded or a hint
+ failed (the index remains usable).
+ */
+int index_prefetch(index_t* index, int level);
+
 /**
  Closes the FILE*s in this index.  Once you have index_reload()ed,
  you can call this function and the index will remain valid.
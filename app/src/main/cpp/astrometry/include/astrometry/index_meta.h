@@ -0,0 +1,53 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef AN_INDEX_META_H
+#define AN_INDEX_META_H
+
+#include <sys/types.h>
+
+#include "astrometry/index.h"
+
+/*
+ * Binary "sidecar" files that cache what loading a single-file index
+ * learns from its FITS headers: the extension layout, the index
+ * metadata (scale range, healpix, cut parameters, ...), where each table
+ * lives, and the kd-tree shapes and types.  With a sidecar, an index
+ * is opened with one small read plus the mmaps of its tables, instead of
+ * parsing and copying a few dozen FITS headers.
+ *
+ * A sidecar is named after the index data it describes (file name,
+ * offset and length), and records the size and modification time of the
+ * file holding them; if those no longer match, it is ignored (and
+ * rewritten on the next full load).  Sidecars are written in native byte
+ * order and are not meant to be moved between machines.
+ *
+ * These are called by index_load() and index_load_fd() once a directory
+ * has been set with index_set_meta_cache_dir().
+ */
+
+/**
+ Loads the index stored as "length" bytes at byte "offset" of "filename"
+ (or of the open file "fd", if it is not -1) from its sidecar in "dir".
+ "length" < 0 means "to the end of the file".  On success, fills in
+ "dest"'s FITS file, metadata and (unless "flags" contains
+ INDEX_ONLY_LOAD_METADATA) its star tree, code tree and quads, and
+ returns 0.  Returns -1, leaving "dest" untouched, if there is no valid
+ sidecar.
+ */
+int index_meta_load(index_t* dest, const char* dir, const char* filename,
+                    int fd, off_t offset, off_t length, int flags);
+
+/**
+ Writes the sidecar for "index", which must be fully loaded from
+ "filename" / "fd", "offset", "length" as for index_meta_load(), into
+ "dir".  The file is replaced atomically, so concurrent loaders never
+ see a partial sidecar.
+ */
+int index_meta_save(const index_t* index, const char* dir,
+                    const char* filename, int fd, off_t offset,
+                    off_t length);
+
+#endif
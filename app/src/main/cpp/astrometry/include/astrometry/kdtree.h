@@ -59,6 +59,9 @@ enum kd_build_options {
     KD_BUILD_LINEAR_LR     = 0x10,
     // DEBUG
     KD_BUILD_FORCE_SORT    = 0x20,
+    /* Large trees are built on all CPUs by default (the result is the
+     same as a single-threaded build); this forces a single thread. */
+    KD_BUILD_NO_THREADS    = 0x40,
     
 };
 
@@ -138,6 +141,25 @@ typedef struct kdtree kdtree_t;
 
 struct kdtree_qres;
 typedef struct kdtree_qres kdtree_qres_t;
+struct kdtree_qres_f;
+typedef struct kdtree_qres_f kdtree_qres_f_t;
+
+/*
+ Called by kdtree_rangesearch_batch for each (query, point) pair within
+ range: "query" is the index of the query point, "ind" the index of the
+ tree point (in the original ordering, like kdtree_qres_t.inds), and
+ "dist2" the squared distance between them.
+ */
+typedef void (*kdtree_batch_callback)(void* token, int query, unsigned int ind,
+                                      double dist2);
+
+/* One (query, point) pair found by kdtree_rangesearch_batch_flat. */
+struct kdtree_match {
+    int query;
+    unsigned int ind;
+    double dist2;
+};
+typedef struct kdtree_match kdtree_match_t;
 
 struct kdtree_funcs {
     void* (*get_data)(const kdtree_t* kd, int i);
@@ -149,7 +171,12 @@ struct kdtree_funcs {
     void (*fix_bounding_boxes)(kdtree_t* kd);
 
     void  (*nearest_neighbour_internal)(const kdtree_t* kd, const void* query, double* bestd2, int* pbest);
+    int (*knn)(const kdtree_t* kd, const void* query, int k, double maxd2, int* inds, double* dist2s);
     kdtree_qres_t* (*rangesearch)(const kdtree_t* kd, kdtree_qres_t* res, const void* pt, double maxd2, int options);
+    // Only for float trees.
+    kdtree_qres_f_t* (*rangesearch_float)(const kdtree_t* kd, kdtree_qres_f_t* res, const float* pt, float maxd2, int options);
+    int (*rangesearch_batch_reuse)(const kdtree_t* kd, kdtree_qres_t** res, const void* pts, int npts, double maxd2, int options);
+    int (*rangesearch_batch)(const kdtree_t* kd, const void* pts, int npts, double maxd2, int options, kdtree_batch_callback cb, void* token);
 
     void (*nodes_contained)(const kdtree_t* kd,
                             const void* querylow, const void* queryhi,
@@ -175,6 +202,39 @@ struct kdtree_funcs {
 };
 typedef struct kdtree_funcs kdtree_funcs;
 
+/*
+ Blocked-subtree layout of a per-node array (see kdtree_reorder_nodes()).
+ The tree levels are cut into runs of "levels" levels; each run is split
+ into subtrees that are stored contiguously, in heap order within the
+ subtree, and subtrees are ordered by their roots.  A root-to-leaf
+ descent then touches one block per run instead of one cache line per
+ level.  levels == 0 means plain heap order.
+
+ For a node at a given level, with 1-based heap index m, its slot is
+   base + (m >> shift) * nodes + (m & mask)
+ where m >> shift is its subtree's root and m & mask its offset below it.
+ */
+struct kdtree_blocking_level {
+    int64_t base;
+    u32 shift;
+    u32 mask;
+    u32 nodes;
+};
+
+struct kdtree_blocking {
+    int levels;
+    struct kdtree_blocking_level level[32];
+};
+typedef struct kdtree_blocking kdtree_blocking_t;
+
+struct kdtree_layout {
+    kdtree_blocking_t bb;
+    // Shared by "split" and "splitdim": they keep separate arrays, but a
+    // node's records sit at the same slot of each.
+    kdtree_blocking_t split;
+};
+typedef struct kdtree_layout kdtree_layout_t;
+
 
 struct kdtree {
     /*
@@ -253,6 +313,11 @@ struct kdtree {
 
     int has_linear_lr;
 
+    /* Non-NULL if the bb / split / splitdim arrays have been rearranged
+     by kdtree_reorder_nodes(); the rearranged arrays are owned by the
+     tree, even if it was read from a file. */
+    kdtree_layout_t* layout;
+
     // For i/o: the name of this tree in the file.
     char* name;
 
@@ -274,6 +339,23 @@ struct kdtree_qres {
     } results;
     double *sdists;          /* Squared distance from query point */
     u32 *inds;    /* Indexes into original data set */
+
+    /* Allocated sizes, in bytes, of "sdists" and "results"; these are
+     only grown when a query asks for them, so can lag "capacity". */
+    size_t sdists_bytes;
+    size_t results_bytes;
+};
+
+/* Single-precision results, from kdtree_rangesearch_float. */
+struct kdtree_qres_f {
+    unsigned int nres;
+    unsigned int capacity; /* Allocated size. */
+    float* results;   /* Points, if KD_OPTIONS_RETURN_POINTS */
+    float* sdists;    /* Squared distances, if KD_OPTIONS_COMPUTE_DISTS */
+    u32* inds;        /* Indexes into original data set */
+
+    size_t sdists_bytes;
+    size_t results_bytes;
 };
 
 // Returns the number of data points in this kdtree.
@@ -350,6 +432,34 @@ void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm);
 /* Free results */
 void kdtree_free_query(kdtree_qres_t *res);
 
+void kdtree_free_query_float(kdtree_qres_f_t *res);
+
+/*
+ A pool of reusable query results, for callers that make many short
+ queries: take an empty result from the pool, pass it to one of the
+ *_reuse range searches (with KD_OPTIONS_NO_RESIZE_RESULTS to keep its
+ arrays at full size), and put it back when done.  Once the pool is
+ warm, such queries do no allocation at all.
+
+ A pool is not thread-safe; use one per caller, or this thread's own
+ pool from kdtree_qres_pool_thread().
+ */
+typedef struct kdtree_qres_pool kdtree_qres_pool_t;
+
+kdtree_qres_pool_t* kdtree_qres_pool_new(void);
+
+// Frees the pool and all results in it.
+void kdtree_qres_pool_free(kdtree_qres_pool_t* pool);
+
+// Returns an empty result (nres = 0), allocating one if the pool is empty.
+kdtree_qres_t* kdtree_qres_pool_get(kdtree_qres_pool_t* pool);
+
+// Returns "res" (which need not have come from this pool) to the pool.
+void kdtree_qres_pool_put(kdtree_qres_pool_t* pool, kdtree_qres_t* res);
+
+// This thread's pool: created on first use, freed when the thread exits.
+kdtree_qres_pool_t* kdtree_qres_pool_thread(void);
+
 /* Free a tree; does not free kd->data */
 void kdtree_free(kdtree_t *kd);
 
@@ -416,6 +526,16 @@ int kdtree_nearest_neighbour(const kdtree_t* kd, const void *pt, double* bestd2)
 int kdtree_nearest_neighbour_within(const kdtree_t* kd, const void *pt,
                                     double maxd2, double* bestd2);
 
+/* k nearest neighbours: finds the (up to) "k" points nearest to "pt"
+ * within distance-squared "maxd2" (use HUGE_VAL for no limit), and
+ * writes their indices in the original ordering (like
+ * kdtree_qres_t.inds) to "inds" and their distances-squared to "dist2s",
+ * both of length "k", nearest first.  Returns the number found, which is
+ * less than "k" only if fewer points are in range; -1 on error.
+ */
+int kdtree_knn(const kdtree_t* kd, const void* pt, int k, double maxd2,
+               int* inds, double* dist2s);
+
 /*
  * Finds the set of non-leaf nodes that are completely contained
  * within the given query rectangle, plus the leaf nodes that
@@ -478,6 +598,27 @@ int kdtree_check(const kdtree_t* t);
 
 void kdtree_fix_bounding_boxes(kdtree_t* kd);
 
+/*
+ Rearranges the bounding boxes, split positions and split dimensions
+ into a blocked-subtree layout (see kdtree_blocking_t), sized so that
+ each subtree block fits in a cache line.  Arrays whose records are too
+ big for that are left in heap order.  Searches are unaffected except
+ that deep descents touch far fewer cache lines and pages.
+
+ Only the arrays read on the way down are rearranged.  The leaf arrays
+ ("lr", and "perm" and "data" behind them) stay as they are: they are
+ indexed by leaf or point, not by interior node, and one descent reads
+ just one leaf's entries.
+
+ The tree gets its own copy of the rearranged arrays (for a tree read
+ from a file, the mapped originals are left alone); such a tree can no
+ longer be written out.
+
+ Returns 0 on success (including if there was nothing to do), -1 on
+ allocation failure, in which case the tree is unchanged.
+ */
+int kdtree_reorder_nodes(kdtree_t* kd);
+
 #if 0
 /* Range seach using callback */
 void kdtree_rangesearch_callback(kdtree_t *kd, real *pt, real maxdistsquared,
@@ -596,6 +737,51 @@ kdtree_qres_t* KDFUNC(kdtree_rangesearch_options)(const kdtree_t *kd, const void
  */
 kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)(const kdtree_t *kd, kdtree_qres_t* res, const void *pt, double maxd2, int options);
 
+/*
+ Range search of a KDTT_FLOAT tree in single precision: the query point,
+ radius and the returned distances and points are all floats, so nothing
+ is converted to or from double.  Honours KD_OPTIONS_COMPUTE_DISTS,
+ SORT_DISTS, SMALL_RADIUS, USE_SPLIT and NO_RESIZE_RESULTS; unlike the
+ double searches, points are only returned with KD_OPTIONS_RETURN_POINTS.
+ "res" is reused if non-NULL.  Returns NULL on error or if the tree is
+ not KDTT_FLOAT.  Free the results with kdtree_free_query_float().
+ */
+kdtree_qres_f_t* KDFUNC(kdtree_rangesearch_float)(const kdtree_t *kd, kdtree_qres_f_t* res, const float *pt, float maxd2, int options);
+
+/*
+ Like kdtree_rangesearch_options_reuse, for "npts" query points at once
+ (stored consecutively in "pts"): the tree is descended once for the
+ whole batch.  The results for point i go in res[i], which is allocated
+ if NULL and reused otherwise; free them with kdtree_free_query().
+
+ Returns 0 on success, -1 on failure.
+ */
+int KDFUNC(kdtree_rangesearch_batch_reuse)(const kdtree_t *kd, kdtree_qres_t** res, const void *pts, int npts, double maxd2, int options);
+
+/*
+ Range search for "npts" query points (stored consecutively in "pts")
+ that calls "cb" for each (query, point) pair within range, in no
+ particular order.  The queries are sorted spatially and searched in
+ small groups of neighbours, each group descending the tree once and
+ sharing the node tests.  "options" are as for
+ kdtree_rangesearch_options; distances are always computed, and the
+ options about the result struct are ignored.
+
+ Returns 0 on success, -1 on failure.
+ */
+int KDFUNC(kdtree_rangesearch_batch)(const kdtree_t *kd, const void *pts, int npts, double maxd2, int options, kdtree_batch_callback cb, void* token);
+
+/*
+ Like kdtree_rangesearch_batch, but writes the matches into the
+ caller's buffer "matches" (of size "maxmatches"), sorted by query and
+ then by point index.
+
+ Returns the number of matches, or -1 on failure.  If that is more than
+ "maxmatches", only some of them have been stored (in no particular
+ order); call again with a buffer that big.
+ */
+int KDFUNC(kdtree_rangesearch_batch_flat)(const kdtree_t *kd, const void *pts, int npts, double maxd2, int options, kdtree_match_t* matches, int maxmatches);
+
 #if !defined(KD_DIM)
 #undef KD_DIM_GENERIC
 #endif
@@ -73,6 +73,15 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
 
 int kdtree_fits_read_chunk(kdtree_fits_t* io, fitsbin_chunk_t* chunk);
 
+/**
+ Rebuilds a tree from its tables, which have already been mapped into
+ "io" (eg, with fitsbin_map_chunk()), without reading any FITS headers.
+ The name, type, shape and split masks are copied from "meta", typically
+ a tree read with kdtree_fits_read_tree() earlier.  The result is closed
+ with kdtree_fits_close(), as usual.
+ */
+kdtree_t* kdtree_fits_attach_tree(kdtree_fits_t* io, const kdtree_t* meta);
+
 qfits_header* kdtree_fits_get_primary_header(kdtree_fits_t* io);
 
 
@@ -34,6 +34,39 @@ enum {
 #define DEFAULT_DISTRACTOR_RATIO 0.25
 #define DEFAULT_VERIFY_PIX 1.0
 #define DEFAULT_BAIL_THRESHOLD 1e-100
+#define DEFAULT_PREFILTER_PROBES 8
+#define DEFAULT_PREFILTER_MIN_TESTED 3
+#define DEFAULT_INDEX_LAG 4
+#define DEFAULT_MAX_SOLUTIONS 5
+
+/*
+ Statistics for one index over one solver_run() call, ie, one "depth
+ window" of field objects [startobj, endobj).  Times are wall-clock
+ seconds: "time_search" is spent in code-tree searches, "time_fit" in
+ fitting TAN WCSes to matched quads, "time_verify" in verification
+ (including the prefilter and tuning), and "time_quads" is the rest:
+ building quads and their codes.  The index-independent setup of each
+ run (the pquad rows) is charged to the first index in the schedule.
+ */
+typedef struct {
+    int indexid;
+    int healpix;
+    int startobj;
+    int endobj;
+    int numtries;
+    int nummatches;
+    int numscaleok;
+    int num_cxdx_skipped;
+    int num_meanx_skipped;
+    int num_radec_skipped;
+    int num_abscale_skipped;
+    int num_prefilter_rejected;
+    int num_verified;
+    double time_quads;
+    double time_search;
+    double time_fit;
+    double time_verify;
+} solver_stats_t;
 
 struct verify_field_t;
 struct solver_t {
@@ -93,6 +126,25 @@ struct solver_t {
     // Fraction of distractors in [0,1].
     double distractor_ratio;
 
+    // Before verifying a match, project up to this many bright index stars
+    // near the quad and skip verification if none of them lands on a field
+    // star (and at least "prefilter_min_tested" landed in the image).
+    // Zero disables the prefilter.
+    int prefilter_probes;
+    int prefilter_min_tested;
+
+    // Indexes are tried best-first, by how many bright field AB pairs fit
+    // their quad-size range; each rank behind the best starts this many
+    // field stars later.  Zero tries all indexes at each depth.
+    int index_lag;
+
+    // Keep this many of the best distinct solutions of the current field
+    // (see solver_get_solutions()).  Zero keeps none.
+    int max_solutions;
+
+    // Record a solver_stats_t per index for each solver_run()?
+    anbool collect_stats;
+
     // Code tolerance in 4D codespace L2 distance.
     double codetol;
 
@@ -164,6 +216,8 @@ struct solver_t {
     int num_radec_skipped;
     // 
     int num_abscale_skipped;
+    // number of matches rejected by the pre-verification filter.
+    int num_prefilter_rejected;
     // The number of times we ran verification on a quad.
     int num_verified;
 
@@ -207,8 +261,26 @@ struct solver_t {
     anbool     best_match_solves;
     anbool     have_best_match;
 
+    // The best distinct hits on this field: a min-heap on log-odds, of
+    // "nsolutions" (<= max_solutions) entries.  Cleared with the field.
+    MatchObj* solutions;
+    int nsolutions;
+
+    // solver_stats_t entries, if "collect_stats"; and the entry of the
+    // index being searched (NULL if not collecting).
+    bl* stats;
+    solver_stats_t* cur_stats;
+
     // Cached data about this field, for verify_hit().
     verify_field_t* vf;
+
+    // Bump arena owning the per-AB-pair ("pquad") scratch arrays of
+    // solver_run().  Reset (not freed) at the end of each run, so repeated
+    // runs on the same solver reuse its blocks; freed by solver_cleanup().
+    struct solver_arena* pquad_arena;
+
+    // Code-tree queries waiting for a batched search (see solver_run()).
+    struct solver_codebatch* codebatch;
 };
 typedef struct solver_t solver_t;
 
@@ -269,6 +341,28 @@ double solver_get_max_radius_arcsec(const solver_t* solver);
  */
 MatchObj* solver_get_best_match(solver_t* solver);
 
+/**
+ Copies up to "maxn" of the best distinct solutions found on the current
+ field (over all solver_run() calls since the field was set) into
+ "sols", best first, and returns the number copied.  Hits count as
+ distinct if their field centers or orientations differ by more than a
+ tenth of the field radius or a few degrees, or if their parities
+ differ.  Only hits above "logratio_toprint" are kept.
+
+ The pointer members of the MatchObjs (sip, theta, refxyz, etc) are
+ NULL; "index" is set.
+ */
+int solver_get_solutions(const solver_t* solver, MatchObj* sols, int maxn);
+
+/**
+ Statistics recorded since the last solver_clear_stats() (if
+ "collect_stats" is set): one entry per index per solver_run() call, in
+ the order they ran.
+ */
+int solver_n_stats(const solver_t* solver);
+const solver_stats_t* solver_get_stats(const solver_t* solver, int i);
+void solver_clear_stats(solver_t* solver);
+
 /**
  Did the best match solve?
 
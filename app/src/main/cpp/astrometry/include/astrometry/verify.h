@@ -18,9 +18,13 @@ struct verify_field_t {
     const starxy_t* field;
     // this copy is normal.
     double* xy;
-    // this copy is permuted by the kdtree
-    double* fieldcopy;
-    kdtree_t* ftree;
+    // uniform grid hash over "xy", for deduplication and matching
+    struct verify_grid* grid;
+
+    // per-index caches of sweep-sorted index stars, by healpix cell, for
+    // verify_hit(); created lazily, one per star kdtree.
+    pl* starcaches;
+    anbool do_star_cache;
 
     // should this field be spatially uniformized at the index's scale?
     anbool do_uniformize;
@@ -34,7 +38,7 @@ typedef struct verify_field_t verify_field_t;
 
 /*
  This function must be called once for each field before verification
- begins.  We build a kdtree out of the field stars (in pixel space)
+ begins.  We build a grid hash of the field stars (in pixel space)
  which will be used during deduplication.
  */
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy);
@@ -105,6 +109,26 @@ void verify_hit(const startree_t* skdt,
                 anbool distance_from_quad_bonus,
                 anbool fake_match);
 
+/*
+ A cheap screen to run before verify_hit().  Projects (through mo->wcstan)
+ up to "nprobe" of the brightest -- by sweep number -- index stars within
+ twice the quad radius of the quad center, skipping the quad's own stars,
+ and counts how many land within 3 sigma of a field star.
+
+ Uses mo->quadxyz, mo->quadpix, mo->star[], mo->dimquads and mo->wcstan.
+ The number of probes that fell inside the image is put in "p_ntested";
+ the number of coincidences is returned.
+ */
+int verify_prefilter(const startree_t* skdt,
+                     const MatchObj* mo,
+                     const verify_field_t* vf,
+                     double verify_pix2,
+                     double fieldW,
+                     double fieldH,
+                     anbool distance_from_quad_bonus,
+                     int nprobe,
+                     int* p_ntested);
+
 // Distractor
 #define THETA_DISTRACTOR -1
 // Conflict
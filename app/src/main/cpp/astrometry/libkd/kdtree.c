@@ -212,16 +212,17 @@ int kdtree_get_level(const kdtree_t* kd, int nodeid) {
 }
 
 int kdtree_get_splitdim(const kdtree_t* kd, int nodeid) {
+    size_t slot = (kd->layout ? kdtree_node_slot(&kd->layout->split, nodeid) : (size_t)nodeid);
     if (kd->splitdim)
-        return kd->splitdim[nodeid];
+        return kd->splitdim[slot];
 
     switch (kdtree_treetype(kd)) {
     case KDT_TREE_U64:
-        return kd->split.l[nodeid] & kd->dimmask;
+        return kd->split.l[slot] & kd->dimmask;
     case KDT_TREE_U32:
-        return kd->split.u[nodeid] & kd->dimmask;
+        return kd->split.u[slot] & kd->dimmask;
     case KDT_TREE_U16:
-        return kd->split.s[nodeid] & kd->dimmask;
+        return kd->split.s[slot] & kd->dimmask;
     }
     return -1;
 }
@@ -549,6 +550,78 @@ void kdtree_free_query(kdtree_qres_t *kq) {
     FREE(kq);
 }
 
+void kdtree_free_query_float(kdtree_qres_f_t *kq) {
+    if (!kq) return;
+    FREE(kq->results);
+    FREE(kq->sdists);
+    FREE(kq->inds);
+    FREE(kq);
+}
+
+struct kdtree_qres_pool {
+    kdtree_qres_t** free;
+    int nfree;
+    int size;
+};
+
+kdtree_qres_pool_t* kdtree_qres_pool_new(void) {
+    return CALLOC(1, sizeof(kdtree_qres_pool_t));
+}
+
+void kdtree_qres_pool_free(kdtree_qres_pool_t* pool) {
+    int i;
+    if (!pool) return;
+    for (i=0; i<pool->nfree; i++)
+        kdtree_free_query(pool->free[i]);
+    FREE(pool->free);
+    FREE(pool);
+}
+
+kdtree_qres_t* kdtree_qres_pool_get(kdtree_qres_pool_t* pool) {
+    kdtree_qres_t* res;
+    if (pool->nfree) {
+        res = pool->free[--pool->nfree];
+        res->nres = 0;
+        return res;
+    }
+    // The first query sizes its arrays.
+    res = CALLOC(1, sizeof(kdtree_qres_t));
+    if (!res)
+        SYSERROR("Failed to allocate kdtree_qres_t struct");
+    return res;
+}
+
+void kdtree_qres_pool_put(kdtree_qres_pool_t* pool, kdtree_qres_t* res) {
+    if (!res) return;
+    if (pool->nfree == pool->size) {
+        int newsize = MAX(8, pool->size * 2);
+        kdtree_qres_t** newfree = REALLOC(pool->free, newsize * sizeof(kdtree_qres_t*));
+        if (!newfree) {
+            kdtree_free_query(res);
+            return;
+        }
+        pool->free = newfree;
+        pool->size = newsize;
+    }
+    pool->free[pool->nfree++] = res;
+}
+
+static void* qrespool_init_key(void* user) {
+    return kdtree_qres_pool_new();
+}
+static void qrespool_free_key(void* pool) {
+    kdtree_qres_pool_free(pool);
+}
+#define TSNAME qrespool
+#define TSFREE qrespool_free_key
+#include "thread-specific.inc"
+#undef TSNAME
+#undef TSFREE
+
+kdtree_qres_pool_t* kdtree_qres_pool_thread(void) {
+    return qrespool_get_key(NULL);
+}
+
 void kdtree_free(kdtree_t *kd) {
     if (!kd) return;
     FREE(kd->name);
@@ -557,6 +630,7 @@ void kdtree_free(kdtree_t *kd) {
     FREE(kd->bb.any);
     FREE(kd->split.any);
     FREE(kd->splitdim);
+    FREE(kd->layout);
     if (kd->free_data)
         FREE(kd->data.any);
     FREE(kd->minval);
@@ -587,6 +661,12 @@ int kdtree_nearest_neighbour_within(const kdtree_t* kd, const void *pt, double m
     return ibest;
 }
 
+int kdtree_knn(const kdtree_t* kd, const void* pt, int k, double maxd2,
+               int* inds, double* dist2s) {
+    assert(kd->fun.knn);
+    return kd->fun.knn(kd, pt, k, maxd2, inds, dist2s);
+}
+
 KD_DECLARE(kdtree_node_node_mindist2, double, (const kdtree_t* kd1, int node1, const kdtree_t* kd2, int node2));
 
 double kdtree_node_node_mindist2(const kdtree_t* kd1, int node1,
@@ -678,3 +758,111 @@ void kdtree_fix_bounding_boxes(kdtree_t* kd) {
     kd->fun.fix_bounding_boxes(kd);
 }
 
+// Subtree blocks of node records are sized to fit in one cache line.
+#define KD_NODE_BLOCK_BYTES 64
+
+static void set_blocking(kdtree_blocking_t* b, int nlevels, size_t recsize) {
+    int h, level;
+    memset(b, 0, sizeof(kdtree_blocking_t));
+    h = 0;
+    while ((((size_t)2 << h) - 1) * recsize <= KD_NODE_BLOCK_BYTES)
+        h++;
+    // One-level blocks are just heap order.
+    if (h < 2 || nlevels <= 1)
+        return;
+    b->levels = h;
+    for (level=0; level<nlevels; level++) {
+        struct kdtree_blocking_level* lev = b->level + level;
+        // first level of this run, and depth below the subtree root
+        int first = (level / h) * h;
+        int d = level - first;
+        lev->shift = d;
+        lev->mask = (1u << d) - 1;
+        lev->nodes = (1u << MIN(h, nlevels - first)) - 1;
+        // nodes in earlier runs, minus the root index offset of this
+        // run's first subtree, plus the (1 << d) - 1 nodes above this
+        // level within the subtree.
+        lev->base = ((int64_t)1 << first) - 1
+            - ((int64_t)1 << first) * lev->nodes
+            + ((int64_t)1 << d) - 1;
+    }
+}
+
+static void* reorder_array(const void* src, size_t recsize, int N,
+                           const kdtree_blocking_t* b) {
+    char* dst;
+    int i;
+    dst = MALLOC((size_t)N * recsize);
+    if (!dst)
+        return NULL;
+    for (i=0; i<N; i++)
+        memcpy(dst + kdtree_node_slot(b, i) * recsize,
+               (const char*)src + (size_t)i * recsize, recsize);
+    return dst;
+}
+
+int kdtree_reorder_nodes(kdtree_t* kd) {
+    kdtree_layout_t* layout;
+    size_t tsz;
+    void* bb = NULL;
+    void* split = NULL;
+    u8* splitdim = NULL;
+
+    if (kd->layout)
+        return 0;
+    layout = CALLOC(1, sizeof(kdtree_layout_t));
+    if (!layout)
+        return -1;
+    tsz = get_tree_size(kd->treetype);
+    // bb covers all levels, split / splitdim only the interior ones.
+    if (kd->bb.any)
+        set_blocking(&layout->bb, kd->nlevels, tsz * 2 * kd->ndim);
+    if (kd->split.any)
+        set_blocking(&layout->split, kd->nlevels - 1, tsz);
+    if (!layout->bb.levels && !layout->split.levels) {
+        FREE(layout);
+        return 0;
+    }
+
+    if (layout->bb.levels &&
+        !(bb = reorder_array(kd->bb.any, tsz * 2 * kd->ndim, kd->nnodes, &layout->bb)))
+        goto bailout;
+    if (layout->split.levels) {
+        if (!(split = reorder_array(kd->split.any, tsz, kd->ninterior, &layout->split)))
+            goto bailout;
+        if (kd->splitdim &&
+            !(splitdim = reorder_array(kd->splitdim, sizeof(u8), kd->ninterior, &layout->split)))
+            goto bailout;
+    }
+
+    // Arrays of a tree read from a file belong to the file; built trees
+    // own theirs.
+    if (bb) {
+        if (!kd->io)
+            FREE(kd->bb.any);
+        kd->bb.any = bb;
+    }
+    if (split) {
+        if (!kd->io)
+            FREE(kd->split.any);
+        kd->split.any = split;
+    }
+    if (splitdim) {
+        if (!kd->io)
+            FREE(kd->splitdim);
+        kd->splitdim = splitdim;
+    }
+    kd->layout = layout;
+    debug("Reordered kdtree nodes: bb blocks of %i levels, split blocks of %i levels\n",
+          layout->bb.levels, layout->split.levels);
+    return 0;
+
+ bailout:
+    ERROR("Failed to allocate reordered kdtree nodes");
+    FREE(bb);
+    FREE(split);
+    FREE(splitdim);
+    FREE(layout);
+    return -1;
+}
+
@@ -11,6 +11,7 @@
 
 #include "kdtree.h"
 #include "kdtree_internal.h"
+#include "errors.h"
 
 KD_DECLARE(kdtree_build_2, kdtree_t*, (kdtree_t* kd, void *data, int N, int D, int Nleaf, int treetype, unsigned int options, double* minval, double* maxval));
 
@@ -50,4 +51,66 @@ kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)
     return kd->fun.rangesearch(kd, res, pt, maxd2, options);
 }
 
+kdtree_qres_f_t* KDFUNC(kdtree_rangesearch_float)
+     (const kdtree_t *kd, kdtree_qres_f_t* res, const float *pt, float maxd2, int options) {
+    if (!kd->fun.rangesearch_float) {
+        ERROR("Tree type %#x is not KDTT_FLOAT", kd->treetype);
+        return NULL;
+    }
+    return kd->fun.rangesearch_float(kd, res, pt, maxd2, options);
+}
+
+int KDFUNC(kdtree_rangesearch_batch_reuse)
+     (const kdtree_t *kd, kdtree_qres_t** res, const void *pts, int npts, double maxd2, int options) {
+    assert(kd->fun.rangesearch_batch_reuse);
+    return kd->fun.rangesearch_batch_reuse(kd, res, pts, npts, maxd2, options);
+}
+
+int KDFUNC(kdtree_rangesearch_batch)
+     (const kdtree_t *kd, const void *pts, int npts, double maxd2, int options,
+      kdtree_batch_callback cb, void* token) {
+    assert(kd->fun.rangesearch_batch);
+    return kd->fun.rangesearch_batch(kd, pts, npts, maxd2, options, cb, token);
+}
+
+struct match_buffer {
+    kdtree_match_t* matches;
+    int maxmatches;
+    int nmatches;
+};
 
+static void add_match(void* token, int query, unsigned int ind, double dist2) {
+    struct match_buffer* buf = token;
+    if (buf->nmatches < buf->maxmatches) {
+        kdtree_match_t* m = buf->matches + buf->nmatches;
+        m->query = query;
+        m->ind = ind;
+        m->dist2 = dist2;
+    }
+    buf->nmatches++;
+}
+
+static int compare_matches(const void* v1, const void* v2) {
+    const kdtree_match_t* m1 = v1;
+    const kdtree_match_t* m2 = v2;
+    if (m1->query != m2->query)
+        return (m1->query < m2->query) ? -1 : 1;
+    if (m1->ind != m2->ind)
+        return (m1->ind < m2->ind) ? -1 : 1;
+    return 0;
+}
+
+int KDFUNC(kdtree_rangesearch_batch_flat)
+     (const kdtree_t *kd, const void *pts, int npts, double maxd2, int options,
+      kdtree_match_t* matches, int maxmatches) {
+    struct match_buffer buf;
+    buf.matches = matches;
+    buf.maxmatches = matches ? maxmatches : 0;
+    buf.nmatches = 0;
+    if (KDFUNC(kdtree_rangesearch_batch)(kd, pts, npts, maxd2, options,
+                                         add_match, &buf))
+        return -1;
+    if (buf.nmatches <= buf.maxmatches)
+        qsort(matches, buf.nmatches, sizeof(kdtree_match_t), compare_matches);
+    return buf.nmatches;
+}
@@ -309,6 +309,77 @@ kdtree_t* kdtree_fits_read_tree(kdtree_fits_t* io, const char* treename,
     return kd;
 }
 
+// Is "tablename" the table "tabname" of the tree named "treename"?
+static anbool is_tree_table(const char* tablename, const char* tabname,
+                            const char* treename) {
+    size_t n = strlen(tabname);
+    if (strncmp(tablename, tabname, n))
+        return FALSE;
+    if (!treename)
+        return tablename[n] == '\0';
+    return (tablename[n] == '_') && (strcmp(tablename + n + 1, treename) == 0);
+}
+
+kdtree_t* kdtree_fits_attach_tree(kdtree_fits_t* io, const kdtree_t* meta) {
+    fitsbin_t* fb = kdtree_fits_get_fitsbin(io);
+    kdtree_t* kd;
+    int i;
+
+    kd = CALLOC(1, sizeof(kdtree_t));
+    if (!kd) {
+        SYSERROR("Couldn't allocate kdtree");
+        return NULL;
+    }
+    kd->name = strdup_safe(meta->name);
+    kd->treetype = meta->treetype;
+    kd->has_linear_lr = meta->has_linear_lr;
+    kd->ndata  = meta->ndata;
+    kd->ndim   = meta->ndim;
+    kd->nnodes = meta->nnodes;
+    kd->nbottom = (kd->nnodes+1)/2;
+    kd->ninterior = kd->nnodes - kd->nbottom;
+    kd->nlevels = kdtree_nnodes_to_nlevels(kd->nnodes);
+    kd->n_bb = meta->n_bb;
+    kd->dimbits = meta->dimbits;
+    kd->dimmask = meta->dimmask;
+    kd->splitmask = meta->splitmask;
+
+    for (i=0; i<fitsbin_n_chunks(fb); i++) {
+        fitsbin_chunk_t* chunk = fitsbin_get_chunk(fb, i);
+        const char* tab = chunk->tablename;
+        if (is_tree_table(tab, KD_STR_LR, kd->name))
+            kd->lr = chunk->data;
+        else if (is_tree_table(tab, KD_STR_PERM, kd->name))
+            kd->perm = chunk->data;
+        else if (is_tree_table(tab, KD_STR_BB, kd->name))
+            kd->bb.any = chunk->data;
+        else if (is_tree_table(tab, KD_STR_SPLIT, kd->name))
+            kd->split.any = chunk->data;
+        else if (is_tree_table(tab, KD_STR_SPLITDIM, kd->name))
+            kd->splitdim = chunk->data;
+        else if (is_tree_table(tab, KD_STR_DATA, kd->name))
+            kd->data.any = chunk->data;
+        else if (is_tree_table(tab, KD_STR_RANGE, kd->name)) {
+            double* r = chunk->data;
+            kd->minval = r;
+            kd->maxval = r + kd->ndim;
+            kd->scale  = r[kd->ndim * 2];
+            kd->invscale = 1.0 / kd->scale;
+        }
+    }
+    if (!kd->data.any || !(kd->bb.any || kd->split.any)) {
+        ERROR("Kdtree \"%s\": data or node tables are not mapped in file %s",
+              kd->name ? kd->name : "", fb->filename);
+        FREE(kd->name);
+        FREE(kd);
+        return NULL;
+    }
+
+    kdtree_update_funcs(kd);
+    kd->io = io;
+    return kd;
+}
+
 int kdtree_fits_write_chunk(kdtree_fits_t* io, fitsbin_chunk_t* chunk) {
     fitsbin_t* fb = kdtree_fits_get_fitsbin(io);
     if (fitsbin_write_chunk(fb, chunk)) {
@@ -397,6 +468,16 @@ int kdtree_fits_close(kdtree_t* kd) {
     // multiple kdtrees from one file...  reference count??
     if (kd->io)
         kdtree_fits_io_close(kd->io);
+    // Reordered node arrays are copies, not part of the mapped file.
+    if (kd->layout) {
+        if (kd->layout->bb.levels)
+            FREE(kd->bb.any);
+        if (kd->layout->split.levels) {
+            FREE(kd->split.any);
+            FREE(kd->splitdim);
+        }
+        FREE(kd->layout);
+    }
     FREE(kd->name);
     FREE(kd);
     return 0;
@@ -7,6 +7,14 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "os-features.h"
 #include "kdtree.h"
@@ -15,10 +23,19 @@
 #include "keywords.h"
 #include "errors.h"
 #include "mathutil.h"
+#include "log.h"
 
 #define KDTREE_MAX_RESULTS 1000
 #define KDTREE_MAX_DIM 100
 
+// Largest leaf (points x dimensions, after padding the points to a
+// multiple of 4) that is scanned with SIMD; bigger leaves use the
+// scalar loop.
+#define KD_LEAF_SIMD_MAX 1024
+
+// Number of neighbouring queries searched together by the batch search.
+#define KD_BATCH_GROUP 64
+
 #define WARNING(x, ...) fprintf(stderr, x, ## __VA_ARGS__)
 
 #define MANGLE(x) KDMANGLE(x, ETYPE, DTYPE, TTYPE)
@@ -130,14 +147,21 @@
 // Which function do we use for rounding?
 #define KD_ROUND rint
 
+// Where node i's bounding box / split live (see kdtree_reorder_nodes)
+#define KD_BB_SLOT(kd, i)    ((kd)->layout ? kdtree_node_slot(&(kd)->layout->bb,    (i)) : (size_t)(i))
+#define KD_SPLIT_SLOT(kd, i) ((kd)->layout ? kdtree_node_slot(&(kd)->layout->split, (i)) : (size_t)(i))
+
 // Get the low corner of the bounding box
-#define LOW_HR( kd, D, i) ((kd)->bb.TTYPE + (2*(size_t)(i)*(size_t)(D)))
+#define LOW_HR( kd, D, i) ((kd)->bb.TTYPE + (2*KD_BB_SLOT(kd, i)*(size_t)(D)))
 
 // Get the high corner of the bounding box
-#define HIGH_HR(kd, D, i) ((kd)->bb.TTYPE + ((2*(size_t)(i)+1)*(size_t)(D)))
+#define HIGH_HR(kd, D, i) ((kd)->bb.TTYPE + ((2*KD_BB_SLOT(kd, i)+1)*(size_t)(D)))
 
 // Get the splitting-plane position
-#define KD_SPLIT(kd, i) ((kd)->split.TTYPE + (size_t)(i))
+#define KD_SPLIT(kd, i) ((kd)->split.TTYPE + KD_SPLIT_SLOT(kd, i))
+
+// Get the splitting dimension (trees with a splitdim array)
+#define KD_SPLITDIM(kd, i) ((kd)->splitdim[KD_SPLIT_SLOT(kd, i)])
 
 // Get a pointer to the 'i'-th data point.
 #define KD_DATA(kd, D, i) ((kd)->data.DTYPE + ((size_t)(D)*(size_t)(i)))
@@ -480,22 +504,53 @@ static void print_results(kdtree_qres_t* res, int D) {
     }
 }
 
+/*
+ Resizes "*parr" (of "*pbytes" bytes, or none if NULL) to "bytes" bytes.
+ */
+static anbool resize_array(void** parr, size_t* pbytes, size_t bytes) {
+    void* arr;
+    if (*parr && *pbytes == bytes)
+        return TRUE;
+    if (!bytes) {
+        FREE(*parr);
+        *parr = NULL;
+        *pbytes = 0;
+        return TRUE;
+    }
+    arr = REALLOC(*parr, bytes);
+    if (!arr)
+        return FALSE;
+    *parr = arr;
+    *pbytes = bytes;
+    return TRUE;
+}
+
+/*
+ Sets the capacity of "res" to "newsize" results.  Only the arrays this
+ query needs are resized, and only if their size changes, so a reused
+ result struct of the right capacity costs nothing.
+ */
 static
 anbool resize_results(kdtree_qres_t* res, int newsize, int D,
                       anbool do_dists, anbool do_points) {
+    size_t indbytes = (size_t)res->capacity * sizeof(u32);
 
     if (FALSE) {
         printf("resize results: before:\n");
         print_results(res, D);
     }
 
-    if (do_dists)
-        res->sdists  = REALLOC(res->sdists , newsize * sizeof(double));
-    if (do_points)
-        res->results.any = REALLOC(res->results.any, (size_t)newsize * (size_t)D * sizeof(etype));
-    res->inds = REALLOC(res->inds, newsize * sizeof(u32));
-    if (newsize && (!res->results.any || (do_dists && !res->sdists) || !res->inds))
+    if ((do_dists &&
+         !resize_array((void**)&res->sdists, &res->sdists_bytes,
+                       (size_t)newsize * sizeof(double))) ||
+        (do_points &&
+         !resize_array(&res->results.any, &res->results_bytes,
+                       (size_t)newsize * (size_t)D * sizeof(etype))) ||
+        !resize_array((void**)&res->inds, &indbytes,
+                      (size_t)newsize * sizeof(u32))) {
         SYSERROR("Failed to resize kdtree results arrays");
+        return FALSE;
+    }
     res->capacity = newsize;
 
     if (FALSE) {
@@ -538,6 +593,215 @@ anbool add_result(const kdtree_t* kd, kdtree_qres_t* res, double sdist,
     return TRUE;
 }
 
+/*
+ Readies a result struct for a new query: allocates it if "res" is NULL,
+ otherwise resizes it (it may be from a tree of different type or
+ dimensionality) and empties it.
+ */
+static kdtree_qres_t* prepare_results(kdtree_qres_t* res, int D,
+                                      anbool do_dists, anbool do_points) {
+    if (res) {
+        if (!res->capacity) {
+            resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points);
+        } else {
+            // call the resize routine just in case the old result struct was
+            // from a tree of different type or dimensionality.
+            resize_results(res, res->capacity, D, do_dists, do_points);
+        }
+        res->nres = 0;
+    } else {
+        res = CALLOC(1, sizeof(kdtree_qres_t));
+        if (!res) {
+            SYSERROR("Failed to allocate kdtree_qres_t struct");
+            return NULL;
+        }
+        if (!resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points)) {
+            kdtree_free_query(res);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+/*
+ Checks the point at index "i" against the query and adds it to "res" if
+ it is within range.  Returns FALSE if adding the result failed.
+ */
+static inline anbool leaf_check_point(const kdtree_t* kd, kdtree_qres_t* res,
+                                      const etype* query, int i, int D,
+                                      double maxd2, anbool do_dists,
+                                      anbool do_points) {
+    const dtype* data = KD_DATA(kd, D, i);
+    if (do_dists) {
+        anbool bailedout = FALSE;
+        double dsqd;
+        // HACK - should do "use_dtype", just like "use_ttype".
+        dist2_bailout(kd, query, data, D, maxd2, &bailedout, &dsqd);
+        if (bailedout)
+            return TRUE;
+        return add_result(kd, res, dsqd, KD_PERM(kd, i), data,
+                          D, do_dists, do_points);
+    }
+    if (dist2_exceeds(kd, query, data, D, maxd2))
+        return TRUE;
+    return add_result(kd, res, LARGE_VAL, KD_PERM(kd, i), data,
+                      D, do_dists, do_points);
+}
+
+/*
+ SIMD leaf scanning, for trees that store points as u16 or u32.
+
+ A leaf's points are converted to floats once, laid out dimension-major
+ (all the x's, then all the y's, ...) so that four points fill a vector.
+ Each query is compared against them four at a time, in the data space,
+ against a threshold padded to cover the float rounding.  Points that pass
+ are candidates only: they are then checked exactly by leaf_check_point,
+ so the results (and their order) are the same as the scalar scan.
+ */
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define LEAF_SIMD (DTYPE_INTEGER && sizeof(dtype) <= sizeof(u32))
+#else
+#define LEAF_SIMD 0
+#endif
+
+typedef struct {
+    int n;
+    // n rounded up to a multiple of 4; the padding lanes hold NaN, which
+    // never passes the threshold.
+    int npad;
+    float pts[KD_LEAF_SIMD_MAX];
+} leaf_floats_t;
+
+/*
+ Prepares the query for leaf_scan: puts it in the data space, as floats,
+ in "fquery", and sets "thresh" to a squared distance that no point
+ within "maxd2" of the query can exceed, even after rounding.  Returns
+ FALSE if the SIMD scan can't be used for this tree or query.
+ */
+static anbool leaf_simd_query(const kdtree_t* kd, const etype* query, int D,
+                              double maxd2, float* fquery, float* thresh) {
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+    double qmax = 0.0;
+    double err, t;
+    int d;
+    if (!LEAF_SIMD)
+        return FALSE;
+    for (d=0; d<D; d++) {
+        double q = POINT_ED(kd, d, query[d], );
+        fquery[d] = q;
+        qmax = MAX(qmax, fabs(q));
+    }
+    // Per dimension, converting the query and the point to float and
+    // subtracting each lose at most one float ulp of the largest value
+    // involved.
+    err = (qmax + (double)DTYPE_MAX) * 0x1p-22;
+    t = sqrt(DIST2_ED(kd, maxd2, )) * (1.0 + 1e-6) + sqrt(D) * err;
+    t = t * t * (1.0 + 1e-4);
+    if (!isfinite(t) || t >= FLT_MAX)
+        return FALSE;
+    *thresh = t;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ Converts the points of leaf [L, R] to floats.  Returns FALSE if the leaf
+ is too big to scan with SIMD.
+ */
+static anbool leaf_load_floats(const kdtree_t* kd, int L, int R, int D,
+                               leaf_floats_t* leaf) {
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+    const dtype* data = KD_DATA(kd, D, L);
+    int n = R - L + 1;
+    int npad = (n + 3) & ~3;
+    u32 v[KD_LEAF_SIMD_MAX];
+    int d, k, j;
+    if (!LEAF_SIMD || (size_t)npad * D > KD_LEAF_SIMD_MAX)
+        return FALSE;
+    leaf->n = n;
+    leaf->npad = npad;
+    // Transpose to dimension-major while still integers...
+    for (k=0; k<n; k++)
+        for (d=0; d<D; d++)
+            v[(size_t)d * npad + k] = data[(size_t)k * D + d];
+    for (d=0; d<D; d++)
+        for (k=n; k<npad; k++)
+            v[(size_t)d * npad + k] = 0;
+    // ...then convert four at a time.
+    for (j=0; j<npad*D; j+=4) {
+#if defined(__SSE2__)
+        __m128i vi = _mm_loadu_si128((const __m128i*)(v + j));
+        __m128 vf;
+        if (sizeof(dtype) < sizeof(u32))
+            vf = _mm_cvtepi32_ps(vi);
+        else
+            // cvtepi32 is signed: bias to the signed range and back.
+            vf = _mm_add_ps(_mm_cvtepi32_ps(_mm_xor_si128(vi, _mm_set1_epi32((int)0x80000000u))),
+                            _mm_set1_ps(2147483648.0f));
+        _mm_storeu_ps(leaf->pts + j, vf);
+#else
+        vst1q_f32(leaf->pts + j, vcvtq_f32_u32(vld1q_u32(v + j)));
+#endif
+    }
+    for (d=0; d<D; d++)
+        for (k=n; k<npad; k++)
+            leaf->pts[(size_t)d * npad + k] = NAN;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ Puts in "cand" the offsets (from the start of the leaf, in increasing
+ order) of the points that may be within range of the query.  Returns the
+ number of candidates.
+ */
+static int leaf_scan(const leaf_floats_t* leaf, const float* fquery, int D,
+                     float thresh, int* cand) {
+    int nc = 0;
+    int k, d;
+#if defined(__SSE2__)
+    __m128 vt = _mm_set1_ps(thresh);
+    for (k=0; k<leaf->npad; k+=4) {
+        __m128 d2 = _mm_setzero_ps();
+        int mask;
+        for (d=0; d<D; d++) {
+            __m128 delta = _mm_sub_ps(_mm_loadu_ps(leaf->pts + (size_t)d * leaf->npad + k),
+                                      _mm_set1_ps(fquery[d]));
+            d2 = _mm_add_ps(d2, _mm_mul_ps(delta, delta));
+        }
+        mask = _mm_movemask_ps(_mm_cmple_ps(d2, vt));
+        for (; mask; mask &= mask - 1)
+            cand[nc++] = k + __builtin_ctz(mask);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    float32x4_t vt = vdupq_n_f32(thresh);
+    for (k=0; k<leaf->npad; k+=4) {
+        float32x4_t d2 = vdupq_n_f32(0.0f);
+        uint32x4_t ok;
+        for (d=0; d<D; d++) {
+            float32x4_t delta = vsubq_f32(vld1q_f32(leaf->pts + (size_t)d * leaf->npad + k),
+                                          vdupq_n_f32(fquery[d]));
+            d2 = vmlaq_f32(d2, delta, delta);
+        }
+        ok = vcleq_f32(d2, vt);
+        if (!vmaxvq_u32(ok))
+            continue;
+        if (vgetq_lane_u32(ok, 0)) cand[nc++] = k;
+        if (vgetq_lane_u32(ok, 1)) cand[nc++] = k + 1;
+        if (vgetq_lane_u32(ok, 2)) cand[nc++] = k + 2;
+        if (vgetq_lane_u32(ok, 3)) cand[nc++] = k + 3;
+    }
+#else
+    (void)leaf; (void)fquery; (void)D; (void)thresh; (void)cand;
+    (void)k; (void)d;
+#endif
+    return nc;
+}
+
 /*
  Can the query be represented as a ttype?
 
@@ -566,7 +830,7 @@ double MANGLE(kdtree_get_splitval)(const kdtree_t* kd, int nodeid) {
         dim = tmpsplit & kd->dimmask;
         return POINT_TE(kd, dim, tmpsplit & kd->splitmask);
     } else {
-        dim = kd->splitdim[nodeid];
+        dim = KD_SPLITDIM(kd, nodeid);
     }
     return POINT_TE(kd, dim, split);
 }
@@ -831,7 +1095,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
         split = *KD_SPLIT(kd, nodeid);
 
         if (kd->splitdim)
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
         else {
             bigint tmpsplit;
             tmpsplit = split;
@@ -984,7 +1248,7 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
         // split/dim trees
         split = *KD_SPLIT(kd, nodeid);
         if (kd->splitdim) {
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
         } else {
             // packed int
             bigint tmpsplit = split;
@@ -1026,6 +1290,211 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
 }
 
 
+double MANGLE(kdtree_node_point_mindist2)
+     (const kdtree_t* kd, int node, const etype* query);
+
+/* A node waiting to be explored by kdtree_knn, with a lower bound on
+ the distance-squared from the query to any of its points. */
+typedef struct {
+    double d2;
+    int node;
+} knn_node_t;
+
+// Min-heap of nodes by distance.
+static void knn_push_node(knn_node_t* q, int* pn, int node, double d2) {
+    int i = (*pn)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (q[parent].d2 <= d2)
+            break;
+        q[i] = q[parent];
+        i = parent;
+    }
+    q[i].d2 = d2;
+    q[i].node = node;
+}
+
+static knn_node_t knn_pop_node(knn_node_t* q, int* pn) {
+    knn_node_t top = q[0];
+    knn_node_t last = q[--(*pn)];
+    int n = *pn;
+    int i = 0;
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= n)
+            break;
+        if (c+1 < n && q[c+1].d2 < q[c].d2)
+            c++;
+        if (last.d2 <= q[c].d2)
+            break;
+        q[i] = q[c];
+        i = c;
+    }
+    q[i] = last;
+    return top;
+}
+
+/* Max-heap of the best "n" results so far, farthest at the root.
+ Replaces the root by (d2, ind) if the heap is full, otherwise adds it. */
+static void knn_add_result(double* heapd, int* heapi, int* pn, int k,
+                           double d2, int ind) {
+    int i, n = *pn;
+    if (n < k) {
+        i = (*pn)++;
+        while (i > 0) {
+            int parent = (i - 1) / 2;
+            if (heapd[parent] >= d2)
+                break;
+            heapd[i] = heapd[parent];
+            heapi[i] = heapi[parent];
+            i = parent;
+        }
+    } else {
+        i = 0;
+        for (;;) {
+            int c = 2*i + 1;
+            if (c >= n)
+                break;
+            if (c+1 < n && heapd[c+1] > heapd[c])
+                c++;
+            if (d2 >= heapd[c])
+                break;
+            heapd[i] = heapd[c];
+            heapi[i] = heapi[c];
+            i = c;
+        }
+    }
+    heapd[i] = d2;
+    heapi[i] = ind;
+}
+
+/*
+ Best-bin-first k-nearest-neighbour search: nodes are explored nearest
+ first from a priority queue, and the k best points so far are kept in
+ a max-heap (in the caller's output arrays) whose root bounds the
+ search.  Node distances come from the bounding boxes if the tree has
+ them; otherwise each child inherits its parent's bound, raised to the
+ distance to the splitting plane for the far child.
+ */
+int MANGLE(kdtree_knn)(const kdtree_t* kd, const void* vquery, int k,
+                       double maxd2, int* inds, double* dist2s) {
+    const etype* query = vquery;
+    knn_node_t qstack[256];
+    knn_node_t* queue = qstack;
+    int qsize = sizeof(qstack) / sizeof(knn_node_t);
+    int nq = 0;
+    int nres = 0;
+    int D;
+    int i;
+    anbool use_bboxes;
+
+    if (!kd || k <= 0)
+        return 0;
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#else
+    D = kd->ndim;
+#endif
+    use_bboxes = (kd->bb.any != NULL);
+
+    knn_push_node(queue, &nq, 0, 0.0);
+    while (nq) {
+        knn_node_t top = knn_pop_node(queue, &nq);
+        double limit = (nres == k) ? dist2s[0] : maxd2;
+        int nodeid = top.node;
+
+        // Everything left in the queue is at least this far away.
+        if (top.d2 > limit)
+            break;
+
+        if (KD_IS_LEAF(kd, nodeid)) {
+            int L = kdtree_left(kd, nodeid);
+            int R = kdtree_right(kd, nodeid);
+            for (i=L; i<=R; i++) {
+                anbool bailedout = FALSE;
+                double dsqd;
+                dist2_bailout(kd, query, KD_DATA(kd, D, i), D, limit,
+                              &bailedout, &dsqd);
+                if (bailedout || (nres == k && dsqd >= limit))
+                    continue;
+                knn_add_result(dist2s, inds, &nres, k, dsqd, i);
+                limit = (nres == k) ? dist2s[0] : maxd2;
+            }
+            continue;
+        }
+
+        // Room for both children.
+        if (nq + 2 > qsize) {
+            knn_node_t* bigger;
+            int newsize = qsize * 2;
+            if (queue == qstack) {
+                bigger = MALLOC(newsize * sizeof(knn_node_t));
+                if (bigger)
+                    memcpy(bigger, qstack, nq * sizeof(knn_node_t));
+            } else
+                bigger = REALLOC(queue, newsize * sizeof(knn_node_t));
+            if (!bigger) {
+                SYSERROR("Failed to grow kdtree_knn queue");
+                if (queue != qstack)
+                    FREE(queue);
+                return -1;
+            }
+            queue = bigger;
+            qsize = newsize;
+        }
+
+        if (use_bboxes) {
+            int child;
+            for (child = KD_CHILD_LEFT(nodeid); child <= KD_CHILD_RIGHT(nodeid); child++) {
+                double d2 = MANGLE(kdtree_node_point_mindist2)(kd, child, query);
+                if (d2 <= limit)
+                    knn_push_node(queue, &nq, child, d2);
+            }
+        } else {
+            ttype split = *KD_SPLIT(kd, nodeid);
+            int dim;
+            etype rsplit;
+            double del, fard2;
+            if (kd->splitdim) {
+                dim = KD_SPLITDIM(kd, nodeid);
+            } else {
+                bigint tmpsplit = split;
+                dim = tmpsplit & kd->dimmask;
+                split = tmpsplit & kd->splitmask;
+            }
+            rsplit = POINT_TE(kd, dim, split);
+            del = query[dim] - rsplit;
+            fard2 = MAX(top.d2, del*del);
+            if (query[dim] < rsplit) {
+                knn_push_node(queue, &nq, KD_CHILD_LEFT(nodeid), top.d2);
+                if (fard2 <= limit)
+                    knn_push_node(queue, &nq, KD_CHILD_RIGHT(nodeid), fard2);
+            } else {
+                knn_push_node(queue, &nq, KD_CHILD_RIGHT(nodeid), top.d2);
+                if (fard2 <= limit)
+                    knn_push_node(queue, &nq, KD_CHILD_LEFT(nodeid), fard2);
+            }
+        }
+    }
+    if (queue != qstack)
+        FREE(queue);
+
+    // Heap-sort the results, nearest first.
+    for (i=nres-1; i>0; i--) {
+        double d2 = dist2s[0];
+        int ind = inds[0];
+        int n = i;
+        // Re-insert the last element into the heap of "i" elements.
+        knn_add_result(dist2s, inds, &n, i, dist2s[i], inds[i]);
+        dist2s[i] = d2;
+        inds[i] = ind;
+    }
+    for (i=0; i<nres; i++)
+        inds[i] = KD_PERM(kd, inds[i]);
+    return nres;
+}
+
 kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
      (const kdtree_t* kd, kdtree_qres_t* res, const void* vquery,
       double maxd2, int options)
@@ -1060,6 +1529,12 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
     //dtype dquery[D];
     ttype tquery[D];
 
+    anbool use_simd = FALSE;
+    float fquery[D];
+    float fthresh = 0;
+    leaf_floats_t leaf;
+    int cand[KD_LEAF_SIMD_MAX];
+
     if (!kd || !query)
         return NULL;
 #if defined(KD_DIM)
@@ -1158,23 +1633,14 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
     }
 
 
-    if (res) {
-        if (!res->capacity) {
-            resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points);
-        } else {
-            // call the resize routine just in case the old result struct was
-            // from a tree of different type or dimensionality.
-            resize_results(res, res->capacity, D, do_dists, do_points);
-        }
-        res->nres = 0;
-    } else {
-        res = CALLOC(1, sizeof(kdtree_qres_t));
-        if (!res) {
-            SYSERROR("Failed to allocate kdtree_qres_t struct");
-            return NULL;
-        }
-        resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points);
-    }
+    // With small radii most of each leaf is out of range, which is where
+    // the SIMD prefilter pays off.
+    if (!do_wholenode_check)
+        use_simd = leaf_simd_query(kd, query, D, maxd2, fquery, &fthresh);
+
+    res = prepare_results(res, D, do_dists, do_points);
+    if (!res)
+        return NULL;
 
     // queue root.
     nodestack[0] = 0;
@@ -1191,41 +1657,28 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
         stackpos--;
 
         if (KD_IS_LEAF(kd, nodeid)) {
-            dtype* data;
             L = kdtree_left(kd, nodeid);
             R = kdtree_right(kd, nodeid);
 
-            if (do_dists) {
-                for (i=L; i<=R; i++) {
-                    anbool bailedout = FALSE;
-                    double dsqd;
-                    data = KD_DATA(kd, D, i);
-                    // FIXME benchmark dist2 vs dist2_bailout.
-
-                    // HACK - should do "use_dtype", just like "use_ttype".
-                    dist2_bailout(kd, query, data, D, maxd2, &bailedout, &dsqd);
-                    if (bailedout)
-                        continue;
-                    if (!add_result(kd, res, dsqd, KD_PERM(kd, i), data,
-                                    D, do_dists, do_points))
-                        return NULL;
-                }
-            } else {
-                for (i=L; i<=R; i++) {
-                    data = KD_DATA(kd, D, i);
-                    // HACK - should do "use_dtype", just like "use_ttype".
-                    if (dist2_exceeds(kd, query, data, D, maxd2))
-                        continue;
-                    if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i), data,
-                                    D, do_dists, do_points))
+            if (use_simd && leaf_load_floats(kd, L, R, D, &leaf)) {
+                int c, nc;
+                nc = leaf_scan(&leaf, fquery, D, fthresh, cand);
+                for (c=0; c<nc; c++)
+                    if (!leaf_check_point(kd, res, query, L + cand[c], D, maxd2,
+                                          do_dists, do_points))
                         return NULL;
-                }
+                continue;
             }
+            for (i=L; i<=R; i++)
+                // FIXME benchmark dist2 vs dist2_bailout.
+                if (!leaf_check_point(kd, res, query, i, D, maxd2,
+                                      do_dists, do_points))
+                    return NULL;
             continue;
         }
 
         if (kd->splitdim)
-            dim = kd->splitdim[nodeid];
+            dim = KD_SPLITDIM(kd, nodeid);
 
         if (use_bboxes) {
             anbool wholenode = FALSE;
@@ -1239,9 +1692,9 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                 int pdim;
                 anbool cut;
                 if (kd->splitdim)
-                    pdim = kd->splitdim[KD_PARENT(nodeid)];
+                    pdim = KD_SPLITDIM(kd, KD_PARENT(nodeid));
                 else {
-                    pdim = kd->split.TTYPE[KD_PARENT(nodeid)];
+                    pdim = *KD_SPLIT(kd, KD_PARENT(nodeid));
                     pdim &= kd->dimmask;
                 }
                 if (TTYPE_INTEGER && use_tquery) {
@@ -1367,7 +1820,7 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                     }
                 }
             } else {
-                dtype rsplit = POINT_TE(kd, dim, split);
+                etype rsplit = POINT_TE(kd, dim, split);
                 if (query[dim] < rsplit) {
                     // query is on the "left" side of the split.
                     stackpos++;
@@ -1410,60 +1863,791 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
 }
 
 
-static void* get_data(const kdtree_t* kd, int i) {
-    return KD_DATA(kd, kd->ndim, i);
+#if !DTYPE_INTEGER && !DTYPE_DOUBLE
+/*
+ Single-precision range search, for float trees (see
+ kdtree_rangesearch_float).  The query, radius, distances and returned
+ points are all floats, so nothing is converted on the way.
+ */
+static anbool resize_results_float(kdtree_qres_f_t* res, unsigned int newsize,
+                                   int D, anbool do_dists, anbool do_points) {
+    size_t indbytes = (size_t)res->capacity * sizeof(u32);
+    if ((do_dists &&
+         !resize_array((void**)&res->sdists, &res->sdists_bytes,
+                       (size_t)newsize * sizeof(float))) ||
+        (do_points &&
+         !resize_array((void**)&res->results, &res->results_bytes,
+                       (size_t)newsize * (size_t)D * sizeof(float))) ||
+        !resize_array((void**)&res->inds, &indbytes,
+                      (size_t)newsize * sizeof(u32))) {
+        SYSERROR("Failed to resize kdtree results arrays");
+        return FALSE;
+    }
+    res->capacity = newsize;
+    return TRUE;
 }
 
-static void copy_data_double(const kdtree_t* kd, int start, int N,
-                             double* dest) {
-    Unused int i, j, d;
-    int D;
+static inline anbool add_result_float(kdtree_qres_f_t* res, float sdist,
+                                      unsigned int ind, const float* pt,
+                                      int D, anbool do_dists, anbool do_points) {
+    if (do_dists)
+        res->sdists[res->nres] = sdist;
+    res->inds[res->nres] = ind;
+    if (do_points)
+        memcpy(res->results + (size_t)res->nres * D, pt, D * sizeof(float));
+    res->nres++;
+    if (res->nres == res->capacity)
+        return resize_results_float(res, res->capacity * 2, D,
+                                    do_dists, do_points);
+    return TRUE;
+}
 
-    D = kd->ndim;
-#if DTYPE_DOUBLE
-    //#warning "Data type is double; just copying data."
-    memcpy(dest, kd->data.DTYPE + start*D, (size_t)N*(size_t)D*sizeof(etype));
-#elif (!DTYPE_INTEGER && !ETYPE_INTEGER)
-    //#warning "Etype and Dtype are both reals; just casting values."
-    for (i=0; i<(N * D); i++)
-        dest[i] = kd->data.DTYPE[start*D + i];
-#else
-    //#warning "Using POINT_DE to convert data."
-    j=0;
-    for (i=0; i<N; i++)
+static void swap_results_float(kdtree_qres_f_t* res, int D, anbool do_points,
+                               int i, int j) {
+    float tmpd = res->sdists[i];
+    u32 tmpi = res->inds[i];
+    res->sdists[i] = res->sdists[j];
+    res->sdists[j] = tmpd;
+    res->inds[i] = res->inds[j];
+    res->inds[j] = tmpi;
+    if (do_points) {
+        int d;
         for (d=0; d<D; d++) {
-            dest[j] = POINT_DE(kd, D, kd->data.DTYPE[(start + i)*D + d]);
-            j++;
+            float tmp = res->results[i*D + d];
+            res->results[i*D + d] = res->results[j*D + d];
+            res->results[j*D + d] = tmp;
         }
-#endif
+    }
 }
 
-static dtype* kdqsort_arr;
-static int kdqsort_D;
-
-static int kdqsort_compare(const void* v1, const void* v2)
-{
-    int i1, i2;
-    dtype val1, val2;
-    i1 = *((int*)v1);
-    i2 = *((int*)v2);
-    val1 = kdqsort_arr[(size_t)i1 * (size_t)kdqsort_D];
-    val2 = kdqsort_arr[(size_t)i2 * (size_t)kdqsort_D];
-    if (val1 < val2)
-        return -1;
-    else if (val1 > val2)
-        return 1;
-    return 0;
+/* Sorts results by res->sdists (heapsort; no recursion, no extra memory). */
+static void sort_results_float(kdtree_qres_f_t* res, int D, anbool do_points) {
+    int n = res->nres;
+    int i;
+    for (i=n/2-1; i>=0; i--) {
+        int p = i;
+        for (;;) {
+            int c = 2*p + 1;
+            if (c >= n)
+                break;
+            if (c+1 < n && res->sdists[c+1] > res->sdists[c])
+                c++;
+            if (res->sdists[p] >= res->sdists[c])
+                break;
+            swap_results_float(res, D, do_points, p, c);
+            p = c;
+        }
+    }
+    for (i=n-1; i>0; i--) {
+        int p = 0;
+        swap_results_float(res, D, do_points, 0, i);
+        for (;;) {
+            int c = 2*p + 1;
+            if (c >= i)
+                break;
+            if (c+1 < i && res->sdists[c+1] > res->sdists[c])
+                c++;
+            if (res->sdists[p] >= res->sdists[c])
+                break;
+            swap_results_float(res, D, do_points, p, c);
+            p = c;
+        }
+    }
 }
 
-static int kdtree_qsort(dtype *arr, unsigned int *parr, int l, int r, int D, int d)
-{
-    int* permute;
-    int i, j, N;
-    dtype* tmparr;
-    int* tmpparr;
+kdtree_qres_f_t* MANGLE(kdtree_rangesearch_float)
+     (const kdtree_t* kd, kdtree_qres_f_t* res, const float* query,
+      float maxd2, int options) {
+    int nodestack[100];
+    int stackpos = 0;
+    int D;
+    anbool do_dists, do_points, do_wholenode_check, use_bboxes;
+    float maxdist;
+    anbool created = FALSE;
 
-    N = r - l + 1;
+    if (!kd || !query)
+        return NULL;
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#else
+    D = kd->ndim;
+#endif
+
+    if (options & KD_OPTIONS_SORT_DISTS)
+        options |= KD_OPTIONS_COMPUTE_DISTS;
+    do_dists = options & KD_OPTIONS_COMPUTE_DISTS;
+    do_points = options & KD_OPTIONS_RETURN_POINTS;
+    do_wholenode_check = !(options & KD_OPTIONS_SMALL_RADIUS);
+    use_bboxes = kd->bb.any &&
+        !(kd->split.any && (options & KD_OPTIONS_USE_SPLIT));
+    assert(use_bboxes || (kd->split.any && kd->splitdim));
+    maxdist = sqrtf(maxd2);
+
+    if (!res) {
+        res = CALLOC(1, sizeof(kdtree_qres_f_t));
+        if (!res) {
+            SYSERROR("Failed to allocate kdtree_qres_f_t struct");
+            return NULL;
+        }
+        created = TRUE;
+    }
+    if (!resize_results_float(res, res->capacity ? res->capacity :
+                              KDTREE_MAX_RESULTS, D, do_dists, do_points))
+        goto bailout;
+    res->nres = 0;
+
+    nodestack[0] = 0;
+    while (stackpos >= 0) {
+        int nodeid = nodestack[stackpos--];
+        int i, L, R;
+        anbool wholenode = FALSE;
+
+        if (use_bboxes) {
+            const float* lo = LOW_HR(kd, D, nodeid);
+            const float* hi = HIGH_HR(kd, D, nodeid);
+            float mind2 = 0, maxd2box = 0;
+            int d;
+            for (d=0; d<D; d++) {
+                float q = query[d];
+                float dmin = 0, dmax;
+                if (q < lo[d])
+                    dmin = lo[d] - q;
+                else if (q > hi[d])
+                    dmin = q - hi[d];
+                mind2 += dmin * dmin;
+                dmax = MAX(q - lo[d], hi[d] - q);
+                maxd2box += dmax * dmax;
+            }
+            if (mind2 > maxd2)
+                continue;
+            wholenode = do_wholenode_check && (maxd2box <= maxd2);
+        }
+
+        if (wholenode || KD_IS_LEAF(kd, nodeid)) {
+            L = kdtree_left(kd, nodeid);
+            R = kdtree_right(kd, nodeid);
+            for (i=L; i<=R; i++) {
+                const float* pt = KD_DATA(kd, D, i);
+                float d2 = 0;
+                int d;
+                if (!wholenode || do_dists) {
+                    for (d=0; d<D; d++) {
+                        float delta = query[d] - pt[d];
+                        d2 += delta * delta;
+                    }
+                    if (!wholenode && d2 > maxd2)
+                        continue;
+                }
+                if (!add_result_float(res, d2, KD_PERM(kd, i), pt, D,
+                                      do_dists, do_points))
+                    goto bailout;
+            }
+            continue;
+        }
+
+        if (use_bboxes) {
+            nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+            nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+        } else {
+            int dim = KD_SPLITDIM(kd, nodeid);
+            float split = *KD_SPLIT(kd, nodeid);
+            if (query[dim] < split) {
+                nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+                if (split - query[dim] <= maxdist)
+                    nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+            } else {
+                nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+                if (query[dim] - split <= maxdist)
+                    nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+            }
+        }
+    }
+
+    if (!(options & KD_OPTIONS_NO_RESIZE_RESULTS))
+        resize_results_float(res, res->nres, D, do_dists, do_points);
+    if (options & KD_OPTIONS_SORT_DISTS)
+        sort_results_float(res, D, do_points);
+    return res;
+
+ bailout:
+    if (created)
+        kdtree_free_query_float(res);
+    return NULL;
+}
+#endif
+
+/*
+ Finds the node at level "level" that "query" falls in, descending by the
+ splitting planes (or, in bounding-box trees, towards the nearer child).
+ Used to put batched queries in the tree's own spatial order.
+ */
+static int query_node(const kdtree_t* kd, const etype* query, int D,
+                      int level) {
+    int nodeid = 0;
+    int l;
+    for (l=0; l<level && !KD_IS_LEAF(kd, nodeid); l++) {
+        anbool goleft;
+        if (kd->split.any) {
+            ttype split = *KD_SPLIT(kd, nodeid);
+            int dim = -1;
+            if (kd->splitdim)
+                dim = KD_SPLITDIM(kd, nodeid);
+            if (!kd->splitdim && TTYPE_INTEGER) {
+                bigint tmpsplit = split;
+                dim = tmpsplit & kd->dimmask;
+                split = tmpsplit & kd->splitmask;
+            }
+            goleft = (query[dim] < POINT_TE(kd, dim, split));
+        } else {
+            double d2[2];
+            int c, d;
+            for (c=0; c<2; c++) {
+                int child = KD_CHILD_LEFT(nodeid) + c;
+                ttype* tlo = LOW_HR(kd, D, child);
+                ttype* thi = HIGH_HR(kd, D, child);
+                d2[c] = 0.0;
+                for (d=0; d<D; d++) {
+                    double lo = POINT_TE(kd, d, tlo[d]);
+                    double hi = POINT_TE(kd, d, thi[d]);
+                    double delta = 0.0;
+                    if (query[d] < lo)
+                        delta = lo - query[d];
+                    else if (query[d] > hi)
+                        delta = query[d] - hi;
+                    d2[c] += delta * delta;
+                }
+            }
+            goleft = (d2[0] <= d2[1]);
+        }
+        nodeid = goleft ? KD_CHILD_LEFT(nodeid) : KD_CHILD_RIGHT(nodeid);
+    }
+    return nodeid;
+}
+
+/*
+ Puts the queries in "order" grouped by the tree node (a few levels
+ deeper than needed to get groups of "ngroup") that they fall in.
+ Returns FALSE on allocation failure.
+ */
+static anbool sort_queries(const kdtree_t* kd, const etype* queries, int nq,
+                           int D, int ngroup, int* order) {
+    int level, nbuckets, first;
+    int* bucket;
+    int* start;
+    int q, b;
+
+    // Four buckets per group.
+    for (level=0; (1 << level) * ngroup < 4 * nq && level < kd->nlevels - 1;
+         level++);
+    nbuckets = 1 << level;
+    first = nbuckets - 1;
+    bucket = malloc((size_t)nq * sizeof(int));
+    start = calloc(nbuckets + 1, sizeof(int));
+    if (!bucket || !start) {
+        free(bucket);
+        free(start);
+        return FALSE;
+    }
+    // (counting sort: stable, so ties stay in query order.)
+    for (q=0; q<nq; q++) {
+        bucket[q] = query_node(kd, queries + (size_t)q*D, D, level) - first;
+        start[bucket[q] + 1]++;
+    }
+    for (b=0; b<nbuckets; b++)
+        start[b+1] += start[b];
+    for (q=0; q<nq; q++)
+        order[start[bucket[q]]++] = q;
+    free(bucket);
+    free(start);
+    return TRUE;
+}
+
+// Sets the bounding box of the queries "list[0..n-1]".
+static void query_list_bbox(const etype* queries, const int* list, int n,
+                            int D, etype* qlo, etype* qhi) {
+    int q, d;
+    for (d=0; d<D; d++)
+        qlo[d] = qhi[d] = queries[(size_t)list[0]*D + d];
+    for (q=1; q<n; q++) {
+        const etype* query = queries + (size_t)list[q]*D;
+        for (d=0; d<D; d++) {
+            qlo[d] = MIN(qlo[d], query[d]);
+            qhi[d] = MAX(qhi[d], query[d]);
+        }
+    }
+}
+
+/*
+ Reports a point found by the batch search: into "res[iq]", or through
+ "cb" if it is set.  Returns FALSE if adding the result failed.
+ */
+static inline anbool batch_add_point(const kdtree_t* kd, kdtree_qres_t** res,
+                                     kdtree_batch_callback cb, void* token,
+                                     const etype* query, int iq, int i, int D,
+                                     double maxd2, anbool do_dists,
+                                     anbool do_points) {
+    anbool bailedout = FALSE;
+    double dsqd;
+    if (!cb)
+        return leaf_check_point(kd, res[iq], query, i, D, maxd2,
+                                do_dists, do_points);
+    dist2_bailout(kd, query, KD_DATA(kd, D, i), D, maxd2, &bailedout, &dsqd);
+    if (!bailedout)
+        cb(token, iq, KD_PERM(kd, i), dsqd);
+    return TRUE;
+}
+
+/*
+ Range search for a batch of query points.
+
+ The queries are sorted into the tree's spatial order (by the leaf each
+ one falls in) and searched in groups of KD_BATCH_GROUP neighbouring
+ queries.  Each group descends the tree once, carrying the list of
+ queries that may still have points under each node, plus the list's
+ bounding box: a node is rejected, or a split sends the whole list to one
+ child, by testing the box, and the queries are tested one by one only
+ where the box straddles the decision.  Leaf points are converted (see
+ leaf_scan) once for all the queries in the group that reach the leaf.
+
+ Supports the same "options" as kdtree_rangesearch_options, except the
+ SPLIT_PRECHECK and L1_PRECHECK shortcuts, which are ignored.  If "cb" is
+ NULL, results for query i are put in res[i] (which is allocated if NULL,
+ else reused), in the same order as kdtree_rangesearch_options would.
+ Otherwise "cb" is called for each (query, point) pair, and "res" and the
+ result-struct options are ignored.
+
+ Returns 0 on success, -1 on failure.
+ */
+static int rangesearch_batch(const kdtree_t* kd, kdtree_qres_t** res,
+                             kdtree_batch_callback cb, void* token,
+                             const etype* queries, int nq,
+                             double maxd2, int options) {
+    int D;
+    int i, q, g;
+    anbool do_dists;
+    anbool do_points = TRUE;
+    anbool do_wholenode_check;
+    anbool use_bboxes = FALSE;
+    double maxdist;
+    double dtlinf = 0.0;
+    ttype tlinf = 0;
+    ttype* tqueries = NULL;
+    anbool* use_tsplit = NULL;
+    float* fqueries = NULL;
+    float* fthresh = NULL;
+    anbool* use_simd = NULL;
+    leaf_floats_t leaf;
+    int cand[KD_LEAF_SIMD_MAX];
+    // The queries, in spatial order.
+    int* order = NULL;
+    // Stack of (node, offset, count) triples; "count" queries in
+    // active[offset...] are still alive at "node".  "boxes" holds the
+    // bounding box (lo, hi) of each of these lists.
+    int* nodestack = NULL;
+    etype* boxes = NULL;
+    int* active = NULL;
+    int* current = NULL;
+    int stackpos, top, maxstack, ngroup;
+    int rtn = -1;
+
+    if (!kd || (!res && !cb) || (nq && !queries))
+        return -1;
+    if (nq == 0)
+        return 0;
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#else
+    D = kd->ndim;
+#endif
+
+    if (cb) {
+        options |= KD_OPTIONS_COMPUTE_DISTS;
+        options &= ~KD_OPTIONS_SORT_DISTS;
+        do_points = FALSE;
+    }
+    if (options & KD_OPTIONS_SORT_DISTS)
+        options |= KD_OPTIONS_COMPUTE_DISTS;
+    do_dists = options & KD_OPTIONS_COMPUTE_DISTS;
+    do_wholenode_check = !(options & KD_OPTIONS_SMALL_RADIUS);
+
+    if (!kd->split.any) {
+        assert(kd->bb.any);
+        use_bboxes = TRUE;
+    } else if (kd->bb.any && !(options & KD_OPTIONS_USE_SPLIT)) {
+        use_bboxes = TRUE;
+    }
+
+    maxdist = sqrt(maxd2);
+    if (TTYPE_INTEGER) {
+        dtlinf = DIST_ET(kd, maxdist, );
+        tlinf  = ceil(dtlinf);
+    }
+
+    if (!cb)
+        for (q=0; q<nq; q++) {
+            res[q] = prepare_results(res[q], D, do_dists, do_points);
+            if (!res[q])
+                return -1;
+        }
+
+    ngroup = MIN(nq, KD_BATCH_GROUP);
+    // A node passes at most its whole list to each child, and each
+    // stack level holds at most one pending sibling.
+    maxstack = 2 * (kd->nlevels + 1);
+    order = malloc((size_t)nq * sizeof(int));
+    nodestack = malloc((size_t)maxstack * 3 * sizeof(int));
+    boxes = malloc((size_t)maxstack * 2 * D * sizeof(etype));
+    active = malloc((size_t)ngroup * (maxstack + 1) * sizeof(int));
+    current = malloc((size_t)ngroup * sizeof(int));
+    tqueries = malloc((size_t)nq * D * sizeof(ttype));
+    use_tsplit = malloc((size_t)nq * sizeof(anbool));
+    if (!order || !nodestack || !boxes || !active || !current || !tqueries ||
+        !use_tsplit) {
+        SYSERROR("Failed to allocate batch range search workspace");
+        goto bailout;
+    }
+
+    // See kdtree_rangesearch_options.
+    if (LEAF_SIMD && !do_wholenode_check) {
+        fqueries = malloc((size_t)nq * D * sizeof(float));
+        fthresh = malloc((size_t)nq * sizeof(float));
+        use_simd = malloc((size_t)nq * sizeof(anbool));
+        if (!fqueries || !fthresh || !use_simd) {
+            SYSERROR("Failed to allocate batch range search workspace");
+            goto bailout;
+        }
+        for (q=0; q<nq; q++)
+            use_simd[q] = leaf_simd_query(kd, queries + (size_t)q*D, D, maxd2,
+                                          fqueries + (size_t)q*D, fthresh + q);
+    }
+
+    for (q=0; q<nq; q++) {
+        use_tsplit[q] = FALSE;
+        if (TTYPE_INTEGER && !use_bboxes)
+            use_tsplit[q] = ttype_query(kd, queries + (size_t)q*D,
+                                        tqueries + (size_t)q*D) &&
+                (dtlinf < TTYPE_MAX);
+    }
+    if (nq > ngroup) {
+        if (!sort_queries(kd, queries, nq, D, ngroup, order)) {
+            SYSERROR("Failed to allocate batch range search workspace");
+            goto bailout;
+        }
+    } else {
+        for (q=0; q<nq; q++)
+            order[q] = q;
+    }
+
+    for (g=0; g<nq; g+=ngroup) {
+        int n = MIN(ngroup, nq - g);
+
+        // queue root, with this group's queries.
+        for (q=0; q<n; q++)
+            active[q] = order[g + q];
+        stackpos = 0;
+        nodestack[0] = 0;
+        nodestack[1] = 0;
+        nodestack[2] = n;
+        query_list_bbox(queries, active, n, D, boxes, boxes + D);
+
+        while (stackpos >= 0) {
+            int nodeid = nodestack[3*stackpos + 0];
+            int ncur   = nodestack[3*stackpos + 2];
+            const etype* qlo = boxes + (size_t)stackpos * 2 * D;
+            const etype* qhi = qlo + D;
+            int* list;
+            int L, R;
+            int nleft, nright;
+            int* left;
+            int* right;
+
+            // This list is at the top of "active"; take it off.
+            top = nodestack[3*stackpos + 1];
+            list = active + top;
+            stackpos--;
+
+            if (KD_IS_LEAF(kd, nodeid)) {
+                anbool simdleaf;
+                L = kdtree_left(kd, nodeid);
+                R = kdtree_right(kd, nodeid);
+                // The leaf is converted once for all the queries that reach it.
+                simdleaf = fqueries && leaf_load_floats(kd, L, R, D, &leaf);
+                for (q=0; q<ncur; q++) {
+                    int iq = list[q];
+                    const etype* query = queries + (size_t)iq*D;
+                    if (simdleaf && use_simd[iq]) {
+                        int c, nc;
+                        nc = leaf_scan(&leaf, fqueries + (size_t)iq*D, D,
+                                       fthresh[iq], cand);
+                        for (c=0; c<nc; c++)
+                            if (!batch_add_point(kd, res, cb, token, query, iq,
+                                                 L + cand[c], D, maxd2,
+                                                 do_dists, do_points))
+                                goto bailout;
+                        continue;
+                    }
+                    for (i=L; i<=R; i++)
+                        if (!batch_add_point(kd, res, cb, token, query, iq, i, D,
+                                             maxd2, do_dists, do_points))
+                            goto bailout;
+                }
+                continue;
+            }
+
+            if (use_bboxes) {
+                ttype *tlo=NULL, *thi=NULL;
+                etype bblo[D], bbhi[D];
+                double gap2 = 0.0;
+                int d;
+                bboxes(kd, nodeid, &tlo, &thi, D);
+                assert(tlo && thi);
+                for (d=0; d<D; d++) {
+                    double delta = 0.0;
+                    bblo[d] = POINT_TE(kd, d, tlo[d]);
+                    bbhi[d] = POINT_TE(kd, d, thi[d]);
+                    if (qhi[d] < bblo[d])
+                        delta = bblo[d] - qhi[d];
+                    else if (qlo[d] > bbhi[d])
+                        delta = qlo[d] - bbhi[d];
+                    gap2 += delta * delta;
+                }
+                // The node is out of range of the whole list.
+                if (gap2 > maxd2)
+                    continue;
+
+                // Survivors are compacted in place; the list is not
+                // needed once it has been filtered.
+                L = kdtree_left(kd, nodeid);
+                R = kdtree_right(kd, nodeid);
+                nleft = 0;
+                for (q=0; q<ncur; q++) {
+                    int iq = list[q];
+                    const etype* query = queries + (size_t)iq*D;
+                    if (bb_point_mindist2_exceeds(bblo, bbhi, query, D, maxd2))
+                        continue;
+                    if (do_wholenode_check &&
+                        !bb_point_maxdist2_exceeds(bblo, bbhi, query, D, maxd2)) {
+                        // the whole node is in range of this query.
+                        for (i=L; i<=R; i++) {
+                            double dsqd = LARGE_VAL;
+                            if (do_dists)
+                                dsqd = dist2(kd, query, KD_DATA(kd, D, i), D);
+                            if (cb)
+                                cb(token, iq, KD_PERM(kd, i), dsqd);
+                            else if (!add_result(kd, res[iq], dsqd, KD_PERM(kd, i),
+                                                 KD_DATA(kd, D, i), D,
+                                                 do_dists, do_points))
+                                goto bailout;
+                        }
+                        continue;
+                    }
+                    list[nleft++] = iq;
+                }
+                if (!nleft)
+                    continue;
+                // both children get the same list.
+                stackpos++;
+                nodestack[3*stackpos + 0] = KD_CHILD_LEFT(nodeid);
+                nodestack[3*stackpos + 1] = top;
+                nodestack[3*stackpos + 2] = nleft;
+                query_list_bbox(queries, list, nleft, D,
+                                boxes + (size_t)stackpos * 2 * D,
+                                boxes + (size_t)stackpos * 2 * D + D);
+                memcpy(list + nleft, list, (size_t)nleft * sizeof(int));
+                stackpos++;
+                nodestack[3*stackpos + 0] = KD_CHILD_RIGHT(nodeid);
+                nodestack[3*stackpos + 1] = top + nleft;
+                nodestack[3*stackpos + 2] = nleft;
+                memcpy(boxes + (size_t)stackpos * 2 * D,
+                       boxes + (size_t)(stackpos - 1) * 2 * D,
+                       2 * D * sizeof(etype));
+            } else {
+                ttype split = *KD_SPLIT(kd, nodeid);
+                int dim = -1;
+                etype rsplit;
+                anbool allleft, allright;
+                if (kd->splitdim)
+                    dim = KD_SPLITDIM(kd, nodeid);
+                if (!kd->splitdim && TTYPE_INTEGER) {
+                    bigint tmpsplit;
+                    tmpsplit = split;
+                    dim = tmpsplit & kd->dimmask;
+                    split = tmpsplit & kd->splitmask;
+                }
+                rsplit = POINT_TE(kd, dim, split);
+
+                // Can the whole list go to one child?  Push it back
+                // unchanged, in place.
+                allleft = (qhi[dim] < rsplit) && (rsplit - qhi[dim] > maxdist);
+                allright = (qlo[dim] >= rsplit) && (qlo[dim] - rsplit > maxdist);
+                if (allleft || allright) {
+                    stackpos++;
+                    nodestack[3*stackpos + 0] = allleft ?
+                        KD_CHILD_LEFT(nodeid) : KD_CHILD_RIGHT(nodeid);
+                    // (offset, count and box are still in place.)
+                    continue;
+                }
+
+                // Children's lists go on top of "active"; the left list
+                // first so that the right child is visited first, as in
+                // kdtree_rangesearch_options.
+                memcpy(current, list, (size_t)ncur * sizeof(int));
+                left = list;
+                nleft = 0;
+                right = left + ncur;
+                nright = 0;
+                for (q=0; q<ncur; q++) {
+                    int iq = current[q];
+                    anbool goleft, goright;
+                    if (TTYPE_INTEGER && use_tsplit[iq]) {
+                        ttype tq = tqueries[(size_t)iq*D + dim];
+                        if (tq < split) {
+                            goleft = TRUE;
+                            goright = (split - tq <= tlinf);
+                        } else {
+                            goright = TRUE;
+                            goleft = (tq - split <= tlinf);
+                        }
+                    } else {
+                        etype qd = queries[(size_t)iq*D + dim];
+                        if (qd < rsplit) {
+                            goleft = TRUE;
+                            goright = (rsplit - qd <= maxdist);
+                        } else {
+                            goright = TRUE;
+                            goleft = (qd - rsplit <= maxdist);
+                        }
+                    }
+                    if (goleft)
+                        left[nleft++] = iq;
+                    if (goright)
+                        right[nright++] = iq;
+                }
+
+                if (nleft) {
+                    stackpos++;
+                    nodestack[3*stackpos + 0] = KD_CHILD_LEFT(nodeid);
+                    nodestack[3*stackpos + 1] = top;
+                    nodestack[3*stackpos + 2] = nleft;
+                    query_list_bbox(queries, left, nleft, D,
+                                    boxes + (size_t)stackpos * 2 * D,
+                                    boxes + (size_t)stackpos * 2 * D + D);
+                    top += nleft;
+                }
+                if (nright) {
+                    // compact the right list down against the left one.
+                    memmove(active + top, right, (size_t)nright * sizeof(int));
+                    stackpos++;
+                    nodestack[3*stackpos + 0] = KD_CHILD_RIGHT(nodeid);
+                    nodestack[3*stackpos + 1] = top;
+                    nodestack[3*stackpos + 2] = nright;
+                    query_list_bbox(queries, active + top, nright, D,
+                                    boxes + (size_t)stackpos * 2 * D,
+                                    boxes + (size_t)stackpos * 2 * D + D);
+                }
+            }
+        }
+    }
+
+    if (!cb)
+        for (q=0; q<nq; q++) {
+            if (!(options & KD_OPTIONS_NO_RESIZE_RESULTS))
+                resize_results(res[q], res[q]->nres, D, do_dists, do_points);
+            if (options & KD_OPTIONS_SORT_DISTS)
+                kdtree_qsort_results(res[q], kd->ndim);
+        }
+    rtn = 0;
+
+ bailout:
+    free(order);
+    free(nodestack);
+    free(boxes);
+    free(active);
+    free(current);
+    free(tqueries);
+    free(use_tsplit);
+    free(fqueries);
+    free(fthresh);
+    free(use_simd);
+    return rtn;
+}
+
+int MANGLE(kdtree_rangesearch_batch_reuse)
+     (const kdtree_t* kd, kdtree_qres_t** res, const void* vqueries, int nq,
+      double maxd2, int options)
+{
+    if (!res)
+        return -1;
+    return rangesearch_batch(kd, res, NULL, NULL, vqueries, nq, maxd2, options);
+}
+
+int MANGLE(kdtree_rangesearch_batch)
+     (const kdtree_t* kd, const void* vqueries, int nq, double maxd2,
+      int options, kdtree_batch_callback cb, void* token)
+{
+    if (!cb)
+        return -1;
+    return rangesearch_batch(kd, NULL, cb, token, vqueries, nq, maxd2, options);
+}
+
+static void* get_data(const kdtree_t* kd, int i) {
+    return KD_DATA(kd, kd->ndim, i);
+}
+
+static void copy_data_double(const kdtree_t* kd, int start, int N,
+                             double* dest) {
+    Unused int i, j, d;
+    int D;
+
+    D = kd->ndim;
+#if DTYPE_DOUBLE
+    //#warning "Data type is double; just copying data."
+    memcpy(dest, kd->data.DTYPE + start*D, (size_t)N*(size_t)D*sizeof(etype));
+#elif (!DTYPE_INTEGER && !ETYPE_INTEGER)
+    //#warning "Etype and Dtype are both reals; just casting values."
+    for (i=0; i<(N * D); i++)
+        dest[i] = kd->data.DTYPE[start*D + i];
+#else
+    //#warning "Using POINT_DE to convert data."
+    j=0;
+    for (i=0; i<N; i++)
+        for (d=0; d<D; d++) {
+            dest[j] = POINT_DE(kd, D, kd->data.DTYPE[(start + i)*D + d]);
+            j++;
+        }
+#endif
+}
+
+/* Per-thread so that subtrees can be sorted concurrently during a
+ parallel build. */
+static __thread dtype* kdqsort_arr;
+static __thread int kdqsort_D;
+
+static int kdqsort_compare(const void* v1, const void* v2)
+{
+    int i1, i2;
+    dtype val1, val2;
+    i1 = *((int*)v1);
+    i2 = *((int*)v2);
+    val1 = kdqsort_arr[(size_t)i1 * (size_t)kdqsort_D];
+    val2 = kdqsort_arr[(size_t)i2 * (size_t)kdqsort_D];
+    if (val1 < val2)
+        return -1;
+    else if (val1 > val2)
+        return 1;
+    return 0;
+}
+
+static int kdtree_qsort(dtype *arr, unsigned int *parr, int l, int r, int D, int d)
+{
+    int* permute;
+    int i, j, N;
+    dtype* tmparr;
+    int* tmpparr;
+
+    N = r - l + 1;
     permute = MALLOC((size_t)N * sizeof(int));
     if (!permute) {
         SYSERROR("Failed to allocate extra permutation array");
@@ -1919,7 +3103,7 @@ static int kdtree_check_node(const kdtree_t* kd, int nodeid) {
 
             split = *KD_SPLIT(kd, nodeid);
             if (kd->splitdim)
-                dim = kd->splitdim[nodeid];
+                dim = KD_SPLITDIM(kd, nodeid);
             else {
                 if (TTYPE_INTEGER) {
                     bigint tmpsplit;
@@ -2124,18 +3308,362 @@ static int needs_data_conversion() {
     return DTYPE_INTEGER && !ETYPE_INTEGER;
 }
 
+/*
+ Splits interior node "i", which owns data points [left, right]: saves
+ its bounding box and splitting plane and partitions the points.
+ Returns "m", the first point of the right child (the left child gets
+ [left, m-1]), or -1 on error.  Only touches data and perm in
+ [left, right], so disjoint nodes can be split concurrently.
+ */
+static int build_node(kdtree_t* kd, int i, int left, int right,
+                      unsigned int options) {
+    int D = kd->ndim;
+    dtype* data = kd->data.DTYPE;
+    unsigned int d;
+    dtype maxrange;
+    ttype s;
+    int dim = 0;
+    int m;
+    dtype qsplit = 0;
+    int xx;
+
+#if defined(KD_DIM)
+    // let the compiler know that D is a constant...
+    D = KD_DIM;
+#endif
+    // compute_bb() leaves "lo" and "hi" unset without dimensions.
+    if (D < 1) {
+        ERROR("kdtree_build: tree has %i dimensions", D);
+        return -1;
+    }
+    dtype hi[D], lo[D];
+
+    if (left >= right) {
+        //debug("Empty node %i: left=right=%i\n", i, left);
+        if (options & KD_BUILD_BBOX) {
+            dtype nullbb[D];
+            for (d=0; d<D; d++)
+                nullbb[d] = 0;
+            save_bb(kd, i, nullbb, nullbb);
+        }
+        if (kd->splitdim)
+            kd->splitdim[i] = 0;
+        // both children get R = right.
+        return right + 1;
+    }
+
+    /* More sanity */
+    assert(0 <= left);
+    assert(left <= right);
+    assert(right < kd->ndata);
+
+    /* Find the bounding-box for this node. */
+    compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
+
+    if (options & KD_BUILD_BBOX)
+        save_bb(kd, i, lo, hi);
+
+    /* Split along dimension with largest range */
+    maxrange = DTYPE_MIN;
+    for (d=0; d<D; d++)
+        if ((hi[d] - lo[d]) >= maxrange) {
+            maxrange = hi[d] - lo[d];
+            dim = d;
+        }
+    d = dim;
+    assert (d < D);
+
+    if ((options & KD_BUILD_FORCE_SORT) ||
+        (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM))) {
+        
+        /* We're packing dimension and split location into an int. */
+
+        /* Sort the data. */
+
+        /* Because the nature of the inttree is to bin the split
+         * planes, we have to be careful. Here, we MUST sort instead
+         * of merely partitioning, because we may not be able to
+         * properly represent the median as a split plane. Imagine the
+         * following on the dtype line: 
+         *
+         *    |P P   | P M  | P    |P     |  PP |  ------> X
+         *           1      2
+         * The |'s are possible split positions. If M is selected to
+         * split on, we actually cannot select the split 1 or 2
+         * immediately, because if we selected 2, then M would be on
+         * the wrong side (the medians always go to the right) and we
+         * can't select 1 because then P would be on the wrong side.
+         * So, the solution is to try split 2, and if point M-1 is on
+         * the correct side, great. Otherwise, we have to move shift
+         * point M-1 into the right side and only then chose plane 1. */
+
+
+        /* FIXME but qsort allocates a 2nd perm array GAH */
+        if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
+            ERROR("kdtree_qsort failed");
+            return -1;
+        }
+        m = (1 + (size_t)left + (size_t)right)/2;
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        
+        /* Make sure sort works */
+        for(xx=left; xx<=right-1; xx++) {
+            assert(KD_ARRAY_VAL(data, D, xx,   d) <=
+                   KD_ARRAY_VAL(data, D, xx+1, d));
+        }
+
+        /* Encode split dimension and value. */
+        /* "s" is the location of the splitting plane in the "tree"
+         data type. */
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        if (kd->split.any) {
+            /* If we are using the "split" array to store both the
+             splitting plane and the splitting dimension, then we
+             truncate a few bits from "s" here. */
+            bigint tmps = s;
+            tmps &= kd->splitmask;
+            assert((tmps & kd->dimmask) == 0);
+            s = tmps;
+        }
+        /* "qsplit" is the location of the splitting plane in the "data"
+         type. */
+        qsplit = POINT_TD(kd, d, s);
+
+        /* Play games to make sure we properly partition the data */
+        while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
+        while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
+
+        /* Even more sanity */
+        assert(m >= -1);
+        assert(left <= m);
+        assert(m <= right);
+        for (xx=left; m && xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
+        for (xx=m; xx<=right; xx++)
+            assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
+
+    } else {
+        /* "m-1" becomes R of the left child;
+         "m" becomes L of the right child. */
+        if (kd->has_linear_lr) {
+            m = kdtree_left(kd, KD_CHILD_RIGHT(i));
+        } else {
+            /* Pivot the data at the median */
+            m = (1 + (size_t)left + (size_t)right) / 2;
+        }
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
+
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        assert(m != 0);
+        assert(left <= (m-1));
+        assert(m <= right);
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <=
+                   KD_ARRAY_VAL(data, D, m, d));
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
+        for (xx=m; xx<=right; xx++)
+            assert(KD_ARRAY_VAL(data, D, m, d) <=
+                   KD_ARRAY_VAL(data, D, xx, d));
+        for (xx=m; xx<=right; xx++)
+            assert(s <= KD_ARRAY_VAL(data, D, xx, d));
+    }
+
+    if (kd->split.any) {
+        if (kd->splitdim)
+            *KD_SPLIT(kd, i) = s;
+        else {
+            bigint tmps = s;
+            *KD_SPLIT(kd, i) = tmps | dim;
+        }
+    }
+    if (kd->splitdim)
+        kd->splitdim[i] = dim;
+
+    return m;
+}
+
+/*
+ The serial build. Because the lr pointers are only stored for the
+ bottom layer, we use the lr array as a stack. At finish, it contains
+ the r pointers for the bottom nodes. The l pointer is simply +1 of the
+ previous right pointer, or 0 if we are at the first element of the lr
+ array.
+ */
+static int build_serial(kdtree_t* kd, unsigned int options) {
+    int i;
+    int lnext, level;
+    int maxlevel = kd->nlevels;
+
+    /* Use the lr array as a stack while building. In place in your face! */
+    kd->lr[0] = kd->ndata - 1;
+    lnext = 1;
+    level = 0;
+
+    for (i = 0; i < kd->ninterior; i++) {
+        int left, right;
+        unsigned int c;
+        int m;
+
+        /* Have we reached the next level in the tree? */
+        if (i == lnext) {
+            level++;
+            lnext = lnext * 2 + 1;
+        }
+
+        /* Since we're not storing the L pointers, we have to infer L */
+        if (i == (1<<level)-1) {
+            left = 0;
+        } else {
+            left = kd->lr[i-1] + 1;
+        }
+        right = kd->lr[i];
+
+        assert(right != (unsigned int)-1);
+
+        m = build_node(kd, i, left, right, options);
+        if (m < 0)
+            return -1;
+
+        /* Store the R pointers for each child */
+        c = 2*i;
+        if (level == maxlevel - 2)
+            c -= kd->ninterior;
+
+        kd->lr[c+1] = m-1;
+        kd->lr[c+2] = right;
+
+        assert(c+2 < kd->nbottom);
+    }
+    return 0;
+}
+
+/* Build trees of at least this many points on several threads. */
+#define KD_PARALLEL_BUILD_MIN 262144
+#define KD_PARALLEL_BUILD_MAX_THREADS 64
+/* Subtree tasks per thread, for load balancing. */
+#define KD_PARALLEL_BUILD_TASKS 8
+
+struct build_state {
+    kdtree_t* kd;
+    unsigned int options;
+    /* R pointer of every node. */
+    int32_t* right;
+    /* Nodes [first, last) are shared among the threads; "next" is the
+     next unclaimed one. */
+    int first;
+    int last;
+    int next;
+    /* Build whole subtrees rooted at the shared nodes? */
+    anbool subtrees;
+    anbool failed;
+};
+
+static int build_split(struct build_state* st, int i, int left) {
+    int right = st->right[i];
+    int m = build_node(st->kd, i, left, right, st->options);
+    if (m < 0)
+        return -1;
+    st->right[KD_CHILD_LEFT(i)]  = m - 1;
+    st->right[KD_CHILD_RIGHT(i)] = right;
+    return m;
+}
+
+static int build_subtree(struct build_state* st, int i, int left) {
+    int m;
+    if (i >= st->kd->ninterior)
+        return 0;
+    m = build_split(st, i, left);
+    if (m < 0)
+        return -1;
+    if (build_subtree(st, KD_CHILD_LEFT(i), left) ||
+        build_subtree(st, KD_CHILD_RIGHT(i), m))
+        return -1;
+    return 0;
+}
+
+static void* build_worker(void* varg) {
+    struct build_state* st = varg;
+    for (;;) {
+        int i, left, rtn;
+        i = __sync_fetch_and_add(&st->next, 1);
+        if (i >= st->last || st->failed)
+            break;
+        left = (i == st->first) ? 0 : st->right[i-1] + 1;
+        if (st->subtrees)
+            rtn = build_subtree(st, i, left);
+        else
+            rtn = (build_split(st, i, left) < 0) ? -1 : 0;
+        if (rtn) {
+            st->failed = TRUE;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int build_run(struct build_state* st, int nthreads) {
+    pthread_t threads[nthreads];
+    int t, nstarted;
+    st->next = st->first;
+    for (nstarted=0; nstarted<nthreads-1; nstarted++)
+        if (pthread_create(threads + nstarted, NULL, build_worker, st))
+            break;
+    build_worker(st);
+    for (t=0; t<nstarted; t++)
+        pthread_join(threads[t], NULL);
+    return st->failed ? -1 : 0;
+}
+
+/*
+ Builds the same tree as build_serial() on "nthreads" threads.  The top
+ levels are built one level at a time, with the nodes of each level
+ shared among the threads; once a level has enough nodes, each node
+ becomes a task whose whole subtree is built depth-first by one thread.
+ Every node is split exactly as in the serial build, on the same range
+ of points, so the results are identical.
+ */
+static int build_parallel(kdtree_t* kd, unsigned int options, int nthreads) {
+    struct build_state st;
+    int level, i;
+
+    memset(&st, 0, sizeof(st));
+    st.kd = kd;
+    st.options = options;
+    st.right = MALLOC((size_t)kd->nnodes * sizeof(int32_t));
+    if (!st.right) {
+        SYSERROR("Failed to allocate R-pointer array");
+        return -1;
+    }
+    st.right[0] = kd->ndata - 1;
+
+    for (level=0; level<kd->nlevels-1; level++) {
+        st.first = (1 << level) - 1;
+        st.last  = (1 << (level+1)) - 1;
+        st.subtrees = (st.last - st.first >= nthreads * KD_PARALLEL_BUILD_TASKS);
+        if (build_run(&st, nthreads) || st.subtrees)
+            break;
+    }
+    if (!st.failed)
+        for (i=0; i<kd->nbottom; i++)
+            kd->lr[i] = st.right[kd->ninterior + i];
+    FREE(st.right);
+    return st.failed ? -1 : 0;
+}
+
 kdtree_t* MANGLE(kdtree_build_2)
      (kdtree_t* kd, etype* indata, int N, int D, int Nleaf, int treetype, unsigned int options, double* minval, double* maxval) {
     int i;
-    int xx;
-    int lnext, level;
     int maxlevel;
+    int nthreads;
     dtype hi[D], lo[D];
-    dtype* data = NULL;
-
-    dtype nullbb[D];
-    for (i=0; i<D; i++)
-        nullbb[i] = 0;
 
     maxlevel = kdtree_compute_levels(N, Nleaf);
 
@@ -2255,205 +3783,19 @@ kdtree_t* MANGLE(kdtree_build_2)
     if (options & KD_BUILD_LINEAR_LR)
         kd->has_linear_lr = TRUE;
 
-    /* Use the lr array as a stack while building. In place in your face! */
-    kd->lr[0] = N - 1;
-    lnext = 1;
-    level = 0;
-
-    // shorthand
-    data = kd->data.DTYPE;
-
-    /* And in one shot, make the kdtree. Because the lr pointers
-     * are only stored for the bottom layer, we use the lr array as a
-     * stack. At finish, it contains the r pointers for the bottom nodes.
-     * The l pointer is simply +1 of the previous right pointer, or 0 if we
-     * are at the first element of the lr array. */
-    for (i = 0; i < kd->ninterior; i++) {
-        unsigned int d;
-        int left, right;
-        dtype maxrange;
-        ttype s;
-        unsigned int c;
-        int dim = 0;
-        int m;
-        dtype qsplit = 0;
-
-        /* Have we reached the next level in the tree? */
-        if (i == lnext) {
-            level++;
-            lnext = lnext * 2 + 1;
-        }
-
-        /* Since we're not storing the L pointers, we have to infer L */
-        if (i == (1<<level)-1) {
-            left = 0;
-        } else {
-            left = kd->lr[i-1] + 1;
-        }
-        right = kd->lr[i];
-
-        assert(right != (unsigned int)-1);
-
-        if (left >= right) {
-            //debug("Empty node %i: left=right=%i\n", i, left);
-            if (options & KD_BUILD_BBOX)
-                save_bb(kd, i, nullbb, nullbb);
-            if (kd->splitdim)
-                kd->splitdim[i] = 0;
-            c = 2*i;
-            if (level == maxlevel - 2)
-                c -= kd->ninterior;
-            kd->lr[c+1] = right;
-            kd->lr[c+2] = right;
-            continue;
-        }
-
-        /* More sanity */
-        assert(0 <= left);
-        assert(left <= right);
-        assert(right < N);
-
-        /* Find the bounding-box for this node. */
-        compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
-
-        if (options & KD_BUILD_BBOX)
-            save_bb(kd, i, lo, hi);
-
-        /* Split along dimension with largest range */
-        maxrange = DTYPE_MIN;
-        for (d=0; d<D; d++)
-            if ((hi[d] - lo[d]) >= maxrange) {
-                maxrange = hi[d] - lo[d];
-                dim = d;
-            }
-        d = dim;
-        assert (d < D);
-
-        if ((options & KD_BUILD_FORCE_SORT) ||
-            (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM))) {
-            
-            /* We're packing dimension and split location into an int. */
-
-            /* Sort the data. */
-
-            /* Because the nature of the inttree is to bin the split
-             * planes, we have to be careful. Here, we MUST sort instead
-             * of merely partitioning, because we may not be able to
-             * properly represent the median as a split plane. Imagine the
-             * following on the dtype line: 
-             *
-             *    |P P   | P M  | P    |P     |  PP |  ------> X
-             *           1      2
-             * The |'s are possible split positions. If M is selected to
-             * split on, we actually cannot select the split 1 or 2
-             * immediately, because if we selected 2, then M would be on
-             * the wrong side (the medians always go to the right) and we
-             * can't select 1 because then P would be on the wrong side.
-             * So, the solution is to try split 2, and if point M-1 is on
-             * the correct side, great. Otherwise, we have to move shift
-             * point M-1 into the right side and only then chose plane 1. */
-
-
-            /* FIXME but qsort allocates a 2nd perm array GAH */
-            if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
-                ERROR("kdtree_qsort failed");
-                // FIXME: memleak mania!
-                return NULL;
-            }
-            m = (1 + (size_t)left + (size_t)right)/2;
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            
-            /* Make sure sort works */
-            for(xx=left; xx<=right-1; xx++) {
-                assert(KD_ARRAY_VAL(data, D, xx,   d) <=
-                       KD_ARRAY_VAL(data, D, xx+1, d));
-            }
-
-            /* Encode split dimension and value. */
-            /* "s" is the location of the splitting plane in the "tree"
-             data type. */
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            if (kd->split.any) {
-                /* If we are using the "split" array to store both the
-                 splitting plane and the splitting dimension, then we
-                 truncate a few bits from "s" here. */
-                bigint tmps = s;
-                tmps &= kd->splitmask;
-                assert((tmps & kd->dimmask) == 0);
-                s = tmps;
-            }
-            /* "qsplit" is the location of the splitting plane in the "data"
-             type. */
-            qsplit = POINT_TD(kd, d, s);
-
-            /* Play games to make sure we properly partition the data */
-            while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
-            while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
-
-            /* Even more sanity */
-            assert(m >= -1);
-            assert(left <= m);
-            assert(m <= right);
-            for (xx=left; m && xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
-            for (xx=m; xx<=right; xx++)
-                assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
-
-        } else {
-            /* "m-1" becomes R of the left child;
-             "m" becomes L of the right child. */
-            if (kd->has_linear_lr) {
-                m = kdtree_left(kd, KD_CHILD_RIGHT(i));
-            } else {
-                /* Pivot the data at the median */
-                m = (1 + (size_t)left + (size_t)right) / 2;
-            }
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
-
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            assert(m != 0);
-            assert(left <= (m-1));
-            assert(m <= right);
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <=
-                       KD_ARRAY_VAL(data, D, m, d));
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
-            for (xx=m; xx<=right; xx++)
-                assert(KD_ARRAY_VAL(data, D, m, d) <=
-                       KD_ARRAY_VAL(data, D, xx, d));
-            for (xx=m; xx<=right; xx++)
-                assert(s <= KD_ARRAY_VAL(data, D, xx, d));
-        }
-
-        if (kd->split.any) {
-            if (kd->splitdim)
-                *KD_SPLIT(kd, i) = s;
-            else {
-                bigint tmps = s;
-                *KD_SPLIT(kd, i) = tmps | dim;
-            }
-        }
-        if (kd->splitdim)
-            kd->splitdim[i] = dim;
-
-        /* Store the R pointers for each child */
-        c = 2*i;
-        if (level == maxlevel - 2)
-            c -= kd->ninterior;
-
-        kd->lr[c+1] = m-1;
-        kd->lr[c+2] = right;
-
-        assert(c+2 < kd->nbottom);
+    nthreads = 1;
+    if (!(options & KD_BUILD_NO_THREADS) && N >= KD_PARALLEL_BUILD_MIN) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu > 1)
+            nthreads = MIN(ncpu, KD_PARALLEL_BUILD_MAX_THREADS);
     }
+    if (nthreads > 1) {
+        logverb("Building kd-tree with %i threads\n", nthreads);
+        if (build_parallel(kd, options, nthreads))
+            return NULL;
+    } else if (build_serial(kd, options))
+        // FIXME: memleak mania!
+        return NULL;
 
     for (i=0; i<kd->nbottom-1; i++)
         assert(kd->lr[i] <= kd->lr[i+1]);
@@ -2913,7 +4255,15 @@ void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
     kd->fun.check = MANGLE(kdtree_check);
     kd->fun.fix_bounding_boxes = MANGLE(kdtree_fix_bounding_boxes);
     kd->fun.nearest_neighbour_internal = MANGLE(kdtree_nn);
+    kd->fun.knn = MANGLE(kdtree_knn);
     kd->fun.rangesearch = MANGLE(kdtree_rangesearch_options);
+#if !DTYPE_INTEGER && !DTYPE_DOUBLE
+    kd->fun.rangesearch_float = MANGLE(kdtree_rangesearch_float);
+#else
+    kd->fun.rangesearch_float = NULL;
+#endif
+    kd->fun.rangesearch_batch_reuse = MANGLE(kdtree_rangesearch_batch_reuse);
+    kd->fun.rangesearch_batch = MANGLE(kdtree_rangesearch_batch);
     kd->fun.nodes_contained = MANGLE(kdtree_nodes_contained);
 }
 
@@ -37,6 +37,17 @@ rtn KDMANGLE(func, d, s, s)args
 		fprintf(stderr, #func ": unimplemented treetype %#x.\n", tt); \
 	}
 
+/* Where node "nodeid"'s record lives in an array with blocking "b". */
+static inline size_t kdtree_node_slot(const kdtree_blocking_t* b, int nodeid) {
+    const struct kdtree_blocking_level* lev;
+    u32 m;
+    if (!b->levels)
+        return nodeid;
+    m = (u32)nodeid + 1;
+    lev = b->level + (31 - __builtin_clz(m));
+    return (size_t)(lev->base + (int64_t)(m >> lev->shift) * lev->nodes + (m & lev->mask));
+}
+
 /* Compute how many levels should be used if you have "N" points and you
    want "Nleaf" points in the leaf nodes.
 */
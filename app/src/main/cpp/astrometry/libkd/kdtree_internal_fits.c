@@ -173,6 +173,12 @@ int MANGLE(kdtree_write_fits)(kdtree_fits_t* io, const kdtree_t* kd,
     // haven't bothered to support this.
     assert(!(flip_endian && fid));
 
+    // The file format is heap-ordered.
+    if (kd->layout) {
+        ERROR("Can't write a kdtree whose nodes have been reordered");
+        return -1;
+    }
+
     fitsbin_chunk_init(&chunk);
 
     // kdtree header is an empty fitsbin_chunk.
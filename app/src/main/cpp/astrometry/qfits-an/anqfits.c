@@ -519,13 +519,14 @@ const qfits_header* anqfits_get_header_const(const anqfits_t* qf, int ext) {
             ERROR("failed to get header start + size for file \"%s\" extension %i", qf->filename, ext);
             return NULL;
         }
-        str = file_get_contents_offset(qf->filename, (int)start, (int)size);
+        str = anqfits_header_get_data(qf, ext, NULL);
         if (!str) {
             ERROR("failed to read \"%s\" extension %i: offset %i size %i\n", qf->filename, ext, (int)start, (int)size);
             return NULL;
         }
         qf->exts[ext].header = qfits_header_read_hdr_string
             ((unsigned char*)str, (int)size);
+        free(str);
     }
     return qf->exts[ext].header;
 }
@@ -544,11 +545,12 @@ char* anqfits_header_get_data(const anqfits_t* qf, int ext, int* Nbytes) {
     N = anqfits_header_size(qf, ext);
     if (N == -1)
         return NULL;
-    fid = fopen(qf->filename, "rb");
+    fid = anqfits_reopen(qf);
     if (!fid) {
         return NULL;
     }
     data = malloc(N + 1);
+    start += qf->offset;
     if (start) {
         if (fseeko(fid, start, SEEK_SET)) {
             SYSERROR("Failed to seek to start of FITS header: byte %li in %s",
@@ -768,11 +770,23 @@ anqfits_t* anqfits_open(const char* filename) {
     return anqfits_open_hdu(filename, -1);
 }
 
-anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
+// Reads FITS block number "iblock" (counting from the start of the FITS
+// data) from "fin", unless that would run past "size" bytes -- the FITS data
+// need not end at the end of the file.  Returns -1 at the end.
+static int read_block(FILE* fin, char* buf, size_t iblock, off_t size) {
+    if ((off_t)(iblock + 1) * (off_t)FITS_BLOCK_SIZE > size)
+        return -1;
+    if (fread(buf, 1, FITS_BLOCK_SIZE, fin) != FITS_BLOCK_SIZE)
+        return -1;
+    return 0;
+}
+
+// Parses the headers of the "size" bytes of FITS data starting at the
+// current position of "fin", which is closed.
+static anqfits_t* open_stream(FILE* fin, const char* filename, off_t size,
+                              int hdu) {
     anqfits_t* qf = NULL;
     // copied from qfits_cache.c: qfits_cache_add()
-    FILE* fin = NULL;
-    struct stat sta;
     size_t n_blocks;
     int found_it;
     int xtend;
@@ -789,23 +803,8 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
 
     qfits_header* hdr = NULL;
 
-    /* Stat file to get its size */
-    if (stat(filename, &sta)!=0) {
-        qdebug(printf("anqfits: cannot stat file %s: %s\n",
-                      filename, strerror(errno)););
-        goto bailout;
-    }
-
-    /* Open input file */
-    fin=fopen(filename, "r");
-    if (!fin) {
-        qdebug(printf("anqfits: cannot open file %s: %s\n",
-                      filename, strerror(errno)););
-        goto bailout;
-    }
-
     /* Read first block in */
-    if (fread(buf, 1, FITS_BLOCK_SIZE, fin) != FITS_BLOCK_SIZE) {
+    if (read_block(fin, buf, 0, size)) {
         qdebug(printf("anqfits: error reading first block from %s: %s\n",
                       filename, strerror(errno)););
         goto bailout;
@@ -836,7 +835,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
         if (!firsttime) {
             // Read next FITS block
             debug("Reading next FITS block\n");
-            if (fread(buf, 1, FITS_BLOCK_SIZE, fin) != FITS_BLOCK_SIZE) {
+            if (read_block(fin, buf, n_blocks, size)) {
                 qdebug(printf("anqfits: error reading file %s\n", filename););
                 goto bailout;
             }
@@ -856,6 +855,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
 
     qf = calloc(1, sizeof(anqfits_t));
     qf->filename = strdup(filename);
+    qf->fd = -1;
     qf->exts = calloc(ext_capacity, sizeof(anqfits_ext_t));
     assert(qf->exts);
     if (!qf->exts)
@@ -911,7 +911,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
             /* Look for extension start */
             found_it = 0;
             while (!found_it && !end_of_file) {
-                if (fread(buf, 1, FITS_BLOCK_SIZE, fin) != FITS_BLOCK_SIZE) {
+                if (read_block(fin, buf, n_blocks, size)) {
                     /* Reached end of file */
                     end_of_file = 1;
                     break;
@@ -943,7 +943,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
 
             while (!found_it && !end_of_file) {
                 if (!firsttime) {
-                    if (fread(buf, 1, FITS_BLOCK_SIZE, fin) != FITS_BLOCK_SIZE) {
+                    if (read_block(fin, buf, n_blocks, size)) {
                         qdebug(printf("anqfits: XTENSION without END in %s\n",
                                       filename););
                         end_of_file = 1;
@@ -998,10 +998,10 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
     for (i=0; i<qf->Nexts; i++) {
         qf->exts[i].hdr_size = qf->exts[i].data_start - qf->exts[i].hdr_start;
         if (i == qf->Nexts-1) {
-            debug("st_size %zu, /block_size = %zu\n",
-                  (size_t)sta.st_size,
-                  (size_t)(sta.st_size / (size_t)FITS_BLOCK_SIZE));
-            qf->exts[i].data_size = ((sta.st_size/FITS_BLOCK_SIZE) -
+            debug("size %zu, /block_size = %zu\n",
+                  (size_t)size,
+                  (size_t)(size / (size_t)FITS_BLOCK_SIZE));
+            qf->exts[i].data_size = ((size/FITS_BLOCK_SIZE) -
                                      qf->exts[i].data_start);
         } else
             qf->exts[i].data_size = (qf->exts[i+1].hdr_start -
@@ -1014,7 +1014,7 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
               qf->exts[i].hdr_start, qf->exts[i].hdr_size,
               qf->exts[i].data_start, qf->exts[i].data_size);
     }
-    qf->filesize = sta.st_size / FITS_BLOCK_SIZE;
+    qf->filesize = size / FITS_BLOCK_SIZE;
 
     return qf;
 
@@ -1031,6 +1031,138 @@ anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
     return NULL;
 }
 
+anqfits_t* anqfits_open_hdu(const char* filename, int hdu) {
+    FILE* fin;
+    struct stat sta;
+
+    /* Stat file to get its size */
+    if (stat(filename, &sta)!=0) {
+        qdebug(printf("anqfits: cannot stat file %s: %s\n",
+                      filename, strerror(errno)););
+        return NULL;
+    }
+
+    /* Open input file */
+    fin=fopen(filename, "r");
+    if (!fin) {
+        qdebug(printf("anqfits: cannot open file %s: %s\n",
+                      filename, strerror(errno)););
+        return NULL;
+    }
+    return open_stream(fin, filename, sta.st_size, hdu);
+}
+
+anqfits_t* anqfits_open_fd(int fd, off_t offset, off_t length,
+                           const char* name) {
+    anqfits_t* qf;
+    FILE* fin;
+    int pfd;
+    char* fdname = NULL;
+
+    if (!name) {
+        asprintf_safe(&fdname, "fd:%i@%lli", fd, (long long)offset);
+        name = fdname;
+    }
+    if (length < 0) {
+        struct stat sta;
+        if (fstat(fd, &sta)) {
+            SYSERROR("Failed to stat %s", name);
+            goto bailout;
+        }
+        length = sta.st_size - offset;
+    }
+    // Parse through a private descriptor, so that fclose() leaves "fd" open.
+    pfd = dup(fd);
+    if (pfd == -1) {
+        SYSERROR("Failed to dup() %s", name);
+        goto bailout;
+    }
+    fin = fdopen(pfd, "rb");
+    if (!fin) {
+        SYSERROR("Failed to fdopen() %s", name);
+        close(pfd);
+        goto bailout;
+    }
+    if (fseeko(fin, offset, SEEK_SET)) {
+        SYSERROR("Failed to seek to byte %lli of %s", (long long)offset, name);
+        fclose(fin);
+        goto bailout;
+    }
+    qf = open_stream(fin, name, length, -1);
+    if (!qf)
+        goto bailout;
+    // Keep our own descriptor: the caller may close theirs.
+    qf->fd = dup(fd);
+    if (qf->fd == -1) {
+        SYSERROR("Failed to dup() %s", name);
+        anqfits_close(qf);
+        goto bailout;
+    }
+    qf->offset = offset;
+    free(fdname);
+    return qf;
+
+ bailout:
+    free(fdname);
+    return NULL;
+}
+
+anqfits_t* anqfits_open_layout(const char* filename, int fd, off_t offset,
+                               off_t filesize, int Nexts,
+                               const anqfits_ext_t* exts) {
+    anqfits_t* qf;
+    int i;
+
+    qf = calloc(1, sizeof(anqfits_t));
+    if (!qf) {
+        SYSERROR("Failed to allocate an anqfits_t");
+        return NULL;
+    }
+    qf->fd = -1;
+    qf->filename = strdup(filename);
+    qf->exts = calloc(Nexts, sizeof(anqfits_ext_t));
+    if (!qf->filename || !qf->exts) {
+        SYSERROR("Failed to allocate an anqfits_t");
+        goto bailout;
+    }
+    qf->Nexts = Nexts;
+    qf->filesize = filesize;
+    qf->offset = offset;
+    // Headers, tables and images are read on demand, as usual.
+    for (i=0; i<Nexts; i++) {
+        qf->exts[i].hdr_start  = exts[i].hdr_start;
+        qf->exts[i].hdr_size   = exts[i].hdr_size;
+        qf->exts[i].data_start = exts[i].data_start;
+        qf->exts[i].data_size  = exts[i].data_size;
+    }
+    if (fd != -1) {
+        qf->fd = dup(fd);
+        if (qf->fd == -1) {
+            SYSERROR("Failed to dup() %s", filename);
+            goto bailout;
+        }
+    }
+    return qf;
+
+ bailout:
+    anqfits_close(qf);
+    return NULL;
+}
+
+FILE* anqfits_reopen(const anqfits_t* qf) {
+    int fd;
+    FILE* fid;
+    if (qf->fd == -1)
+        return fopen(qf->filename, "rb");
+    fd = dup(qf->fd);
+    if (fd == -1)
+        return NULL;
+    fid = fdopen(fd, "rb");
+    if (!fid)
+        close(fd);
+    return fid;
+}
+
 void anqfits_close(anqfits_t* qf) {
     int i;
     if (!qf)
@@ -1045,6 +1177,8 @@ void anqfits_close(anqfits_t* qf) {
     }
     free(qf->exts);
     free(qf->filename);
+    if (qf->fd != -1)
+        close(qf->fd);
     free(qf);
 }
 
@@ -1158,13 +1292,13 @@ void* anqfits_readpix(const anqfits_t* qf, int ext,
     //NY = y1 - y0;
     //planesize = img->width * img->height * (off_t)img->bpp;
 
-    f = fopen(qf->filename, "rb");
+    f = anqfits_reopen(qf);
     if (!f) {
         qfits_error("Failed to fopen %s: %s\n", qf->filename, strerror(errno));
         return NULL;
     }
 
-    start = ((off_t)qf->exts[ext].data_start * (off_t)FITS_BLOCK_SIZE
+    start = (qf->offset + (off_t)qf->exts[ext].data_start * (off_t)FITS_BLOCK_SIZE
              + ((off_t)y0 * img->width + (off_t)x0) * (off_t)img->bpp);
     size = (((off_t)(y1 - y0 - 1) * img->width + (off_t)(x1 - x0)) *
             (off_t)img->bpp);
@@ -19,8 +19,10 @@ struct potential_quad
 	double costheta, sintheta;
 	// (field pixel noise / quad scale in pixels)^2
 	double rel_field_noise2;
-	anbool* inbox;
+	// field stars eligible to be C or D (in ascending order)
+	int* inbox;
 	int ninbox;
+	// code-frame positions of the field stars, indexed by star
 	double* xy;
 };
 typedef struct potential_quad pquad;
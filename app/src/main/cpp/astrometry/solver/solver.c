@@ -10,6 +10,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdarg.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "os-features.h"
 #include "ioutils.h"
@@ -331,11 +336,6 @@ static inline void sety(double* d, int ind, double val) {
     d[ind*2 + 1] = val;
 }
 
-static void field_getxy(solver_t* sp, int index, double* x, double* y) {
-    *x = starxy_getx(sp->fieldxy, index);
-    *y = starxy_gety(sp->fieldxy, index);
-}
-
 static double field_getx(solver_t* sp, int index) {
     return starxy_getx(sp->fieldxy, index);
 }
@@ -379,6 +379,7 @@ void solver_reset_counters(solver_t* s) {
     s->num_cxdx_skipped = 0;
     s->num_radec_skipped = 0;
     s->num_abscale_skipped = 0;
+    s->num_prefilter_rejected = 0;
     s->num_verified = 0;
 }
 
@@ -546,8 +547,9 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult);
+                             int slot, anbool* placed);
+
+static void flush_code_queries(solver_t* solver);
 
 static void resolve_matches(kdtree_qres_t* krez, const double *field,
                             const int* fstars, int dimquads,
@@ -571,54 +573,291 @@ static void check_scale(pquad* pq, solver_t* s) {
     pq->scale_ok = TRUE;
 }
 
-static void check_inbox(pquad* pq, int start, solver_t* solver) {
-    int i;
+/*
+ Rotates field stars [start, end) into the code frame of the AB pair and
+ appends those that lie inside the circle (and aren't A or B) to the
+ pquad's "inbox" list.  Returns the number of stars appended.
+
+ The field is read straight from the starxy_t x[] and y[] arrays, two
+ stars at a time with SSE2 or NEON where available.
+ */
+static int check_inbox(pquad* pq, int start, int end, solver_t* solver) {
+    const double* fx = solver->fieldxy->x;
+    const double* fy = solver->fieldxy->y;
+    double* xy = pq->xy;
+    int* inbox = pq->inbox;
+    int n = pq->ninbox;
     double Ax, Ay;
-    field_getxy(solver, pq->fieldA, &Ax, &Ay);
-    // check which C, D points are inside the circle.
-    for (i = start; i < pq->ninbox; i++) {
-        double r;
-        double Cx, Cy, xxtmp;
-        double tol = solver->codetol;
-        if (!pq->inbox[i])
-            continue;
-        field_getxy(solver, i, &Cx, &Cy);
-        Cx -= Ax;
-        Cy -= Ay;
-        xxtmp = Cx;
-        Cx = Cx * pq->costheta + Cy * pq->sintheta;
-        Cy = -xxtmp * pq->sintheta + Cy * pq->costheta;
-
-        // make sure it's in the circle centered at (0.5, 0.5)
-        // with radius 1/sqrt(2) (plus codetol for fudge):
-        // (x-1/2)^2 + (y-1/2)^2   <=   (r + codetol)^2
-        // x^2-x+1/4 + y^2-y+1/4   <=   (1/sqrt(2) + codetol)^2
-        // x^2-x + y^2-y + 1/2     <=   1/2 + sqrt(2)*codetol + codetol^2
-        // x^2-x + y^2-y           <=   sqrt(2)*codetol + codetol^2
-        r = (Cx * Cx - Cx) + (Cy * Cy - Cy);
-        if (r > (tol * (M_SQRT2 + tol))) {
-            pq->inbox[i] = FALSE;
-            continue;
+    double costheta = pq->costheta;
+    double sintheta = pq->sintheta;
+    double tol = solver->codetol;
+    // make sure it's in the circle centered at (0.5, 0.5)
+    // with radius 1/sqrt(2) (plus codetol for fudge):
+    // (x-1/2)^2 + (y-1/2)^2   <=   (r + codetol)^2
+    // x^2-x+1/4 + y^2-y+1/4   <=   (1/sqrt(2) + codetol)^2
+    // x^2-x + y^2-y + 1/2     <=   1/2 + sqrt(2)*codetol + codetol^2
+    // x^2-x + y^2-y           <=   sqrt(2)*codetol + codetol^2
+    double rmax = tol * (M_SQRT2 + tol);
+    int i = start;
+
+    Ax = fx[pq->fieldA];
+    Ay = fy[pq->fieldA];
+
+#if defined(__SSE2__)
+    {
+        __m128d vAx = _mm_set1_pd(Ax), vAy = _mm_set1_pd(Ay);
+        __m128d vcos = _mm_set1_pd(costheta), vsin = _mm_set1_pd(sintheta);
+        __m128d vrmax = _mm_set1_pd(rmax);
+        for (; i + 2 <= end; i += 2) {
+            __m128d cx = _mm_sub_pd(_mm_loadu_pd(fx + i), vAx);
+            __m128d cy = _mm_sub_pd(_mm_loadu_pd(fy + i), vAy);
+            __m128d u = _mm_add_pd(_mm_mul_pd(cx, vcos), _mm_mul_pd(cy, vsin));
+            __m128d v = _mm_sub_pd(_mm_mul_pd(cy, vcos), _mm_mul_pd(cx, vsin));
+            __m128d r = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(u, u), u),
+                                   _mm_sub_pd(_mm_mul_pd(v, v), v));
+            int mask = _mm_movemask_pd(_mm_cmple_pd(r, vrmax));
+            _mm_storeu_pd(xy + 2*i,     _mm_unpacklo_pd(u, v));
+            _mm_storeu_pd(xy + 2*i + 2, _mm_unpackhi_pd(u, v));
+            inbox[n] = i;
+            n += (mask & 1) && (i != pq->fieldA) && (i != pq->fieldB);
+            inbox[n] = i + 1;
+            n += (mask >> 1) && (i+1 != pq->fieldA) && (i+1 != pq->fieldB);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    {
+        float64x2_t vAx = vdupq_n_f64(Ax), vAy = vdupq_n_f64(Ay);
+        float64x2_t vcos = vdupq_n_f64(costheta), vsin = vdupq_n_f64(sintheta);
+        float64x2_t vrmax = vdupq_n_f64(rmax);
+        for (; i + 2 <= end; i += 2) {
+            float64x2_t cx = vsubq_f64(vld1q_f64(fx + i), vAx);
+            float64x2_t cy = vsubq_f64(vld1q_f64(fy + i), vAy);
+            float64x2x2_t uv;
+            float64x2_t r;
+            uint64x2_t ok;
+            uv.val[0] = vaddq_f64(vmulq_f64(cx, vcos), vmulq_f64(cy, vsin));
+            uv.val[1] = vsubq_f64(vmulq_f64(cy, vcos), vmulq_f64(cx, vsin));
+            r = vaddq_f64(vsubq_f64(vmulq_f64(uv.val[0], uv.val[0]), uv.val[0]),
+                          vsubq_f64(vmulq_f64(uv.val[1], uv.val[1]), uv.val[1]));
+            ok = vcleq_f64(r, vrmax);
+            vst2q_f64(xy + 2*i, uv);
+            inbox[n] = i;
+            n += (vgetq_lane_u64(ok, 0) != 0) && (i != pq->fieldA) && (i != pq->fieldB);
+            inbox[n] = i + 1;
+            n += (vgetq_lane_u64(ok, 1) != 0) && (i+1 != pq->fieldA) && (i+1 != pq->fieldB);
         }
-        setx(pq->xy, i, Cx);
-        sety(pq->xy, i, Cy);
     }
+#endif
+    for (; i < end; i++) {
+        double Cx, Cy, u, v, r;
+        Cx = fx[i] - Ax;
+        Cy = fy[i] - Ay;
+        u = Cx * costheta + Cy * sintheta;
+        v = Cy * costheta - Cx * sintheta;
+        setx(xy, i, u);
+        sety(xy, i, v);
+        r = (u * u - u) + (v * v - v);
+        if (r > rmax || i == pq->fieldA || i == pq->fieldB)
+            continue;
+        inbox[n++] = i;
+    }
+
+    i = n - pq->ninbox;
+    pq->ninbox = n;
+    return i;
+}
+
+/*
+ Code-tree queries gathered while building the quads of one AB pair,
+ resolved with a single batched kd-tree search by flush_code_queries().
+ All queued codes are for the current index.
+ */
+#define SOLVER_CODE_BATCH 256
+
+struct solver_codebatch {
+    int n;
+    double tol2;
+    double codes[SOLVER_CODE_BATCH * DCMAX];
+    int stars[SOLVER_CODE_BATCH * DQMAX];
+    int dimquad[SOLVER_CODE_BATCH];
+    anbool parity[SOLVER_CODE_BATCH];
+    kdtree_qres_t* results[SOLVER_CODE_BATCH];
+};
+
+static void solver_codebatch_free(solver_t* solver) {
+    struct solver_codebatch* b = solver->codebatch;
+    int i;
+    if (!b)
+        return;
+    for (i=0; i<SOLVER_CODE_BATCH; i++)
+        kdtree_free_query(b->results[i]);
+    free(b);
+    solver->codebatch = NULL;
 }
 
 #if defined DEBUGSOLVER
 static void print_inbox(pquad* pq) {
     int i;
     debug("[ ");
-    for (i = 0; i < pq->ninbox; i++) {
-        if (pq->inbox[i])
-            debug("%i ", i);
-    }
+    for (i = 0; i < pq->ninbox; i++)
+        debug("%i ", pq->inbox[i]);
     debug("] (n %i)\n", pq->ninbox);
 }
 #else
 static void print_inbox(pquad* pq) {}
 #endif
 
+/*
+ A simple bump allocator for the pquad "inbox" and "xy" arrays.  There
+ can be one pair of arrays per AB pair (up to ~500k of them), all with
+ the same lifetime (one solver_run), so rather than malloc/free each we
+ carve them out of large blocks and release everything at once.
+ */
+#define SOLVER_ARENA_BLOCK (1 << 20)
+
+struct solver_arena_block {
+    struct solver_arena_block* next;
+    size_t size;
+    size_t used;
+};
+typedef struct solver_arena_block solver_arena_block;
+
+struct solver_arena {
+    solver_arena_block* head;
+    // block we're currently allocating from
+    solver_arena_block* cur;
+};
+
+static void* solver_arena_alloc(solver_t* solver, size_t n) {
+    struct solver_arena* arena = solver->pquad_arena;
+    solver_arena_block* blk;
+    solver_arena_block* last = NULL;
+    size_t size;
+
+    if (!arena) {
+        arena = solver->pquad_arena = calloc(1, sizeof(struct solver_arena));
+        if (!arena)
+            return NULL;
+    }
+    // keep every allocation 16-byte aligned
+    n = (n + 15) & ~(size_t)15;
+
+    // Blocks past "cur" are left over from a previous run: reuse them if
+    // they are large enough.
+    for (blk = (arena->cur ? arena->cur : arena->head); blk; blk = blk->next) {
+        last = blk;
+        if (blk->size - blk->used >= n) {
+            void* p = (char*)(blk + 1) + blk->used;
+            blk->used += n;
+            arena->cur = blk;
+            return p;
+        }
+    }
+
+    size = MAX(n, SOLVER_ARENA_BLOCK);
+    blk = malloc(sizeof(solver_arena_block) + size);
+    if (!blk)
+        return NULL;
+    blk->next = NULL;
+    blk->size = size;
+    blk->used = n;
+    if (last)
+        last->next = blk;
+    else
+        arena->head = blk;
+    arena->cur = blk;
+    return blk + 1;
+}
+
+// Releases everything allocated since the last reset.  Blocks that were
+// used are kept for the next run; blocks that weren't are freed.
+static void solver_arena_reset(solver_t* solver) {
+    struct solver_arena* arena = solver->pquad_arena;
+    solver_arena_block** pblk;
+    if (!arena)
+        return;
+    pblk = &arena->head;
+    while (*pblk) {
+        solver_arena_block* blk = *pblk;
+        if (blk->used) {
+            blk->used = 0;
+            pblk = &blk->next;
+        } else {
+            *pblk = blk->next;
+            free(blk);
+        }
+    }
+    arena->cur = arena->head;
+}
+
+static void solver_arena_free(solver_t* solver) {
+    struct solver_arena* arena = solver->pquad_arena;
+    solver_arena_block* blk;
+    if (!arena)
+        return;
+    blk = arena->head;
+    while (blk) {
+        solver_arena_block* next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    free(arena);
+    solver->pquad_arena = NULL;
+}
+
+/*
+ Initializes the pquads for all AB pairs with the given star B (and
+ A < B), testing stars [0, ncand) other than A and B as candidate C,D
+ stars.  The inbox/xy arrays of the scale-OK pairs are carved from a
+ single arena allocation sized by the number of such pairs.
+ */
+static void init_pquad_row(pquad* pquads, int fieldB, int ncand, int numxy,
+                           solver_t* solver) {
+    size_t xybytes, inboxbytes;
+    char* mem;
+    int fieldA;
+    int nok = 0;
+
+    for (fieldA = 0; fieldA < fieldB; fieldA++) {
+        pquad* pq = pquads + fieldB * numxy + fieldA;
+        pq->fieldA = fieldA;
+        pq->fieldB = fieldB;
+        debug("  trying A=%i, B=%i\n", fieldA, fieldB);
+        check_scale(pq, solver);
+        if (!pq->scale_ok) {
+            debug("    bad scale for A=%i, B=%i\n", fieldA, fieldB);
+            continue;
+        }
+        nok++;
+    }
+    if (!nok)
+        return;
+
+    xybytes = ((size_t)numxy * 2 * sizeof(double) + 15) & ~(size_t)15;
+    inboxbytes = ((size_t)numxy * sizeof(int) + 15) & ~(size_t)15;
+    mem = solver_arena_alloc(solver, (size_t)nok * (xybytes + inboxbytes));
+    if (!mem) {
+        ERROR("Failed to allocate inbox arrays for %i AB pairs", nok);
+        for (fieldA = 0; fieldA < fieldB; fieldA++)
+            pquads[fieldB * numxy + fieldA].scale_ok = FALSE;
+        return;
+    }
+
+    for (fieldA = 0; fieldA < fieldB; fieldA++) {
+        pquad* pq = pquads + fieldB * numxy + fieldA;
+        if (!pq->scale_ok)
+            continue;
+        pq->xy = (double*)mem;
+        mem += xybytes;
+        pq->inbox = (int*)mem;
+        mem += inboxbytes;
+        pq->ninbox = 0;
+        check_inbox(pq, 0, ncand, solver);
+        debug("    inbox(A=%i, B=%i): ", fieldA, fieldB);
+        print_inbox(pq);
+    }
+}
+
 
 void solver_reset_field_size(solver_t* s) {
     s->field_minx = s->field_maxx = s->field_miny = s->field_maxy = 0;
@@ -695,6 +934,7 @@ void solver_free_field(solver_t* solver) {
     if (solver->vf)
         verify_field_free(solver->vf);
     solver->vf = NULL;
+    solver->nsolutions = 0;
 }
 
 starxy_t* solver_get_field(solver_t* solver) {
@@ -726,26 +966,25 @@ static double get_tolerance(solver_t* solver) {
  fieldoffset - offset into the field array where we should add the first star
  n_to_add - number of stars to add
  adding - the star we're currently adding; in [0, n_to_add).
+ bottom - position in the pquad's "inbox" list to start adding from.
  fieldtop - the maximum field star number to build quads out of.
  dimquad, solver, tol2 - passed to try_all_codes.
  */
 static void add_stars(const pquad* pq, int* field, int fieldoffset,
-                      int n_to_add, int adding, int fieldtop,
+                      int n_to_add, int adding, int bottom, int fieldtop,
                       int dimquad,
                       solver_t* solver, double tol2) {
-    int bottom;
+    int k;
     int* f = field + fieldoffset;
-    // When we're adding the first star, we start from index zero.
-    // When we're adding subsequent stars, we start from the previous value
-    // plus one, to avoid adding permutations.
-    bottom = (adding ? f[adding-1] + 1 : 0);
-
-    // It looks funny that we're using f[adding] as a loop variable, but
-    // it's required because try_all_codes needs to know which field stars
-    // were used to create the quad (which are stored in the "f" array)
-    for (f[adding]=bottom; f[adding]<fieldtop; f[adding]++) {
-        if (!pq->inbox[f[adding]])
-            continue;
+
+    // The "inbox" list is sorted, so when we're adding subsequent stars we
+    // start from the list position after the previous star, to avoid adding
+    // permutations.  try_all_codes needs to know which field stars were used
+    // to create the quad, so they're stored in the "f" array as we go.
+    for (k = bottom; k < pq->ninbox; k++) {
+        f[adding] = pq->inbox[k];
+        if (f[adding] >= fieldtop)
+            break;
         if (unlikely(solver->quit_now))
             return;
 
@@ -756,30 +995,220 @@ static void add_stars(const pquad* pq, int* field, int fieldoffset,
             TRY_ALL_CODES(pq, field, dimquad, solver, tol2);
         } else {
             // Else recurse.
-            add_stars(pq, field, fieldoffset, n_to_add, adding+1,
+            add_stars(pq, field, fieldoffset, n_to_add, adding+1, k+1,
                       fieldtop, dimquad, solver, tol2);
         }
     }
 }
 
 
+static double stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Adds (sign = 1) or subtracts (sign = -1) the solver's counters.
+static void stats_add_counters(solver_stats_t* st, const solver_t* s, int sign) {
+    st->numtries += sign * s->numtries;
+    st->nummatches += sign * s->nummatches;
+    st->numscaleok += sign * s->numscaleok;
+    st->num_cxdx_skipped += sign * s->num_cxdx_skipped;
+    st->num_meanx_skipped += sign * s->num_meanx_skipped;
+    st->num_radec_skipped += sign * s->num_radec_skipped;
+    st->num_abscale_skipped += sign * s->num_abscale_skipped;
+    st->num_prefilter_rejected += sign * s->num_prefilter_rejected;
+    st->num_verified += sign * s->num_verified;
+}
+
+int solver_n_stats(const solver_t* solver) {
+    return solver->stats ? bl_size(solver->stats) : 0;
+}
+
+const solver_stats_t* solver_get_stats(const solver_t* solver, int i) {
+    return bl_access(solver->stats, i);
+}
+
+void solver_clear_stats(solver_t* solver) {
+    if (solver->stats)
+        bl_remove_all(solver->stats);
+}
+
+/*
+ Index scheduling.  Each index is scored by how many AB pairs among the
+ brightest SOLVER_SCHEDULE_STARS field stars fall in its quad-size range
+ (ie, how much of the field's bright-star scale distribution it can
+ match), weighted by the density of index quads at that scale, which
+ goes as 1/scale^2; indexes are tried best-first.  Indexes are also staggered
+ in depth: an index ranked below r better-scoring ones tries the quads
+ whose newest star is "newpoint" only once the search has reached star
+ newpoint + r * index_lag.  Every quad is still tried before solver_run
+ returns; only the order changes.
+ */
+#define SOLVER_SCHEDULE_STARS 40
+
+typedef struct {
+    int index;      // position in solver->indexes
+    double minAB2;
+    double maxAB2;
+    int npairs;     // bright AB pairs in the quad-size range
+    double score;
+    int lag;        // in field stars
+} index_sched_t;
+
+static int compare_index_sched(const void* v1, const void* v2) {
+    const index_sched_t* s1 = v1;
+    const index_sched_t* s2 = v2;
+    if (s1->score != s2->score)
+        return (s1->score > s2->score) ? -1 : 1;
+    // keep the caller's order among equals.
+    return s1->index - s2->index;
+}
+
+static void schedule_indexes(solver_t* solver, index_sched_t* sched,
+                             int num_indexes, int numxy) {
+    int nstars = MIN(numxy, SOLVER_SCHEDULE_STARS);
+    int i, a, b;
+
+    for (i = 0; i < num_indexes; i++) {
+        sched[i].npairs = 0;
+        sched[i].minAB2 = MAX(sched[i].minAB2, solver->minminAB2);
+        sched[i].maxAB2 = MIN(sched[i].maxAB2, solver->maxmaxAB2);
+    }
+    for (b = 1; b < nstars; b++) {
+        for (a = 0; a < b; a++) {
+            double d2 = square(field_getx(solver, b) - field_getx(solver, a)) +
+                square(field_gety(solver, b) - field_gety(solver, a));
+            for (i = 0; i < num_indexes; i++)
+                if (d2 >= sched[i].minAB2 && d2 <= sched[i].maxAB2)
+                    sched[i].npairs++;
+        }
+    }
+    for (i = 0; i < num_indexes; i++)
+        sched[i].score = (sched[i].npairs == 0) ? 0.0 :
+            sched[i].npairs / sqrt(sched[i].minAB2 * sched[i].maxAB2);
+    qsort(sched, num_indexes, sizeof(index_sched_t), compare_index_sched);
+
+    for (i = 0; i < num_indexes; i++) {
+        if (i && sched[i].score == sched[i-1].score)
+            sched[i].lag = sched[i-1].lag;
+        else
+            sched[i].lag = i * solver->index_lag;
+        logverb("Index \"%s\": %i bright AB pairs in range, score %g, lag %i\n",
+                ((index_t*)pl_get(solver->indexes, sched[i].index))->indexname,
+                sched[i].npairs, sched[i].score, sched[i].lag);
+    }
+}
+
+// Is field star "star" in the (sorted) inbox of this AB pair?
+static anbool inbox_contains(const pquad* pq, int star) {
+    int lo = 0, hi = pq->ninbox;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pq->inbox[mid] < star)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < pq->ninbox && pq->inbox[lo] == star);
+}
+
+/*
+ Tries all the quads for one index whose newest star is "newpoint".  The
+ pquads' inbox lists may already hold stars beyond "newpoint" (if this
+ index is lagging); add_stars stops at "newpoint".
+ */
+static void try_index_newpoint(solver_t* solver, pquad* pquads, int numxy,
+                               const index_sched_t* sched, int newpoint) {
+    index_t* index = pl_get(solver->indexes, sched->index);
+    int field[DQMAX];
+    int dimquads;
+    double tol2;
+
+    memset(field, 0, sizeof(field));
+    set_index(solver, index);
+    dimquads = index_dimquads(index);
+
+    // quads with the new star on the diagonal:
+    field[B] = newpoint;
+    debug("Trying quads with B=%i\n", newpoint);
+    for (field[A] = 0; field[A] < newpoint; field[A]++) {
+        pquad* pq = pquads + field[B] * numxy + field[A];
+        if (!pq->scale_ok)
+            continue;
+        if ((pq->scale < sched->minAB2) ||
+            (pq->scale > sched->maxAB2))
+            continue;
+        // set code tolerance for this index and AB pair...
+        solver->rel_field_noise2 = pq->rel_field_noise2;
+        tol2 = get_tolerance(solver);
+        // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
+        // ("dimquads - 2" because we've set stars A and B at this point)
+        add_stars(pq, field, C, dimquads-2, 0, 0, newpoint, dimquads, solver, tol2);
+        flush_code_queries(solver);
+        if (solver->quit_now)
+            return;
+    }
+
+    // quads with the new star not on the diagonal:
+    field[C] = newpoint;
+    // (in this loop field[C] > field[D])
+    debug("Trying quads with C=%i\n", newpoint);
+    for (field[A] = 0; field[A] < newpoint; field[A]++) {
+        for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
+            // grab the "pquad" for this AB combo
+            pquad* pq = pquads + field[B] * numxy + field[A];
+            if (!pq->scale_ok)
+                continue;
+            if ((pq->scale < sched->minAB2) ||
+                (pq->scale > sched->maxAB2))
+                continue;
+            if (!inbox_contains(pq, field[C]))
+                continue;
+            debug("  C is in the box for A=%i, B=%i\n", field[A], field[B]);
+
+            solver->rel_field_noise2 = pq->rel_field_noise2;
+            tol2 = get_tolerance(solver);
+
+            if (dimquads > 3) {
+                // ("dimquads - 3" because we've set stars A, B, and C at this point)
+                add_stars(pq, field, D, dimquads-3, 0, 0, newpoint, dimquads, solver, tol2);
+            } else {
+                TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
+            }
+            flush_code_queries(solver);
+            if (solver->quit_now)
+                return;
+        }
+    }
+}
+
 // The real deal
 void solver_run(solver_t* solver) {
-    int numxy, newpoint;
+    int numxy, newpoint, step, maxlag;
     double usertime, systime;
     // first timer callback is called after 1 second
     time_t next_timer_callback_time = time(NULL) + 1;
     pquad* pquads;
     size_t i, num_indexes;
-    double tol2;
-    int field[DQMAX];
+    int fieldA, fieldB;
+    double tsetup = 0.0;
 
     get_resource_stats(&usertime, &systime, NULL);
+    if (solver->collect_stats)
+        tsetup = stats_clock();
 
     if (!solver->vf)
         solver_preprocess_field(solver);
 
-    memset(field, 0, sizeof(field));
+    if (!solver->codebatch) {
+        solver->codebatch = calloc(1, sizeof(struct solver_codebatch));
+        if (!solver->codebatch) {
+            ERROR("Failed to allocate code query batch");
+            return;
+        }
+    }
+    solver->codebatch->n = 0;
 
     solver->starttime = usertime + systime;
 
@@ -794,9 +1223,11 @@ void solver_run(solver_t* solver) {
     }
 
     num_indexes = pl_size(solver->indexes);
+    if (!num_indexes)
+        return;
     {
-        double minAB2s[num_indexes];
-        double maxAB2s[num_indexes];
+        index_sched_t sched[num_indexes];
+        solver_stats_t runstats[num_indexes];
         solver->minminAB2 = LARGE_VAL;
         solver->maxmaxAB2 = -LARGE_VAL;
         for (i = 0; i < num_indexes; i++) {
@@ -807,10 +1238,11 @@ void solver_run(solver_t* solver) {
             solver_compute_quad_range(solver, index, &minAB, &maxAB);
             //logverb("Index \"%s\" quad range %f to %f\n", index->indexname,
             //minAB, maxAB);
-            minAB2s[i] = square(minAB);
-            maxAB2s[i] = square(maxAB);
-            solver->minminAB2 = MIN(solver->minminAB2, minAB2s[i]);
-            solver->maxmaxAB2 = MAX(solver->maxmaxAB2, maxAB2s[i]);
+            sched[i].index = i;
+            sched[i].minAB2 = square(minAB);
+            sched[i].maxAB2 = square(maxAB);
+            solver->minminAB2 = MIN(solver->minminAB2, sched[i].minAB2);
+            solver->maxmaxAB2 = MAX(solver->maxmaxAB2, sched[i].maxAB2);
 
             if (index->cx_less_than_dx) {
                 solver->cxdx_margin = 1.5 * solver->codetol;
@@ -822,6 +1254,20 @@ void solver_run(solver_t* solver) {
             solver->maxmaxAB2 = MIN(solver->maxmaxAB2, square(solver->quadsize_max));
         logverb("Quad scale range: [%g, %g] pixels\n", sqrt(solver->minminAB2), sqrt(solver->maxmaxAB2));
 
+        schedule_indexes(solver, sched, num_indexes, numxy);
+        maxlag = 0;
+        for (i = 0; i < num_indexes; i++)
+            maxlag = MAX(maxlag, sched[i].lag);
+
+        memset(runstats, 0, sizeof(runstats));
+        for (i = 0; i < num_indexes; i++) {
+            index_t* index = pl_get(solver->indexes, sched[i].index);
+            runstats[i].indexid = index->indexid;
+            runstats[i].healpix = index->healpix;
+            runstats[i].startobj = solver->startobj;
+            runstats[i].endobj = numxy;
+        }
+
         // quick-n-dirty scale estimate using stars A,B.
         solver->abscale_high = square(arcsec2rad(solver->funits_upper) * (1.0 + solver->codetol));
         solver->abscale_low  = square(arcsec2rad(solver->funits_lower) * (1.0 - solver->codetol));
@@ -847,13 +1293,10 @@ void solver_run(solver_t* solver) {
          * A<B.)
          *
          * For each AB pair, we cache the scale and the rotation parameters,
-         * and we keep an array "inbox" of length "numxy" of booleans, one for
-         * each star, which say whether that star is eligible to be star C or D
-         * of a quad with AB at the corners.  (Obviously A and B aren't
-         * eligible).
-         *
-         * The "ninbox" parameter is somewhat misnamed - it says that "inbox"
-         * elements in the range [0, ninbox) have been initialized.
+         * and we keep a sorted list "inbox" of the "ninbox" stars that are
+         * eligible to be star C or D of a quad with AB at the corners.
+         * (Obviously A and B aren't eligible).  Stars are appended as
+         * "newpoint" advances.
          */
 
         /* (See explanatory paragraph below) If "solver->startobj" isn't zero,
@@ -861,44 +1304,25 @@ void solver_run(solver_t* solver) {
          * A=startobj-2, B=startobj-1. */
         if (solver->startobj) {
             debug("startobj > 0; priming pquad arrays.\n");
-            for (field[B] = 0; field[B] < solver->startobj; field[B]++) {
-                for (field[A] = 0; field[A] < field[B]; field[A]++) {
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    pq->fieldA = field[A];
-                    pq->fieldB = field[B];
-                    debug("trying A=%i, B=%i\n", field[A], field[B]);
-                    check_scale(pq, solver);
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    pq->xy = malloc(numxy * 2 * sizeof(double));
-                    pq->inbox = malloc(numxy * sizeof(anbool));
-                    memset(pq->inbox, TRUE, solver->startobj);
-                    pq->ninbox = solver->startobj;
-                    pq->inbox[field[A]] = FALSE;
-                    pq->inbox[field[B]] = FALSE;
-                    check_inbox(pq, 0, solver);
-                    debug("  inbox(A=%i, B=%i): ", field[A], field[B]);
-                    print_inbox(pq);
-                }
-            }
+            for (fieldB = 0; fieldB < solver->startobj; fieldB++)
+                init_pquad_row(pquads, fieldB, solver->startobj, numxy, solver);
         }
 
-        /* Each time through the "for" loop below, we consider a new star
-         * ("newpoint").  First, we try building all quads that have the new
-         * star on the diagonal (star B).  Then, we try building all quads that
-         * have the star not on the diagonal (star D).
-         * 
+        /* Each time through the "for" loop below, we take a step deeper into
+         * the field.  First, we add the new star ("newpoint"): we initialize
+         * the pquads that have it as star B, and add it to the "inbox" lists
+         * of the existing AB pairs.
+         *
+         * Then each index (in schedule order) tries the quads whose newest
+         * star is "step" minus its lag: those with the star on the diagonal
+         * (star B), then those with the star not on the diagonal (star C).
+         *
          * For each AB pair, we have a "potential_quad" or "pquad" struct.
          * This caches the computation we need to do: deciding whether the
          * scale is acceptable, computing the transformation to code
          * coordinates, and deciding which C,D stars are in the circle.
          */
-        for (newpoint = solver->startobj; newpoint < numxy; newpoint++) {
-
-            debug("Trying newpoint=%i (%.1f,%.1f)\n", newpoint,
-                  field_getx(solver,newpoint), field_gety(solver,newpoint));
+        for (step = solver->startobj; step < numxy + maxlag; step++) {
 
             // Give our caller a chance to cancel us midway. The callback
             // returns how long to wait before calling again.
@@ -915,117 +1339,67 @@ void solver_run(solver_t* solver) {
                 }
             }
 
-            solver->last_examined_object = newpoint;
-            // quads with the new star on the diagonal:
-            field[B] = newpoint;
-            debug("Trying quads with B=%i\n", newpoint);
-	
-            // first do an index-independent scale check...
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                // initialize the "pquad" struct for this AB combo.
-                pquad* pq = pquads + field[B] * numxy + field[A];
-                pq->fieldA = field[A];
-                pq->fieldB = field[B];
-                debug("  trying A=%i, B=%i\n", field[A], field[B]);
-                check_scale(pq, solver);
-                if (!pq->scale_ok) {
-                    debug("    bad scale for A=%i, B=%i\n", field[A], field[B]);
-                    continue;
+            if (solver->collect_stats) {
+                double t = stats_clock();
+                runstats[0].time_quads += t - tsetup;
+                tsetup = t;
+            }
+
+            if (step < numxy) {
+                newpoint = step;
+                debug("Adding newpoint=%i (%.1f,%.1f)\n", newpoint,
+                      field_getx(solver,newpoint), field_gety(solver,newpoint));
+                solver->last_examined_object = newpoint;
+
+                // first do an index-independent scale check, and initialize
+                // the "pquad" structs for the AB combos with the new star
+                // as B, trying all stars up to "newpoint"...
+                init_pquad_row(pquads, newpoint, newpoint + 1, numxy, solver);
+
+                // ... then test if the new star is in the box of the
+                // existing AB combos.
+                for (fieldA = 0; fieldA < newpoint; fieldA++) {
+                    for (fieldB = fieldA + 1; fieldB < newpoint; fieldB++) {
+                        pquad* pq = pquads + fieldB * numxy + fieldA;
+                        if (!pq->scale_ok)
+                            continue;
+                        check_inbox(pq, newpoint, newpoint + 1, solver);
+                    }
                 }
-                // initialize the "inbox" array:
-                pq->inbox = malloc(numxy * sizeof(anbool));
-                pq->xy = malloc(numxy * 2 * sizeof(double));
-                // -try all stars up to "newpoint"...
-                assert(sizeof(anbool) == 1);
-                memset(pq->inbox, TRUE, newpoint + 1);
-                pq->ninbox = newpoint + 1;
-                // -except A and B.
-                pq->inbox[field[A]] = FALSE;
-                pq->inbox[field[B]] = FALSE;
-                check_inbox(pq, 0, solver);
-                debug("    inbox(A=%i, B=%i): ", field[A], field[B]);
-                print_inbox(pq);
             }
 
             // Now iterate through the different indices
             for (i = 0; i < num_indexes; i++) {
-                index_t* index = pl_get(solver->indexes, i);
-                int dimquads;
-                set_index(solver, index);
-                dimquads = index_dimquads(index);
-                for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                    // initialize the "pquad" struct for this AB combo.
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok)
-                        continue;
-                    if ((pq->scale < minAB2s[i]) ||
-                        (pq->scale > maxAB2s[i]))
-                        continue;
-                    // set code tolerance for this index and AB pair...
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-                    tol2 = get_tolerance(solver);
-                    // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
-                    // ("dimquads - 2" because we've set stars A and B at this point)
-                    add_stars(pq, field, C, dimquads-2, 0, newpoint, dimquads, solver, tol2);
-                    if (solver->quit_now)
-                        goto quitnow;
+                solver_stats_t* st = runstats + i;
+                double t0 = 0.0, timed0 = 0.0;
+                newpoint = step - sched[i].lag;
+                if (newpoint < solver->startobj || newpoint >= numxy)
+                    continue;
+                if (solver->collect_stats) {
+                    // The search, fit and verify timers are accumulated
+                    // into "cur_stats" as they happen; the remaining time
+                    // goes to time_quads.
+                    solver->cur_stats = st;
+                    stats_add_counters(st, solver, -1);
+                    timed0 = st->time_search + st->time_fit + st->time_verify;
+                    t0 = stats_clock();
                 }
-            }
-
-            if (solver->quit_now)
-                goto quitnow;
-
-            // Now try building quads with the new star not on the diagonal:
-            field[C] = newpoint;
-            // (in this loop field[C] > field[D])
-            debug("Trying quads with C=%i\n", newpoint);
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
-                    // grab the "pquad" for this AB combo
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    // test if this C is in the box:
-                    pq->inbox[field[C]] = TRUE;
-                    pq->ninbox = field[C] + 1;
-                    check_inbox(pq, field[C], solver);
-                    if (!pq->inbox[field[C]]) {
-                        debug("  C is not in the box for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    debug("  C is in the box for A=%i, B=%i\n", field[A], field[B]);
-                    debug("    box now:");
-                    print_inbox(pq);
-                    debug("\n");
-
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-
-                    for (i = 0; i < pl_size(solver->indexes); i++) {
-                        int dimquads;
-                        index_t* index = pl_get(solver->indexes, i);
-                        if ((pq->scale < minAB2s[i]) ||
-                            (pq->scale > maxAB2s[i]))
-                            continue;
-                        set_index(solver, index);
-                        dimquads = index_dimquads(index);
-
-                        tol2 = get_tolerance(solver);
-
-                        if (dimquads > 3) {
-                            // ("dimquads - 3" because we've set stars A, B, and C at this point)
-                            add_stars(pq, field, D, dimquads-3, 0, newpoint, dimquads, solver, tol2);
-                        } else {
-                            TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
-                        }
-                        if (solver->quit_now)
-                            goto quitnow;
-                    }
+                try_index_newpoint(solver, pquads, numxy, sched + i, newpoint);
+                if (solver->collect_stats) {
+                    double t = stats_clock();
+                    double timed = st->time_search + st->time_fit + st->time_verify;
+                    st->time_quads += (t - t0) - (timed - timed0);
+                    stats_add_counters(st, solver, 1);
+                    solver->cur_stats = NULL;
+                    tsetup = t;
                 }
+                if (solver->quit_now)
+                    goto quitnow;
             }
-            logverb("object %u of %u: %i quads tried, %i matched.\n",
-                    newpoint + 1, numxy, solver->numtries, solver->nummatches);
+
+            if (step < numxy)
+                logverb("object %u of %u: %i quads tried, %i matched.\n",
+                        step + 1, numxy, solver->numtries, solver->nummatches);
 
             if ((solver->maxquads && (solver->numtries >= solver->maxquads))
                 || (solver->maxmatches && (solver->nummatches >= solver->maxmatches))
@@ -1034,12 +1408,17 @@ void solver_run(solver_t* solver) {
         }
 
     quitnow:
-        for (i = 0; i < (numxy*numxy); i++) {
-            pquad* pq = pquads + i;
-            free(pq->inbox);
-            free(pq->xy);
-        }
+        // (the pquads' inbox and xy arrays live in the arena)
+        solver_arena_reset(solver);
         free(pquads);
+
+        if (solver->collect_stats) {
+            runstats[0].time_quads += stats_clock() - tsetup;
+            if (!solver->stats)
+                solver->stats = bl_new(16, sizeof(solver_stats_t));
+            for (i = 0; i < num_indexes; i++)
+                bl_append(solver->stats, runstats + i);
+        }
     }
 }
 
@@ -1100,7 +1479,6 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
                             const double* code, solver_t* solver,
                             anbool current_parity, double tol2) {
     int i;
-    kdtree_qres_t* result = NULL;
     int dimcode = (dimquad - NBACK) * 2;
     int stars[DQMAX];
     double flipcode[DCMAX];
@@ -1116,9 +1494,9 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, code, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
+                     tol2, stars, NULL, 0, placed);
     if (unlikely(solver->quit_now))
-        goto bailout;
+        return;
 
     // Flipped:
     stars[0] = fieldstars[1];
@@ -1131,10 +1509,7 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, flipcode, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
-
- bailout:
-    kdtree_free_query(result);
+                     tol2, stars, NULL, 0, placed);
 }
 
 /**
@@ -1153,11 +1528,8 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult) {
+                             int slot, anbool* placed) {
     int i;
-    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
-        KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_USE_SPLIT;
     double mycode[DCMAX];
     int Nstars = dimquad - NBACK;
     int lastslot = dimquad - NBACK - 1;
@@ -1242,7 +1614,7 @@ static void try_permutations(const int* origstars, int dimquad,
             placed[i] = TRUE;
             try_permutations(origstars, dimquad, origcode, solver,
                              current_parity, tol2, stars, code, 
-                             slot+1, placed, presult);
+                             slot+1, placed);
             placed[i] = FALSE;
 
         } else {
@@ -1251,21 +1623,20 @@ static void try_permutations(const int* origstars, int dimquad,
             continue;
 #endif
 				
-            // Search with the code we've built.
-            *presult = kdtree_rangesearch_options_reuse
-                (solver->index->codekd->tree, *presult, code, tol2, options);
-            //debug("      trying ABCD = [%i %i %i %i]: %i results.\n",
-            //fstars[A], fstars[B], fstars[C], fstars[D], result->nres);
-
-            if ((*presult)->nres) {
-                double pixvals[DQMAX*2];
-                int j;
-                for (j=0; j<dimquad; j++) {
-                    setx(pixvals, j, field_getx(solver, stars[j]));
-                    sety(pixvals, j, field_gety(solver, stars[j]));
-                }
-                resolve_matches(*presult, pixvals, stars, dimquad, solver,
-                                current_parity);
+            // Queue a search with the code we've built.
+            {
+                struct solver_codebatch* b = solver->codebatch;
+                int dimcode = (dimquad - NBACK) * 2;
+                memcpy(b->codes + (size_t)b->n * dimcode, code,
+                       dimcode * sizeof(double));
+                memcpy(b->stars + (size_t)b->n * DQMAX, stars,
+                       dimquad * sizeof(int));
+                b->dimquad[b->n] = dimquad;
+                b->parity[b->n] = current_parity;
+                b->tol2 = tol2;
+                b->n++;
+                if (b->n == SOLVER_CODE_BATCH)
+                    flush_code_queries(solver);
             }
             if (unlikely(solver->quit_now))
                 return;
@@ -1273,6 +1644,49 @@ static void try_permutations(const int* origstars, int dimquad,
     }
 }
 
+/*
+ Searches the code tree for all queued codes at once, then resolves the
+ matches of each code in the order they were queued.
+ */
+static void flush_code_queries(solver_t* solver) {
+    struct solver_codebatch* b = solver->codebatch;
+    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+        KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_USE_SPLIT;
+    int i, j;
+
+    double t0 = 0.0;
+
+    if (!b || !b->n)
+        return;
+    if (solver->cur_stats)
+        t0 = stats_clock();
+    if (kdtree_rangesearch_batch_reuse(solver->index->codekd->tree, b->results,
+                                       b->codes, b->n, b->tol2, options)) {
+        ERROR("Code tree search failed for %i codes", b->n);
+        b->n = 0;
+        return;
+    }
+    if (solver->cur_stats)
+        solver->cur_stats->time_search += stats_clock() - t0;
+    for (i=0; i<b->n; i++) {
+        const int* stars = b->stars + (size_t)i * DQMAX;
+        //debug("      trying ABCD = [%i %i %i %i]: %i results.\n",
+        //stars[A], stars[B], stars[C], stars[D], b->results[i]->nres);
+        if (b->results[i]->nres) {
+            double pixvals[DQMAX*2];
+            for (j=0; j<b->dimquad[i]; j++) {
+                setx(pixvals, j, field_getx(solver, stars[j]));
+                sety(pixvals, j, field_gety(solver, stars[j]));
+            }
+            resolve_matches(b->results[i], pixvals, stars, b->dimquad[i],
+                            solver, b->parity[i]);
+        }
+        if (unlikely(solver->quit_now))
+            break;
+    }
+    b->n = 0;
+}
+
 static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
                             const int* fieldstars, int dimquads,
                             solver_t* solver, anbool current_parity) {
@@ -1292,6 +1706,8 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         int i;
         anbool outofbounds = FALSE;
         double abscale;
+        double t0 = 0.0;
+        int fitfail;
 
         solver->nummatches++;
         thisquadno = krez->inds[jj];
@@ -1326,7 +1742,12 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         }
 
         // compute TAN projection from the matching quad alone.
-        if (fit_tan_wcs(starxyz, field_xy, dimquads, &wcs, &scale)) {
+        if (solver->cur_stats)
+            t0 = stats_clock();
+        fitfail = fit_tan_wcs_quad(starxyz, field_xy, dimquads, &wcs, &scale);
+        if (solver->cur_stats)
+            solver->cur_stats->time_fit += stats_clock() - t0;
+        if (fitfail) {
             // bad quad.
             logverb("bad quad at %s:%i\n", __FILE__, __LINE__);
             continue;
@@ -1366,14 +1787,152 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
 
         set_center_and_radius(solver, &mo, &(mo.wcstan), NULL);
 
+        if (solver->cur_stats)
+            t0 = stats_clock();
         if (solver_handle_hit(solver, &mo, NULL, FALSE))
             solver->quit_now = TRUE;
+        if (solver->cur_stats)
+            solver->cur_stats->time_verify += stats_clock() - t0;
 
         if (unlikely(solver->quit_now))
             return;
     }
 }
 
+/*
+ Alternative solutions.  "solutions" is a min-heap on log-odds, so the
+ worst kept solution is solutions[0].  Hits whose centers are within
+ SOLUTION_SAME_RADIUS (as a fraction of the field radius) and whose
+ orientations are within SOLUTION_SAME_ANGLE degrees (with the same
+ parity) are the same solution, and only the best of them is kept.
+ */
+#define SOLUTION_SAME_RADIUS 0.1
+#define SOLUTION_SAME_ANGLE 5.0
+
+static anbool same_solution(const MatchObj* m1, const MatchObj* m2) {
+    double r;
+    double dangle;
+    if (m1->parity != m2->parity)
+        return FALSE;
+    r = SOLUTION_SAME_RADIUS * MAX(m1->radius, m2->radius);
+    if (distsq(m1->center, m2->center, 3) > r*r)
+        return FALSE;
+    dangle = fabs(remainder(tan_get_orientation(&m1->wcstan) -
+                            tan_get_orientation(&m2->wcstan), 360.0));
+    return (dangle <= SOLUTION_SAME_ANGLE);
+}
+
+static void solution_sift_down(MatchObj* heap, int n, int i) {
+    MatchObj tmp;
+    for (;;) {
+        int c = 2*i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && heap[c+1].logodds < heap[c].logodds)
+            c++;
+        if (heap[i].logodds <= heap[c].logodds)
+            break;
+        memcpy(&tmp, heap + i, sizeof(MatchObj));
+        memcpy(heap + i, heap + c, sizeof(MatchObj));
+        memcpy(heap + c, &tmp, sizeof(MatchObj));
+        i = c;
+    }
+}
+
+static void solution_sift_up(MatchObj* heap, int i) {
+    MatchObj tmp;
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (heap[p].logodds <= heap[i].logodds)
+            break;
+        memcpy(&tmp, heap + i, sizeof(MatchObj));
+        memcpy(heap + i, heap + p, sizeof(MatchObj));
+        memcpy(heap + p, &tmp, sizeof(MatchObj));
+        i = p;
+    }
+}
+
+// Copies the hit without the arrays it owns (they belong to the caller).
+static void solution_set(solver_t* sp, MatchObj* dst, const MatchObj* mo) {
+    memcpy(dst, mo, sizeof(MatchObj));
+    dst->sip = NULL;
+    dst->refradec = NULL;
+    dst->fieldxy = NULL;
+    dst->fieldxy_orig = NULL;
+    dst->tagalong = NULL;
+    dst->field_tagalong = NULL;
+    dst->theta = NULL;
+    dst->matchodds = NULL;
+    dst->testperm = NULL;
+    dst->refxyz = NULL;
+    dst->refxy = NULL;
+    dst->refstarid = NULL;
+    dst->index = sp->index;
+}
+
+static void solver_record_solution(solver_t* sp, const MatchObj* mo) {
+    MatchObj* heap;
+    int i;
+
+    if (sp->max_solutions <= 0)
+        return;
+    if (!sp->solutions) {
+        sp->solutions = malloc(sp->max_solutions * sizeof(MatchObj));
+        if (!sp->solutions) {
+            ERROR("Failed to allocate %i solutions", sp->max_solutions);
+            return;
+        }
+        sp->nsolutions = 0;
+    }
+    heap = sp->solutions;
+
+    for (i=0; i<sp->nsolutions; i++) {
+        if (!same_solution(heap + i, mo))
+            continue;
+        if (mo->logodds > heap[i].logodds) {
+            solution_set(sp, heap + i, mo);
+            solution_sift_down(heap, sp->nsolutions, i);
+        }
+        return;
+    }
+    if (sp->nsolutions < sp->max_solutions) {
+        solution_set(sp, heap + sp->nsolutions, mo);
+        solution_sift_up(heap, sp->nsolutions);
+        sp->nsolutions++;
+        return;
+    }
+    if (mo->logodds <= heap[0].logodds)
+        return;
+    solution_set(sp, heap, mo);
+    solution_sift_down(heap, sp->nsolutions, 0);
+}
+
+static int compare_solutions(const void* v1, const void* v2) {
+    const MatchObj* m1 = v1;
+    const MatchObj* m2 = v2;
+    if (m1->logodds > m2->logodds)
+        return -1;
+    if (m1->logodds < m2->logodds)
+        return 1;
+    return 0;
+}
+
+int solver_get_solutions(const solver_t* solver, MatchObj* sols, int maxn) {
+    MatchObj* all;
+    int n = solver->nsolutions;
+    if (!n || maxn <= 0)
+        return 0;
+    all = malloc(n * sizeof(MatchObj));
+    if (!all)
+        return 0;
+    memcpy(all, solver->solutions, n * sizeof(MatchObj));
+    qsort(all, n, sizeof(MatchObj), compare_solutions);
+    n = MIN(n, maxn);
+    memcpy(sols, all, n * sizeof(MatchObj));
+    free(all);
+    return n;
+}
+
 void solver_inject_match(solver_t* solver, MatchObj* mo, sip_t* sip) {
     solver_handle_hit(solver, mo, sip, TRUE);
 }
@@ -1396,6 +1955,23 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
 
     logaccept = MIN(sp->logratio_tokeep, sp->logratio_totune);
 
+    // Screen out hopeless matches before paying for full verification:
+    // a true match should line up at least one of the bright index stars
+    // around the quad with a field star.
+    if (!fake_match && !verifysip && sp->prefilter_probes > 0) {
+        int ntested;
+        int nmatch = verify_prefilter(sp->index->starkd, mo, sp->vf,
+                                      match_distance_in_pixels2,
+                                      sp->field_maxx, sp->field_maxy,
+                                      sp->distance_from_quad_bonus,
+                                      sp->prefilter_probes, &ntested);
+        if (nmatch == 0 && ntested >= sp->prefilter_min_tested) {
+            debug("Prefilter: none of %i probe stars matched; skipping verification.\n", ntested);
+            sp->num_prefilter_rejected++;
+            return FALSE;
+        }
+    }
+
     verify_hit(sp->index->starkd, sp->index->cutnside,
                mo, verifysip, sp->vf, match_distance_in_pixels2,
                sp->distractor_ratio, sp->field_maxx, sp->field_maxy,
@@ -1455,8 +2031,10 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
 
     matchobj_print(mo, log_get_level());
 
-    if (mo->logodds < sp->logratio_tokeep)
+    if (mo->logodds < sp->logratio_tokeep) {
+        solver_record_solution(sp, mo);
         return FALSE;
+    }
 
     logverb("Pixel scale: %g arcsec/pix.\n", mo->scale);
     logverb("Parity: %s.\n", (mo->parity ? "neg" : "pos"));
@@ -1642,6 +2220,9 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
          */
     }
 
+    // (with the final, tweaked WCS)
+    solver_record_solution(sp, mo);
+
     // If the user didn't supply a callback, or if the callback
     // returns TRUE, consider it solved.
     solved = (!sp->record_match_callback ||
@@ -1682,6 +2263,10 @@ void solver_set_default_values(solver_t* solver) {
     solver->codetol = DEFAULT_CODE_TOL;
     solver->distractor_ratio = DEFAULT_DISTRACTOR_RATIO;
     solver->verify_pix = DEFAULT_VERIFY_PIX;
+    solver->prefilter_probes = DEFAULT_PREFILTER_PROBES;
+    solver->prefilter_min_tested = DEFAULT_PREFILTER_MIN_TESTED;
+    solver->index_lag = DEFAULT_INDEX_LAG;
+    solver->max_solutions = DEFAULT_MAX_SOLUTIONS;
     solver->verify_uniformize = TRUE;
     solver->verify_dedup = TRUE;
     solver->distance_from_quad_bonus = TRUE;
@@ -1696,6 +2281,13 @@ void solver_clear_indexes(solver_t* solver) {
 
 void solver_cleanup(solver_t* solver) {
     solver_free_field(solver);
+    solver_arena_free(solver);
+    solver_codebatch_free(solver);
+    free(solver->solutions);
+    solver->solutions = NULL;
+    if (solver->stats)
+        bl_free(solver->stats);
+    solver->stats = NULL;
     pl_free(solver->indexes);
     solver->indexes = NULL;
     if (solver->have_best_match) {
@@ -61,9 +61,444 @@ typedef struct verify_s verify_t;
 
 static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas);
 
+/*
+ A uniform grid hash over a set of points in pixel space.  The points in
+ cell c (row-major, "w" cells per row) are k = start[c] .. start[c+1]-1,
+ at (xy[2k], xy[2k+1]), with original index inds[k].
+ */
+struct verify_grid {
+    double x0, y0;
+    double scale;   // cells per pixel
+    int w, h;
+    int* start;
+    int* inds;
+    double* xy;
+};
+typedef struct verify_grid verify_grid_t;
+
+// Aim for about this many points per grid cell...
+#define GRID_DENSITY 2.0
+// ... but don't make more than this many cells across.
+#define GRID_MAXW 256
+
+static void grid_free(verify_grid_t* g) {
+    if (!g)
+        return;
+    free(g->start);
+    free(g->inds);
+    free(g->xy);
+    free(g);
+}
+
+static inline int grid_cell(const verify_grid_t* g, double x, double y) {
+    return (int)((y - g->y0) * g->scale) * g->w + (int)((x - g->x0) * g->scale);
+}
+
+// Builds a grid of the N points (xy[2*perm[i]], xy[2*perm[i]+1]), or of
+// the first N points if "perm" is NULL.  Original index "i".
+static verify_grid_t* grid_new(const double* xy, const int* perm, int N) {
+    verify_grid_t* g;
+    double x0, y0, x1, y1;
+    double cell;
+    int i, c, ncells;
+
+    g = calloc(1, sizeof(verify_grid_t));
+    if (!g)
+        return NULL;
+    x0 = y0 = 0.0;
+    x1 = y1 = 1.0;
+    for (i=0; i<N; i++) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        if (i == 0 || p[0] < x0) x0 = p[0];
+        if (i == 0 || p[0] > x1) x1 = p[0];
+        if (i == 0 || p[1] < y0) y0 = p[1];
+        if (i == 0 || p[1] > y1) y1 = p[1];
+    }
+    cell = sqrt(MAX(x1 - x0, 1.0) * MAX(y1 - y0, 1.0) * GRID_DENSITY / MAX(N, 1));
+    cell = MAX(cell, MAX(x1 - x0, y1 - y0) / GRID_MAXW);
+    cell = MAX(cell, 1.0);
+    g->x0 = x0;
+    g->y0 = y0;
+    g->scale = 1.0 / cell;
+    g->w = (int)((x1 - x0) * g->scale) + 1;
+    g->h = (int)((y1 - y0) * g->scale) + 1;
+    ncells = g->w * g->h;
+
+    g->start = calloc(ncells + 1, sizeof(int));
+    g->inds = malloc(MAX(N, 1) * sizeof(int));
+    g->xy = malloc(MAX(N, 1) * 2 * sizeof(double));
+    if (!g->start || !g->inds || !g->xy) {
+        grid_free(g);
+        return NULL;
+    }
+    // counting sort of the points by cell.
+    for (i=0; i<N; i++) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        g->start[grid_cell(g, p[0], p[1]) + 1]++;
+    }
+    for (c=0; c<ncells; c++)
+        g->start[c+1] += g->start[c];
+    for (i=N-1; i>=0; i--) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        int k = --g->start[grid_cell(g, p[0], p[1]) + 1];
+        g->inds[k] = i;
+        g->xy[2*k+0] = p[0];
+        g->xy[2*k+1] = p[1];
+    }
+    // start[c+1] now holds the start of cell c; shift down.
+    memmove(g->start, g->start + 1, ncells * sizeof(int));
+    g->start[ncells] = N;
+    return g;
+}
+
+// The range of cells overlapping the square of half-width "r" around (x,y).
+// Returns FALSE if it doesn't overlap the grid at all.
+static anbool grid_cell_range(const verify_grid_t* g, double x, double y, double r,
+                              int* cx0, int* cx1, int* cy0, int* cy1) {
+    double fx0 = floor((x - r - g->x0) * g->scale);
+    double fx1 = floor((x + r - g->x0) * g->scale);
+    double fy0 = floor((y - r - g->y0) * g->scale);
+    double fy1 = floor((y + r - g->y0) * g->scale);
+    if (!(fx1 >= 0 && fy1 >= 0 && fx0 < g->w && fy0 < g->h))
+        return FALSE;
+    *cx0 = (int)MAX(fx0, 0);
+    *cx1 = (int)MIN(fx1, g->w - 1);
+    *cy0 = (int)MAX(fy0, 0);
+    *cy1 = (int)MIN(fy1, g->h - 1);
+    return TRUE;
+}
+
+// Returns the original index of the point nearest (x,y), if it is within
+// distance-squared "maxd2"; otherwise -1.
+static int grid_nearest(const verify_grid_t* g, double x, double y,
+                        double maxd2, double* p_d2) {
+    int cx0, cx1, cy0, cy1, cy, k;
+    int best = -1;
+    double bestd2 = maxd2;
+
+    if (!grid_cell_range(g, x, y, sqrt(maxd2), &cx0, &cx1, &cy0, &cy1))
+        return -1;
+    for (cy=cy0; cy<=cy1; cy++) {
+        int c = cy * g->w;
+        for (k=g->start[c + cx0]; k<g->start[c + cx1 + 1]; k++) {
+            double d2 = square(g->xy[2*k+0] - x) + square(g->xy[2*k+1] - y);
+            if (d2 <= bestd2) {
+                bestd2 = d2;
+                best = g->inds[k];
+            }
+        }
+    }
+    if (best >= 0 && p_d2)
+        *p_d2 = bestd2;
+    return best;
+}
+
+/*
+ Index stars cached by healpix cell, so that repeated verifications of
+ (nearby) matches on the same field don't have to search the star kdtree
+ and sort the results by sweep number every time.
+
+ Cells are small compared to the field.  The first verification centered
+ in a cell just marks it; the second one searches a circle wide enough to
+ cover any search of that radius centered in the cell, sorts the stars by
+ (sweep, star id) and keeps them.  Later searches centered in the cell
+ only have to pick out the stars in their circle, and get them in sweep
+ order for free.
+ */
+typedef struct {
+    int hp;             // -1: empty slot
+    int N;              // -1: no stars cached
+    double center[3];
+    double crad;        // distance from center to the corners
+    double rcover;      // radius of the cached circle around "center"
+    // one allocation, starting at "xyz".  Stars are sorted by "key":
+    // sweep number in the high 32 bits, star id in the low 32.
+    double* xyz;
+    uint64_t* key;
+} star_cell_t;
+
+typedef struct {
+    const startree_t* skdt;
+    int nside;
+    int tablesize;      // power of two
+    int ncells;
+    size_t nstars;
+    star_cell_t* table;
+} star_cache_t;
+
+// Drop the cached stars if there are more than this many...
+#define STAR_CACHE_MAX_STARS (1 << 19)
+// ... and forget all cells if more than this many have been visited.
+#define STAR_CACHE_MAX_CELLS (1 << 16)
+// Cell side length, as a fraction of the (first) search radius.
+#define STAR_CACHE_CELL_FRACTION 0.25
+
+#define STAR_KEY(sweep, id) (((uint64_t)(uint32_t)(sweep) << 32) | (uint32_t)(id))
+#define STAR_KEY_ID(key) ((int)(uint32_t)(key))
+
+static void star_cache_clear(star_cache_t* sc) {
+    int i;
+    for (i=0; i<sc->tablesize; i++) {
+        free(sc->table[i].xyz);
+        sc->table[i].xyz = NULL;
+        sc->table[i].N = -1;
+    }
+    sc->nstars = 0;
+}
+
+static void star_cache_free(star_cache_t* sc) {
+    if (!sc)
+        return;
+    star_cache_clear(sc);
+    free(sc->table);
+    free(sc);
+}
+
+static star_cell_t* star_cache_alloc_table(int tablesize) {
+    star_cell_t* table = malloc(tablesize * sizeof(star_cell_t));
+    int i;
+    if (!table)
+        return NULL;
+    for (i=0; i<tablesize; i++) {
+        table[i].hp = -1;
+        table[i].N = -1;
+        table[i].xyz = NULL;
+    }
+    return table;
+}
+
+static star_cache_t* star_cache_new(const startree_t* skdt, int nside) {
+    star_cache_t* sc = calloc(1, sizeof(star_cache_t));
+    if (!sc)
+        return NULL;
+    sc->skdt = skdt;
+    sc->nside = nside;
+    sc->tablesize = 256;
+    sc->table = star_cache_alloc_table(sc->tablesize);
+    if (!sc->table) {
+        free(sc);
+        return NULL;
+    }
+    return sc;
+}
+
+static star_cell_t* star_cache_slot(star_cell_t* table, int tablesize, int hp) {
+    unsigned int h = ((unsigned int)hp * 2654435761u) & (tablesize - 1);
+    while (table[h].hp != -1 && table[h].hp != hp)
+        h = (h + 1) & (tablesize - 1);
+    return table + h;
+}
+
+// Returns the table entry for "hp"; sets *p_new if it was just added.
+// NULL on allocation failure.
+static star_cell_t* star_cache_cell(star_cache_t* sc, int hp, anbool* p_new) {
+    star_cell_t* cell = star_cache_slot(sc->table, sc->tablesize, hp);
+
+    *p_new = FALSE;
+    if (cell->hp == hp)
+        return cell;
+    if (sc->ncells >= STAR_CACHE_MAX_CELLS) {
+        int i;
+        star_cache_clear(sc);
+        for (i=0; i<sc->tablesize; i++)
+            sc->table[i].hp = -1;
+        sc->ncells = 0;
+        cell = star_cache_slot(sc->table, sc->tablesize, hp);
+    }
+    if (2 * (sc->ncells + 1) > sc->tablesize) {
+        int newsize = sc->tablesize * 2;
+        star_cell_t* newtable = star_cache_alloc_table(newsize);
+        int i;
+        if (!newtable)
+            return NULL;
+        for (i=0; i<sc->tablesize; i++)
+            if (sc->table[i].hp != -1)
+                *star_cache_slot(newtable, newsize, sc->table[i].hp) = sc->table[i];
+        free(sc->table);
+        sc->table = newtable;
+        sc->tablesize = newsize;
+        cell = star_cache_slot(sc->table, sc->tablesize, hp);
+    }
+    cell->hp = hp;
+    cell->N = -1;
+    cell->crad = -1.0;
+    cell->xyz = NULL;
+    sc->ncells++;
+    *p_new = TRUE;
+    return cell;
+}
+
+static void star_cell_geometry(const star_cache_t* sc, star_cell_t* cell) {
+    double corner[3];
+    int dx, dy;
+    healpix_to_xyzarr(cell->hp, sc->nside, 0.5, 0.5, cell->center);
+    cell->crad = 0.0;
+    for (dy=0; dy<2; dy++)
+        for (dx=0; dx<2; dx++) {
+            healpix_to_xyzarr(cell->hp, sc->nside, dx, dy, corner);
+            cell->crad = MAX(cell->crad, sqrt(distsq(cell->center, corner, 3)));
+        }
+    // (a little slack for the curved cell edges)
+    cell->crad *= 1.05;
+}
+
+typedef struct {
+    uint64_t key;
+    int i;
+} star_key_t;
+
+static int compare_star_keys(const void* v1, const void* v2) {
+    const star_key_t* s1 = v1;
+    const star_key_t* s2 = v2;
+    if (s1->key != s2->key)
+        return (s1->key < s2->key) ? -1 : 1;
+    return 0;
+}
+
+// Caches the stars within "rcover" of the cell center.
+static int star_cache_fill_cell(star_cache_t* sc, star_cell_t* cell, double rcover) {
+    const startree_t* skdt = sc->skdt;
+    double* xyz = NULL;
+    int* inds = NULL;
+    star_key_t* order;
+    int N = 0;
+    int i;
+
+    // The stars this cell had no longer count against the budget.
+    if (cell->N > 0)
+        sc->nstars -= cell->N;
+    free(cell->xyz);
+    cell->xyz = NULL;
+    cell->N = -1;
+    if (sc->nstars > STAR_CACHE_MAX_STARS) {
+        debug("Clearing the index star cache (%zu stars)\n", sc->nstars);
+        star_cache_clear(sc);
+    }
+
+    startree_search_for(skdt, cell->center, square(rcover), &xyz, NULL, &inds, &N);
+    order = malloc(MAX(N, 1) * sizeof(star_key_t));
+    cell->xyz = malloc(MAX(N, 1) * (3 * sizeof(double) + sizeof(uint64_t)));
+    if (!order || !cell->xyz) {
+        free(order);
+        free(cell->xyz);
+        cell->xyz = NULL;
+        free(xyz);
+        free(inds);
+        return -1;
+    }
+    for (i=0; i<N; i++) {
+        order[i].key = STAR_KEY(skdt->sweep[inds[i]], inds[i]);
+        order[i].i = i;
+    }
+    qsort(order, N, sizeof(star_key_t), compare_star_keys);
+
+    cell->N = N;
+    cell->rcover = rcover;
+    cell->key = (uint64_t*)(cell->xyz + 3 * N);
+    for (i=0; i<N; i++) {
+        cell->key[i] = order[i].key;
+        memcpy(cell->xyz + 3*i, xyz + 3*order[i].i, 3 * sizeof(double));
+    }
+    sc->nstars += N;
+    free(order);
+    free(xyz);
+    free(inds);
+    return 0;
+}
+
+/*
+ Finds the index stars within distance-squared "r2" of "center", in order
+ of (sweep, star id).  Returns -1 if the cache can't answer this query
+ (first visit to the cell, or allocation failure); the caller should then
+ search the kdtree.
+ */
+static int star_cache_search(star_cache_t* sc, const double* center, double r2,
+                             double** p_xyz, int** p_starid, int* p_N) {
+    star_cell_t* cell;
+    anbool isnew;
+    double r = sqrt(r2);
+    double* xyz;
+    int* starid;
+    int i, N;
+
+    cell = star_cache_cell(sc, xyzarrtohealpix(center, sc->nside), &isnew);
+    if (!cell || isnew)
+        return -1;
+    if (cell->crad < 0)
+        star_cell_geometry(sc, cell);
+    if (cell->N == -1 ||
+        sqrt(distsq(cell->center, center, 3)) + r > cell->rcover) {
+        // Second visit, or a wider search than we have cached.  Leave some
+        // room for the search radius to vary between matches.
+        if (star_cache_fill_cell(sc, cell, 1.05 * r + cell->crad))
+            return -1;
+    }
+    N = 0;
+    xyz = malloc(MAX(cell->N, 1) * 3 * sizeof(double));
+    starid = malloc(MAX(cell->N, 1) * sizeof(int));
+    if (!xyz || !starid) {
+        free(xyz);
+        free(starid);
+        return -1;
+    }
+    for (i=0; i<cell->N; i++) {
+        const double* s = cell->xyz + 3*i;
+        double d2 = square(s[0] - center[0]) + square(s[1] - center[1]) +
+            square(s[2] - center[2]);
+        if (d2 > r2)
+            continue;
+        memcpy(xyz + 3*N, s, 3 * sizeof(double));
+        starid[N] = STAR_KEY_ID(cell->key[i]);
+        N++;
+    }
+    if (!N) {
+        free(xyz);
+        free(starid);
+        xyz = NULL;
+        starid = NULL;
+    }
+    *p_xyz = xyz;
+    *p_starid = starid;
+    *p_N = N;
+    return 0;
+}
+
+// Index-star search for verify_hit(), through the field's cache for this
+// star kdtree if possible.  Returns TRUE if the results came from the
+// cache (and are therefore already sorted by sweep).
+static anbool verify_search_index_stars(const verify_field_t* vf,
+                                        const startree_t* skdt,
+                                        const double* center, double r2,
+                                        double** p_xyz, int** p_starid, int* p_N) {
+    star_cache_t* sc = NULL;
+    int i;
+
+    if (vf->do_star_cache && vf->starcaches) {
+        for (i=0; i<pl_size(vf->starcaches); i++) {
+            star_cache_t* c = pl_get(vf->starcaches, i);
+            if (c->skdt == skdt) {
+                sc = c;
+                break;
+            }
+        }
+        if (!sc) {
+            int nside = (int)healpix_nside_for_side_length_arcmin(
+                STAR_CACHE_CELL_FRACTION * deg2arcmin(distsq2deg(r2)));
+            // (keep 12 nside^2 within an int)
+            nside = MIN(MAX(nside, 1), 8192);
+            sc = star_cache_new(skdt, nside);
+            if (sc)
+                pl_append(vf->starcaches, sc);
+        }
+        if (sc && star_cache_search(sc, center, r2, p_xyz, p_starid, p_N) == 0)
+            return TRUE;
+    }
+    startree_search_for(skdt, center, r2, p_xyz, NULL, p_starid, p_N);
+    return FALSE;
+}
+
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
     verify_field_t* vf;
-    int Nleaf = 5;
 
     vf = malloc(sizeof(verify_field_t));
     if (!vf) {
@@ -71,19 +506,21 @@ verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
         return NULL;
     }
     vf->field = fieldxy;
-    // Note on kdtree type: I tried U32 (duu) but it was marginally slower.
-    // I didn't try U16 (dss) because we need a fair bit of accuracy here.
-    // Make a copy of the field objects, because we're going to build a
-    // kdtree out of them and that shuffles their order.
-    vf->fieldcopy = starxy_copy_xy(fieldxy);
     vf->xy = starxy_copy_xy(fieldxy);
-    if (!vf->fieldcopy || !vf->xy) {
+    if (!vf->xy) {
         fprintf(stderr, "Failed to copy the field.\n");
         return NULL;
     }
-    // Build a tree out of the field objects (in pixel space)
-    vf->ftree = kdtree_build(NULL, vf->fieldcopy, starxy_n(vf->field),
-                             2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    // Hash the field objects (in pixel space); they don't change while
+    // we verify matches against them.
+    vf->grid = grid_new(vf->xy, NULL, starxy_n(vf->field));
+    if (!vf->grid) {
+        fprintf(stderr, "Failed to build the field grid.\n");
+        return NULL;
+    }
+
+    vf->starcaches = pl_new(4);
+    vf->do_star_cache = TRUE;
 
     vf->do_uniformize = TRUE;
     vf->do_dedup = TRUE;
@@ -95,9 +532,14 @@ verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
 void verify_field_free(verify_field_t* vf) {
     if (!vf)
         return;
-    kdtree_free(vf->ftree);
+    grid_free(vf->grid);
+    if (vf->starcaches) {
+        int i;
+        for (i=0; i<pl_size(vf->starcaches); i++)
+            star_cache_free(pl_get(vf->starcaches, i));
+        pl_free(vf->starcaches);
+    }
     free(vf->xy);
-    free(vf->fieldcopy);
     free(vf);
 }
 
@@ -463,9 +905,7 @@ static double real_verify_star_lists(verify_t* v,
     double logbg;
     double logd;
     //double matchnsigma = 5.0;
-    double* refcopy;
-    kdtree_t* rtree;
-    int Nleaf = 10;
+    verify_grid_t* rgrid;
     int* rmatches;
     double* rprobs;
     double* all_logodds = NULL;
@@ -473,32 +913,30 @@ static double real_verify_star_lists(verify_t* v,
     int mu;
     int* rperm;
 
-    if (!v->NR || !v->NT) {
+    if (v->NR <= 0 || v->NT <= 0) {
         logerr("real_verify_star_lists: NR=%i, NT=%i\n", v->NR, v->NT);
         return -LARGE_VAL;
     }
 
-    // Build a tree out of the index stars in pixel space...
-    // kdtree scrambles the data array so make a copy first.
-    refcopy = malloc(2 * v->NR * sizeof(double));
-    // we must pack/unpermute the refxys; remember this packing order in "rperm".
+    // Hash the index stars in pixel space, in "refperm" order; remember
+    // this packing order in "rperm".
     // we borrow storage for "rperm"...
     if (!v->badguys)
-        v->badguys = malloc(v->NR * sizeof(int));
+        v->badguys = malloc((size_t)v->NR * sizeof(int));
     rperm = v->badguys;
-    for (i=0; i<v->NR; i++) {
-        int ri = v->refperm[i];
-        rperm[i] = ri;
-        refcopy[2*i+0] = v->refxy[2*ri+0];
-        refcopy[2*i+1] = v->refxy[2*ri+1];
+    for (i=0; i<v->NR; i++)
+        rperm[i] = v->refperm[i];
+    rgrid = grid_new(v->refxy, rperm, v->NR);
+    if (!rgrid) {
+        logerr("real_verify_star_lists: failed to build the reference star grid\n");
+        return -LARGE_VAL;
     }
-    rtree = kdtree_build(NULL, refcopy, v->NR, 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
 
-    rmatches = malloc(v->NR * sizeof(int));
+    rmatches = malloc((size_t)v->NR * sizeof(int));
     for (i=0; i<v->NR; i++)
         rmatches[i] = -1;
 
-    rprobs = malloc(v->NR * sizeof(double));
+    rprobs = malloc((size_t)v->NR * sizeof(double));
     for (i=0; i<v->NR; i++)
         rprobs[i] = -LARGE_VAL;
 
@@ -526,7 +964,6 @@ static double real_verify_star_lists(verify_t* v,
         const double* testxy;
         double sig2;
         int refi;
-        int tmpi;
         double d2;
         //double reallogfg;
         double logfg;
@@ -542,16 +979,15 @@ static double real_verify_star_lists(verify_t* v,
         debug2("test star %i: (%.1f,%.1f), sigma: %.1f\n", i, testxy[0], testxy[1], sqrt(sig2));
 
         // find nearest ref star (within 5 sigma)
-        tmpi = kdtree_nearest_neighbour_within(rtree, testxy, sig2 * 25.0, &d2);
-        if (tmpi == -1) {
+        refi = grid_nearest(rgrid, testxy[0], testxy[1], sig2 * 25.0, &d2);
+        if (refi == -1) {
             // no nearest neighbour within range.
             debug2("  No nearest neighbour.\n");
             refi = -1;
             logfg = -LARGE_VAL;
         } else {
             double loggmax;
-            // Note that "refi" is w.r.t. the "refcopy" array (not the original data).
-            refi = kdtree_permute(rtree, tmpi);
+            // Note that "refi" is w.r.t. the "rperm" order (not the original data).
             // peak value of the Gaussian
             loggmax = log((1.0 - distractors) / (2.0 * M_PI * sig2 * v->NR));
             // FIXME - do something with uninformative hits?
@@ -766,8 +1202,7 @@ static double real_verify_star_lists(verify_t* v,
 
     free(rprobs);
 
-    kdtree_free(rtree);
-    free(refcopy);
+    grid_free(rgrid);
 
     return bestlogodds;
 }
@@ -855,10 +1290,9 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
  */
 static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas) {
     anbool* keepers = NULL;
-    int i, j, ti;
-    kdtree_qres_t* res = NULL;
+    int i, ti;
+    const verify_grid_t* g = vf->grid;
     double nsig2 = nsigmas*nsigmas;
-    int options = KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_SMALL_RADIUS;
 
     // default to FALSE
     keepers = calloc(v->NTall, sizeof(anbool));
@@ -868,13 +1302,20 @@ static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t*
     }
     for (i=0; i<v->NT; i++) {
         double sxy[2];
+        double r2;
+        int cx0, cx1, cy0, cy1, cy, k;
         ti = v->testperm[i];
         if (!keepers[ti])
             continue;
+        r2 = nsig2 * v->testsigma[ti];
         starxy_get(vf->field, ti, sxy);
-        res = kdtree_rangesearch_options_reuse(vf->ftree, res, sxy, nsig2 * v->testsigma[ti], options);
-        for (j=0; j<res->nres; j++) {
-            int ind = res->inds[j];
+        if (!grid_cell_range(g, sxy[0], sxy[1], sqrt(r2), &cx0, &cx1, &cy0, &cy1))
+            continue;
+        for (cy=cy0; cy<=cy1; cy++)
+        for (k=g->start[cy * g->w + cx0]; k<g->start[cy * g->w + cx1 + 1]; k++) {
+            int ind = g->inds[k];
+            if (square(g->xy[2*k+0] - sxy[0]) + square(g->xy[2*k+1] - sxy[1]) > r2)
+                continue;
             if (ind > i) {
                 keepers[ind] = FALSE;
                 if (DEBUGVERIFY) {
@@ -887,7 +1328,6 @@ static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t*
             }
         }
     }
-    kdtree_free_query(res);
     return keepers;
 }
 
@@ -903,6 +1343,97 @@ void verify_get_quad_center(const verify_field_t* vf, const MatchObj* mo, double
     *quadr2 = distsq(Axy, centerpix, 2);
 }
 
+// Maximum number of probes verify_prefilter() will project.
+#define PREFILTER_MAX_PROBES 32
+
+int verify_prefilter(const startree_t* skdt,
+                     const MatchObj* mo,
+                     const verify_field_t* vf,
+                     double pix2,
+                     double fieldW,
+                     double fieldH,
+                     anbool do_gamma,
+                     int nprobe,
+                     int* p_ntested) {
+    double qxyz[3] = {0, 0, 0};
+    double qr2;
+    double qc[2], Q2;
+    double* starxyz = NULL;
+    int* starinds = NULL;
+    int N = 0;
+    // the "nprobe" brightest (lowest sweep) candidates, sorted by sweep.
+    int probe[PREFILTER_MAX_PROBES];
+    int probesweep[PREFILTER_MAX_PROBES];
+    int nkeep = 0;
+    int i, j, ntested, nmatch;
+    tan_t wcs;
+
+    assert(skdt->sweep);
+    nprobe = MIN(nprobe, PREFILTER_MAX_PROBES);
+    *p_ntested = 0;
+    if (nprobe <= 0)
+        return 0;
+
+    // quad center and radius on the sphere (AB is the diameter).
+    for (i=0; i<mo->dimquads; i++)
+        for (j=0; j<3; j++)
+            qxyz[j] += mo->quadxyz[3*i + j];
+    normalize_3(qxyz);
+    qr2 = 0.25 * distsq(mo->quadxyz, mo->quadxyz + 3, 3);
+    startree_search_for(skdt, qxyz, 4.0 * qr2, &starxyz, NULL, &starinds, &N);
+
+    for (i=0; i<N; i++) {
+        int sweep;
+        anbool inquad = FALSE;
+        for (j=0; j<mo->dimquads; j++)
+            if (starinds[i] == (int)mo->star[j]) {
+                inquad = TRUE;
+                break;
+            }
+        if (inquad)
+            continue;
+        sweep = skdt->sweep[starinds[i]];
+        if (nkeep == nprobe && sweep >= probesweep[nkeep-1])
+            continue;
+        // insertion into the sorted probe list.
+        j = MIN(nkeep, nprobe - 1);
+        while (j > 0 && probesweep[j-1] > sweep) {
+            probe[j] = probe[j-1];
+            probesweep[j] = probesweep[j-1];
+            j--;
+        }
+        probe[j] = i;
+        probesweep[j] = sweep;
+        if (nkeep < nprobe)
+            nkeep++;
+    }
+
+    qc[0] = 0.5 * (mo->quadpix[0] + mo->quadpix[2]);
+    qc[1] = 0.5 * (mo->quadpix[1] + mo->quadpix[3]);
+    Q2 = distsq(mo->quadpix, qc, 2);
+    wcs = mo->wcstan;
+    wcs.imagew = fieldW;
+    wcs.imageh = fieldH;
+
+    ntested = nmatch = 0;
+    for (i=0; i<nkeep; i++) {
+        double x, y, sigma2;
+        if (!tan_xyzarr2pixelxy(&wcs, starxyz + 3*probe[i], &x, &y) ||
+            !tan_pixel_is_inside_image(&wcs, x, y))
+            continue;
+        ntested++;
+        sigma2 = pix2;
+        if (do_gamma)
+            sigma2 = get_sigma2_at_radius(pix2, square(x - qc[0]) + square(y - qc[1]), Q2);
+        if (grid_nearest(vf->grid, x, y, 9.0 * sigma2, NULL) >= 0)
+            nmatch++;
+    }
+    free(starxyz);
+    free(starinds);
+    *p_ntested = ntested;
+    return nmatch;
+}
+
 void verify_get_uniformize_scale(int cutnside, double scale, int W, int H, int* cutnw, int* cutnh) {
     double cutarcsec, cutpix;
     cutarcsec = healpix_side_length_arcmin(cutnside) * 60.0;
@@ -1045,6 +1576,8 @@ void verify_wcs(const startree_t* skdt,
 static void set_null_mo(MatchObj* mo) {
     mo->nfield = 0;
     mo->nmatch = 0;
+    mo->nconflict = 0;
+    mo->ndistractor = 0;
     matchobj_compute_derived(mo);
     mo->logodds = -LARGE_VAL;
 }
@@ -1224,17 +1757,18 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     double* fieldcenter;
     double fieldr2;
     double effA, K, worst;
-    int besti;
+    int besti = -1;
     int* theta = NULL;
     double* allodds = NULL;
     sip_t thewcs;
     int ibad, igood;
     double* refxyz = NULL;
-    int* sweep = NULL;
+    int64_t* sweep = NULL;
     verify_t the_v;
     verify_t* v = &the_v;
     int NRimage;
     int ibailed, istopped;
+    anbool cached;
 
     assert(mo->wcs_valid || sip);
     assert(isfinite(logaccept));
@@ -1287,7 +1821,8 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
      */
     assert(skdt->sweep);
     // Find all index stars within the bounding circle of the field.
-    startree_search_for(skdt, fieldcenter, fieldr2, &refxyz, NULL, &v->refstarid, &v->NRall);
+    cached = verify_search_index_stars(vf, skdt, fieldcenter, fieldr2,
+                                       &refxyz, &v->refstarid, &v->NRall);
     debug2("%i reference stars in the bounding circle\n", v->NRall);
     if (!refxyz) {
         // no stars in range.
@@ -1317,25 +1852,29 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     // Sort by sweep #.
     // Each index star has a "sweep number" assigned during index building;
     // it roughly represents a local brightness ordering.  Use this to sort the
-    // index stars.
+    // index stars.  Ties are broken by star id, so that the order does not
+    // depend on the kdtree search (or on the star cache).
     // (NOTE that here we do want "sweep" to be size "NRall"; only the
     // bottom "NRimage" of the "refperm" array will be accessed in the
     // permuted_sort below, so none of
     // the elements between NRimage and NRall will be touched.)
-    sweep = malloc(v->NRall * sizeof(int));
-    for (i=0; i<v->NRall; i++)
-        sweep[i] = skdt->sweep[v->refstarid[i]];
-    // Note here that we're passing in an existing permutation array; it
-    // gets re-permuted during this call.
-    permuted_sort(sweep, sizeof(int), compare_ints_asc, v->refperm, v->NR);
-    free(sweep);
-    sweep = NULL;
+    // (Stars from the cache are already in this order.)
+    if (!cached) {
+        sweep = malloc(v->NRall * sizeof(int64_t));
+        for (i=0; i<v->NRall; i++)
+            sweep[i] = STAR_KEY(skdt->sweep[v->refstarid[i]], v->refstarid[i]);
+        // Note here that we're passing in an existing permutation array; it
+        // gets re-permuted during this call.
+        permuted_sort(sweep, sizeof(int64_t), compare_int64_asc, v->refperm, v->NR);
+        free(sweep);
+        sweep = NULL;
+    }
     debug2("Found %i reference stars.\n", v->NR);
 
     // "refstarids" are indices into the star kdtree and could be used to
     // retrieve "tag-along" data with, eg, startree_get_data_column().
 
-    v->badguys = malloc(v->NR * sizeof(int));
+    v->badguys = malloc((size_t)v->NR * sizeof(int));
 
     // remove reference stars that are part of the quad.
     if (!fake_match) {
@@ -1403,22 +1942,21 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     // NRimage: only the stars inside the image bounds.
     mo->nindex = NRimage;
 
-    if (log_get_level() >= LOG_ALL) {
-        int nm, nc, nd;
-        verify_count_hits(theta, besti, &nm, &nc, &nd);
-        debug("verify: logodds %g, %i matches, %i conflicts, %i distractors after %i field objects.\n",
-              K, nm, nc, nd, besti);
-    }
+    // Count hits for every verified match, not just accepted ones: the
+    // solver keeps a few runners-up whose counts are reported too.
+    if (theta)
+        verify_count_hits(theta, besti, &mo->nmatch, &mo->nconflict,
+                          &mo->ndistractor);
+    else
+        mo->nmatch = mo->nconflict = mo->ndistractor = 0;
+
+    debug("verify: logodds %g, %i matches, %i conflicts, %i distractors after %i field objects.\n",
+          K, mo->nmatch, mo->nconflict, mo->ndistractor, besti);
 
     if (K >= logaccept) {
         int ri, ti;
         int* etheta;
         double* eodds;
-        int nm, nc, nd;
-        verify_count_hits(theta, besti, &nm, &nc, &nd);
-        mo->nmatch = nm;
-        mo->nconflict = nc;
-        mo->ndistractor = nd;
 
         fixup_theta(theta, allodds, ibailed, istopped, v, besti, NRimage, refxyz,
                     &etheta, &eodds);
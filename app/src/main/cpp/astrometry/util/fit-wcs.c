@@ -909,3 +909,107 @@ int fit_tan_wcs(const double* starxyz,
                                 tan, p_scale);
 }
 
+int fit_tan_wcs_quad(const double* starxyz,
+                     const double* fieldxy,
+                     int N,
+                     // output:
+                     tan_t* tan,
+                     double* p_scale) {
+    // Same fit as fit_tan_wcs_solve() (unweighted, tangent point at the
+    // star center-of-mass), but for at most DQMAX points: everything lives
+    // on the stack and the 2x2 SVD is replaced by the closed-form polar
+    // decomposition of the covariance matrix.
+    double p[DQMAX*2];
+    double f[DQMAX*2];
+    double field_cm[2] = {0, 0};
+    double star_cm[3] = {0, 0, 0};
+    double pcm[2] = {0, 0};
+    double a, b, c, d;
+    double u, v, h;
+    double R[4];
+    double pvar, fvar;
+    double scale;
+    int i;
+
+    if (N < 2 || N > DQMAX)
+        return -1;
+
+    memset(tan, 0, sizeof(tan_t));
+
+    for (i=0; i<N; i++) {
+        field_cm[0] += fieldxy[i*2 + 0];
+        field_cm[1] += fieldxy[i*2 + 1];
+        star_cm[0] += starxyz[i*3 + 0];
+        star_cm[1] += starxyz[i*3 + 1];
+        star_cm[2] += starxyz[i*3 + 2];
+    }
+    field_cm[0] /= N;
+    field_cm[1] /= N;
+    normalize_3(star_cm);
+
+    for (i=0; i<N; i++) {
+        f[2*i+0] = fieldxy[2*i+0] - field_cm[0];
+        f[2*i+1] = fieldxy[2*i+1] - field_cm[1];
+        if (!star_coords(starxyz + i*3, star_cm, TRUE, p + 2*i, p + 2*i + 1))
+            return -1;
+        pcm[0] += p[2*i + 0];
+        pcm[1] += p[2*i + 1];
+    }
+    pcm[0] /= N;
+    pcm[1] /= N;
+
+    // covariance [a b; c d] = sum f p'
+    a = b = c = d = 0.0;
+    pvar = fvar = 0.0;
+    for (i=0; i<N; i++) {
+        p[2*i + 0] -= pcm[0];
+        p[2*i + 1] -= pcm[1];
+        a += p[2*i + 0] * f[2*i + 0];
+        b += p[2*i + 1] * f[2*i + 0];
+        c += p[2*i + 0] * f[2*i + 1];
+        d += p[2*i + 1] * f[2*i + 1];
+        pvar += square(p[2*i + 0]) + square(p[2*i + 1]);
+        fvar += square(f[2*i + 0]) + square(f[2*i + 1]);
+    }
+
+    // The orthogonal factor Q = U V' of cov = U S V' is the rotation
+    // [u -v; v u] or reflection [u v; v -u] closest to cov, depending on
+    // the sign of its determinant.  R = V U' = Q'.
+    if (a*d - b*c >= 0.0) {
+        u = a + d;
+        v = c - b;
+        h = hypot(u, v);
+        if (h == 0.0)
+            return -1;
+        u /= h;
+        v /= h;
+        R[0] =  u; R[1] = v;
+        R[2] = -v; R[3] = u;
+    } else {
+        u = a - d;
+        v = b + c;
+        h = hypot(u, v);
+        if (h == 0.0)
+            return -1;
+        u /= h;
+        v /= h;
+        R[0] = u; R[1] =  v;
+        R[2] = v; R[3] = -u;
+    }
+
+    if (fvar == 0.0)
+        return -1;
+    scale = rad2deg(sqrt(pvar / fvar));
+
+    tan->cd[0][0] = R[0] * scale;
+    tan->cd[0][1] = R[1] * scale;
+    tan->cd[1][0] = R[2] * scale;
+    tan->cd[1][1] = R[3] * scale;
+    tan->crpix[0] = field_cm[0];
+    tan->crpix[1] = field_cm[1];
+    xyzarr2radecdegarr(star_cm, tan->crval);
+
+    if (p_scale) *p_scale = scale;
+    return 0;
+}
+
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <string.h>
 #include <assert.h>
 
@@ -410,13 +411,43 @@ static int find_table_column(fitsbin_t* fb, const char* colname, off_t* pstart,
     return -1;
 }
 
+// Maps the "tabsize" bytes of table data at "tabstart" as the data of
+// "chunk", checking that they hold chunk->nrows rows of chunk->itemsize.
+static int map_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk,
+                     off_t tabstart, off_t tabsize) {
+    size_t expected;
+    int mode, flags;
+    off_t mapstart;
+    int mapoffset;
+
+    expected = (size_t)chunk->itemsize * (size_t)chunk->nrows;
+    if (fits_bytes_needed(expected) != tabsize) {
+        ERROR("Expected table size (%zu => %i FITS blocks) is not equal to "
+              "size of table \"%s\" (%zu => %i FITS blocks).",
+              expected, fits_blocks_needed(expected),
+              chunk->tablename, (size_t)tabsize,
+              (int)(tabsize / (off_t)FITS_BLOCK_SIZE));
+        return -1;
+    }
+    // The FITS data may start part-way into the file.
+    tabstart += fb->fits->offset;
+    get_mmap_size(tabstart, tabsize, &mapstart, &(chunk->mapsize), &mapoffset);
+    mode = PROT_READ;
+    flags = MAP_SHARED;
+    chunk->map = mmap(0, chunk->mapsize, mode, flags, fileno(fb->fid), mapstart);
+    if (chunk->map == MAP_FAILED) {
+        SYSERROR("Couldn't mmap file \"%s\"", fb->filename);
+        chunk->map = NULL;
+        return -1;
+    }
+    chunk->data = chunk->map + mapoffset;
+    return 0;
+}
+
 static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
     off_t tabstart=0, tabsize=0;
     int ext;
     size_t expected = 0;
-    int mode, flags;
-    off_t mapstart;
-    int mapoffset;
     int table_nrows;
     int table_rowsize;
     fitsext_t* inmemext = NULL;
@@ -452,6 +483,7 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
         //debug("fits_find_table_column(%s) took %g ms\n", chunk->tablename, 1000 * (timenow() - t0));
 
         //t0 = timenow();
+        chunk->ext = ext;
         chunk->header = fitsbin_get_header(fb, ext);
         if (!chunk->header) {
             ERROR("Couldn't read FITS header from file \"%s\" extension %i", fb->filename, ext);
@@ -485,9 +517,9 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
         return -1;
     }
 
-    expected = (size_t)chunk->itemsize * (size_t)chunk->nrows;
     if (in_memory(fb)) {
         int i;
+        expected = (size_t)chunk->itemsize * (size_t)chunk->nrows;
         chunk->data = malloc(expected);
         for (i=0; i<chunk->nrows; i++) {
             memcpy(((char*)chunk->data) + (size_t)i * (size_t)chunk->itemsize,
@@ -496,25 +528,8 @@ static int read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
         // delete inmemext->items ?
 
     } else {
-
-        if (fits_bytes_needed(expected) != tabsize) {
-            ERROR("Expected table size (%zu => %i FITS blocks) is not equal to "
-                  "size of table \"%s\" (%zu => %i FITS blocks).",
-                  expected, fits_blocks_needed(expected),
-                  chunk->tablename, (size_t)tabsize,
-                  (int)(tabsize / (off_t)FITS_BLOCK_SIZE));
-            return -1;
-        }
-        get_mmap_size(tabstart, tabsize, &mapstart, &(chunk->mapsize), &mapoffset);
-        mode = PROT_READ;
-        flags = MAP_SHARED;
-        chunk->map = mmap(0, chunk->mapsize, mode, flags, fileno(fb->fid), mapstart);
-        if (chunk->map == MAP_FAILED) {
-            SYSERROR("Couldn't mmap file \"%s\"", fb->filename);
-            chunk->map = NULL;
+        if (map_chunk(fb, chunk, tabstart, tabsize))
             return -1;
-        }
-        chunk->data = chunk->map + mapoffset;
     }
     return 0;
 }
@@ -526,6 +541,62 @@ int fitsbin_read_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk) {
     return 0;
 }
 
+int fitsbin_map_chunk(fitsbin_t* fb, fitsbin_chunk_t* chunk, int ext) {
+    off_t tabstart, tabsize;
+    if (in_memory(fb) || !fb->fid) {
+        ERROR("fitsbin_map_chunk: \"%s\" is not open for reading", fb->filename);
+        return -1;
+    }
+    if (ext < 1 || ext >= fb->Next) {
+        ERROR("Table \"%s\": extension %i is not in file \"%s\"",
+              chunk->tablename, ext, fb->filename);
+        return -1;
+    }
+    if (fitsbin_get_datinfo(fb, ext, &tabstart, &tabsize))
+        return -1;
+    chunk->ext = ext;
+    if (map_chunk(fb, chunk, tabstart, tabsize))
+        return -1;
+    fitsbin_add_chunk(fb, chunk);
+    return 0;
+}
+
+int fitsbin_madvise(fitsbin_t* fb, int advice) {
+    int i;
+    int rtn = 0;
+    for (i=0; i<nchunks(fb); i++) {
+        fitsbin_chunk_t* chunk = get_chunk(fb, i);
+        // in-memory chunks have no mapping.
+        if (!chunk->map)
+            continue;
+        if (madvise(chunk->map, chunk->mapsize, advice)) {
+            SYSERROR("Couldn't madvise() chunk \"%s\" of file \"%s\"",
+                     chunk->tablename, fb->filename);
+            rtn = -1;
+        }
+    }
+    return rtn;
+}
+
+size_t fitsbin_touch(fitsbin_t* fb) {
+    int i;
+    size_t ps = getpagesize();
+    size_t touched = 0;
+    volatile char sum = 0;
+    for (i=0; i<nchunks(fb); i++) {
+        fitsbin_chunk_t* chunk = get_chunk(fb, i);
+        const char* map = chunk->map;
+        size_t off;
+        if (!map)
+            continue;
+        for (off=0; off<chunk->mapsize; off+=ps)
+            sum += map[off];
+        touched += chunk->mapsize;
+    }
+    (void)sum;
+    return touched;
+}
+
 int fitsbin_read(fitsbin_t* fb) {
     int i;
 
@@ -551,7 +622,7 @@ fitsbin_t* fitsbin_open_fits(anqfits_t* fits) {
     fb = new_fitsbin(fits->filename);
     if (!fb)
         return fb;
-    fb->fid = fopen(fits->filename, "rb");
+    fb->fid = anqfits_reopen(fits);
     if (!fb->fid) {
         SYSERROR("Failed to open file \"%s\"", fits->filename);
         goto bailout;
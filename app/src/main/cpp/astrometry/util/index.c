@@ -3,7 +3,11 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
+#include <sys/mman.h>
+#include <pthread.h>
+
 #include "index.h"
+#include "index_meta.h"
 #include "log.h"
 #include "errors.h"
 #include "ioutils.h"
@@ -267,6 +271,122 @@ index_t* index_build_from(codetree_t* codekd, quadfile_t* quads, startree_t* sta
     return index;
 }
 
+// Where index_load() keeps index metadata files; NULL if it doesn't.
+// Loads on other threads may still be using a directory that has been
+// replaced, so every directory ever set stays in "meta_cache_dirs" (and
+// is reused if it is set again).
+struct meta_cache_dir {
+    struct meta_cache_dir* next;
+    char path[1];
+};
+static struct meta_cache_dir* meta_cache_dirs = NULL;
+static const char* meta_cache_dir = NULL;
+static pthread_mutex_t meta_cache_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void index_set_meta_cache_dir(const char* dir) {
+    struct meta_cache_dir* d = NULL;
+    pthread_mutex_lock(&meta_cache_dir_lock);
+    if (dir) {
+        for (d = meta_cache_dirs; d; d = d->next)
+            if (!strcmp(d->path, dir))
+                break;
+        if (!d) {
+            d = malloc(sizeof(struct meta_cache_dir) + strlen(dir));
+            if (d) {
+                strcpy(d->path, dir);
+                d->next = meta_cache_dirs;
+                meta_cache_dirs = d;
+            } else
+                ERROR("Failed to allocate index metadata directory name");
+        }
+    }
+    meta_cache_dir = d ? d->path : NULL;
+    pthread_mutex_unlock(&meta_cache_dir_lock);
+}
+
+static const char* get_meta_cache_dir(void) {
+    const char* dir;
+    pthread_mutex_lock(&meta_cache_dir_lock);
+    dir = meta_cache_dir;
+    pthread_mutex_unlock(&meta_cache_dir_lock);
+    return dir;
+}
+
+// Checks the metadata of a freshly-opened index and applies "flags"; on
+// failure, closes "dest" and frees "allocd".
+static index_t* finish_load(index_t* dest, int flags, index_t* allocd) {
+    logverb("Index scale: [%g, %g] arcmin, [%g, %g] arcsec\n",
+            dest->index_scale_lower / 60.0, dest->index_scale_upper / 60.0,
+            dest->index_scale_lower, dest->index_scale_upper);
+    logverb("Index has %i quads and %i stars\n", dest->nquads, dest->nstars);
+
+    if (!dest->circle) {
+        ERROR("Code kdtree does not contain the CIRCLE header.");
+        goto bailout;
+    }
+
+    if (flags & INDEX_ONLY_LOAD_METADATA) {
+        index_unload(dest);
+        // If we're using anqfits_t (dest->fits), keep that open for
+        // fast reopening.  anqfits_t doesn't keep a FILE* or anything
+        // open (except the descriptor given to index_load_fd()), so
+        // that's fine.
+    } else if (flags & INDEX_REORDER_TREES) {
+        // Not fatal: the trees are still usable in file order.
+        if (kdtree_reorder_nodes(dest->starkd->tree) ||
+            kdtree_reorder_nodes(dest->codekd->tree))
+            logmsg("Failed to reorder kd-tree nodes of %s\n", dest->indexfn);
+    }
+    return dest;
+
+ bailout:
+    index_close(dest);
+    free(allocd);
+    return NULL;
+}
+
+// Loads "dest" from its metadata file, if there is an up-to-date one.
+static anbool load_from_meta(index_t* dest, int fd, off_t offset,
+                             off_t length, int flags) {
+    const char* dir = get_meta_cache_dir();
+    if (!dir)
+        return FALSE;
+    if (index_meta_load(dest, dir, dest->indexfn, fd, offset,
+                        length, flags))
+        return FALSE;
+    free(dest->indexname);
+    dest->indexname = strdup(dest->fits->filename);
+    debug("Loaded index %s from its metadata file\n", dest->indexfn);
+    return TRUE;
+}
+
+// Opens the parts of the index in dest->fits and reads the metadata,
+// saving it for next time if index_set_meta_cache_dir() was called and
+// the index data have a "filename"; on failure, closes "dest" and frees
+// "allocd".
+static index_t* load_from_fits(index_t* dest, const char* filename, int fd,
+                               off_t offset, off_t length, int flags,
+                               index_t* allocd) {
+    const char* dir;
+    if (index_reload(dest)) {
+        index_close(dest);
+        free(allocd);
+        return NULL;
+    }
+
+    free(dest->indexname);
+    dest->indexname = strdup(quadfile_get_filename(dest->quads));
+    set_meta(dest);
+
+    // Not fatal: we just parse the headers again next time.
+    dir = get_meta_cache_dir();
+    if (dir && filename && dest->circle &&
+        index_meta_save(dest, dir, filename, fd, offset, length))
+        logverb("Failed to save metadata for index %s\n", dest->indexfn);
+
+    return finish_load(dest, flags, allocd);
+}
+
 index_t* index_load(const char* indexname, int flags, index_t* dest) {
     index_t* allocd = NULL;
 
@@ -285,40 +405,52 @@ index_t* index_load(const char* indexname, int flags, index_t* dest) {
         ERROR("Did not find file for index named %s", dest->indexname);
         goto bailout;
     }
+    if (load_from_meta(dest, -1, 0, -1, flags))
+        return finish_load(dest, flags, allocd);
     dest->fits = anqfits_open(dest->indexfn);
     if (!dest->fits) {
         ERROR("Failed to open FITS file %s", dest->indexfn);
         goto bailout;
     }
-    if (index_reload(dest))
-        goto bailout;
+    return load_from_fits(dest, dest->indexfn, -1, 0, -1, flags, allocd);
 
-    free(dest->indexname);
-    dest->indexname = strdup(quadfile_get_filename(dest->quads));
-    set_meta(dest);
+ bailout:
+    index_close(dest);
+    free(allocd);
+    return NULL;
+}
 
-    logverb("Index scale: [%g, %g] arcmin, [%g, %g] arcsec\n",
-            dest->index_scale_lower / 60.0, dest->index_scale_upper / 60.0,
-            dest->index_scale_lower, dest->index_scale_upper);
-    logverb("Index has %i quads and %i stars\n", dest->nquads, dest->nstars);
+index_t* index_load_fd(int fd, off_t offset, off_t length, const char* name,
+                       int flags, index_t* dest) {
+    index_t* allocd = NULL;
 
-    if (!dest->circle) {
-        ERROR("Code kdtree does not contain the CIRCLE header.");
-        goto bailout;
-    }
+    if (!dest)
+        allocd = dest = calloc(1, sizeof(index_t));
+    else
+        memset(dest, 0, sizeof(index_t));
 
-    if (flags & INDEX_ONLY_LOAD_METADATA) {
-        index_unload(dest);
-        // If we're using anqfits_t (dest->fits), keep that open for
-        // fast reopening.  anqfits_t doesn't keep a FILE* or anything
-        // open, so that's fine.
+    // Metadata files are found by name, so unnamed data can't have one.
+    if (name) {
+        dest->indexfn = strdup(name);
+        if (load_from_meta(dest, fd, offset, length, flags))
+            return finish_load(dest, flags, allocd);
+        free(dest->indexfn);
+        dest->indexfn = NULL;
     }
-    return dest;
 
- bailout:
-    index_close(dest);
-    free(allocd);
-    return NULL;
+    dest->fits = anqfits_open_fd(fd, offset, length, name);
+    if (!dest->fits) {
+        ERROR("Failed to open FITS data at byte %lli of %s", (long long)offset,
+              name ? name : "file descriptor");
+        index_close(dest);
+        free(allocd);
+        return NULL;
+    }
+    dest->indexname = strdup(dest->fits->filename);
+    dest->indexfn = strdup(dest->fits->filename);
+    if (flags & INDEX_ONLY_LOAD_METADATA)
+        logverb("Loading metadata for %s...\n", dest->indexname);
+    return load_from_fits(dest, name, fd, offset, length, flags, allocd);
 }
 
 int index_reload(index_t* index) {
@@ -369,6 +501,46 @@ void index_unload(index_t* index) {
     }
 }
 
+int index_prefetch(index_t* index, int level) {
+    fitsbin_t* fbs[3];
+    int i;
+    int rtn = 0;
+
+    if (!index->starkd || !index->codekd || !index->quads) {
+        ERROR("Index %s is not loaded", index->indexfn);
+        return -1;
+    }
+    // Ordered by how early the solver needs them.
+    fbs[0] = index->codekd->tree->io;
+    fbs[1] = index->starkd->tree->io;
+    fbs[2] = index->quads->fb;
+
+    for (i=0; i<3; i++) {
+        if (level >= INDEX_PREFETCH_TOUCH) {
+            // The touch walks the data front to back: let read-ahead
+            // run ahead of it.
+            size_t nb;
+            if (fitsbin_madvise(fbs[i], MADV_SEQUENTIAL))
+                rtn = -1;
+            if (fitsbin_madvise(fbs[i], MADV_WILLNEED))
+                rtn = -1;
+            nb = fitsbin_touch(fbs[i]);
+            debug("Touched %zu bytes of %s\n", nb, index->indexfn);
+        }
+        // Tree searches and quad lookups jump around; read-ahead
+        // only wastes I/O.
+        if (fitsbin_madvise(fbs[i], MADV_RANDOM))
+            rtn = -1;
+        if (level < INDEX_PREFETCH_TOUCH &&
+            ((i < 2 && level >= INDEX_PREFETCH_TREES) ||
+             level >= INDEX_PREFETCH_ALL)) {
+            if (fitsbin_madvise(fbs[i], MADV_WILLNEED))
+                rtn = -1;
+        }
+    }
+    return rtn;
+}
+
 int index_close_fds(index_t* ind) {
     kdtree_fits_t* io;
     if (ind->quads->fb->fid) {
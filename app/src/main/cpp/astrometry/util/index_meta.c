@@ -0,0 +1,607 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index_meta.h"
+#include "kdtree_fits_io.h"
+#include "fitsbin.h"
+#include "anqfits.h"
+#include "log.h"
+#include "errors.h"
+#include "ioutils.h"
+
+// Bump META_VERSION whenever the layout below changes.
+static const char META_MAGIC[8] = "ANIXMETA";
+#define META_VERSION 1
+// Written in native byte order; a sidecar from another machine is ignored.
+#define META_ENDIAN 0x01020304
+
+// Sanity limits for values read from a sidecar.
+#define META_MAX_SIZE  (1 << 20)
+#define META_MAX_EXTS  1024
+#define META_MAX_CHUNKS 64
+
+// The file holding an index, and where in it the index is.
+typedef struct {
+    const char* filename;
+    int fd;
+    int64_t offset;
+    int64_t length;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+} source_t;
+
+static int get_source(source_t* src, const char* filename, int fd,
+                      off_t offset, off_t length) {
+    struct stat st;
+    if ((fd == -1) ? stat(filename, &st) : fstat(fd, &st)) {
+        SYSERROR("Failed to stat index file %s", filename);
+        return -1;
+    }
+    src->filename = filename;
+    src->fd = fd;
+    src->offset = offset;
+    src->length = (length < 0) ? (st.st_size - offset) : length;
+    src->size = st.st_size;
+    src->mtime = st.st_mtim.tv_sec;
+    src->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+// "<dir>/<basename>-<hash of name, offset and length>.meta"
+static char* meta_filename(const char* dir, const source_t* src) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char* p;
+    const char* base;
+    int64_t vals[2];
+    size_t i;
+    char* fn;
+
+    for (p = (const unsigned char*)src->filename; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    vals[0] = src->offset;
+    vals[1] = src->length;
+    p = (const unsigned char*)vals;
+    for (i=0; i<sizeof(vals); i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+
+    base = strrchr(src->filename, '/');
+    base = base ? base + 1 : src->filename;
+    asprintf_safe(&fn, "%s/%s-%016llx.meta", dir, base, (unsigned long long)h);
+    return fn;
+}
+
+// Writing.  Errors are picked up by ferror() at the end.
+
+static void put_int(FILE* f, int32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void put_i64(FILE* f, int64_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void put_double(FILE* f, double v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void put_str(FILE* f, const char* s) {
+    if (!s) {
+        put_int(f, -1);
+        return;
+    }
+    put_int(f, strlen(s));
+    fwrite(s, 1, strlen(s), f);
+}
+
+// Reading, from a buffer holding the whole sidecar.  Reading past the end
+// sets "bad" and returns zeros.
+
+typedef struct {
+    const char* buf;
+    size_t len;
+    size_t pos;
+    anbool bad;
+} reader_t;
+
+static void get(reader_t* r, void* dest, size_t n) {
+    if (r->bad || n > r->len - r->pos) {
+        r->bad = TRUE;
+        memset(dest, 0, n);
+        return;
+    }
+    memcpy(dest, r->buf + r->pos, n);
+    r->pos += n;
+}
+
+static int32_t get_int(reader_t* r) {
+    int32_t v;
+    get(r, &v, sizeof(v));
+    return v;
+}
+
+static int64_t get_i64(reader_t* r) {
+    int64_t v;
+    get(r, &v, sizeof(v));
+    return v;
+}
+
+static double get_double(reader_t* r) {
+    double v;
+    get(r, &v, sizeof(v));
+    return v;
+}
+
+// Returns a newly-allocated string, or NULL if a NULL string was written
+// (or on error: check r->bad).
+static char* get_str(reader_t* r) {
+    int32_t n = get_int(r);
+    char* s;
+    if (r->bad || n < 0)
+        return NULL;
+    if ((size_t)n > r->len - r->pos) {
+        r->bad = TRUE;
+        return NULL;
+    }
+    s = malloc(n + 1);
+    get(r, s, n);
+    s[n] = '\0';
+    return s;
+}
+
+// The tables of a fitsbin: name, extension and shape.
+
+static anbool all_mapped(fitsbin_t* fb) {
+    int i;
+    for (i=0; i<fitsbin_n_chunks(fb); i++) {
+        fitsbin_chunk_t* chunk = fitsbin_get_chunk(fb, i);
+        if (!chunk->map || chunk->ext < 1)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void put_chunks(FILE* f, fitsbin_t* fb) {
+    int i;
+    put_int(f, fitsbin_n_chunks(fb));
+    for (i=0; i<fitsbin_n_chunks(fb); i++) {
+        fitsbin_chunk_t* chunk = fitsbin_get_chunk(fb, i);
+        put_str(f, chunk->tablename);
+        put_int(f, chunk->ext);
+        put_int(f, chunk->itemsize);
+        put_int(f, chunk->nrows);
+    }
+}
+
+static int map_chunks(reader_t* r, fitsbin_t* fb) {
+    int i, n;
+    n = get_int(r);
+    if (r->bad || n < 0 || n > META_MAX_CHUNKS)
+        return -1;
+    for (i=0; i<n; i++) {
+        fitsbin_chunk_t chunk;
+        int ext;
+        fitsbin_chunk_init(&chunk);
+        chunk.tablename = get_str(r);
+        ext = get_int(r);
+        chunk.itemsize = get_int(r);
+        chunk.nrows = get_int(r);
+        chunk.required = TRUE;
+        if (r->bad || !chunk.tablename ||
+            fitsbin_map_chunk(fb, &chunk, ext)) {
+            free(chunk.tablename);
+            return -1;
+        }
+        // fitsbin_map_chunk() keeps its own copy of the name.
+        free(chunk.tablename);
+    }
+    return 0;
+}
+
+static void* chunk_data(fitsbin_t* fb, const char* tablename) {
+    int i;
+    for (i=0; i<fitsbin_n_chunks(fb); i++) {
+        fitsbin_chunk_t* chunk = fitsbin_get_chunk(fb, i);
+        if (streq(chunk->tablename, tablename))
+            return chunk->data;
+    }
+    return NULL;
+}
+
+// A kd-tree: the fields kdtree_fits_attach_tree() needs, then its tables.
+
+static void put_tree(FILE* f, const kdtree_t* kd) {
+    put_str(f, kd->name);
+    put_int(f, kd->treetype);
+    put_int(f, kd->ndata);
+    put_int(f, kd->ndim);
+    put_int(f, kd->nnodes);
+    put_int(f, kd->has_linear_lr);
+    put_int(f, kd->n_bb);
+    put_int(f, kd->dimbits);
+    put_int(f, kd->dimmask);
+    put_int(f, kd->splitmask);
+    put_chunks(f, kd->io);
+}
+
+static kdtree_t* get_tree(reader_t* r, anqfits_t* fits) {
+    kdtree_t meta;
+    kdtree_t* kd = NULL;
+    kdtree_fits_t* io;
+
+    memset(&meta, 0, sizeof(kdtree_t));
+    meta.name = get_str(r);
+    meta.treetype = get_int(r);
+    meta.ndata = get_int(r);
+    meta.ndim = get_int(r);
+    meta.nnodes = get_int(r);
+    meta.has_linear_lr = get_int(r);
+    meta.n_bb = get_int(r);
+    meta.dimbits = get_int(r);
+    meta.dimmask = get_int(r);
+    meta.splitmask = get_int(r);
+    if (r->bad || meta.ndim < 1 ||
+        meta.ndata < 0 || meta.nnodes < 1) {
+        free(meta.name);
+        return NULL;
+    }
+    io = kdtree_fits_open_fits(fits);
+    if (!io) {
+        free(meta.name);
+        return NULL;
+    }
+    if (map_chunks(r, io) == 0)
+        kd = kdtree_fits_attach_tree(io, &meta);
+    free(meta.name);
+    if (!kd) {
+        kdtree_fits_io_close(io);
+        return NULL;
+    }
+    // As kdtree_fits_read_tree() users do: the tables stay mapped.
+    fitsbin_close_fd(io);
+    return kd;
+}
+
+static void put_quads(FILE* f, const quadfile_t* qf) {
+    put_int(f, qf->numquads);
+    put_int(f, qf->numstars);
+    put_int(f, qf->dimquads);
+    put_double(f, qf->index_scale_upper);
+    put_double(f, qf->index_scale_lower);
+    put_int(f, qf->indexid);
+    put_int(f, qf->healpix);
+    put_int(f, qf->hpnside);
+    put_chunks(f, qf->fb);
+}
+
+static quadfile_t* get_quads(reader_t* r, anqfits_t* fits) {
+    quadfile_t* qf = calloc(1, sizeof(quadfile_t));
+    if (!qf) {
+        SYSERROR("Couldn't malloc a quadfile struct");
+        return NULL;
+    }
+    qf->numquads = get_int(r);
+    qf->numstars = get_int(r);
+    qf->dimquads = get_int(r);
+    qf->index_scale_upper = get_double(r);
+    qf->index_scale_lower = get_double(r);
+    qf->indexid = get_int(r);
+    qf->healpix = get_int(r);
+    qf->hpnside = get_int(r);
+    if (r->bad)
+        goto bailout;
+    qf->fb = fitsbin_open_fits(fits);
+    if (!qf->fb || map_chunks(r, qf->fb))
+        goto bailout;
+    qf->quadarray = chunk_data(qf->fb, "quads");
+    if (!qf->quadarray)
+        goto bailout;
+    fitsbin_close_fd(qf->fb);
+    return qf;
+
+ bailout:
+    quadfile_close(qf);
+    return NULL;
+}
+
+// The index metadata, as set by index_load().
+
+static void put_index(FILE* f, const index_t* index) {
+    put_int(f, index->indexid);
+    put_int(f, index->healpix);
+    put_int(f, index->hpnside);
+    put_double(f, index->index_jitter);
+    put_int(f, index->cutnside);
+    put_int(f, index->cutnsweep);
+    put_double(f, index->cutdedup);
+    put_str(f, index->cutband);
+    put_int(f, index->cutmargin);
+    put_int(f, index->circle);
+    put_int(f, index->cx_less_than_dx);
+    put_int(f, index->meanx_less_than_half);
+    put_double(f, index->index_scale_upper);
+    put_double(f, index->index_scale_lower);
+    put_int(f, index->dimquads);
+    put_int(f, index->nstars);
+    put_int(f, index->nquads);
+}
+
+static void get_index(reader_t* r, index_t* index) {
+    index->indexid = get_int(r);
+    index->healpix = get_int(r);
+    index->hpnside = get_int(r);
+    index->index_jitter = get_double(r);
+    index->cutnside = get_int(r);
+    index->cutnsweep = get_int(r);
+    index->cutdedup = get_double(r);
+    index->cutband = get_str(r);
+    index->cutmargin = get_int(r);
+    index->circle = get_int(r);
+    index->cx_less_than_dx = get_int(r);
+    index->meanx_less_than_half = get_int(r);
+    index->index_scale_upper = get_double(r);
+    index->index_scale_lower = get_double(r);
+    index->dimquads = get_int(r);
+    index->nstars = get_int(r);
+    index->nquads = get_int(r);
+}
+
+// File layout: magic, version, byte order; the source file, location and
+// identity; the FITS extension layout; the index metadata; then the star
+// tree, code tree and quads, each followed by its tables.
+
+int index_meta_save(const index_t* index, const char* dir,
+                    const char* filename, int fd, off_t offset,
+                    off_t length) {
+    source_t src;
+    char* fn = NULL;
+    char* tmpfn = NULL;
+    const anqfits_t* fits = index->fits;
+    FILE* f = NULL;
+    int tmpfd;
+    int i;
+
+    if (!fits || !index->starkd || !index->codekd || !index->quads)
+        return -1;
+    // Only tables mmapped from the file can be found again.
+    if (!all_mapped(index->starkd->tree->io) ||
+        !all_mapped(index->codekd->tree->io) ||
+        !all_mapped(index->quads->fb)) {
+        debug("Index %s has tables that are not mapped; not writing metadata\n",
+              filename);
+        return -1;
+    }
+    if (get_source(&src, filename, fd, offset, length))
+        return -1;
+    fn = meta_filename(dir, &src);
+    asprintf_safe(&tmpfn, "%s.XXXXXX", fn);
+    tmpfd = mkstemp(tmpfn);
+    if (tmpfd == -1) {
+        SYSERROR("Failed to create index metadata file %s", tmpfn);
+        goto bailout;
+    }
+    f = fdopen(tmpfd, "wb");
+    if (!f) {
+        SYSERROR("Failed to open index metadata file %s", tmpfn);
+        close(tmpfd);
+        unlink(tmpfn);
+        goto bailout;
+    }
+
+    fwrite(META_MAGIC, 1, sizeof(META_MAGIC), f);
+    put_int(f, META_VERSION);
+    put_int(f, META_ENDIAN);
+
+    put_str(f, src.filename);
+    put_i64(f, src.offset);
+    put_i64(f, src.length);
+    put_i64(f, src.size);
+    put_i64(f, src.mtime);
+    put_i64(f, src.mtime_nsec);
+
+    put_i64(f, fits->filesize);
+    put_int(f, fits->Nexts);
+    for (i=0; i<fits->Nexts; i++) {
+        put_int(f, fits->exts[i].hdr_start);
+        put_int(f, fits->exts[i].hdr_size);
+        put_int(f, fits->exts[i].data_start);
+        put_int(f, fits->exts[i].data_size);
+    }
+
+    put_index(f, index);
+    put_tree(f, index->starkd->tree);
+    put_tree(f, index->codekd->tree);
+    put_quads(f, index->quads);
+
+    if (ferror(f) | fclose(f)) {
+        SYSERROR("Failed to write index metadata file %s", tmpfn);
+        unlink(tmpfn);
+        goto bailout;
+    }
+    if (rename(tmpfn, fn)) {
+        SYSERROR("Failed to rename %s to %s", tmpfn, fn);
+        unlink(tmpfn);
+        goto bailout;
+    }
+    logverb("Wrote index metadata for %s to %s\n", filename, fn);
+    free(tmpfn);
+    free(fn);
+    return 0;
+
+ bailout:
+    free(tmpfn);
+    free(fn);
+    return -1;
+}
+
+// Reads all of the (small) file "fn"; returns NULL if it does not exist.
+static char* read_meta_file(const char* fn, size_t* len) {
+    struct stat st;
+    char* buf;
+    ssize_t n;
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            SYSERROR("Failed to open index metadata file %s", fn);
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size > META_MAX_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    buf = malloc(st.st_size ? st.st_size : 1);
+    n = read(fd, buf, st.st_size);
+    close(fd);
+    if (n != st.st_size) {
+        free(buf);
+        return NULL;
+    }
+    *len = n;
+    return buf;
+}
+
+int index_meta_load(index_t* dest, const char* dir, const char* filename,
+                    int fd, off_t offset, off_t length, int flags) {
+    source_t src;
+    reader_t r;
+    char* fn;
+    char* buf;
+    char* srcname;
+    char magic[sizeof(META_MAGIC)];
+    anqfits_ext_t* exts = NULL;
+    anqfits_t* fits = NULL;
+    startree_t* starkd = NULL;
+    codetree_t* codekd = NULL;
+    quadfile_t* quads = NULL;
+    kdtree_t* kd;
+    index_t meta;
+    int64_t filesize;
+    int i, nexts;
+    anbool match;
+
+    memset(&meta, 0, sizeof(index_t));
+    if (get_source(&src, filename, fd, offset, length))
+        return -1;
+    fn = meta_filename(dir, &src);
+    memset(&r, 0, sizeof(reader_t));
+    r.buf = buf = read_meta_file(fn, &r.len);
+    if (!buf) {
+        debug("No index metadata file %s\n", fn);
+        free(fn);
+        return -1;
+    }
+
+    get(&r, magic, sizeof(magic));
+    if (memcmp(magic, META_MAGIC, sizeof(magic)) ||
+        get_int(&r) != META_VERSION ||
+        get_int(&r) != META_ENDIAN)
+        goto bailout;
+
+    srcname = get_str(&r);
+    match = (srcname && streq(srcname, src.filename));
+    free(srcname);
+    match = match &&
+        (get_i64(&r) == src.offset) &&
+        (get_i64(&r) == src.length) &&
+        (get_i64(&r) == src.size) &&
+        (get_i64(&r) == src.mtime) &&
+        (get_i64(&r) == src.mtime_nsec);
+    if (r.bad || !match) {
+        logverb("Index metadata %s is out of date for %s\n", fn, filename);
+        goto bailout;
+    }
+
+    filesize = get_i64(&r);
+    nexts = get_int(&r);
+    if (r.bad || nexts < 1 || nexts > META_MAX_EXTS)
+        goto bailout;
+    exts = calloc(nexts, sizeof(anqfits_ext_t));
+    for (i=0; i<nexts; i++) {
+        exts[i].hdr_start  = get_int(&r);
+        exts[i].hdr_size   = get_int(&r);
+        exts[i].data_start = get_int(&r);
+        exts[i].data_size  = get_int(&r);
+        // Everything must lie within the index data.
+        if (((int64_t)exts[i].data_start + exts[i].data_size) * FITS_BLOCK_SIZE >
+            src.length)
+            r.bad = TRUE;
+    }
+    get_index(&r, &meta);
+    if (r.bad)
+        goto bailout;
+
+    fits = anqfits_open_layout(src.filename, fd, offset, filesize, nexts, exts);
+    if (!fits)
+        goto bailout;
+
+    if (!(flags & INDEX_ONLY_LOAD_METADATA)) {
+        kd = get_tree(&r, fits);
+        if (!kd)
+            goto bailout;
+        starkd = calloc(1, sizeof(startree_t));
+        starkd->tree = kd;
+        starkd->sweep = chunk_data(kd->io, "sweep");
+
+        kd = get_tree(&r, fits);
+        if (!kd)
+            goto bailout;
+        codekd = calloc(1, sizeof(codetree_t));
+        codekd->tree = kd;
+
+        quads = get_quads(&r, fits);
+        if (!quads)
+            goto bailout;
+    }
+
+    free(exts);
+    free(buf);
+    free(fn);
+
+    dest->indexid = meta.indexid;
+    dest->healpix = meta.healpix;
+    dest->hpnside = meta.hpnside;
+    dest->index_jitter = meta.index_jitter;
+    dest->cutnside = meta.cutnside;
+    dest->cutnsweep = meta.cutnsweep;
+    dest->cutdedup = meta.cutdedup;
+    dest->cutband = meta.cutband;
+    dest->cutmargin = meta.cutmargin;
+    dest->circle = meta.circle;
+    dest->cx_less_than_dx = meta.cx_less_than_dx;
+    dest->meanx_less_than_half = meta.meanx_less_than_half;
+    dest->index_scale_upper = meta.index_scale_upper;
+    dest->index_scale_lower = meta.index_scale_lower;
+    dest->dimquads = meta.dimquads;
+    dest->nstars = meta.nstars;
+    dest->nquads = meta.nquads;
+    dest->fits = fits;
+    dest->starkd = starkd;
+    dest->codekd = codekd;
+    dest->quads = quads;
+    return 0;
+
+ bailout:
+    logverb("Not using index metadata file %s\n", fn);
+    startree_close(starkd);
+    codetree_close(codekd);
+    quadfile_close(quads);
+    if (fits)
+        anqfits_close(fits);
+    free(meta.cutband);
+    free(exts);
+    free(buf);
+    free(fn);
+    return -1;
+}
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "starkd.h"
@@ -125,7 +126,10 @@ void startree_search_for_radec(const startree_t* s, double ra, double dec, doubl
 void startree_search_for(const startree_t* s, const double* xyzcenter, double radius2,
                          double** xyzresults, double** radecresults,
                          int** starinds, int* nresults) {
-    kdtree_qres_t* res = NULL;
+    // verify makes many of these queries; reuse this thread's result buffers.
+    kdtree_qres_pool_t* pool = kdtree_qres_pool_thread();
+    kdtree_qres_t* pooled = NULL;
+    kdtree_qres_t* res;
     int opts;
     double* xyz;
     int i, N;
@@ -134,7 +138,14 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
     if (xyzresults || radecresults)
         opts |= KD_OPTIONS_RETURN_POINTS;
 
-    res = kdtree_rangesearch_options(s->tree, xyzcenter, radius2, opts);
+    if (pool) {
+        pooled = kdtree_qres_pool_get(pool);
+        res = pooled ? kdtree_rangesearch_options_reuse(s->tree, pooled, xyzcenter, radius2,
+                                                        opts | KD_OPTIONS_NO_RESIZE_RESULTS) : NULL;
+    } else {
+        // No pool for this thread: a one-off result.
+        res = kdtree_rangesearch_options(s->tree, xyzcenter, radius2, opts);
+    }
 	
     if (!res || !res->nres) {
         if (xyzresults)
@@ -144,9 +155,7 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
         if (starinds)
             *starinds = NULL;
         *nresults = 0;
-        if (res)
-            kdtree_free_query(res);
-        return;
+        goto done;
     }
 
     xyz = res->results.d;
@@ -159,16 +168,23 @@ void startree_search_for(const startree_t* s, const double* xyzcenter, double ra
             xyzarr2radecdegarr(xyz + i*3, (*radecresults) + i*2);
     }
     if (xyzresults) {
-        // Steal the results array.
-        *xyzresults = xyz;
-        res->results.d = NULL;
+        // Copy rather than steal the results array, so the buffer stays
+        // full-size for the next query.
+        *xyzresults = malloc(N * 3 * sizeof(double));
+        memcpy(*xyzresults, xyz, N * 3 * sizeof(double));
     }
     if (starinds) {
         *starinds = malloc(res->nres * sizeof(int));
         for (i=0; i<N; i++)
             (*starinds)[i] = res->inds[i];
     }
-    kdtree_free_query(res);
+
+ done:
+    // A failed search leaves "pooled" with us; it still goes back.
+    if (pool)
+        kdtree_qres_pool_put(pool, pooled);
+    else
+        kdtree_free_query(res);
 }
 
 
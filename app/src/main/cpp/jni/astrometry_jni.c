@@ -1,11 +1,14 @@
 #include <jni.h>
 #include <android/log.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
-#include "astrometry/simplexy.h"
-#include "astrometry/image2xy.h"
 #include "astrometry/log.h"
 #include "astrometry/solver.h"
 #include "astrometry/index.h"
@@ -14,18 +17,12 @@
 #include "astrometry/sip-utils.h"
 #include "astrometry/matchobj.h"
 
+#include "star_detect.h"
+
 #define LOG_TAG "AstrometryNative"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
-static int compare_floats(const void *a, const void *b) {
-    float fa = *(const float *)a;
-    float fb = *(const float *)b;
-    if (fa < fb) return -1;
-    if (fa > fb) return 1;
-    return 0;
-}
-
 JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved) {
     log_init(LOG_MSG);
     LOGI("Astrometry native library loaded");
@@ -49,359 +46,261 @@ Java_com_astro_app_native_1_AstrometryNative_detectStarsNative(
         return NULL;
     }
 
-    // Convert u8 grayscale to float, matching solve-field's code path.
-    // solve-field reads BITPIX=8 FITS as TFLOAT via cfitsio, so image2xy_run
-    // always receives float data. Using image_u8 produces different detection
-    // results (different star count and order).
-    int npix = width * height;
-    float* image_f = (float*)malloc(npix * sizeof(float));
-    if (!image_f) {
-        LOGE("Failed to allocate float image (%dx%d)", width, height);
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
+    int N = 0;
+    float* stars = detect_stars_u8((const unsigned char*)pixels, width, height,
+                                   plim, dpsf, downsample, &N);
+    (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
+    if (!stars) {
         return NULL;
     }
-    for (int i = 0; i < npix; i++) {
-        image_f[i] = (float)((unsigned char)pixels[i]);
-    }
-    (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
 
-    // Set up simplexy parameters
-    simplexy_t params;
-    memset(&params, 0, sizeof(simplexy_t));
-    simplexy_fill_in_defaults(&params);
-
-    params.image = image_f;
-    params.nx = width;
-    params.ny = height;
-    params.dpsf = dpsf;
-    params.plim = plim;
-    params.dlim = 1.0;
-    params.saddle = 5.0;
-    params.maxper = 1000;
-    params.maxnpeaks = 100000;
-    params.maxsize = 2000;
-    params.halfbox = 100;
-
-    LOGI("Running image2xy on %dx%d image (float), downsample=%d, plim=%.1f, dpsf=%.1f",
-         width, height, downsample, plim, dpsf);
-
-    // Adaptive plim retry: if too few stars detected, retry with lower threshold.
-    // plim=8 is conservative; astrometry.net's u8 default is plim=4.
-    float plim_values[3];
-    int num_plim = 0;
-    plim_values[num_plim++] = plim;
-    if (6.0f < plim) plim_values[num_plim++] = 6.0f;
-    if (4.0f < plim) plim_values[num_plim++] = 4.0f;
-    int MIN_STARS_RETRY = 30;
-
-    float* current_image = image_f;  // Track current image buffer for cleanup
-    int prev_npeaks = 0;
-
-    for (int attempt = 0; attempt < num_plim; attempt++) {
-        if (attempt > 0) {
-            prev_npeaks = params.npeaks;
-            // Re-copy float image since simplexy modifies it internally
-            simplexy_free_contents(&params);  // Also frees params.image (== current_image)
-            memset(&params, 0, sizeof(simplexy_t));
-            simplexy_fill_in_defaults(&params);
-            float* image_f2 = (float*)malloc(npix * sizeof(float));
-            if (!image_f2) {
-                LOGE("Failed to allocate float image for retry");
-                return NULL;
-            }
-            jbyte* pixels2 = (*env)->GetByteArrayElements(env, imageData, NULL);
-            if (!pixels2) {
-                free(image_f2);
-                LOGE("Failed to re-get image data for retry");
-                return NULL;
-            }
-            for (int i = 0; i < npix; i++) {
-                image_f2[i] = (float)((unsigned char)pixels2[i]);
-            }
-            (*env)->ReleaseByteArrayElements(env, imageData, pixels2, JNI_ABORT);
-            current_image = image_f2;
-            params.image = image_f2;
-            params.nx = width;
-            params.ny = height;
-            params.dpsf = dpsf;
-            params.plim = plim_values[attempt];
-            params.dlim = 1.0;
-            params.saddle = 5.0;
-            params.maxper = 1000;
-            params.maxnpeaks = 100000;
-            params.maxsize = 2000;
-            params.halfbox = 100;
-            LOGI("Retry %d: plim=%.1f (previous had %d stars < %d)",
-                 attempt, plim_values[attempt], prev_npeaks, MIN_STARS_RETRY);
-        }
+    // Create result array: [x0, y0, flux0, x1, y1, flux1, ...]
+    jfloatArray resultArray = (*env)->NewFloatArray(env, N * 3);
+    if (resultArray) {
+        (*env)->SetFloatArrayRegion(env, resultArray, 0, N * 3, stars);
+    }
+    free(stars);
+    return resultArray;
+}
 
-        int result = image2xy_run(&params, downsample, 0);
-        if (result != 0) {
-            LOGE("Star detection failed (result=%d)", result);
-            simplexy_free_contents(&params);
-            return NULL;
-        }
+// ============================================================================
+// SOLVER STATISTICS
+// ============================================================================
+
+// Per-index, per-depth statistics of the most recent solveFieldNative call,
+// flattened STATS_STRIDE values per entry (see put_stats).
+#define STATS_STRIDE 17
+
+static pthread_mutex_t last_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double* last_stats = NULL;
+static int last_stats_n = 0;
+
+static void put_stats(double* out, const solver_stats_t* st) {
+    out[0] = st->indexid;
+    out[1] = st->healpix;
+    out[2] = st->startobj;
+    out[3] = st->endobj;
+    out[4] = st->numtries;
+    out[5] = st->nummatches;
+    out[6] = st->numscaleok;
+    out[7] = st->num_cxdx_skipped;
+    out[8] = st->num_meanx_skipped;
+    out[9] = st->num_radec_skipped;
+    out[10] = st->num_abscale_skipped;
+    out[11] = st->num_prefilter_rejected;
+    out[12] = st->num_verified;
+    out[13] = st->time_quads;
+    out[14] = st->time_search;
+    out[15] = st->time_fit;
+    out[16] = st->time_verify;
+}
 
-        if (params.npeaks >= MIN_STARS_RETRY || attempt == num_plim - 1) {
-            break;
-        }
+// Logs a per-depth summary and keeps the entries for getLastSolveStatsNative.
+static void save_solver_stats(const solver_t* solver) {
+    int n = solver_n_stats(solver);
+    double* flat = (n > 0) ? malloc((size_t)n * STATS_STRIDE * sizeof(double)) : NULL;
+    if (n > 0 && !flat) {
+        LOGE("Failed to allocate solver statistics");
+        n = 0;
     }
-
-    if (params.npeaks == 0) {
-        LOGE("No stars found after all plim attempts");
-        simplexy_free_contents(&params);
-        return NULL;
+    for (int i = 0; i < n; i++) {
+        const solver_stats_t* st = solver_get_stats(solver, i);
+        put_stats(flat + (size_t)i * STATS_STRIDE, st);
+        if (st->numtries == 0) {
+            continue;
+        }
+        LOGI("Stats %d-%d index %d: %d quads, %d matches, %d verified (%d prefiltered); "
+             "quads %.1f ms, search %.1f ms, fit %.1f ms, verify %.1f ms",
+             st->startobj + 1, st->endobj, st->indexid, st->numtries, st->nummatches,
+             st->num_verified, st->num_prefilter_rejected,
+             st->time_quads * 1e3, st->time_search * 1e3,
+             st->time_fit * 1e3, st->time_verify * 1e3);
     }
 
-    LOGI("Detected %d stars (plim=%.1f)", params.npeaks, params.plim);
-
-    // Filter detections: reject edge stars and hot pixels
-    {
-        int N_raw = params.npeaks;
-        int MIN_REMAIN = 30;
+    pthread_mutex_lock(&last_stats_lock);
+    free(last_stats);
+    last_stats = flat;
+    last_stats_n = n;
+    pthread_mutex_unlock(&last_stats_lock);
+}
 
-        // Edge margin: max(10px, 1% of dimension)
-        float margin_x = width * 0.01f;
-        if (margin_x < 10.0f) margin_x = 10.0f;
-        float margin_y = height * 0.01f;
-        if (margin_y < 10.0f) margin_y = 10.0f;
+JNIEXPORT jdoubleArray JNICALL
+Java_com_astro_app_native_1_AstrometryNative_getLastSolveStatsNative(
+    JNIEnv *env,
+    jclass clazz
+) {
+    pthread_mutex_lock(&last_stats_lock);
+    int len = last_stats_n * STATS_STRIDE;
+    jdoubleArray arr = (*env)->NewDoubleArray(env, len);
+    if (arr && len > 0) {
+        (*env)->SetDoubleArrayRegion(env, arr, 0, len, last_stats);
+    }
+    pthread_mutex_unlock(&last_stats_lock);
+    return arr;
+}
 
-        // Compute median flux via partial sort (selection algorithm)
-        float* flux_copy = malloc(N_raw * sizeof(float));
-        if (!flux_copy) {
-            LOGE("flux_copy malloc failed (%d floats), skipping edge/hot-pixel filter", N_raw);
-        } else {
-            memcpy(flux_copy, params.flux, N_raw * sizeof(float));
-            qsort(flux_copy, N_raw, sizeof(float), compare_floats);
-            float median_flux = flux_copy[N_raw / 2];
-            float hot_threshold = 50.0f * median_flux;
-            free(flux_copy);
-
-            // Single-pass filter with array compaction
-            int kept = 0;
-            for (int i = 0; i < N_raw; i++) {
-                // Edge check
-                if (params.x[i] < margin_x || params.x[i] > width - margin_x ||
-                    params.y[i] < margin_y || params.y[i] > height - margin_y) {
-                    continue;
-                }
-                // Hot pixel check
-                if (median_flux > 0 && params.flux[i] > hot_threshold) {
-                    continue;
-                }
-                // Safety floor: stop filtering if we'd go below minimum
-                // (count remaining unfiltered stars)
-                if (kept < MIN_REMAIN && (N_raw - i + kept) <= MIN_REMAIN) {
-                    // Keep all remaining to avoid going below floor
-                    for (int j = i; j < N_raw && kept < N_raw; j++) {
-                        if (j != kept) {
-                            params.x[kept] = params.x[j];
-                            params.y[kept] = params.y[j];
-                            params.flux[kept] = params.flux[j];
-                            if (params.background) params.background[kept] = params.background[j];
-                        }
-                        kept++;
-                    }
-                    break;
-                }
-                if (i != kept) {
-                    params.x[kept] = params.x[i];
-                    params.y[kept] = params.y[i];
-                    params.flux[kept] = params.flux[i];
-                    if (params.background) params.background[kept] = params.background[i];
-                }
-                kept++;
-            }
-            int filtered = N_raw - kept;
-            if (filtered > 0) {
-                LOGI("Filtered %d detections (edge/hot pixel), %d remaining", filtered, kept);
-                params.npeaks = kept;
-            }
-        }
+// ============================================================================
+// INDEX LOADING
+// ============================================================================
+
+// An index path is either a file name or "container#offset:length" for an
+// index stored inside a larger file, such as an uncompressed asset in the
+// APK (see AstrometryNative.indexInContainer). The latter is mmapped in
+// place rather than copied out first.
+static index_t* load_index(const char* path, int flags) {
+    const char* hash = strrchr(path, '#');
+    long long offset, length;
+    int end = 0;
+    if (!hash || sscanf(hash + 1, "%lld:%lld%n", &offset, &length, &end) != 2 ||
+        hash[1 + end] != '\0') {
+        return index_load(path, flags, NULL);
     }
 
-    int N = params.npeaks;
-
-    // Resort stars using solve-field's interleaved merge algorithm
-    // (from resort-xylist.c). This interleaves two orderings:
-    // 1. Sorted by background-subtracted flux (descending)
-    // 2. Sorted by raw flux (flux + background) (descending)
-    // This ensures the brightest stars appear first in the list,
-    // which is critical for the solver's depth iteration.
-    int* perm1 = malloc(N * sizeof(int));  // flux-sorted indices
-    int* perm2 = malloc(N * sizeof(int));  // raw-signal-sorted indices
-    float* rawsignal = malloc(N * sizeof(float));
-    unsigned char* used = calloc(N, 1);
-    int* output_order = malloc(N * sizeof(int));
-
-    if (!perm1 || !perm2 || !rawsignal || !used || !output_order) {
-        LOGE("Failed to allocate resort buffers");
-        free(perm1); free(perm2); free(rawsignal); free(used); free(output_order);
-        simplexy_free_contents(&params);
+    char* container = strndup(path, hash - path);
+    if (!container) {
         return NULL;
     }
-
-    // Initialize permutation arrays as identity
-    for (int i = 0; i < N; i++) {
-        perm1[i] = i;
-        perm2[i] = i;
-        rawsignal[i] = params.flux[i] + params.background[i];
+    int fd = open(container, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Failed to open %s: %s", container, strerror(errno));
+        free(container);
+        return NULL;
     }
+    // The index keeps its own descriptor.
+    index_t* idx = index_load_fd(fd, (off_t)offset, (off_t)length, path, flags, NULL);
+    close(fd);
+    free(container);
+    return idx;
+}
 
-    // Sort perm1 by flux descending (simple insertion sort, N is small ~700)
-    for (int i = 1; i < N; i++) {
-        int key = perm1[i];
-        float keyval = params.flux[key];
-        int j = i - 1;
-        while (j >= 0 && params.flux[perm1[j]] < keyval) {
-            perm1[j + 1] = perm1[j];
-            j--;
-        }
-        perm1[j + 1] = key;
-    }
+// ============================================================================
+// INDEX METADATA CACHE
+// ============================================================================
 
-    // Sort perm2 by rawsignal descending
-    for (int i = 1; i < N; i++) {
-        int key = perm2[i];
-        float keyval = rawsignal[key];
-        int j = i - 1;
-        while (j >= 0 && rawsignal[perm2[j]] < keyval) {
-            perm2[j + 1] = perm2[j];
-            j--;
-        }
-        perm2[j + 1] = key;
-    }
+// Every solve loads its indexes afresh. With a cache directory set, the
+// FITS headers of each index are parsed once, and later loads read a small
+// metadata file instead (see index_meta.h).
 
-    // Interleave: for each rank, emit perm1[i] then perm2[i] (skip used)
-    int out_idx = 0;
-    for (int i = 0; i < N && out_idx < N; i++) {
-        if (!used[perm1[i]]) {
-            used[perm1[i]] = 1;
-            output_order[out_idx++] = perm1[i];
-        }
-        if (out_idx < N && !used[perm2[i]]) {
-            used[perm2[i]] = 1;
-            output_order[out_idx++] = perm2[i];
-        }
+JNIEXPORT void JNICALL
+Java_com_astro_app_native_1_AstrometryNative_setIndexCacheDirNative(
+    JNIEnv *env,
+    jclass clazz,
+    jstring cacheDir
+) {
+    if (!cacheDir) {
+        index_set_meta_cache_dir(NULL);
+        return;
     }
+    const char* dir = (*env)->GetStringUTFChars(env, cacheDir, NULL);
+    if (!dir) {
+        return;
+    }
+    index_set_meta_cache_dir(dir);
+    LOGI("Index metadata cache: %s", dir);
+    (*env)->ReleaseStringUTFChars(env, cacheDir, dir);
+}
 
-    LOGI("Resorted %d stars (interleaved flux/rawsignal)", out_idx);
-
-    // Uniformize: spatially distribute stars across grid bins (matching
-    // solve-field's uniformize.py). Round-robin interleaves bins so that
-    // early stars span the entire field, enabling the solver to form
-    // field-spanning quads immediately instead of clustering in one area.
-    {
-        float xmin = params.x[output_order[0]], xmax = xmin;
-        float ymin = params.y[output_order[0]], ymax = ymin;
-        for (int i = 1; i < N; i++) {
-            int s = output_order[i];
-            if (params.x[s] < xmin) xmin = params.x[s];
-            if (params.x[s] > xmax) xmax = params.x[s];
-            if (params.y[s] < ymin) ymin = params.y[s];
-            if (params.y[s] > ymax) ymax = params.y[s];
-        }
-        float Wf = xmax - xmin;
-        float Hf = ymax - ymin;
-
-        if (Wf > 0 && Hf > 0) {
-            int UNIFORMIZE_N = 10;
-            int NX = (int)(Wf / sqrtf(Wf * Hf / (float)UNIFORMIZE_N) + 0.5f);
-            if (NX < 1) NX = 1;
-            int NY = (int)((float)UNIFORMIZE_N / (float)NX + 0.5f);
-            if (NY < 1) NY = 1;
-            int nbins = NX * NY;
-
-            LOGI("Uniformize: %dx%d bins", NX, NY);
-
-            int* bin_counts = calloc(nbins, sizeof(int));
-            int* bin_assign = malloc(N * sizeof(int));
-
-            for (int i = 0; i < N; i++) {
-                int s = output_order[i];
-                int ix = (int)((params.x[s] - xmin) / Wf * NX);
-                int iy = (int)((params.y[s] - ymin) / Hf * NY);
-                if (ix >= NX) ix = NX - 1;
-                if (iy >= NY) iy = NY - 1;
-                if (ix < 0) ix = 0;
-                if (iy < 0) iy = 0;
-                bin_assign[i] = iy * NX + ix;
-                bin_counts[bin_assign[i]]++;
-            }
-
-            int maxlen = 0;
-            for (int b = 0; b < nbins; b++)
-                if (bin_counts[b] > maxlen) maxlen = bin_counts[b];
-
-            int** bin_lists = malloc(nbins * sizeof(int*));
-            int* bin_pos = calloc(nbins, sizeof(int));
-            for (int b = 0; b < nbins; b++)
-                bin_lists[b] = malloc(bin_counts[b] * sizeof(int));
-            for (int i = 0; i < N; i++) {
-                int b = bin_assign[i];
-                bin_lists[b][bin_pos[b]++] = i;
-            }
-
-            int* uniform_order = malloc(N * sizeof(int));
-            int u_idx = 0;
-            int* thisrow = malloc(nbins * sizeof(int));
-            for (int round = 0; round < maxlen; round++) {
-                int rowlen = 0;
-                for (int b = 0; b < nbins; b++) {
-                    if (round < bin_counts[b])
-                        thisrow[rowlen++] = bin_lists[b][round];
-                }
-                // Sort by resort index (preserves brightness ordering within round)
-                for (int i = 1; i < rowlen; i++) {
-                    int key = thisrow[i];
-                    int j = i - 1;
-                    while (j >= 0 && thisrow[j] > key) { thisrow[j+1] = thisrow[j]; j--; }
-                    thisrow[j+1] = key;
-                }
-                for (int i = 0; i < rowlen; i++)
-                    uniform_order[u_idx++] = output_order[thisrow[i]];
+// ============================================================================
+// INDEX PREFETCH
+// ============================================================================
+
+// Index files are mmapped, so the first solve after app start pays for
+// faulting in the kd-tree pages one at a time. Reading them once on a
+// background thread puts them in the page cache, where the mappings made by
+// later solveFieldNative calls find them.
+
+typedef struct {
+    char** paths;
+    int n;
+} prefetch_job_t;
+
+static void* prefetch_thread(void* arg) {
+    prefetch_job_t* job = arg;
+    for (int i = 0; i < job->n; i++) {
+        index_t* idx = load_index(job->paths[i], 0);
+        if (!idx) {
+            LOGE("Prefetch: failed to load index: %s", job->paths[i]);
+        } else {
+            if (index_prefetch(idx, INDEX_PREFETCH_TOUCH)) {
+                LOGE("Prefetch: failed to prefetch index: %s", job->paths[i]);
             }
-
-            for (int i = 0; i < N; i++)
-                output_order[i] = uniform_order[i];
-
-            free(uniform_order);
-            free(thisrow);
-            for (int b = 0; b < nbins; b++) free(bin_lists[b]);
-            free(bin_lists);
-            free(bin_pos);
-            free(bin_counts);
-            free(bin_assign);
+            index_free(idx);
         }
+        free(job->paths[i]);
     }
+    LOGI("Prefetched %d index files", job->n);
+    free(job->paths);
+    free(job);
+    return NULL;
+}
 
-    // Create result array: [x0, y0, flux0, x1, y1, flux1, ...]
-    jfloatArray resultArray = (*env)->NewFloatArray(env, N * 3);
-    if (!resultArray) {
-        free(perm1); free(perm2); free(rawsignal); free(used); free(output_order);
-        simplexy_free_contents(&params);
-        return NULL;
+JNIEXPORT void JNICALL
+Java_com_astro_app_native_1_AstrometryNative_prefetchIndexesNative(
+    JNIEnv *env,
+    jclass clazz,
+    jobjectArray indexPaths
+) {
+    int n = (*env)->GetArrayLength(env, indexPaths);
+    prefetch_job_t* job = calloc(1, sizeof(prefetch_job_t));
+    if (!job || !(job->paths = calloc(n > 0 ? n : 1, sizeof(char*)))) {
+        LOGE("Failed to allocate index prefetch job");
+        free(job);
+        return;
     }
-
-    jfloat* buffer = malloc(N * 3 * sizeof(jfloat));
-    for (int i = 0; i < N; i++) {
-        int src = output_order[i];
-        buffer[i * 3] = params.x[src];
-        buffer[i * 3 + 1] = params.y[src];
-        buffer[i * 3 + 2] = params.flux[src];
+    for (int i = 0; i < n; i++) {
+        jstring jpath = (jstring)(*env)->GetObjectArrayElement(env, indexPaths, i);
+        const char* path = (*env)->GetStringUTFChars(env, jpath, NULL);
+        if (path) {
+            job->paths[job->n] = strdup(path);
+            if (job->paths[job->n]) {
+                job->n++;
+            }
+            (*env)->ReleaseStringUTFChars(env, jpath, path);
+        }
+        (*env)->DeleteLocalRef(env, jpath);
     }
 
-    (*env)->SetFloatArrayRegion(env, resultArray, 0, N * 3, buffer);
-
-    free(buffer);
-    free(perm1);
-    free(perm2);
-    free(rawsignal);
-    free(used);
-    free(output_order);
-    simplexy_free_contents(&params);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetch_thread, job)) {
+        LOGE("Failed to start index prefetch thread");
+        for (int i = 0; i < job->n; i++) {
+            free(job->paths[i]);
+        }
+        free(job->paths);
+        free(job);
+    }
+    pthread_attr_destroy(&attr);
+}
 
-    return resultArray;
+// ============================================================================
+// PLATE SOLVING
+// ============================================================================
+
+// Result array layout: the best solution, then the alternatives.
+#define RESULT_HEADER 12
+#define SOLUTION_STRIDE 14
+
+// Writes one solution as [ra, dec, crpixX, crpixY, cd11, cd12, cd21, cd22,
+// pixelScale, rotation, logOdds, nmatch, nconflict, indexId].
+static void put_solution(jdouble* out, const MatchObj* mo) {
+    const tan_t* tan = &mo->wcstan;
+    out[0] = tan->crval[0];
+    out[1] = tan->crval[1];
+    out[2] = tan->crpix[0];
+    out[3] = tan->crpix[1];
+    out[4] = tan->cd[0][0];
+    out[5] = tan->cd[0][1];
+    out[6] = tan->cd[1][0];
+    out[7] = tan->cd[1][1];
+    out[8] = tan_pixel_scale(tan);
+    out[9] = atan2(tan->cd[0][1], tan->cd[0][0]) * 180.0 / M_PI;
+    out[10] = mo->logodds;
+    out[11] = mo->nmatch;
+    out[12] = mo->nconflict;
+    out[13] = mo->indexid;
 }
 
 /*
@@ -409,6 +308,9 @@ Java_com_astro_app_native_1_AstrometryNative_detectStarsNative(
  *
  * solveFieldNative takes detected stars and index file paths, returns WCS result.
  * Result array format: [solved (0/1), ra, dec, crpixX, crpixY, cd11, cd12, cd21, cd22, pixelScale, rotation, logOdds]
+ * followed by [numSolutions] and numSolutions blocks of SOLUTION_STRIDE values
+ * (see put_solution): the best distinct solutions seen, best first, whether
+ * or not the field solved.
  *
  * This implements depth iteration like solve-field does:
  * - Tries stars 1-10, then 11-20, then 21-30, etc.
@@ -477,6 +379,7 @@ Java_com_astro_app_native_1_AstrometryNative_solveFieldNative(
     solver->distance_from_quad_bonus = TRUE;  // Explicit (default, but for clarity)
     solver->tweak_aborder = 2;           // Match solve-field default
     solver->tweak_abporder = 2;          // Match solve-field default
+    solver->collect_stats = TRUE;        // Per-depth timings, see getLastSolveStatsNative
 
     // Load index files
     int numIndexes = (*env)->GetArrayLength(env, indexPaths);
@@ -486,8 +389,11 @@ Java_com_astro_app_native_1_AstrometryNative_solveFieldNative(
         jstring jpath = (jstring)(*env)->GetObjectArrayElement(env, indexPaths, i);
         const char* path = (*env)->GetStringUTFChars(env, jpath, NULL);
 
-        index_t* idx = index_load(path, 0, NULL);
+        index_t* idx = load_index(path, INDEX_REORDER_TREES);
         if (idx) {
+            // Pages not already cached by prefetchIndexesNative start
+            // loading now, while the solver sets up.
+            index_prefetch(idx, INDEX_PREFETCH_TREES);
             solver_add_index(solver, idx);
             LOGI("Loaded index: %s", path);
         } else {
@@ -542,9 +448,14 @@ Java_com_astro_app_native_1_AstrometryNative_solveFieldNative(
         }
     }
 
+    // Alternative solutions (the first is normally the accepted one)
+    MatchObj solutions[DEFAULT_MAX_SOLUTIONS];
+    int numSolutions = solver_get_solutions(solver, solutions, DEFAULT_MAX_SOLUTIONS);
+
     // Create result array
-    jdoubleArray resultArray = (*env)->NewDoubleArray(env, 12);
-    jdouble result[12] = {0};
+    int resultLen = RESULT_HEADER + 1 + numSolutions * SOLUTION_STRIDE;
+    jdoubleArray resultArray = (*env)->NewDoubleArray(env, resultLen);
+    jdouble result[RESULT_HEADER + 1 + DEFAULT_MAX_SOLUTIONS * SOLUTION_STRIDE] = {0};
 
     if (solved) {
         MatchObj* mo = solver_get_best_match(solver);
@@ -572,7 +483,19 @@ Java_com_astro_app_native_1_AstrometryNative_solveFieldNative(
         LOGI("NOT SOLVED after all depths");
     }
 
-    (*env)->SetDoubleArrayRegion(env, resultArray, 0, 12, result);
+    result[RESULT_HEADER] = numSolutions;
+    for (int i = 0; i < numSolutions; i++) {
+        put_solution(result + RESULT_HEADER + 1 + i * SOLUTION_STRIDE, solutions + i);
+        LOGI("Solution %d: RA=%.4f, Dec=%.4f, logodds=%.1f, %d matches, index %d",
+             i, solutions[i].wcstan.crval[0], solutions[i].wcstan.crval[1],
+             solutions[i].logodds, solutions[i].nmatch, solutions[i].indexid);
+    }
+
+    if (resultArray) {
+        (*env)->SetDoubleArrayRegion(env, resultArray, 0, resultLen, result);
+    }
+
+    save_solver_stats(solver);
 
     // Cleanup
     solver_free(solver);
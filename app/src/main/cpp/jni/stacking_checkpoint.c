@@ -0,0 +1,307 @@
+#include <android/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "stacking_checkpoint.h"
+
+#define LOG_TAG "StackCheckpoint"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Section alignment. Tiles start on a page so that untouched tiles stay
+// holes in the sparse file.
+#define SECTION_ALIGN 64
+#define TILES_ALIGN 4096
+
+// Journal fields are read back after the process died at an arbitrary
+// point, so each update must reach the mapping after the data it covers.
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+
+static uint64_t align_up(uint64_t v, uint64_t a) {
+    return (v + a - 1) / a * a;
+}
+
+// ============================================================================
+// LAYOUT
+// ============================================================================
+
+static void compute_layout(stack_checkpoint_header_t* h) {
+    uint64_t tile_pix = (uint64_t)h->tile * h->tile;
+    uint64_t off = align_up(sizeof(stack_checkpoint_header_t), TILES_ALIGN);
+    h->off_tiles = off;
+    off += (uint64_t)h->tiles_x * h->tiles_y * tile_pix * sizeof(float);
+    off = align_up(off, SECTION_ALIGN);
+    h->off_regions = off;
+    off += (uint64_t)h->max_frames * h->region_bytes;
+    off = align_up(off, SECTION_ALIGN);
+    h->off_ref_stars = off;
+    off += (uint64_t)h->max_ref_stars * 3 * sizeof(float);
+    off = align_up(off, SECTION_ALIGN);
+    h->off_ref_triangles = off;
+    off += (uint64_t)h->max_ref_triangles * h->triangle_bytes;
+    off = align_up(off, SECTION_ALIGN);
+    h->off_journal_pixels = off;
+    off += (uint64_t)h->width * h->height;
+    off = align_up(off, SECTION_ALIGN);
+    h->off_journal_row = off;
+    off += (uint64_t)h->width * sizeof(float);
+    h->file_bytes = align_up(off, SECTION_ALIGN);
+}
+
+// Maps the whole file and points the section pointers into it, using the
+// layout in `h` (the mapped header may not have been written yet).
+static stack_checkpoint_t* map_checkpoint(int fd, const stack_checkpoint_header_t* h) {
+    size_t size = (size_t)h->file_bytes;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        LOGE("mmap of %zu bytes failed: %s", size, strerror(errno));
+        return NULL;
+    }
+    stack_checkpoint_t* ck = (stack_checkpoint_t*)calloc(1, sizeof(stack_checkpoint_t));
+    if (!ck) {
+        munmap(map, size);
+        return NULL;
+    }
+    ck->fd = fd;
+    ck->map = map;
+    ck->mapsize = size;
+    ck->header = (stack_checkpoint_header_t*)map;
+
+    char* base = (char*)map;
+    ck->tiles = (float*)(base + h->off_tiles);
+    ck->regions = base + h->off_regions;
+    ck->ref_stars = (float*)(base + h->off_ref_stars);
+    ck->ref_triangles = base + h->off_ref_triangles;
+    ck->journal_pixels = (unsigned char*)(base + h->off_journal_pixels);
+    ck->journal_row = (float*)(base + h->off_journal_row);
+    return ck;
+}
+
+// ============================================================================
+// CREATE / OPEN / CLOSE
+// ============================================================================
+
+stack_checkpoint_t* stack_checkpoint_create(const char* path,
+                                            const stack_checkpoint_header_t* geom)
+{
+    if (geom->width <= 0 || geom->height <= 0 || geom->tile <= 0 || geom->max_frames <= 0) {
+        LOGE("Invalid checkpoint geometry");
+        return NULL;
+    }
+
+    stack_checkpoint_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STACK_CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.version = STACK_CHECKPOINT_VERSION;
+    h.header_bytes = sizeof(stack_checkpoint_header_t);
+    h.width = geom->width;
+    h.height = geom->height;
+    h.tile = geom->tile;
+    h.tiles_x = geom->tiles_x;
+    h.tiles_y = geom->tiles_y;
+    h.max_frames = geom->max_frames;
+    h.max_ref_stars = geom->max_ref_stars;
+    h.max_ref_triangles = geom->max_ref_triangles;
+    h.region_bytes = geom->region_bytes;
+    h.triangle_bytes = geom->triangle_bytes;
+    h.combine_mode = geom->combine_mode;
+    h.align_model = geom->align_model;
+    h.journal_backup_row = -1;
+    compute_layout(&h);
+
+    if ((uint64_t)(size_t)h.file_bytes != h.file_bytes) {
+        LOGE("Checkpoint too large for this address space: %llu bytes",
+             (unsigned long long)h.file_bytes);
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        LOGE("Failed to create checkpoint %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    // Sparse: sections are zero until written
+    if (ftruncate(fd, (off_t)h.file_bytes)) {
+        LOGE("Failed to size checkpoint to %llu bytes: %s",
+             (unsigned long long)h.file_bytes, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    stack_checkpoint_t* ck = map_checkpoint(fd, &h);
+    if (!ck) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    // The magic goes in with the rest of the header; an all-zero file
+    // (killed before this point) is rejected on open.
+    memcpy(ck->header, &h, sizeof(h));
+
+    LOGI("Checkpoint %s: %dx%d, %d frames, %llu bytes (sparse)",
+         path, h.width, h.height, h.max_frames, (unsigned long long)h.file_bytes);
+    return ck;
+}
+
+stack_checkpoint_t* stack_checkpoint_open(const char* path) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        LOGE("Failed to open checkpoint %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    stack_checkpoint_header_t h;
+    struct stat st;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+        LOGE("Failed to read checkpoint header from %s", path);
+        close(fd);
+        return NULL;
+    }
+    if (memcmp(h.magic, STACK_CHECKPOINT_MAGIC, sizeof(h.magic)) ||
+        h.version != STACK_CHECKPOINT_VERSION ||
+        h.header_bytes != sizeof(stack_checkpoint_header_t)) {
+        LOGE("%s is not a version %d stacking checkpoint", path, STACK_CHECKPOINT_VERSION);
+        close(fd);
+        return NULL;
+    }
+
+    // Recompute the layout rather than trusting stored offsets
+    stack_checkpoint_header_t expect = h;
+    compute_layout(&expect);
+    if (h.width <= 0 || h.height <= 0 || h.tile <= 0 || h.max_frames <= 0 ||
+        expect.file_bytes != h.file_bytes || expect.off_journal_row != h.off_journal_row ||
+        (uint64_t)st.st_size < h.file_bytes ||
+        h.frame_count < 0 || h.frame_count > h.max_frames ||
+        h.num_ref_stars < 0 || h.num_ref_stars > h.max_ref_stars ||
+        h.num_ref_triangles < 0 || h.num_ref_triangles > h.max_ref_triangles) {
+        LOGE("Checkpoint %s is inconsistent (size %lld)", path, (long long)st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    stack_checkpoint_t* ck = map_checkpoint(fd, &h);
+    if (!ck) {
+        close(fd);
+        return NULL;
+    }
+    LOGI("Reopened checkpoint %s: %dx%d, %d frames", path, h.width, h.height, h.frame_count);
+    return ck;
+}
+
+void stack_checkpoint_close(stack_checkpoint_t* ck) {
+    if (!ck) {
+        return;
+    }
+    msync(ck->map, ck->mapsize, MS_SYNC);
+    munmap(ck->map, ck->mapsize);
+    close(ck->fd);
+    free(ck);
+}
+
+void stack_checkpoint_sync(stack_checkpoint_t* ck) {
+    msync(ck->map, ck->mapsize, MS_ASYNC);
+}
+
+float* stack_checkpoint_tile(const stack_checkpoint_t* ck, int i) {
+    size_t tile_pix = (size_t)ck->header->tile * ck->header->tile;
+    return ck->tiles + (size_t)i * tile_pix;
+}
+
+int stack_checkpoint_set_reference(stack_checkpoint_t* ck, const float* stars, int num_stars,
+                                   const void* triangles, int num_triangles)
+{
+    stack_checkpoint_header_t* h = ck->header;
+    if (num_stars > h->max_ref_stars || num_triangles > h->max_ref_triangles) {
+        LOGE("Reference too large for checkpoint (%d stars, %d triangles)",
+             num_stars, num_triangles);
+        return 0;
+    }
+    memcpy(ck->ref_stars, stars, (size_t)num_stars * 3 * sizeof(float));
+    memcpy(ck->ref_triangles, triangles, (size_t)num_triangles * h->triangle_bytes);
+    PUBLISH(h->num_ref_triangles, num_triangles);
+    PUBLISH(h->num_ref_stars, num_stars);
+    return 1;
+}
+
+// ============================================================================
+// JOURNAL
+// ============================================================================
+
+void stack_checkpoint_begin_frame(stack_checkpoint_t* ck, const unsigned char* pixels) {
+    stack_checkpoint_header_t* h = ck->header;
+    memcpy(ck->journal_pixels, pixels, (size_t)h->width * h->height);
+    PUBLISH(h->journal_frame, h->frame_count);
+    PUBLISH(h->journal_rows_done, 0);
+    PUBLISH(h->journal_backup_row, -1);
+    PUBLISH(h->journal_active, 1);
+}
+
+// Copies row y's sums (across all tiles) to or from the backup row.
+static void copy_row(stack_checkpoint_t* ck, int y, int to_backup) {
+    const stack_checkpoint_header_t* h = ck->header;
+    int ty = y / h->tile;
+    int ly = y % h->tile;
+    for (int tx = 0; tx < h->tiles_x; tx++) {
+        int x0 = tx * h->tile;
+        int cols = h->width - x0;
+        if (cols > h->tile) cols = h->tile;
+        float* sums = stack_checkpoint_tile(ck, ty * h->tiles_x + tx) + (size_t)ly * h->tile;
+        if (to_backup) {
+            memcpy(ck->journal_row + x0, sums, cols * sizeof(float));
+        } else {
+            memcpy(sums, ck->journal_row + x0, cols * sizeof(float));
+        }
+    }
+}
+
+void stack_checkpoint_save_row(stack_checkpoint_t* ck, int y) {
+    copy_row(ck, y, 1);
+    PUBLISH(ck->header->journal_backup_row, y);
+}
+
+void stack_checkpoint_row_done(stack_checkpoint_t* ck, int y) {
+    PUBLISH(ck->header->journal_rows_done, y + 1);
+}
+
+void stack_checkpoint_commit_frame(stack_checkpoint_t* ck) {
+    stack_checkpoint_header_t* h = ck->header;
+    // frame_count first: a frame whose count is published is never redone
+    PUBLISH(h->frame_count, h->journal_frame + 1);
+    PUBLISH(h->journal_active, 0);
+    stack_checkpoint_sync(ck);
+}
+
+void stack_checkpoint_cancel_frame(stack_checkpoint_t* ck) {
+    PUBLISH(ck->header->journal_active, 0);
+}
+
+int stack_checkpoint_recover(stack_checkpoint_t* ck) {
+    stack_checkpoint_header_t* h = ck->header;
+    if (!h->journal_active) {
+        return -1;
+    }
+    if (h->frame_count != h->journal_frame) {
+        // Killed between publishing the count and clearing the journal
+        PUBLISH(h->journal_active, 0);
+        return -1;
+    }
+    int y = h->journal_rows_done;
+    if (y < 0 || y > h->height) {
+        LOGE("Corrupt journal (rows done %d); dropping interrupted frame", y);
+        PUBLISH(h->journal_active, 0);
+        return -1;
+    }
+    if (h->journal_backup_row == y && y < h->height) {
+        LOGI("Restoring half-updated row %d", y);
+        copy_row(ck, y, 0);
+    }
+    LOGI("Resuming interrupted frame %d from row %d", h->journal_frame, y);
+    return y;
+}
@@ -0,0 +1,119 @@
+#ifndef STACKING_CHECKPOINT_H
+#define STACKING_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory-mapped checkpoint of a stacking session, so a session survives the
+// process being killed and can be reopened without re-aligning any frame.
+//
+// The accumulator tiles live in the file itself (the file is sparse: tiles
+// no frame has touched cost no disk and no RSS, and the kernel may page
+// resident tiles out). Reference stars/triangles, frame footprints and the
+// frame count are kept alongside:
+//
+//   file = header | tiles | regions | ref stars | ref triangles
+//        | journal pixels | journal row
+//
+// Record layouts (regions, triangles) belong to the caller; their sizes are
+// stored in the header and checked on reopen.
+//
+// Adding a frame is journaled so an interrupted frame can be completed on
+// resume: the source pixels are copied into the journal first, then every
+// accumulator row is backed up before it is modified and marked done after.
+// On reopen, a row caught mid-update is restored from its backup and the
+// frame is rolled forward from the first unfinished row.
+
+#define STACK_CHECKPOINT_MAGIC "ASTKCKPT"
+#define STACK_CHECKPOINT_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+
+    // Geometry (fixed at creation)
+    int32_t width;
+    int32_t height;
+    int32_t tile;             // Accumulator tile edge (pixels)
+    int32_t tiles_x;
+    int32_t tiles_y;
+    int32_t max_frames;       // Capacity of the region table
+    int32_t max_ref_stars;
+    int32_t max_ref_triangles;
+    uint32_t region_bytes;
+    uint32_t triangle_bytes;
+
+    // Session settings
+    int32_t combine_mode;
+    int32_t align_model;
+
+    // Committed state
+    int32_t frame_count;
+    int32_t num_ref_stars;
+    int32_t num_ref_triangles;
+
+    // Journal of the frame being added
+    int32_t journal_active;
+    int32_t journal_frame;      // Index the frame will take (== frame_count while active)
+    int32_t journal_rows_done;  // Rows [0, rows_done) fully accumulated
+    int32_t journal_backup_row; // Row whose previous sums are in the backup, or -1
+
+    uint64_t off_tiles;
+    uint64_t off_regions;
+    uint64_t off_ref_stars;
+    uint64_t off_ref_triangles;
+    uint64_t off_journal_pixels;
+    uint64_t off_journal_row;
+    uint64_t file_bytes;
+} stack_checkpoint_header_t;
+
+typedef struct {
+    int fd;
+    void* map;
+    size_t mapsize;
+
+    stack_checkpoint_header_t* header;
+    float* tiles;                   // tiles_x * tiles_y tiles of tile*tile sums
+    void* regions;                  // max_frames records of region_bytes
+    float* ref_stars;               // max_ref_stars * [x, y, flux]
+    void* ref_triangles;            // max_ref_triangles records of triangle_bytes
+    unsigned char* journal_pixels;  // width * height
+    float* journal_row;             // width sums
+} stack_checkpoint_t;
+
+// Creates (or truncates) the checkpoint at `path`. Only the geometry fields
+// and session settings of `geom` are used. Returns NULL on failure.
+stack_checkpoint_t* stack_checkpoint_create(const char* path,
+                                            const stack_checkpoint_header_t* geom);
+
+// Maps an existing checkpoint. Returns NULL if it is missing or malformed.
+stack_checkpoint_t* stack_checkpoint_open(const char* path);
+
+// Flushes and unmaps. The file is kept.
+void stack_checkpoint_close(stack_checkpoint_t* ck);
+
+// Schedules write-back of dirty pages (does not wait).
+void stack_checkpoint_sync(stack_checkpoint_t* ck);
+
+// Accumulator tile i (row-major tile index).
+float* stack_checkpoint_tile(const stack_checkpoint_t* ck, int i);
+
+// Stores the reference stars ([x, y, flux] * n) and triangles.
+int stack_checkpoint_set_reference(stack_checkpoint_t* ck, const float* stars, int num_stars,
+                                   const void* triangles, int num_triangles);
+
+// Journaling. begin copies the frame's pixels; the frame's region must
+// already be in regions[frame_count].
+void stack_checkpoint_begin_frame(stack_checkpoint_t* ck, const unsigned char* pixels);
+void stack_checkpoint_save_row(stack_checkpoint_t* ck, int y);
+void stack_checkpoint_row_done(stack_checkpoint_t* ck, int y);
+void stack_checkpoint_commit_frame(stack_checkpoint_t* ck);
+void stack_checkpoint_cancel_frame(stack_checkpoint_t* ck);
+
+// On reopen: if a frame was interrupted, undoes any half-updated row and
+// returns the row to resume from (the pixels are in journal_pixels and the
+// region in regions[journal_frame]). Returns -1 if there is nothing to redo.
+int stack_checkpoint_recover(stack_checkpoint_t* ck);
+
+#endif
@@ -0,0 +1,358 @@
+#include <android/log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "astrometry/ioutils.h"
+#include "stacking_framestore.h"
+
+#define LOG_TAG "FrameStore"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+#define TILE FRAME_STORE_TILE
+#define TILE_PIX (FRAME_STORE_TILE * FRAME_STORE_TILE)
+
+// ============================================================================
+// MAPPING HELPERS
+// ============================================================================
+
+// Maps [start, start+size) of the scratch file. Returns a pointer to `start`
+// (not to the page-aligned mapping base, which is returned in *pmap).
+static void* map_range(frame_store_t* fs, size_t start, size_t size, int prot,
+                       void** pmap, size_t* pmapsize)
+{
+    off_t mapstart;
+    size_t mapsize;
+    int gap;
+    get_mmap_size(start, size, &mapstart, &mapsize, &gap);
+
+    void* map = mmap(NULL, mapsize, prot, MAP_SHARED, fs->fd, mapstart);
+    if (map == MAP_FAILED) {
+        LOGE("mmap failed (offset %lld, size %zu): %s",
+             (long long)mapstart, mapsize, strerror(errno));
+        return NULL;
+    }
+    *pmap = map;
+    *pmapsize = mapsize;
+    return (char*)map + gap;
+}
+
+static size_t slot_offset(const frame_store_t* fs, int band, int frame) {
+    return (size_t)band * fs->band_bytes + (size_t)frame * fs->slot_bytes;
+}
+
+static void unmap_slot(frame_store_t* fs) {
+    if (fs->map) {
+        munmap(fs->map, fs->mapsize);
+    }
+    fs->map = NULL;
+    fs->mapsize = 0;
+    fs->slot = NULL;
+    fs->cur_band = -1;
+}
+
+// ============================================================================
+// OPEN / CLOSE
+// ============================================================================
+
+static frame_store_t* frame_store_alloc(int width, int height, int max_frames) {
+    if (width <= 0 || height <= 0 || max_frames <= 0 || max_frames > FRAME_STORE_MAX_FRAMES) {
+        LOGE("Invalid frame store geometry: %dx%d, %d frames", width, height, max_frames);
+        return NULL;
+    }
+
+    frame_store_t* fs = (frame_store_t*)calloc(1, sizeof(frame_store_t));
+    if (!fs) {
+        LOGE("Failed to allocate frame store");
+        return NULL;
+    }
+    fs->width = width;
+    fs->height = height;
+    fs->max_frames = max_frames;
+    fs->tiles_x = (width + TILE - 1) / TILE;
+    fs->num_bands = (height + TILE - 1) / TILE;
+    fs->slot_bytes = (size_t)fs->tiles_x * TILE_PIX * sizeof(uint16_t);
+    fs->band_bytes = fs->slot_bytes * (size_t)max_frames;
+    fs->cur_band = -1;
+    fs->fd = -1;
+    return fs;
+}
+
+static off_t frame_store_bytes(const frame_store_t* fs) {
+    return (off_t)fs->band_bytes * fs->num_bands;
+}
+
+frame_store_t* frame_store_open(const char* dir, int width, int height, int max_frames) {
+    if (!dir) {
+        dir = "/tmp";
+    }
+    frame_store_t* fs = frame_store_alloc(width, height, max_frames);
+    if (!fs) {
+        return NULL;
+    }
+
+    // Not create_temp_file(): that calls exit() on failure.
+    char* path = NULL;
+    asprintf_safe(&path, "%s/tmp.framestore.XXXXXX", dir);
+    if (!path) {
+        LOGE("Failed to build scratch file name");
+        free(fs);
+        return NULL;
+    }
+    fs->fd = mkstemp(path);
+    if (fs->fd == -1) {
+        LOGE("Failed to create scratch file %s: %s", path, strerror(errno));
+        free(path);
+        free(fs);
+        return NULL;
+    }
+    // The store is private to this session; let the kernel reclaim it when
+    // the descriptor is closed (including if the process is killed).
+    unlink(path);
+    free(path);
+
+    off_t total = frame_store_bytes(fs);
+    if (ftruncate(fs->fd, total)) {
+        LOGE("Failed to size scratch file to %lld bytes: %s",
+             (long long)total, strerror(errno));
+        close(fs->fd);
+        free(fs);
+        return NULL;
+    }
+
+    LOGI("Frame store: %dx%d, up to %d frames, %d bands x %d tiles, %lld bytes on disk",
+         width, height, max_frames, fs->num_bands, fs->tiles_x, (long long)total);
+    return fs;
+}
+
+frame_store_t* frame_store_open_file(const char* path, int width, int height, int max_frames,
+                                     int resume_frames)
+{
+    frame_store_t* fs = frame_store_alloc(width, height, max_frames);
+    if (!fs) {
+        return NULL;
+    }
+    if (resume_frames > max_frames) {
+        LOGE("Cannot resume %d frames in a store of %d", resume_frames, max_frames);
+        free(fs);
+        return NULL;
+    }
+
+    off_t total = frame_store_bytes(fs);
+    if (resume_frames < 0) {
+        fs->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    } else {
+        fs->fd = open(path, O_RDWR);
+    }
+    if (fs->fd == -1) {
+        LOGE("Failed to open frame store %s: %s", path, strerror(errno));
+        free(fs);
+        return NULL;
+    }
+
+    if (resume_frames < 0) {
+        if (ftruncate(fs->fd, total)) {
+            LOGE("Failed to size frame store to %lld bytes: %s",
+                 (long long)total, strerror(errno));
+            close(fs->fd);
+            unlink(path);
+            free(fs);
+            return NULL;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fs->fd, &st) || st.st_size != total) {
+            LOGE("Frame store %s does not match %dx%d x %d frames", path,
+                 width, height, max_frames);
+            close(fs->fd);
+            free(fs);
+            return NULL;
+        }
+        fs->num_frames = resume_frames;
+    }
+
+    LOGI("Frame store %s: %dx%d, %d of %d frames", path, width, height,
+         fs->num_frames, max_frames);
+    return fs;
+}
+
+void frame_store_close(frame_store_t* fs) {
+    if (!fs) {
+        return;
+    }
+    unmap_slot(fs);
+    if (fs->fd != -1) {
+        close(fs->fd);
+    }
+    free(fs);
+}
+
+int frame_store_is_full(const frame_store_t* fs) {
+    return fs->num_frames >= fs->max_frames;
+}
+
+// ============================================================================
+// WRITING FRAMES
+// ============================================================================
+
+int frame_store_begin_frame(frame_store_t* fs) {
+    if (fs->writing) {
+        LOGE("begin_frame: a frame is already being written");
+        return 0;
+    }
+    if (frame_store_is_full(fs)) {
+        LOGE("begin_frame: store is full (%d frames)", fs->max_frames);
+        return 0;
+    }
+    fs->writing = 1;
+    fs->cur_band = -1;
+    return 1;
+}
+
+int frame_store_put_row(frame_store_t* fs, int y, const float* row) {
+    if (!fs->writing || y < 0 || y >= fs->height) {
+        return 0;
+    }
+    int band = y / TILE;
+    if (band != fs->cur_band) {
+        unmap_slot(fs);
+        fs->slot = (uint16_t*)map_range(fs, slot_offset(fs, band, fs->num_frames),
+                                        fs->slot_bytes, PROT_READ | PROT_WRITE,
+                                        &fs->map, &fs->mapsize);
+        if (!fs->slot) {
+            return 0;
+        }
+        fs->cur_band = band;
+    }
+
+    uint16_t* dst = fs->slot + (size_t)(y % TILE) * TILE;
+    for (int tx = 0; tx < fs->tiles_x; tx++) {
+        int x0 = tx * TILE;
+        int n = fs->width - x0;
+        if (n > TILE) n = TILE;
+        uint16_t* tile_row = dst + (size_t)tx * TILE_PIX;
+        for (int i = 0; i < n; i++) {
+            float v = row[x0 + i];
+            if (v < 0.0f) {
+                tile_row[i] = FRAME_STORE_NO_DATA;
+            } else {
+                if (v > 255.0f) v = 255.0f;
+                tile_row[i] = (uint16_t)(v * 256.0f + 0.5f);
+            }
+        }
+    }
+    return 1;
+}
+
+int frame_store_end_frame(frame_store_t* fs) {
+    if (!fs->writing) {
+        return 0;
+    }
+    unmap_slot(fs);
+    fs->writing = 0;
+    fs->num_frames++;
+    return 1;
+}
+
+void frame_store_abort_frame(frame_store_t* fs) {
+    unmap_slot(fs);
+    fs->writing = 0;
+}
+
+// ============================================================================
+// COMBINING
+// ============================================================================
+
+static void sort_u16(uint16_t* v, int n) {
+    // Insertion sort: n is the number of stacked frames (small).
+    for (int i = 1; i < n; i++) {
+        uint16_t key = v[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > key) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = key;
+    }
+}
+
+int frame_store_combine_percentile(frame_store_t* fs, double percentile,
+                                   unsigned char* out)
+{
+    if (fs->writing) {
+        LOGE("combine: a frame is still being written");
+        return 0;
+    }
+    int nframes = fs->num_frames;
+    if (nframes == 0) {
+        return 0;
+    }
+    if (percentile < 0.0) percentile = 0.0;
+    if (percentile > 100.0) percentile = 100.0;
+
+    uint16_t vals[FRAME_STORE_MAX_FRAMES];
+
+    for (int band = 0; band < fs->num_bands; band++) {
+        // One mapping covers this band for all committed frames.
+        void* map;
+        size_t mapsize;
+        const uint16_t* base = (const uint16_t*)map_range(
+            fs, slot_offset(fs, band, 0), fs->slot_bytes * (size_t)nframes,
+            PROT_READ, &map, &mapsize);
+        if (!base) {
+            return 0;
+        }
+        madvise(map, mapsize, MADV_SEQUENTIAL);
+
+        size_t slot_elems = fs->slot_bytes / sizeof(uint16_t);
+        int y0 = band * TILE;
+        int rows = fs->height - y0;
+        if (rows > TILE) rows = TILE;
+
+        for (int tx = 0; tx < fs->tiles_x; tx++) {
+            int x0 = tx * TILE;
+            int cols = fs->width - x0;
+            if (cols > TILE) cols = TILE;
+            const uint16_t* tile = base + (size_t)tx * TILE_PIX;
+
+            for (int ly = 0; ly < rows; ly++) {
+                unsigned char* orow = out + (size_t)(y0 + ly) * fs->width + x0;
+                for (int lx = 0; lx < cols; lx++) {
+                    size_t p = (size_t)ly * TILE + lx;
+                    int n = 0;
+                    for (int f = 0; f < nframes; f++) {
+                        uint16_t v = tile[(size_t)f * slot_elems + p];
+                        if (v != FRAME_STORE_NO_DATA) {
+                            vals[n++] = v;
+                        }
+                    }
+                    if (n == 0) {
+                        orow[lx] = 0;
+                        continue;
+                    }
+                    sort_u16(vals, n);
+                    // Linear interpolation between the bracketing order statistics.
+                    double pos = percentile / 100.0 * (n - 1);
+                    int lo = (int)pos;
+                    int hi = (lo + 1 < n) ? lo + 1 : lo;
+                    double frac = pos - lo;
+                    double v = (vals[lo] * (1.0 - frac) + vals[hi] * frac) / 256.0;
+                    int iv = (int)(v + 0.5);
+                    if (iv > 255) iv = 255;
+                    orow[lx] = (unsigned char)iv;
+                }
+            }
+        }
+        munmap(map, mapsize);
+    }
+
+    LOGI("Combined %d frames at percentile %.1f", nframes, percentile);
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef STACKING_FRAMESTORE_H
+#define STACKING_FRAMESTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Disk-backed store of aligned (warped) frames for order-statistic combining
+// (median / percentile) without holding N full frames in memory.
+//
+// Frames are written to an unlinked scratch file as 8.8 fixed-point samples.
+// The file is organised as horizontal bands of FRAME_STORE_TILE rows; within
+// a band, each frame owns one contiguous slot of FRAME_STORE_TILE x
+// FRAME_STORE_TILE tiles:
+//
+//   file = band[0] band[1] ...
+//   band = slot[frame 0] slot[frame 1] ... slot[max_frames - 1]
+//   slot = tile[0] tile[1] ... tile[tiles_x - 1]
+//
+// Writing a frame maps one slot at a time; combining maps one band (all
+// frames) at a time, so the resident working set is bounded by
+// max_frames * width * FRAME_STORE_TILE * 2 bytes regardless of image height.
+
+#define FRAME_STORE_TILE 64
+#define FRAME_STORE_MAX_FRAMES 256
+
+// Sample value marking a pixel that fell outside the warped frame.
+#define FRAME_STORE_NO_DATA 0xFFFF
+
+typedef struct {
+    int width;
+    int height;
+    int max_frames;
+    int num_frames;     // Frames committed so far
+
+    int tiles_x;
+    int num_bands;
+    size_t slot_bytes;  // One frame's share of one band
+    size_t band_bytes;  // max_frames * slot_bytes
+
+    int fd;
+
+    // Write cursor: the frame being written and its currently-mapped slot.
+    int writing;
+    int cur_band;
+    void* map;
+    size_t mapsize;
+    uint16_t* slot;
+} frame_store_t;
+
+// Creates a scratch file in `dir` (unlinked immediately, so it disappears
+// with the process). Returns NULL on failure.
+frame_store_t* frame_store_open(const char* dir, int width, int height, int max_frames);
+
+// Opens a store in a named file that outlives the process (used by
+// checkpointed sessions). resume_frames < 0 creates (truncates) the file;
+// otherwise an existing file is reopened with its first resume_frames frames
+// treated as committed.
+frame_store_t* frame_store_open_file(const char* path, int width, int height, int max_frames,
+                                     int resume_frames);
+
+void frame_store_close(frame_store_t* fs);
+
+int frame_store_is_full(const frame_store_t* fs);
+
+// Frame writing: begin, then put every row y = 0..height-1 in order, then end.
+// Row samples are pixel values in [0, 255]; negative values mean "no data".
+int frame_store_begin_frame(frame_store_t* fs);
+int frame_store_put_row(frame_store_t* fs, int y, const float* row);
+int frame_store_end_frame(frame_store_t* fs);
+
+// Drops a frame started with frame_store_begin_frame without committing it.
+void frame_store_abort_frame(frame_store_t* fs);
+
+// Combines all committed frames per pixel, taking the given percentile
+// (0..100; 50 = median) of the valid samples. Writes width*height bytes.
+// Pixels with no valid samples are set to 0.
+int frame_store_combine_percentile(frame_store_t* fs, double percentile,
+                                   unsigned char* out);
+
+#endif
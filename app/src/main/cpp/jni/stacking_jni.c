@@ -5,15 +5,23 @@
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "astrometry/starxy.h"
 #include "astrometry/kdtree.h"
+#include "astrometry/sip.h"
+#include "astrometry/fit-wcs.h"
+#include "astrometry/gslutils.h"
 #include "gsl/gsl_matrix.h"
 #include "gsl/gsl_vector.h"
 #include "gsl/gsl_linalg.h"
 #include "gsl/gsl_blas.h"
 #include "gsl/gsl_errno.h"
 
+#include "stacking_checkpoint.h"
+#include "stacking_framestore.h"
+#include "star_detect.h"
+
 #define LOG_TAG "StackingNative"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
@@ -25,6 +33,32 @@
 #define RANSAC_ITERATIONS 500      // Number of RANSAC iterations
 #define RANSAC_INLIER_THRESHOLD 3.0  // 3 pixels reprojection error threshold
 #define MAX_STACKING_STARS 50      // Use top 50 brightest stars for alignment
+#define ACCUM_TILE 64              // Accumulator tile edge (pixels)
+#define ACCUM_TILE_PIX (ACCUM_TILE * ACCUM_TILE)
+#define REGION_MARGIN 0.01         // Slack (px) when classifying whole tiles against a frame's footprint
+#define REMAP_STEP 16              // Remap grid node spacing (pixels); divides ACCUM_TILE
+#define REMAP_NODES (ACCUM_TILE / REMAP_STEP + 1)
+
+// Alignment models (must match StackingNative.ALIGN_*)
+#define ALIGN_AFFINE 0             // RANSAC affine only
+#define ALIGN_HOMOGRAPHY 1         // Projective refit on the RANSAC inliers
+#define ALIGN_POLYNOMIAL 2         // SIP-style polynomial refit (lens distortion)
+#define ALIGN_POLY_ORDER 3         // Highest polynomial order tried
+#define ALIGN_POINTS_PER_PARAM 2   // Inliers required per fitted coefficient
+#define ALIGN_REFINE_PASSES 2      // Refit / re-select inlier rounds
+#define ALIGN_PLANE_SCALE (1.0 / 3600.0)  // deg/px of the synthetic TAN used for SIP fitting
+
+// Combine modes (must match StackingNative.COMBINE_*)
+#define COMBINE_MEAN 0             // Running sum / count accumulator
+#define COMBINE_MEDIAN 1           // Per-pixel median from the disk-backed frame store
+
+// Pipelined session: per-frame status (must match StackingNative.FRAME_*)
+#define FRAME_STACKED 0
+#define FRAME_DETECTION_FAILED 1
+#define FRAME_ALIGNMENT_FAILED 2
+#define FRAME_ERROR 3
+#define FRAME_RESULT_LEN 6         // [success, inliers, rms, frameCount, status, starCount]
+#define PIPELINE_MAX_DEPTH 16      // Upper bound on frames buffered per queue
 
 // Triangle descriptor: scale-invariant side-length ratios
 typedef struct {
@@ -46,6 +80,44 @@ typedef struct {
     double a, b, c, d, tx, ty;
 } affine_t;
 
+// Reference pixel -> source frame pixel, for one of the ALIGN_* models.
+// The polynomial follows the SIP convention:
+//   src = ref + SUM a[p][q] * u^p * v^q,  (u, v) = ref - (cx, cy),  p+q <= order
+// (constant and linear terms included, so it subsumes the affine part).
+typedef struct {
+    int model;        // ALIGN_* actually fitted (may be simpler than requested)
+    affine_t aff;     // ALIGN_AFFINE
+    double h[9];      // ALIGN_HOMOGRAPHY, row-major
+    int order;        // ALIGN_POLYNOMIAL
+    double cx, cy;
+    double a[ALIGN_POLY_ORDER + 1][ALIGN_POLY_ORDER + 1];
+    double b[ALIGN_POLY_ORDER + 1][ALIGN_POLY_ORDER + 1];
+} warp_model_t;
+
+// Footprint of one stacked frame in reference coordinates. Per-pixel frame
+// counts are re-derived from these instead of being stored.
+typedef struct {
+    int identity;       // Reference frame: covers every pixel
+    warp_model_t warp;  // Reference pixel -> source frame pixel
+} frame_region_t;
+
+// Source positions of a tile's remap grid nodes, (REMAP_NODES)^2 row-major.
+// Pixels between nodes are interpolated bilinearly, so warping costs the
+// same per pixel whatever the alignment model.
+typedef struct {
+    float sx[REMAP_NODES * REMAP_NODES];
+    float sy[REMAP_NODES * REMAP_NODES];
+} remap_grid_t;
+
+// Footprint classes of the accumulated frames against one tile, kept in step
+// with the region list so resolving the tile need not re-classify every frame.
+typedef struct {
+    int full;      // Frames covering every pixel of the tile
+    int npartial;  // Frames covering part of it...
+    int cap;
+    int* partial;  // ...by index into the region list
+} tile_tally_t;
+
 // Stacking context (accumulator + reference frame info)
 typedef struct {
     int width;
@@ -53,15 +125,41 @@ typedef struct {
     int is_color;
     int frame_count;
 
-    // Accumulator (grayscale only for now)
-    float* sum_r;     // Running sum of pixel values
-    int* count;       // Per-pixel frame count
+    // Accumulator (grayscale only for now): running sums in ACCUM_TILE x
+    // ACCUM_TILE tiles, allocated on first touch. 4 bytes per resident pixel.
+    int tiles_x;
+    int tiles_y;
+    float** sum_tiles;
+
+    // One footprint per accumulated frame (frame_count entries)
+    frame_region_t* regions;
+    int regions_cap;
+
+    // One tally per tile over those footprints; allocated with the first
+    // frame, and rebuilt from the regions when a checkpoint is resumed.
+    tile_tally_t* tallies;
+
+    // Order-statistic combining (COMBINE_MEDIAN): warped frames are also
+    // written to a disk-backed frame store. NULL in COMBINE_MEAN mode.
+    int combine_mode;
+    frame_store_t* store;
+
+    // Requested ALIGN_* model for frames after the reference
+    int align_model;
+
+    // Checkpointed session: sum tiles and regions point into the mapped
+    // checkpoint file instead of the heap. NULL otherwise.
+    stack_checkpoint_t* checkpoint;
 
     // Reference frame info (first frame's stars)
     triangle_t* ref_triangles;
     int num_ref_triangles;
     float* ref_stars;  // [x, y, flux] * N
     int num_ref_stars;
+
+    // Detection/warp threads while a pipelined session runs, else NULL.
+    // While set, only the warp thread touches the accumulator.
+    struct stacking_pipeline* pipeline;
 } stacking_context_t;
 
 // ============================================================================
@@ -124,6 +222,28 @@ static triangle_t* form_triangles(float* stars, int num_stars, int* out_num_tria
         return NULL;
     }
 
+    // Nearest neighbours come from a kd-tree over the stars used (the
+    // tree permutes its copy of the coordinates, not "stars").
+    double* xy = (double*)malloc((size_t)max_use_stars * 2 * sizeof(double));
+    if (!xy) {
+        LOGE("Failed to allocate star coordinates");
+        free(triangles);
+        *out_num_triangles = 0;
+        return NULL;
+    }
+    for (int i = 0; i < max_use_stars; i++) {
+        xy[i * 2] = stars[i * 3];
+        xy[i * 2 + 1] = stars[i * 3 + 1];
+    }
+    kdtree_t* kd = kdtree_build(NULL, xy, max_use_stars, 2, 8, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    if (!kd) {
+        LOGE("Failed to build star kd-tree");
+        free(xy);
+        free(triangles);
+        *out_num_triangles = 0;
+        return NULL;
+    }
+
     int tri_idx = 0;
 
     // For each star (only use top MAX_STACKING_STARS)
@@ -131,42 +251,27 @@ static triangle_t* form_triangles(float* stars, int num_stars, int* out_num_tria
         float xi = stars[i * 3];
         float yi = stars[i * 3 + 1];
 
-        // Find NUM_NEIGHBORS nearest neighbors (brute force is fast for 50 stars)
-        typedef struct { float d2; int idx; } neighbor_t;
-        neighbor_t neighbors[MAX_STACKING_STARS];
-        int num_neighbors = 0;
-
-        for (int j = 0; j < max_use_stars; j++) {
-            if (i == j) continue;
-            float xj = stars[j * 3];
-            float yj = stars[j * 3 + 1];
-            float d2 = dist2(xi, yi, xj, yj);
-            neighbors[num_neighbors].d2 = d2;
-            neighbors[num_neighbors].idx = j;
-            num_neighbors++;
-        }
-
-        // Sort by distance (simple insertion sort, N is small)
-        for (int a = 1; a < num_neighbors; a++) {
-            neighbor_t key = neighbors[a];
-            int b = a - 1;
-            while (b >= 0 && neighbors[b].d2 > key.d2) {
-                neighbors[b + 1] = neighbors[b];
-                b--;
-            }
-            neighbors[b + 1] = key;
+        // Find NUM_NEIGHBORS nearest neighbors, nearest first; ask for one
+        // more since the star itself is among them.
+        double query[2] = { xi, yi };
+        int knn_inds[NUM_NEIGHBORS + 1];
+        double knn_d2[NUM_NEIGHBORS + 1];
+        int num_found = kdtree_knn(kd, query, NUM_NEIGHBORS + 1, HUGE_VAL, knn_inds, knn_d2);
+
+        int neighbors[NUM_NEIGHBORS];
+        int use_neighbors = 0;
+        for (int n = 0; n < num_found && use_neighbors < NUM_NEIGHBORS; n++) {
+            if (knn_inds[n] != i)
+                neighbors[use_neighbors++] = knn_inds[n];
         }
 
-        // Take first NUM_NEIGHBORS
-        int use_neighbors = (num_neighbors < NUM_NEIGHBORS) ? num_neighbors : NUM_NEIGHBORS;
-
         // Form triangles: C(use_neighbors, 2) pairs with star i
         for (int a = 0; a < use_neighbors; a++) {
             for (int b = a + 1; b < use_neighbors; b++) {
                 if (tri_idx >= max_triangles) break;
 
-                int idx_a = neighbors[a].idx;
-                int idx_b = neighbors[b].idx;
+                int idx_a = neighbors[a];
+                int idx_b = neighbors[b];
 
                 // Compute side lengths.
                 // Each side is "opposite" one vertex:
@@ -208,6 +313,8 @@ static triangle_t* form_triangles(float* stars, int num_stars, int* out_num_tria
         }
     }
 
+    kdtree_free(kd);
+    free(xy);
     *out_num_triangles = tri_idx;
     return triangles;
 }
@@ -216,13 +323,94 @@ static triangle_t* form_triangles(float* stars, int num_stars, int* out_num_tria
 // TRIANGLE MATCHING
 // ============================================================================
 
+static int compare_pair_ind(const void* v1, const void* v2) {
+    unsigned int i1 = ((const kdtree_match_t*)v1)->ind;
+    unsigned int i2 = ((const kdtree_match_t*)v2)->ind;
+    return (i1 > i2) - (i1 < i2);
+}
+
+// Finds the (new, reference) triangle pairs whose ratios may match, sorted by
+// new then reference triangle, with single-precision kd-tree searches over
+// the reference ratios. The search radius covers the whole +-tolerance box;
+// the caller applies the exact test. Returns the number of pairs, or -1.
+static int find_ratio_pairs(const triangle_t* ref_tri, int num_ref_tri,
+                            const triangle_t* new_tri, int num_new_tri,
+                            kdtree_match_t** out_pairs)
+{
+    *out_pairs = NULL;
+    if (num_ref_tri == 0 || num_new_tri == 0) {
+        return 0;
+    }
+
+    // (The tree permutes ref_ratios; match indices are still reference
+    // triangle indices.)
+    float* ref_ratios = (float*)malloc((size_t)num_ref_tri * 2 * sizeof(float));
+    if (!ref_ratios) {
+        return -1;
+    }
+    for (int j = 0; j < num_ref_tri; j++) {
+        ref_ratios[j * 2] = ref_tri[j].ratio1;
+        ref_ratios[j * 2 + 1] = ref_tri[j].ratio2;
+    }
+    kdtree_t* kd = kdtree_build(NULL, ref_ratios, num_ref_tri, 2, 8, KDTT_FLOAT,
+                                KD_BUILD_SPLIT);
+    if (!kd) {
+        free(ref_ratios);
+        return -1;
+    }
+
+    // Slightly more than 2*tol^2, so float rounding of the ratio differences
+    // can't drop a pair the exact test would accept.
+    float r2 = 2.0f * TRIANGLE_RATIO_TOLERANCE * TRIANGLE_RATIO_TOLERANCE * (1.0f + 1e-5f);
+    int cap = num_new_tri * 4;
+    int n = 0;
+    kdtree_match_t* pairs = (kdtree_match_t*)malloc((size_t)cap * sizeof(kdtree_match_t));
+    kdtree_qres_f_t* res = NULL;
+    for (int i = 0; pairs && i < num_new_tri; i++) {
+        float query[2] = { new_tri[i].ratio1, new_tri[i].ratio2 };
+        kdtree_qres_f_t* found = kdtree_rangesearch_float(kd, res, query, r2,
+                                                          KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+                                                          KD_OPTIONS_NO_RESIZE_RESULTS);
+        if (!found) {
+            n = -1;
+            break;
+        }
+        res = found;
+        if (n + (int)res->nres > cap) {
+            cap = 2 * (n + (int)res->nres);
+            kdtree_match_t* grown = (kdtree_match_t*)realloc(pairs, (size_t)cap * sizeof(kdtree_match_t));
+            if (!grown) {
+                n = -1;
+                break;
+            }
+            pairs = grown;
+        }
+        for (unsigned int k = 0; k < res->nres; k++) {
+            pairs[n + k].query = i;
+            pairs[n + k].ind = res->inds[k];
+            pairs[n + k].dist2 = res->sdists[k];
+        }
+        qsort(pairs + n, res->nres, sizeof(kdtree_match_t), compare_pair_ind);
+        n += res->nres;
+    }
+
+    kdtree_free_query_float(res);
+    kdtree_free(kd);
+    free(ref_ratios);
+    if (!pairs || n < 0) {
+        free(pairs);
+        return -1;
+    }
+    *out_pairs = pairs;
+    return n;
+}
+
 // Match triangles between reference and new frame, build correspondence list
 static correspondence_t* match_triangles(
     triangle_t* ref_tri, int num_ref_tri, float* ref_stars,
     triangle_t* new_tri, int num_new_tri, float* new_stars,
     int* out_num_correspondences)
 {
-    // Brute force matching (fast for ~500 triangles each)
     // Each matching triangle pair produces 3 correspondences; cap for memory safety
     int max_corr = num_ref_tri * num_new_tri * 3;
     if (max_corr > 10000) max_corr = 10000;
@@ -233,32 +421,42 @@ static correspondence_t* match_triangles(
         return NULL;
     }
 
+    kdtree_match_t* pairs;
+    int num_pairs = find_ratio_pairs(ref_tri, num_ref_tri, new_tri, num_new_tri, &pairs);
+    if (num_pairs < 0) {
+        LOGE("Failed to search triangle ratios");
+        free(corr);
+        *out_num_correspondences = 0;
+        return NULL;
+    }
+
     int corr_idx = 0;
     int total_tri_matches = 0;  // diagnostic: total triangle pairs that match by ratio
 
-    for (int i = 0; i < num_new_tri; i++) {
-        for (int j = 0; j < num_ref_tri; j++) {
-            // Check if ratios match within tolerance
-            if (fabsf(new_tri[i].ratio1 - ref_tri[j].ratio1) < TRIANGLE_RATIO_TOLERANCE &&
-                fabsf(new_tri[i].ratio2 - ref_tri[j].ratio2) < TRIANGLE_RATIO_TOLERANCE)
-            {
-                total_tri_matches++;
-                // Triangle match found - add 3 star correspondences
-                for (int k = 0; k < 3; k++) {
-                    if (corr_idx >= max_corr) break;
-
-                    int new_idx = new_tri[i].star_indices[k];
-                    int ref_idx = ref_tri[j].star_indices[k];
-
-                    corr[corr_idx].new_x = new_stars[new_idx * 3];
-                    corr[corr_idx].new_y = new_stars[new_idx * 3 + 1];
-                    corr[corr_idx].ref_x = ref_stars[ref_idx * 3];
-                    corr[corr_idx].ref_y = ref_stars[ref_idx * 3 + 1];
-                    corr_idx++;
-                }
+    for (int p = 0; p < num_pairs; p++) {
+        int i = pairs[p].query;
+        int j = (int)pairs[p].ind;
+        // Check if ratios match within tolerance
+        if (fabsf(new_tri[i].ratio1 - ref_tri[j].ratio1) < TRIANGLE_RATIO_TOLERANCE &&
+            fabsf(new_tri[i].ratio2 - ref_tri[j].ratio2) < TRIANGLE_RATIO_TOLERANCE)
+        {
+            total_tri_matches++;
+            // Triangle match found - add 3 star correspondences
+            for (int k = 0; k < 3; k++) {
+                if (corr_idx >= max_corr) break;
+
+                int new_idx = new_tri[i].star_indices[k];
+                int ref_idx = ref_tri[j].star_indices[k];
+
+                corr[corr_idx].new_x = new_stars[new_idx * 3];
+                corr[corr_idx].new_y = new_stars[new_idx * 3 + 1];
+                corr[corr_idx].ref_x = ref_stars[ref_idx * 3];
+                corr[corr_idx].ref_y = ref_stars[ref_idx * 3 + 1];
+                corr_idx++;
             }
         }
     }
+    free(pairs);
 
     *out_num_correspondences = corr_idx;
     LOGI("Found %d star correspondences from %d triangle matches (cap=%d)",
@@ -454,6 +652,296 @@ static int ransac_affine(correspondence_t* corr, int num_corr, affine_t* best_af
     return 1;
 }
 
+// ============================================================================
+// ALIGNMENT MODELS
+// ============================================================================
+
+// Map a reference pixel to source frame coordinates
+static void apply_warp(const warp_model_t* w, double x, double y, double* sx, double* sy) {
+    if (w->model == ALIGN_HOMOGRAPHY) {
+        double den = w->h[6] * x + w->h[7] * y + w->h[8];
+        *sx = (w->h[0] * x + w->h[1] * y + w->h[2]) / den;
+        *sy = (w->h[3] * x + w->h[4] * y + w->h[5]) / den;
+    } else if (w->model == ALIGN_POLYNOMIAL) {
+        double u = x - w->cx;
+        double v = y - w->cy;
+        double powu[ALIGN_POLY_ORDER + 1], powv[ALIGN_POLY_ORDER + 1];
+        powu[0] = powv[0] = 1.0;
+        for (int p = 1; p <= w->order; p++) {
+            powu[p] = powu[p - 1] * u;
+            powv[p] = powv[p - 1] * v;
+        }
+        double fuv = 0.0, guv = 0.0;
+        for (int p = 0; p <= w->order; p++) {
+            for (int q = 0; p + q <= w->order; q++) {
+                fuv += w->a[p][q] * powu[p] * powv[q];
+                guv += w->b[p][q] * powu[p] * powv[q];
+            }
+        }
+        *sx = x + fuv;
+        *sy = y + guv;
+    } else {
+        *sx = w->aff.a * x + w->aff.b * y + w->aff.tx;
+        *sy = w->aff.c * x + w->aff.d * y + w->aff.ty;
+    }
+}
+
+static void mat3_mul(const double* A, const double* B, double* C) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            C[i * 3 + j] = A[i * 3] * B[j] + A[i * 3 + 1] * B[3 + j] + A[i * 3 + 2] * B[6 + j];
+        }
+    }
+}
+
+// Similarity taking points to zero mean and mean distance sqrt(2)
+// (Hartley normalisation; keeps the DLT system well conditioned).
+static void normalising_transform(const double* xy, int n, double* T, double* Tinv) {
+    double mx = 0.0, my = 0.0, d = 0.0;
+    for (int i = 0; i < n; i++) {
+        mx += xy[2 * i];
+        my += xy[2 * i + 1];
+    }
+    mx /= n;
+    my /= n;
+    for (int i = 0; i < n; i++) {
+        d += hypot(xy[2 * i] - mx, xy[2 * i + 1] - my);
+    }
+    d /= n;
+    double s = (d > 0.0) ? M_SQRT2 / d : 1.0;
+    const double t[9] = { s, 0, -s * mx,  0, s, -s * my,  0, 0, 1 };
+    const double ti[9] = { 1 / s, 0, mx,  0, 1 / s, my,  0, 0, 1 };
+    memcpy(T, t, sizeof(t));
+    memcpy(Tinv, ti, sizeof(ti));
+}
+
+// Least-squares homography ref -> src (DLT with h22 = 1 in normalised coordinates).
+static int fit_homography(const stacking_context_t* ctx, const double* ref, const double* src,
+                          int n, warp_model_t* out)
+{
+    double Tr[9], Tri[9], Ts[9], Tsi[9];
+    normalising_transform(ref, n, Tr, Tri);
+    normalising_transform(src, n, Ts, Tsi);
+
+    gsl_matrix* A = gsl_matrix_alloc(2 * n, 8);
+    gsl_vector* b = gsl_vector_alloc(2 * n);
+    gsl_vector* x = NULL;
+    if (!A || !b) {
+        if (A) gsl_matrix_free(A);
+        if (b) gsl_vector_free(b);
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        double rx = Tr[0] * ref[2 * i] + Tr[2];
+        double ry = Tr[4] * ref[2 * i + 1] + Tr[5];
+        double sx = Ts[0] * src[2 * i] + Ts[2];
+        double sy = Ts[4] * src[2 * i + 1] + Ts[5];
+        const double row_x[8] = { rx, ry, 1, 0, 0, 0, -rx * sx, -ry * sx };
+        const double row_y[8] = { 0, 0, 0, rx, ry, 1, -rx * sy, -ry * sy };
+        for (int j = 0; j < 8; j++) {
+            gsl_matrix_set(A, 2 * i, j, row_x[j]);
+            gsl_matrix_set(A, 2 * i + 1, j, row_y[j]);
+        }
+        gsl_vector_set(b, 2 * i, sx);
+        gsl_vector_set(b, 2 * i + 1, sy);
+    }
+    int rtn = gslutils_solve_leastsquares_v(A, 1, b, &x, NULL);
+    gsl_matrix_free(A);
+    gsl_vector_free(b);
+    if (rtn || !x) {
+        if (x) gsl_vector_free(x);
+        return 0;
+    }
+
+    double Hn[9], tmp[9], H[9];
+    for (int j = 0; j < 8; j++) {
+        Hn[j] = gsl_vector_get(x, j);
+    }
+    Hn[8] = 1.0;
+    gsl_vector_free(x);
+
+    // Undo the normalisation: H = Ts^-1 * Hn * Tr
+    mat3_mul(Hn, Tr, tmp);
+    mat3_mul(Tsi, tmp, H);
+
+    // Reject fits whose horizon line crosses the frame: the denominator
+    // must keep one sign over the whole reference image.
+    const double cx[4] = { 0, ctx->width, 0, ctx->width };
+    const double cy[4] = { 0, 0, ctx->height, ctx->height };
+    double den0 = H[8];  // Denominator at the origin
+    if (fabs(den0) < 1e-12) {
+        return 0;
+    }
+    for (int k = 0; k < 4; k++) {
+        double den = H[6] * cx[k] + H[7] * cy[k] + H[8];
+        if (den / den0 < 0.1) {
+            return 0;
+        }
+    }
+
+    memset(out, 0, sizeof(warp_model_t));
+    out->model = ALIGN_HOMOGRAPHY;
+    for (int j = 0; j < 9; j++) {
+        out->h[j] = H[j] / den0;
+    }
+    return 1;
+}
+
+// Least-squares polynomial ref -> src of the given order, via the SIP fitter.
+// Source positions are lifted onto the sky through a synthetic TAN
+// projection; fit_sip_coefficients holds that TAN fixed, so the forward SIP
+// terms it returns are exactly the pixel-space polynomial we want.
+static int fit_polynomial(const stacking_context_t* ctx, const double* ref, const double* src,
+                          int n, int order, warp_model_t* out)
+{
+    tan_t plane;
+    memset(&plane, 0, sizeof(tan_t));
+    plane.crpix[0] = 0.5 * ctx->width;
+    plane.crpix[1] = 0.5 * ctx->height;
+    plane.cd[0][0] = ALIGN_PLANE_SCALE;
+    plane.cd[1][1] = ALIGN_PLANE_SCALE;
+    plane.imagew = ctx->width;
+    plane.imageh = ctx->height;
+
+    double* starxyz = (double*)malloc((size_t)n * 3 * sizeof(double));
+    if (!starxyz) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        tan_pixelxy2xyzarr(&plane, src[2 * i], src[2 * i + 1], starxyz + 3 * i);
+    }
+
+    sip_t sip;
+    int rtn = fit_sip_coefficients(starxyz, ref, NULL, n, &plane, order, 0, &sip);
+    free(starxyz);
+    if (rtn) {
+        return 0;
+    }
+
+    memset(out, 0, sizeof(warp_model_t));
+    out->model = ALIGN_POLYNOMIAL;
+    out->order = order;
+    out->cx = plane.crpix[0];
+    out->cy = plane.crpix[1];
+    for (int p = 0; p <= order; p++) {
+        for (int q = 0; p + q <= order; q++) {
+            out->a[p][q] = sip.a[p][q];
+            out->b[p][q] = sip.b[p][q];
+        }
+    }
+    return 1;
+}
+
+// Fit the requested model, stepping down (polynomial orders, then
+// homography) while there are too few inliers to constrain it.
+static int fit_warp(const stacking_context_t* ctx, int model, const double* ref,
+                    const double* src, int n, warp_model_t* out)
+{
+    if (model == ALIGN_POLYNOMIAL) {
+        for (int order = ALIGN_POLY_ORDER; order >= 2; order--) {
+            int ncoeffs = (order + 1) * (order + 2) / 2;
+            if (n >= ALIGN_POINTS_PER_PARAM * ncoeffs &&
+                fit_polynomial(ctx, ref, src, n, order, out)) {
+                return 1;
+            }
+        }
+    }
+    if (model == ALIGN_POLYNOMIAL || model == ALIGN_HOMOGRAPHY) {
+        // 8 parameters, two equations per point
+        if (n >= ALIGN_POINTS_PER_PARAM * 4 && fit_homography(ctx, ref, src, n, out)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reprojection test of a ref -> src model against every correspondence.
+// If ref/src are non-NULL the inliers are copied out as (x, y) pairs.
+// Returns the inlier count; *out_rms is the RMS error over the inliers.
+static int select_inliers(const warp_model_t* w, const correspondence_t* corr, int num_corr,
+                          double* ref, double* src, double* out_rms)
+{
+    int n = 0;
+    double sum_sq = 0.0;
+    for (int i = 0; i < num_corr; i++) {
+        double sx, sy;
+        apply_warp(w, corr[i].ref_x, corr[i].ref_y, &sx, &sy);
+        double dx = sx - corr[i].new_x;
+        double dy = sy - corr[i].new_y;
+        double err2 = dx * dx + dy * dy;
+        if (!(err2 < RANSAC_INLIER_THRESHOLD * RANSAC_INLIER_THRESHOLD)) {
+            continue;
+        }
+        if (ref) {
+            ref[2 * n] = corr[i].ref_x;
+            ref[2 * n + 1] = corr[i].ref_y;
+            src[2 * n] = corr[i].new_x;
+            src[2 * n + 1] = corr[i].new_y;
+        }
+        sum_sq += err2;
+        n++;
+    }
+    *out_rms = (n > 0) ? sqrt(sum_sq / n) : 0.0;
+    return n;
+}
+
+// Turn the RANSAC affine (new -> ref) into the warp model (ref -> new).
+// For ALIGN_HOMOGRAPHY / ALIGN_POLYNOMIAL the affine inliers seed a refit
+// with the richer model, whose own inliers (typically the distorted corner
+// stars the affine rejected) seed the next pass. A refit is kept only if it
+// does not lose inliers. On refinement *inliers / *rms are replaced by the
+// refined model's inlier count and inlier RMS.
+static int refine_alignment(const stacking_context_t* ctx, const correspondence_t* corr,
+                            int num_corr, const affine_t* aff, warp_model_t* warp,
+                            int* inliers, double* rms)
+{
+    memset(warp, 0, sizeof(warp_model_t));
+    warp->model = ALIGN_AFFINE;
+    if (!invert_affine(aff, &warp->aff)) {
+        LOGE("Failed to invert affine transform");
+        return 0;
+    }
+    if (ctx->align_model == ALIGN_AFFINE) {
+        return 1;
+    }
+
+    double* ref = (double*)malloc((size_t)num_corr * 2 * sizeof(double));
+    double* src = (double*)malloc((size_t)num_corr * 2 * sizeof(double));
+    if (!ref || !src) {
+        LOGE("Failed to allocate refinement buffers; keeping affine");
+        free(ref);
+        free(src);
+        return 1;
+    }
+
+    double best_rms;
+    int best_n = select_inliers(warp, corr, num_corr, ref, src, &best_rms);
+    for (int pass = 0; pass < ALIGN_REFINE_PASSES; pass++) {
+        warp_model_t trial;
+        if (!fit_warp(ctx, ctx->align_model, ref, src, best_n, &trial)) {
+            break;
+        }
+        double trial_rms;
+        int n = select_inliers(&trial, corr, num_corr, NULL, NULL, &trial_rms);
+        if (n < best_n || (n == best_n && trial_rms >= best_rms)) {
+            break;
+        }
+        *warp = trial;
+        best_rms = trial_rms;
+        best_n = select_inliers(warp, corr, num_corr, ref, src, &best_rms);
+    }
+    free(ref);
+    free(src);
+
+    if (warp->model != ALIGN_AFFINE) {
+        *inliers = best_n;
+        *rms = best_rms;
+    }
+    LOGI("Alignment model %d (order %d): %d inliers, RMS=%.2f px",
+         warp->model, warp->order, best_n, best_rms);
+    return 1;
+}
+
 // ============================================================================
 // BILINEAR INTERPOLATION & WARPING
 // ============================================================================
@@ -483,156 +971,436 @@ static float bilinear_sample(unsigned char* image, int width, int height, float
     return v0 * (1.0f - fy) + v1 * fy;
 }
 
-// Warp image to reference frame using affine transform and accumulate
-static void warp_and_accumulate(stacking_context_t* ctx, unsigned char* image,
-                               affine_t* aff)
-{
-    // Compute inverse affine (map reference pixels to new frame)
-    affine_t inv_aff;
-    if (!invert_affine(aff, &inv_aff)) {
-        LOGE("Failed to invert affine transform");
-        return;
-    }
-
-    int npix = ctx->width * ctx->height;
-
-    // For each pixel in reference frame
-    for (int y = 0; y < ctx->height; y++) {
-        for (int x = 0; x < ctx->width; x++) {
-            int idx = y * ctx->width + x;
+// ============================================================================
+// TILED ACCUMULATOR
+// ============================================================================
 
-            // Map to new frame coordinates
-            float src_x, src_y;
-            apply_affine(&inv_aff, (float)x, (float)y, &src_x, &src_y);
+// Same bounds test as the bilinear sampler: the source position must have a
+// full 2x2 neighbourhood inside the frame.
+static inline int source_in_bounds(const stacking_context_t* ctx, float src_x, float src_y) {
+    return src_x >= 0 && src_y >= 0 && src_x < ctx->width - 1 && src_y < ctx->height - 1;
+}
 
-            // Sample new frame with bilinear interpolation
-            if (src_x >= 0 && src_y >= 0 && src_x < ctx->width - 1 && src_y < ctx->height - 1) {
-                float value = bilinear_sample(image, ctx->width, ctx->height, src_x, src_y);
-                ctx->sum_r[idx] += value;
-                ctx->count[idx]++;
-            }
+// Source positions of the grid nodes of the tile at (x0, y0). Nodes run one
+// step past the tile's last pixel, so edge tiles may sample outside the image.
+static void build_remap_grid(const frame_region_t* r, int x0, int y0, remap_grid_t* g) {
+    for (int j = 0; j < REMAP_NODES; j++) {
+        for (int i = 0; i < REMAP_NODES; i++) {
+            double sx, sy;
+            apply_warp(&r->warp, x0 + i * REMAP_STEP, y0 + j * REMAP_STEP, &sx, &sy);
+            g->sx[j * REMAP_NODES + i] = (float)sx;
+            g->sy[j * REMAP_NODES + i] = (float)sy;
         }
     }
-
-    ctx->frame_count++;
 }
 
-// ============================================================================
-// JNI ENTRY POINTS
-// ============================================================================
-
-#ifndef STACKING_TESTING  /* Skip JNI entry points when unit-testing static functions */
+// Source positions of row `ly` of a tile (ACCUM_TILE entries), interpolated
+// from the grid. Warping and footprint counting both go through here, so
+// they agree exactly on which pixels a frame covers.
+static void remap_row(const remap_grid_t* g, int ly, float* sx, float* sy) {
+    int j = ly / REMAP_STEP;
+    float fy = (float)(ly % REMAP_STEP) * (1.0f / REMAP_STEP);
+    float col_x[REMAP_NODES], col_y[REMAP_NODES];
+    for (int i = 0; i < REMAP_NODES; i++) {
+        const float* x = g->sx + j * REMAP_NODES + i;
+        const float* y = g->sy + j * REMAP_NODES + i;
+        col_x[i] = x[0] + (x[REMAP_NODES] - x[0]) * fy;
+        col_y[i] = y[0] + (y[REMAP_NODES] - y[0]) * fy;
+    }
+    for (int c = 0; c < REMAP_NODES - 1; c++) {
+        float dx = (col_x[c + 1] - col_x[c]) * (1.0f / REMAP_STEP);
+        float dy = (col_y[c + 1] - col_y[c]) * (1.0f / REMAP_STEP);
+        for (int k = 0; k < REMAP_STEP; k++) {
+            sx[c * REMAP_STEP + k] = col_x[c] + dx * k;
+            sy[c * REMAP_STEP + k] = col_y[c] + dy * k;
+        }
+    }
+}
 
-JNIEXPORT jlong JNICALL
-Java_com_astro_app_native_1_StackingNative_initStackingNative(
-    JNIEnv *env,
-    jclass clazz,
-    jint width,
-    jint height,
-    jboolean isColor)
+// Classify a tile against a frame footprint: 1 = every pixel covered,
+// 0 = no pixel covered, -1 = partial (test per pixel). Fills `grid` for
+// non-identity regions. Every interpolated position is a convex combination
+// of grid nodes, so testing the nodes suffices whatever the alignment model;
+// REGION_MARGIN keeps float rounding at the edge on the slow path.
+static int region_classify_tile(const stacking_context_t* ctx, const frame_region_t* r,
+                                int tx, int ty, remap_grid_t* grid)
 {
-    LOGI("initStackingNative: %dx%d, color=%d", width, height, isColor);
+    if (r->identity) {
+        return 1;
+    }
+    build_remap_grid(r, tx * ACCUM_TILE, ty * ACCUM_TILE, grid);
+    const double lo_x = REGION_MARGIN, hi_x = ctx->width - 1 - REGION_MARGIN;
+    const double lo_y = REGION_MARGIN, hi_y = ctx->height - 1 - REGION_MARGIN;
+    const int nodes = REMAP_NODES * REMAP_NODES;
+    int inside = 0;
+    int left = 0, right = 0, above = 0, below = 0;
+    for (int k = 0; k < nodes; k++) {
+        double sx = grid->sx[k];
+        double sy = grid->sy[k];
+        if (sx >= lo_x && sx < hi_x && sy >= lo_y && sy < hi_y) inside++;
+        if (sx < -REGION_MARGIN) left++;
+        if (sx > ctx->width - 1 + REGION_MARGIN) right++;
+        if (sy < -REGION_MARGIN) above++;
+        if (sy > ctx->height - 1 + REGION_MARGIN) below++;
+    }
+    if (inside == nodes) {
+        return 1;
+    }
+    if (left == nodes || right == nodes || above == nodes || below == nodes) {
+        return 0;
+    }
+    return -1;
+}
 
-    // Disable GSL's default error handler which calls abort().
-    // Without this, singular matrices in RANSAC crash the entire app.
-    gsl_set_error_handler_off();
+static inline int tile_extent(int origin, int size) {
+    int n = size - origin;
+    return (n < ACCUM_TILE) ? n : ACCUM_TILE;
+}
 
-    if (width <= 0 || height <= 0) {
-        LOGE("Invalid dimensions: %dx%d", width, height);
-        return 0;
+// Allocate every tile the footprint may touch, before any sum is modified,
+// so an allocation failure leaves the accumulator unchanged.
+static int reserve_tiles(stacking_context_t* ctx, const frame_region_t* r) {
+    for (int ty = 0; ty < ctx->tiles_y; ty++) {
+        for (int tx = 0; tx < ctx->tiles_x; tx++) {
+            float** tile = &ctx->sum_tiles[ty * ctx->tiles_x + tx];
+            if (*tile) {
+                continue;
+            }
+            remap_grid_t grid;
+            if (region_classify_tile(ctx, r, tx, ty, &grid) == 0) {
+                continue;
+            }
+            *tile = (float*)calloc(ACCUM_TILE_PIX, sizeof(float));
+            if (!*tile) {
+                LOGE("Failed to allocate accumulator tile (%d, %d)", tx, ty);
+                return 0;
+            }
+        }
     }
+    return 1;
+}
 
-    size_t npix = (size_t)width * (size_t)height;
-    // Check for overflow
-    if (npix / (size_t)width != (size_t)height) {
-        LOGE("Dimension overflow: %dx%d", width, height);
+static void free_accumulator(stacking_context_t* ctx) {
+    // Checkpointed tiles and regions belong to the mapping
+    if (ctx->sum_tiles && !ctx->checkpoint) {
+        for (int i = 0; i < ctx->tiles_x * ctx->tiles_y; i++) {
+            free(ctx->sum_tiles[i]);
+        }
+    }
+    free(ctx->sum_tiles);
+    if (!ctx->checkpoint) {
+        free(ctx->regions);
+    }
+    if (ctx->tallies) {
+        for (int i = 0; i < ctx->tiles_x * ctx->tiles_y; i++) {
+            free(ctx->tallies[i].partial);
+        }
+    }
+    free(ctx->tallies);
+    ctx->sum_tiles = NULL;
+    ctx->regions = NULL;
+    ctx->regions_cap = 0;
+    ctx->tallies = NULL;
+}
+
+static int push_region(stacking_context_t* ctx, const frame_region_t* r) {
+    if (ctx->frame_count >= ctx->regions_cap && ctx->checkpoint) {
+        LOGE("Checkpoint full (%d frames)", ctx->regions_cap);
         return 0;
     }
+    if (ctx->frame_count >= ctx->regions_cap) {
+        int cap = ctx->regions_cap ? ctx->regions_cap * 2 : 16;
+        frame_region_t* grown = (frame_region_t*)realloc(ctx->regions, cap * sizeof(frame_region_t));
+        if (!grown) {
+            LOGE("Failed to grow frame region list");
+            return 0;
+        }
+        ctx->regions = grown;
+        ctx->regions_cap = cap;
+    }
+    ctx->regions[ctx->frame_count] = *r;
+    return 1;
+}
 
-    stacking_context_t* ctx = (stacking_context_t*)calloc(1, sizeof(stacking_context_t));
-    if (!ctx) {
-        LOGE("Failed to allocate context");
+// Add frame `f` of the region list to the tile tallies. Every list is grown
+// before any tally changes, so a failure leaves them as they were.
+static int tally_frame(stacking_context_t* ctx, int f) {
+    const frame_region_t* r = &ctx->regions[f];
+    int ntiles = ctx->tiles_x * ctx->tiles_y;
+    if (!ctx->tallies) {
+        ctx->tallies = (tile_tally_t*)calloc((size_t)ntiles, sizeof(tile_tally_t));
+        if (!ctx->tallies) {
+            LOGE("Failed to allocate tile tallies");
+            return 0;
+        }
+    }
+    signed char* classes = (signed char*)malloc((size_t)ntiles);
+    if (!classes) {
+        LOGE("Failed to allocate tile tallies");
         return 0;
     }
+    for (int i = 0; i < ntiles; i++) {
+        tile_tally_t* t = &ctx->tallies[i];
+        remap_grid_t grid;
+        classes[i] = (signed char)region_classify_tile(ctx, r, i % ctx->tiles_x, i / ctx->tiles_x, &grid);
+        if (classes[i] == -1 && t->npartial >= t->cap) {
+            int cap = t->cap ? t->cap * 2 : 4;
+            int* grown = (int*)realloc(t->partial, cap * sizeof(int));
+            if (!grown) {
+                LOGE("Failed to grow tile tally");
+                free(classes);
+                return 0;
+            }
+            t->partial = grown;
+            t->cap = cap;
+        }
+    }
+    for (int i = 0; i < ntiles; i++) {
+        tile_tally_t* t = &ctx->tallies[i];
+        if (classes[i] == 1) {
+            t->full++;
+        } else if (classes[i] == -1) {
+            t->partial[t->npartial++] = f;
+        }
+    }
+    free(classes);
+    return 1;
+}
 
-    // Initialize random seed once per session (combines timestamp + process ID)
-    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
-    LOGI("Initialized random seed for stacking session");
+// Resolve one tile of the mean stack into `out` (row stride = image width).
+static void resolve_tile_mean(const stacking_context_t* ctx, int tx, int ty, unsigned char* out) {
+    int x0 = tx * ACCUM_TILE, y0 = ty * ACCUM_TILE;
+    int cols = tile_extent(x0, ctx->width);
+    int rows = tile_extent(y0, ctx->height);
+    const float* sum = ctx->sum_tiles[ty * ctx->tiles_x + tx];
 
-    ctx->width = width;
-    ctx->height = height;
-    ctx->is_color = isColor;
-    ctx->frame_count = 0;
+    if (!sum) {
+        for (int ly = 0; ly < rows; ly++) {
+            memset(out + (size_t)(y0 + ly) * ctx->width + x0, 0, cols);
+        }
+        return;
+    }
 
-    // Allocate accumulator (grayscale only for now)
-    ctx->sum_r = (float*)calloc(npix, sizeof(float));
-    ctx->count = (int*)calloc(npix, sizeof(int));
+    // Frames covering the whole tile contribute a constant; only partially
+    // overlapping frames need a per-pixel count.
+    const tile_tally_t* t = &ctx->tallies[ty * ctx->tiles_x + tx];
+    int full = t->full;
+    uint16_t partial[ACCUM_TILE_PIX];
+    int have_partial = 0;
+    for (int p = 0; p < t->npartial; p++) {
+        remap_grid_t grid;
+        build_remap_grid(&ctx->regions[t->partial[p]], x0, y0, &grid);
+        if (!have_partial) {
+            memset(partial, 0, sizeof(partial));
+            have_partial = 1;
+        }
+        float sx[ACCUM_TILE], sy[ACCUM_TILE];
+        for (int ly = 0; ly < rows; ly++) {
+            remap_row(&grid, ly, sx, sy);
+            for (int lx = 0; lx < cols; lx++) {
+                partial[ly * ACCUM_TILE + lx] += source_in_bounds(ctx, sx[lx], sy[lx]);
+            }
+        }
+    }
 
-    if (!ctx->sum_r || !ctx->count) {
-        LOGE("Failed to allocate accumulator");
-        free(ctx->sum_r);
-        free(ctx->count);
-        free(ctx);
-        return 0;
+    for (int ly = 0; ly < rows; ly++) {
+        unsigned char* orow = out + (size_t)(y0 + ly) * ctx->width + x0;
+        const float* srow = sum + ly * ACCUM_TILE;
+        for (int lx = 0; lx < cols; lx++) {
+            int count = full + (have_partial ? partial[ly * ACCUM_TILE + lx] : 0);
+            if (count > 0) {
+                float avg = srow[lx] / (float)count;
+                int val = (int)(avg + 0.5f);
+                if (val < 0) val = 0;
+                if (val > 255) val = 255;
+                orow[lx] = (unsigned char)val;
+            } else {
+                orow[lx] = 0;
+            }
+        }
     }
+}
 
-    ctx->ref_triangles = NULL;
-    ctx->num_ref_triangles = 0;
-    ctx->ref_stars = NULL;
-    ctx->num_ref_stars = 0;
+// Stop writing to the frame store after an I/O failure; the session keeps
+// stacking with the mean accumulator.
+static void drop_frame_store(stacking_context_t* ctx) {
+    LOGE("Frame store write failed, falling back to mean combine");
+    frame_store_abort_frame(ctx->store);
+    frame_store_close(ctx->store);
+    ctx->store = NULL;
+    ctx->combine_mode = COMBINE_MEAN;
+    if (ctx->checkpoint) {
+        ctx->checkpoint->header->combine_mode = COMBINE_MEAN;
+    }
+}
 
-    LOGI("Stacking context initialized");
-    return (jlong)(intptr_t)ctx;
+// Scratch buffers for accumulating one frame
+typedef struct {
+    remap_grid_t* grids;  // One band of tiles
+    int* classes;         // Footprint class per tile of the band
+    float* row;           // Warped row for the frame store (NULL without one)
+} accum_buffers_t;
+
+static void free_accum_buffers(accum_buffers_t* b) {
+    free(b->grids);
+    free(b->classes);
+    free(b->row);
 }
 
-JNIEXPORT jdoubleArray JNICALL
-Java_com_astro_app_native_1_StackingNative_addFrameNative(
-    JNIEnv *env,
-    jclass clazz,
-    jlong handle,
-    jbyteArray imageData,
-    jfloatArray stars,
-    jfloatArray refStars)
-{
-    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
-    if (!ctx) {
-        LOGE("Invalid context handle");
-        return NULL;
+static int alloc_accum_buffers(const stacking_context_t* ctx, accum_buffers_t* b) {
+    b->grids = (remap_grid_t*)malloc(ctx->tiles_x * sizeof(remap_grid_t));
+    b->classes = (int*)malloc(ctx->tiles_x * sizeof(int));
+    b->row = ctx->store ? (float*)malloc(ctx->width * sizeof(float)) : NULL;
+    if (!b->grids || !b->classes || (ctx->store && !b->row)) {
+        LOGE("Failed to allocate accumulation buffers");
+        free_accum_buffers(b);
+        return 0;
     }
+    return 1;
+}
 
-    // Validate array lengths
-    jsize imageLen = (*env)->GetArrayLength(env, imageData);
-    if (imageLen < (jsize)((size_t)ctx->width * ctx->height)) {
-        LOGE("imageData too short: %d < %dx%d", imageLen, ctx->width, ctx->height);
-        return NULL;
+// Accumulate rows [y_start, height) of a frame whose footprint `region` is
+// already recorded in ctx->regions. Source positions come from each tile's
+// remap grid, so the per-pixel cost does not depend on the alignment model.
+// In COMBINE_MEDIAN mode each warped row is also written to the frame store.
+// With a checkpoint, every row is backed up before it is modified and
+// marked done after, so an interrupted frame can be resumed by row.
+static void accumulate_rows(stacking_context_t* ctx, const unsigned char* image,
+                            const frame_region_t* region, int y_start, accum_buffers_t* b)
+{
+    float* row = b->row;
+    if (row && !frame_store_begin_frame(ctx->store)) {
+        row = NULL;
+        drop_frame_store(ctx);
     }
-    jsize starsLen = (*env)->GetArrayLength(env, stars);
-    if (starsLen % 3 != 0) {
-        LOGE("stars array length not multiple of 3: %d", starsLen);
-        return NULL;
+
+    float src_x[ACCUM_TILE], src_y[ACCUM_TILE];
+    for (int ty = y_start / ACCUM_TILE; ty < ctx->tiles_y; ty++) {
+        for (int tx = 0; tx < ctx->tiles_x; tx++) {
+            b->classes[tx] = region_classify_tile(ctx, region, tx, ty, &b->grids[tx]);
+        }
+        int y0 = ty * ACCUM_TILE;
+        int rows = tile_extent(y0, ctx->height);
+        for (int ly = (y0 < y_start) ? y_start - y0 : 0; ly < rows; ly++) {
+            int y = y0 + ly;
+            if (ctx->checkpoint) {
+                stack_checkpoint_save_row(ctx->checkpoint, y);
+            }
+            for (int tx = 0; tx < ctx->tiles_x; tx++) {
+                int x0 = tx * ACCUM_TILE;
+                int cols = tile_extent(x0, ctx->width);
+                int cls = b->classes[tx];
+                if (cls == 0) {
+                    if (row) {
+                        for (int lx = 0; lx < cols; lx++) row[x0 + lx] = -1.0f;  // No data
+                    }
+                    continue;
+                }
+                // Tile was reserved: it intersects this frame's footprint
+                float* sum = ctx->sum_tiles[ty * ctx->tiles_x + tx] + ly * ACCUM_TILE;
+                if (region->identity) {
+                    const unsigned char* src = image + (size_t)y * ctx->width + x0;
+                    for (int lx = 0; lx < cols; lx++) {
+                        sum[lx] += (float)src[lx];
+                        if (row) row[x0 + lx] = (float)src[lx];
+                    }
+                    continue;
+                }
+                remap_row(&b->grids[tx], ly, src_x, src_y);
+                for (int lx = 0; lx < cols; lx++) {
+                    float value = -1.0f;  // No data
+                    if (cls == 1 || source_in_bounds(ctx, src_x[lx], src_y[lx])) {
+                        value = bilinear_sample((unsigned char*)image, ctx->width, ctx->height,
+                                                src_x[lx], src_y[lx]);
+                        sum[lx] += value;
+                    }
+                    if (row) {
+                        row[x0 + lx] = value;
+                    }
+                }
+            }
+            if (row && !frame_store_put_row(ctx->store, y, row)) {
+                row = NULL;
+                drop_frame_store(ctx);
+            }
+            // Only now is the row complete in both the sums and the store
+            if (ctx->checkpoint) {
+                stack_checkpoint_row_done(ctx->checkpoint, y);
+            }
+        }
     }
 
-    // Get image data
-    jbyte* pixels = (*env)->GetByteArrayElements(env, imageData, NULL);
-    if (!pixels) {
-        LOGE("Failed to get image data");
-        return NULL;
+    if (row) {
+        frame_store_end_frame(ctx->store);
     }
+}
 
-    // Get star arrays
-    jfloat* stars_arr = (*env)->GetFloatArrayElements(env, stars, NULL);
-    jfloat* ref_stars_arr = (refStars != NULL) ? (*env)->GetFloatArrayElements(env, refStars, NULL) : NULL;
+// Add one frame with the given footprint: the reference (identity) or a
+// frame warped into the reference frame.
+static int accumulate_frame(stacking_context_t* ctx, const unsigned char* image,
+                            const frame_region_t* region)
+{
+    accum_buffers_t b;
+    if (!alloc_accum_buffers(ctx, &b)) {
+        return 0;
+    }
+    if (!reserve_tiles(ctx, region) || !push_region(ctx, region) ||
+        !tally_frame(ctx, ctx->frame_count)) {
+        free_accum_buffers(&b);
+        return 0;
+    }
 
-    if (!stars_arr) {
-        LOGE("Failed to get stars array");
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-        return NULL;
+    if (ctx->checkpoint) {
+        stack_checkpoint_begin_frame(ctx->checkpoint, image);
     }
+    accumulate_rows(ctx, image, region, 0, &b);
+    free_accum_buffers(&b);
 
-    int num_stars = (*env)->GetArrayLength(env, stars) / 3;
+    ctx->frame_count++;
+    if (ctx->checkpoint) {
+        stack_checkpoint_commit_frame(ctx->checkpoint);
+    }
+    return 1;
+}
 
-    LOGI("addFrame: %d stars detected", num_stars);
+// Accumulate the reference frame as-is (identity transform)
+static int accumulate_reference(stacking_context_t* ctx, unsigned char* image) {
+    frame_region_t region;
+    memset(&region, 0, sizeof(region));
+    region.identity = 1;
+    return accumulate_frame(ctx, image, &region);
+}
+
+// Warp image to reference frame and accumulate
+static int warp_and_accumulate(stacking_context_t* ctx, unsigned char* image,
+                               const warp_model_t* warp)
+{
+    frame_region_t region;
+    memset(&region, 0, sizeof(region));
+    region.warp = *warp;
+    return accumulate_frame(ctx, image, &region);
+}
 
+// ============================================================================
+// FRAME STACKING
+// ============================================================================
+
+static void set_stack_result(double result[4], int success, int inliers, double rms,
+                             int frame_count)
+{
+    result[0] = success ? 1.0 : 0.0;
+    result[1] = (double)inliers;
+    result[2] = rms;
+    result[3] = (double)frame_count;
+}
+
+// Align one frame to the reference and accumulate it; the first frame becomes
+// the reference. Fills result = [success, inliers, rmsError, frameCount].
+// Returns 0 on a hard error (allocation or reference setup), 1 otherwise
+// (including alignment failures, reported through result[0]).
+static int stack_frame(stacking_context_t* ctx, unsigned char* pixels,
+                       const float* stars, int num_stars, double result[4])
+{
     // Check if this is the first frame (reference)
     if (ctx->frame_count == 0) {
         // First frame - use as reference, no alignment needed
@@ -643,41 +1411,46 @@ Java_com_astro_app_native_1_StackingNative_addFrameNative(
         ctx->ref_stars = (float*)malloc(ctx->num_ref_stars * 3 * sizeof(float));
         if (!ctx->ref_stars) {
             LOGE("Failed to allocate ref_stars");
-            (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-            (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-            return NULL;
+            return 0;
         }
-        memcpy(ctx->ref_stars, stars_arr, ctx->num_ref_stars * 3 * sizeof(float));
+        memcpy(ctx->ref_stars, stars, ctx->num_ref_stars * 3 * sizeof(float));
 
         // Form reference triangles
         ctx->ref_triangles = form_triangles(ctx->ref_stars, ctx->num_ref_stars,
                                            &ctx->num_ref_triangles);
         if (!ctx->ref_triangles) {
             LOGE("Failed to form reference triangles");
-            (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-            (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-            return NULL;
+            free(ctx->ref_stars);
+            ctx->ref_stars = NULL;
+            return 0;
         }
 
         LOGI("Formed %d reference triangles from %d stars", ctx->num_ref_triangles,
              ctx->num_ref_stars);
 
         // Add first frame directly to accumulator (identity transform)
-        int npix = ctx->width * ctx->height;
-        for (int i = 0; i < npix; i++) {
-            ctx->sum_r[i] += (float)((unsigned char)pixels[i]);
-            ctx->count[i]++;
+        if ((ctx->checkpoint &&
+             !stack_checkpoint_set_reference(ctx->checkpoint, ctx->ref_stars, ctx->num_ref_stars,
+                                             ctx->ref_triangles, ctx->num_ref_triangles)) ||
+            !accumulate_reference(ctx, pixels)) {
+            LOGE("Failed to accumulate reference frame");
+            free(ctx->ref_triangles);
+            free(ctx->ref_stars);
+            ctx->ref_triangles = NULL;
+            ctx->ref_stars = NULL;
+            return 0;
         }
-        ctx->frame_count++;
 
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-        (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
+        // success, inliers=0, rms=0, frameCount=1
+        set_stack_result(result, 1, 0, 0.0, ctx->frame_count);
+        return 1;
+    }
 
-        // Return success
-        jdoubleArray result = (*env)->NewDoubleArray(env, 4);
-        jdouble buffer[4] = {1.0, 0.0, 0.0, 1.0};  // success, inliers=0, rms=0, frameCount=1
-        (*env)->SetDoubleArrayRegion(env, result, 0, 4, buffer);
-        return result;
+    // Median stacking keeps every frame; refuse frames beyond the store's capacity
+    if (ctx->store && frame_store_is_full(ctx->store)) {
+        LOGE("Frame store full (%d frames)", ctx->store->max_frames);
+        set_stack_result(result, 0, 0, 0.0, ctx->frame_count);
+        return 1;
     }
 
     // Subsequent frames - align to reference
@@ -686,42 +1459,28 @@ Java_com_astro_app_native_1_StackingNative_addFrameNative(
     // Form triangles from new frame
     int num_new_tri;
     int use_stars = (num_stars < MAX_STACKING_STARS) ? num_stars : MAX_STACKING_STARS;
-    triangle_t* new_tri = form_triangles(stars_arr, use_stars, &num_new_tri);
+    triangle_t* new_tri = form_triangles((float*)stars, use_stars, &num_new_tri);
 
     if (!new_tri || num_new_tri == 0) {
         LOGE("Failed to form new frame triangles");
-        if (new_tri) free(new_tri);
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-        (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-        if (ref_stars_arr) (*env)->ReleaseFloatArrayElements(env, refStars, ref_stars_arr, JNI_ABORT);
-
-        // Return failure
-        jdoubleArray result = (*env)->NewDoubleArray(env, 4);
-        jdouble buffer[4] = {0.0, 0.0, 0.0, (double)ctx->frame_count};
-        (*env)->SetDoubleArrayRegion(env, result, 0, 4, buffer);
-        return result;
+        free(new_tri);
+        set_stack_result(result, 0, 0, 0.0, ctx->frame_count);
+        return 1;
     }
 
     // Match triangles
     int num_corr;
     correspondence_t* corr = match_triangles(ctx->ref_triangles, ctx->num_ref_triangles,
                                             ctx->ref_stars,
-                                            new_tri, num_new_tri, stars_arr,
+                                            new_tri, num_new_tri, (float*)stars,
                                             &num_corr);
     free(new_tri);
 
     if (!corr || num_corr < 3) {
         LOGE("Triangle matching failed (only %d correspondences)", num_corr);
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-        (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-        if (ref_stars_arr) (*env)->ReleaseFloatArrayElements(env, refStars, ref_stars_arr, JNI_ABORT);
-        if (corr) free(corr);
-
-        // Return failure
-        jdoubleArray result = (*env)->NewDoubleArray(env, 4);
-        jdouble buffer[4] = {0.0, 0.0, 0.0, (double)ctx->frame_count};
-        (*env)->SetDoubleArrayRegion(env, result, 0, 4, buffer);
-        return result;
+        free(corr);
+        set_stack_result(result, 0, 0, 0.0, ctx->frame_count);
+        return 1;
     }
 
     // RANSAC affine estimation
@@ -731,34 +1490,809 @@ Java_com_astro_app_native_1_StackingNative_addFrameNative(
     if (!ransac_affine(corr, num_corr, &aff, &inliers, &rms)) {
         LOGE("RANSAC failed");
         free(corr);
-        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
-        (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-        if (ref_stars_arr) (*env)->ReleaseFloatArrayElements(env, refStars, ref_stars_arr, JNI_ABORT);
-
-        // Return failure
-        jdoubleArray result = (*env)->NewDoubleArray(env, 4);
-        jdouble buffer[4] = {0.0, 0.0, 0.0, (double)ctx->frame_count};
-        (*env)->SetDoubleArrayRegion(env, result, 0, 4, buffer);
-        return result;
+        set_stack_result(result, 0, 0, 0.0, ctx->frame_count);
+        return 1;
     }
+
+    // Refine to the session's alignment model (no-op for ALIGN_AFFINE)
+    warp_model_t warp;
+    int refined = refine_alignment(ctx, corr, num_corr, &aff, &warp, &inliers, &rms);
     free(corr);
 
     // Warp and accumulate
-    warp_and_accumulate(ctx, (unsigned char*)pixels, &aff);
+    if (!refined || !warp_and_accumulate(ctx, pixels, &warp)) {
+        LOGE("Warp failed");
+        set_stack_result(result, 0, inliers, rms, ctx->frame_count);
+        return 1;
+    }
+
+    LOGI("Frame %d added successfully", ctx->frame_count);
+    set_stack_result(result, 1, inliers, rms, ctx->frame_count);
+    return 1;
+}
+
+// ============================================================================
+// PIPELINED SESSION
+// ============================================================================
+
+// Frames flow: submit (caller thread) -> detect_q -> detection thread ->
+// warp_q -> warp thread -> Java listener. Both queues are bounded, so a
+// submitter that outruns the slowest stage blocks (back-pressure) and
+// throughput settles at the rate of the slowest stage.
+
+typedef struct {
+    int seq;
+    unsigned char* pixels;
+    float* stars;
+    int num_stars;
+    int status;
+    double result[4];
+} frame_job_t;
+
+typedef struct {
+    frame_job_t** items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} job_queue_t;
+
+typedef struct stacking_pipeline {
+    stacking_context_t* ctx;
+    job_queue_t detect_q;
+    job_queue_t warp_q;
+    pthread_t detect_thread;
+    pthread_t warp_thread;
+    int next_seq;
+
+    // Detection parameters
+    float plim;
+    float dpsf;
+    int downsample;
+    int min_stars;
+
+    // Java listener, called on the warp thread
+    JavaVM* vm;
+    jobject listener;
+    jmethodID on_frame;
+} stacking_pipeline_t;
+
+static int job_queue_init(job_queue_t* q, int capacity) {
+    memset(q, 0, sizeof(job_queue_t));
+    q->items = (frame_job_t**)calloc(capacity, sizeof(frame_job_t*));
+    if (!q->items) {
+        return 0;
+    }
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 1;
+}
+
+static void job_queue_destroy(job_queue_t* q) {
+    if (!q->items) {
+        return;
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    q->items = NULL;
+}
+
+// Blocks while the queue is full. Returns 0 if the queue was closed.
+static int job_queue_push(job_queue_t* q, frame_job_t* job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    q->items[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+// Blocks while the queue is empty. Returns NULL once closed and drained.
+static frame_job_t* job_queue_pop(job_queue_t* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    frame_job_t* job = NULL;
+    if (q->count > 0) {
+        job = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static void job_queue_close(job_queue_t* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void free_job(frame_job_t* job) {
+    free(job->pixels);
+    free(job->stars);
+    free(job);
+}
+
+static void* detect_thread_main(void* arg) {
+    stacking_pipeline_t* p = (stacking_pipeline_t*)arg;
+    stacking_context_t* ctx = p->ctx;
+    frame_job_t* job;
+
+    while ((job = job_queue_pop(&p->detect_q)) != NULL) {
+        job->stars = detect_stars_u8(job->pixels, ctx->width, ctx->height,
+                                     p->plim, p->dpsf, p->downsample, &job->num_stars);
+        if (!job->stars || job->num_stars < p->min_stars) {
+            LOGE("Pipeline frame %d: too few stars (%d < %d)",
+                 job->seq, job->num_stars, p->min_stars);
+            job->status = FRAME_DETECTION_FAILED;
+        }
+        // warp_q is only closed by this thread, so the push cannot fail
+        job_queue_push(&p->warp_q, job);
+    }
+
+    // Submissions are finished: let the warp thread drain and exit
+    job_queue_close(&p->warp_q);
+    return NULL;
+}
+
+static void deliver_frame(JNIEnv* env, stacking_pipeline_t* p, const frame_job_t* job) {
+    if (!env || !p->listener) {
+        return;
+    }
+    jdouble buffer[FRAME_RESULT_LEN] = {
+        job->result[0], job->result[1], job->result[2], job->result[3],
+        (double)job->status, (double)job->num_stars
+    };
+    jdoubleArray arr = (*env)->NewDoubleArray(env, FRAME_RESULT_LEN);
+    if (!arr) {
+        (*env)->ExceptionClear(env);
+        return;
+    }
+    (*env)->SetDoubleArrayRegion(env, arr, 0, FRAME_RESULT_LEN, buffer);
+    (*env)->CallVoidMethod(env, p->listener, p->on_frame, (jint)job->seq, arr);
+    if ((*env)->ExceptionCheck(env)) {
+        LOGE("Frame listener threw an exception (frame %d)", job->seq);
+        (*env)->ExceptionClear(env);
+    }
+    (*env)->DeleteLocalRef(env, arr);
+}
+
+static void* warp_thread_main(void* arg) {
+    stacking_pipeline_t* p = (stacking_pipeline_t*)arg;
+    stacking_context_t* ctx = p->ctx;
+    JNIEnv* env = NULL;
+    if ((*p->vm)->AttachCurrentThread(p->vm, &env, NULL) != JNI_OK) {
+        LOGE("Warp thread failed to attach to the JVM; results will not be delivered");
+        env = NULL;
+    }
+
+    frame_job_t* job;
+    while ((job = job_queue_pop(&p->warp_q)) != NULL) {
+        set_stack_result(job->result, 0, 0, 0.0, ctx->frame_count);
+        if (job->status != FRAME_DETECTION_FAILED) {
+            if (!stack_frame(ctx, job->pixels, job->stars, job->num_stars, job->result)) {
+                job->status = FRAME_ERROR;
+            } else {
+                job->status = (job->result[0] > 0.5) ? FRAME_STACKED : FRAME_ALIGNMENT_FAILED;
+            }
+        }
+        deliver_frame(env, p, job);
+        free_job(job);
+    }
+
+    if (env) {
+        (*p->vm)->DetachCurrentThread(p->vm);
+    }
+    return NULL;
+}
+
+static void free_pipeline(JNIEnv* env, stacking_pipeline_t* p) {
+    job_queue_destroy(&p->detect_q);
+    job_queue_destroy(&p->warp_q);
+    if (p->listener) {
+        (*env)->DeleteGlobalRef(env, p->listener);
+    }
+    free(p);
+}
+
+// Stop accepting frames, wait for every queued frame to be stacked and
+// delivered, then tear the threads down.
+static void finish_pipeline(JNIEnv* env, stacking_context_t* ctx) {
+    stacking_pipeline_t* p = ctx->pipeline;
+    if (!p) {
+        return;
+    }
+    job_queue_close(&p->detect_q);
+    pthread_join(p->detect_thread, NULL);
+    pthread_join(p->warp_thread, NULL);
+    ctx->pipeline = NULL;
+    free_pipeline(env, p);
+    LOGI("Pipeline finished: %d frames stacked", ctx->frame_count);
+}
+
+// ============================================================================
+// CHECKPOINTING
+// ============================================================================
+
+// Point the accumulator tiles and region table into the checkpoint mapping.
+static int attach_checkpoint(stacking_context_t* ctx, stack_checkpoint_t* ck) {
+    float** tiles = (float**)calloc((size_t)ctx->tiles_x * ctx->tiles_y, sizeof(float*));
+    if (!tiles) {
+        LOGE("Failed to allocate accumulator");
+        return 0;
+    }
+    for (int i = 0; i < ctx->tiles_x * ctx->tiles_y; i++) {
+        tiles[i] = stack_checkpoint_tile(ck, i);
+    }
+    free_accumulator(ctx);
+    ctx->sum_tiles = tiles;
+    ctx->regions = (frame_region_t*)ck->regions;
+    ctx->regions_cap = ck->header->max_frames;
+    ctx->checkpoint = ck;
+    return 1;
+}
+
+// Path of the frame store that accompanies a checkpoint (caller frees)
+static char* checkpoint_store_path(const char* path) {
+    size_t len = strlen(path);
+    char* store_path = (char*)malloc(len + sizeof(".frames"));
+    if (store_path) {
+        memcpy(store_path, path, len);
+        memcpy(store_path + len, ".frames", sizeof(".frames"));
+    }
+    return store_path;
+}
+
+// Rebuild a stacking context from a checkpoint, completing a frame that was
+// interrupted mid-accumulation. Returns NULL on failure.
+static stacking_context_t* resume_from_checkpoint(const char* path) {
+    stack_checkpoint_t* ck = stack_checkpoint_open(path);
+    if (!ck) {
+        return NULL;
+    }
+    const stack_checkpoint_header_t* h = ck->header;
+    if (h->tile != ACCUM_TILE || h->region_bytes != sizeof(frame_region_t) ||
+        h->triangle_bytes != sizeof(triangle_t) ||
+        h->tiles_x != (h->width + ACCUM_TILE - 1) / ACCUM_TILE ||
+        h->tiles_y != (h->height + ACCUM_TILE - 1) / ACCUM_TILE) {
+        LOGE("Checkpoint %s was written by an incompatible build", path);
+        stack_checkpoint_close(ck);
+        return NULL;
+    }
+
+    stacking_context_t* ctx = (stacking_context_t*)calloc(1, sizeof(stacking_context_t));
+    if (!ctx) {
+        stack_checkpoint_close(ck);
+        return NULL;
+    }
+    ctx->width = h->width;
+    ctx->height = h->height;
+    ctx->tiles_x = h->tiles_x;
+    ctx->tiles_y = h->tiles_y;
+    ctx->frame_count = h->frame_count;
+    ctx->combine_mode = COMBINE_MEAN;
+    ctx->align_model = h->align_model;
+    if (!attach_checkpoint(ctx, ck)) {
+        stack_checkpoint_close(ck);
+        free(ctx);
+        return NULL;
+    }
+
+    if (h->frame_count > 0 || h->journal_active) {
+        ctx->num_ref_stars = h->num_ref_stars;
+        ctx->num_ref_triangles = h->num_ref_triangles;
+        ctx->ref_stars = (float*)malloc((size_t)(h->num_ref_stars * 3 + 1) * sizeof(float));
+        ctx->ref_triangles = (triangle_t*)malloc((size_t)(h->num_ref_triangles + 1) * sizeof(triangle_t));
+        if (!ctx->ref_stars || !ctx->ref_triangles) {
+            LOGE("Failed to allocate reference stars");
+            goto bailout;
+        }
+        memcpy(ctx->ref_stars, ck->ref_stars, (size_t)h->num_ref_stars * 3 * sizeof(float));
+        memcpy(ctx->ref_triangles, ck->ref_triangles,
+               (size_t)h->num_ref_triangles * sizeof(triangle_t));
+    }
+
+    int redo_from = stack_checkpoint_recover(ck);
+
+    if (h->combine_mode == COMBINE_MEDIAN) {
+        char* store_path = checkpoint_store_path(path);
+        if (store_path) {
+            ctx->store = frame_store_open_file(store_path, h->width, h->height, h->max_frames,
+                                               h->frame_count);
+            if (!ctx->store && h->frame_count == 0 && redo_from < 0) {
+                // Killed before the store was created; nothing in it yet
+                ctx->store = frame_store_open_file(store_path, h->width, h->height,
+                                                   h->max_frames, -1);
+            }
+        }
+        free(store_path);
+        if (ctx->store) {
+            ctx->combine_mode = COMBINE_MEDIAN;
+        } else {
+            LOGE("Frame store lost; resuming with mean combine");
+            ck->header->combine_mode = COMBINE_MEAN;
+        }
+    }
+
+    if (redo_from >= 0) {
+        accum_buffers_t b;
+        if (!alloc_accum_buffers(ctx, &b)) {
+            goto bailout;
+        }
+        accumulate_rows(ctx, ck->journal_pixels, &ctx->regions[h->journal_frame], redo_from, &b);
+        free_accum_buffers(&b);
+        ctx->frame_count++;
+        stack_checkpoint_commit_frame(ck);
+    }
+
+    for (int f = 0; f < ctx->frame_count; f++) {
+        if (!tally_frame(ctx, f)) {
+            goto bailout;
+        }
+    }
+
+    LOGI("Resumed stacking session %s: %dx%d, %d frames", path, ctx->width, ctx->height,
+         ctx->frame_count);
+    return ctx;
+
+ bailout:
+    free_accumulator(ctx);
+    free(ctx->ref_stars);
+    free(ctx->ref_triangles);
+    frame_store_close(ctx->store);
+    stack_checkpoint_close(ck);
+    free(ctx);
+    return NULL;
+}
+
+// ============================================================================
+// JNI ENTRY POINTS
+// ============================================================================
+
+#ifndef STACKING_TESTING  /* Skip JNI entry points when unit-testing static functions */
+
+JNIEXPORT jlong JNICALL
+Java_com_astro_app_native_1_StackingNative_initStackingNative(
+    JNIEnv *env,
+    jclass clazz,
+    jint width,
+    jint height,
+    jboolean isColor,
+    jint combineMode,
+    jint maxFrames,
+    jstring scratchDir)
+{
+    LOGI("initStackingNative: %dx%d, color=%d, combine=%d", width, height, isColor, combineMode);
+
+    // Disable GSL's default error handler which calls abort().
+    // Without this, singular matrices in RANSAC crash the entire app.
+    gsl_set_error_handler_off();
+
+    if (width <= 0 || height <= 0) {
+        LOGE("Invalid dimensions: %dx%d", width, height);
+        return 0;
+    }
+
+    size_t npix = (size_t)width * (size_t)height;
+    // Check for overflow
+    if (npix / (size_t)width != (size_t)height) {
+        LOGE("Dimension overflow: %dx%d", width, height);
+        return 0;
+    }
+
+    stacking_context_t* ctx = (stacking_context_t*)calloc(1, sizeof(stacking_context_t));
+    if (!ctx) {
+        LOGE("Failed to allocate context");
+        return 0;
+    }
+
+    // Initialize random seed once per session (combines timestamp + process ID)
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    LOGI("Initialized random seed for stacking session");
+
+    ctx->width = width;
+    ctx->height = height;
+    ctx->is_color = isColor;
+    ctx->frame_count = 0;
+
+    // Allocate accumulator tile table (grayscale only for now); tiles
+    // themselves are allocated as frames touch them
+    ctx->tiles_x = (width + ACCUM_TILE - 1) / ACCUM_TILE;
+    ctx->tiles_y = (height + ACCUM_TILE - 1) / ACCUM_TILE;
+    ctx->sum_tiles = (float**)calloc((size_t)ctx->tiles_x * ctx->tiles_y, sizeof(float*));
+
+    if (!ctx->sum_tiles) {
+        LOGE("Failed to allocate accumulator");
+        free(ctx);
+        return 0;
+    }
+
+    ctx->combine_mode = COMBINE_MEAN;
+    ctx->store = NULL;
+    if (combineMode == COMBINE_MEDIAN) {
+        const char* dir = scratchDir ? (*env)->GetStringUTFChars(env, scratchDir, NULL) : NULL;
+        ctx->store = frame_store_open(dir, width, height, maxFrames);
+        if (dir) (*env)->ReleaseStringUTFChars(env, scratchDir, dir);
+        if (!ctx->store) {
+            LOGE("Failed to open frame store");
+            free_accumulator(ctx);
+            free(ctx);
+            return 0;
+        }
+        ctx->combine_mode = COMBINE_MEDIAN;
+    }
+
+    ctx->align_model = ALIGN_AFFINE;
+
+    ctx->ref_triangles = NULL;
+    ctx->num_ref_triangles = 0;
+    ctx->ref_stars = NULL;
+    ctx->num_ref_stars = 0;
+
+    LOGI("Stacking context initialized");
+    return (jlong)(intptr_t)ctx;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_astro_app_native_1_StackingNative_setAlignmentModelNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle,
+    jint model)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx) {
+        LOGE("Invalid context handle");
+        return JNI_FALSE;
+    }
+    if (ctx->pipeline) {
+        LOGE("setAlignmentModel called while a pipelined session is running");
+        return JNI_FALSE;
+    }
+    if (model != ALIGN_AFFINE && model != ALIGN_HOMOGRAPHY && model != ALIGN_POLYNOMIAL) {
+        LOGE("Unknown alignment model %d", model);
+        return JNI_FALSE;
+    }
+    ctx->align_model = model;
+    if (ctx->checkpoint) {
+        ctx->checkpoint->header->align_model = model;
+    }
+    LOGI("Alignment model set to %d", model);
+    return JNI_TRUE;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_astro_app_native_1_StackingNative_enableCheckpointNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle,
+    jstring path,
+    jint maxFrames)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx || !path) {
+        LOGE("enableCheckpoint: invalid handle or path");
+        return JNI_FALSE;
+    }
+    if (ctx->checkpoint || ctx->pipeline || ctx->frame_count > 0) {
+        LOGE("enableCheckpoint must be called on a fresh session");
+        return JNI_FALSE;
+    }
+    if (ctx->store) {
+        // The median store must outlive the process too; keep one slot per frame
+        maxFrames = ctx->store->max_frames;
+    }
+    if (maxFrames <= 0) {
+        LOGE("enableCheckpoint: invalid frame capacity %d", maxFrames);
+        return JNI_FALSE;
+    }
+
+    const char* cpath = (*env)->GetStringUTFChars(env, path, NULL);
+    if (!cpath) {
+        return JNI_FALSE;
+    }
+
+    stack_checkpoint_header_t geom;
+    memset(&geom, 0, sizeof(geom));
+    geom.width = ctx->width;
+    geom.height = ctx->height;
+    geom.tile = ACCUM_TILE;
+    geom.tiles_x = ctx->tiles_x;
+    geom.tiles_y = ctx->tiles_y;
+    geom.max_frames = maxFrames;
+    geom.max_ref_stars = MAX_STACKING_STARS;
+    geom.max_ref_triangles = MAX_STACKING_STARS * MAX_TRIANGLES_PER_STAR;
+    geom.region_bytes = sizeof(frame_region_t);
+    geom.triangle_bytes = sizeof(triangle_t);
+    geom.combine_mode = ctx->combine_mode;
+    geom.align_model = ctx->align_model;
+
+    stack_checkpoint_t* ck = stack_checkpoint_create(cpath, &geom);
+    frame_store_t* store = NULL;
+    if (ck && ctx->store) {
+        char* store_path = checkpoint_store_path(cpath);
+        if (store_path) {
+            store = frame_store_open_file(store_path, ctx->width, ctx->height, maxFrames, -1);
+        }
+        free(store_path);
+        if (!store) {
+            stack_checkpoint_close(ck);
+            unlink(cpath);
+            ck = NULL;
+        }
+    }
+    if (ck && !attach_checkpoint(ctx, ck)) {
+        frame_store_close(store);
+        stack_checkpoint_close(ck);
+        unlink(cpath);
+        ck = NULL;
+    }
+    (*env)->ReleaseStringUTFChars(env, path, cpath);
+    if (!ck) {
+        LOGE("Failed to enable checkpoint");
+        return JNI_FALSE;
+    }
+
+    if (store) {
+        frame_store_close(ctx->store);
+        ctx->store = store;
+    }
+    LOGI("Checkpointing enabled (%d frames)", maxFrames);
+    return JNI_TRUE;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_astro_app_native_1_StackingNative_resumeStackingNative(
+    JNIEnv *env,
+    jclass clazz,
+    jstring path)
+{
+    if (!path) {
+        return 0;
+    }
+    // Same process-wide setup as initStackingNative
+    gsl_set_error_handler_off();
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
+    const char* cpath = (*env)->GetStringUTFChars(env, path, NULL);
+    if (!cpath) {
+        return 0;
+    }
+    stacking_context_t* ctx = resume_from_checkpoint(cpath);
+    (*env)->ReleaseStringUTFChars(env, path, cpath);
+    return (jlong)(intptr_t)ctx;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_astro_app_native_1_StackingNative_getSessionInfoNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx) {
+        return NULL;
+    }
+    // [width, height, frameCount, combineMode, alignModel]
+    jint info[5] = { ctx->width, ctx->height, ctx->frame_count,
+                     ctx->combine_mode, ctx->align_model };
+    jintArray result = (*env)->NewIntArray(env, 5);
+    if (result) {
+        (*env)->SetIntArrayRegion(env, result, 0, 5, info);
+    }
+    return result;
+}
+
+JNIEXPORT jdoubleArray JNICALL
+Java_com_astro_app_native_1_StackingNative_addFrameNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle,
+    jbyteArray imageData,
+    jfloatArray stars,
+    jfloatArray refStars)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx) {
+        LOGE("Invalid context handle");
+        return NULL;
+    }
+    if (ctx->pipeline) {
+        LOGE("addFrame called while a pipelined session is running");
+        return NULL;
+    }
+
+    // Validate array lengths
+    jsize imageLen = (*env)->GetArrayLength(env, imageData);
+    if (imageLen < (jsize)((size_t)ctx->width * ctx->height)) {
+        LOGE("imageData too short: %d < %dx%d", imageLen, ctx->width, ctx->height);
+        return NULL;
+    }
+    jsize starsLen = (*env)->GetArrayLength(env, stars);
+    if (starsLen % 3 != 0) {
+        LOGE("stars array length not multiple of 3: %d", starsLen);
+        return NULL;
+    }
+
+    // Get image data
+    jbyte* pixels = (*env)->GetByteArrayElements(env, imageData, NULL);
+    if (!pixels) {
+        LOGE("Failed to get image data");
+        return NULL;
+    }
+
+    // Get star array (refStars is kept for API compatibility; the reference
+    // stars are held natively since the first frame)
+    jfloat* stars_arr = (*env)->GetFloatArrayElements(env, stars, NULL);
+    if (!stars_arr) {
+        LOGE("Failed to get stars array");
+        (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
+        return NULL;
+    }
+
+    int num_stars = starsLen / 3;
+    LOGI("addFrame: %d stars detected", num_stars);
+
+    double out[4];
+    int ok = stack_frame(ctx, (unsigned char*)pixels, stars_arr, num_stars, out);
 
     (*env)->ReleaseByteArrayElements(env, imageData, pixels, JNI_ABORT);
     (*env)->ReleaseFloatArrayElements(env, stars, stars_arr, JNI_ABORT);
-    if (ref_stars_arr) (*env)->ReleaseFloatArrayElements(env, refStars, ref_stars_arr, JNI_ABORT);
 
-    LOGI("Frame %d added successfully", ctx->frame_count);
+    if (!ok) {
+        return NULL;
+    }
 
-    // Return success
     jdoubleArray result = (*env)->NewDoubleArray(env, 4);
-    jdouble buffer[4] = {1.0, (double)inliers, rms, (double)ctx->frame_count};
-    (*env)->SetDoubleArrayRegion(env, result, 0, 4, buffer);
+    (*env)->SetDoubleArrayRegion(env, result, 0, 4, out);
     return result;
 }
 
+JNIEXPORT jboolean JNICALL
+Java_com_astro_app_native_1_StackingNative_startPipelineNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle,
+    jint queueDepth,
+    jfloat plim,
+    jfloat dpsf,
+    jint downsample,
+    jint minStars,
+    jobject listener)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx || !listener) {
+        LOGE("startPipeline: invalid handle or listener");
+        return JNI_FALSE;
+    }
+    if (ctx->pipeline) {
+        LOGE("startPipeline: pipeline already running");
+        return JNI_FALSE;
+    }
+    if (queueDepth < 1) queueDepth = 1;
+    if (queueDepth > PIPELINE_MAX_DEPTH) queueDepth = PIPELINE_MAX_DEPTH;
+
+    stacking_pipeline_t* p = (stacking_pipeline_t*)calloc(1, sizeof(stacking_pipeline_t));
+    if (!p) {
+        LOGE("Failed to allocate pipeline");
+        return JNI_FALSE;
+    }
+    p->ctx = ctx;
+    p->plim = plim;
+    p->dpsf = dpsf;
+    p->downsample = downsample;
+    p->min_stars = minStars;
+
+    jclass cls = (*env)->GetObjectClass(env, listener);
+    p->on_frame = (*env)->GetMethodID(env, cls, "onFrameProcessed", "(I[D)V");
+    (*env)->DeleteLocalRef(env, cls);
+    if (!p->on_frame || (*env)->GetJavaVM(env, &p->vm) != JNI_OK) {
+        LOGE("startPipeline: listener has no onFrameProcessed(int, double[])");
+        (*env)->ExceptionClear(env);
+        free(p);
+        return JNI_FALSE;
+    }
+    p->listener = (*env)->NewGlobalRef(env, listener);
+
+    if (!job_queue_init(&p->detect_q, queueDepth) || !job_queue_init(&p->warp_q, queueDepth)) {
+        LOGE("Failed to allocate pipeline queues");
+        free_pipeline(env, p);
+        return JNI_FALSE;
+    }
+
+    if (pthread_create(&p->detect_thread, NULL, detect_thread_main, p)) {
+        LOGE("Failed to start detection thread");
+        free_pipeline(env, p);
+        return JNI_FALSE;
+    }
+    if (pthread_create(&p->warp_thread, NULL, warp_thread_main, p)) {
+        LOGE("Failed to start warp thread");
+        job_queue_close(&p->detect_q);
+        pthread_join(p->detect_thread, NULL);
+        free_pipeline(env, p);
+        return JNI_FALSE;
+    }
+
+    ctx->pipeline = p;
+    LOGI("Pipeline started: queue depth %d, plim=%.1f, downsample=%d",
+         queueDepth, plim, downsample);
+    return JNI_TRUE;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_astro_app_native_1_StackingNative_submitFrameNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle,
+    jbyteArray imageData)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx || !ctx->pipeline) {
+        LOGE("submitFrame: no pipeline running");
+        return -1;
+    }
+    stacking_pipeline_t* p = ctx->pipeline;
+
+    size_t npix = (size_t)ctx->width * ctx->height;
+    jsize imageLen = (*env)->GetArrayLength(env, imageData);
+    if ((size_t)imageLen < npix) {
+        LOGE("submitFrame: imageData too short: %d < %dx%d", imageLen, ctx->width, ctx->height);
+        return -1;
+    }
+
+    frame_job_t* job = (frame_job_t*)calloc(1, sizeof(frame_job_t));
+    if (job) {
+        job->pixels = (unsigned char*)malloc(npix);
+    }
+    if (!job || !job->pixels) {
+        LOGE("submitFrame: failed to allocate frame buffer");
+        free(job);
+        return -1;
+    }
+    (*env)->GetByteArrayRegion(env, imageData, 0, (jsize)npix, (jbyte*)job->pixels);
+    job->seq = p->next_seq;
+    job->status = FRAME_STACKED;
+
+    // Blocks while the detection queue is full (back-pressure)
+    if (!job_queue_push(&p->detect_q, job)) {
+        free_job(job);
+        return -1;
+    }
+    return p->next_seq++;
+}
+
+JNIEXPORT void JNICALL
+Java_com_astro_app_native_1_StackingNative_finishPipelineNative(
+    JNIEnv *env,
+    jclass clazz,
+    jlong handle)
+{
+    stacking_context_t* ctx = (stacking_context_t*)(intptr_t)handle;
+    if (!ctx) {
+        return;
+    }
+    finish_pipeline(env, ctx);
+}
+
 JNIEXPORT jbyteArray JNICALL
 Java_com_astro_app_native_1_StackingNative_getStackedImageNative(
     JNIEnv *env,
@@ -771,6 +2305,11 @@ Java_com_astro_app_native_1_StackingNative_getStackedImageNative(
         return NULL;
     }
 
+    if (ctx->pipeline) {
+        LOGE("getStackedImage called before finishPipeline");
+        return NULL;
+    }
+
     if (ctx->frame_count == 0) {
         LOGE("No frames stacked yet");
         return NULL;
@@ -789,16 +2328,21 @@ Java_com_astro_app_native_1_StackingNative_getStackedImageNative(
         return NULL;
     }
 
-    // Average the accumulated values
-    for (int i = 0; i < npix; i++) {
-        if (ctx->count[i] > 0) {
-            float avg = ctx->sum_r[i] / (float)ctx->count[i];
-            int val = (int)(avg + 0.5f);
-            if (val < 0) val = 0;
-            if (val > 255) val = 255;
-            pixels[i] = (jbyte)val;
-        } else {
-            pixels[i] = 0;
+    if (ctx->combine_mode == COMBINE_MEDIAN && ctx->store) {
+        int ok = frame_store_combine_percentile(ctx->store, 50.0, (unsigned char*)pixels);
+        (*env)->ReleaseByteArrayElements(env, result, pixels, ok ? 0 : JNI_ABORT);
+        if (!ok) {
+            LOGE("Median combine failed");
+            return NULL;
+        }
+        LOGI("Generated median-stacked image from %d frames", ctx->store->num_frames);
+        return result;
+    }
+
+    // Average the accumulated values, one tile at a time
+    for (int ty = 0; ty < ctx->tiles_y; ty++) {
+        for (int tx = 0; tx < ctx->tiles_x; tx++) {
+            resolve_tile_mean(ctx, tx, ty, (unsigned char*)pixels);
         }
     }
 
@@ -832,10 +2376,12 @@ Java_com_astro_app_native_1_StackingNative_releaseNative(
         return;
     }
 
-    free(ctx->sum_r);
-    free(ctx->count);
+    finish_pipeline(env, ctx);
+    free_accumulator(ctx);
     free(ctx->ref_stars);
     free(ctx->ref_triangles);
+    frame_store_close(ctx->store);
+    stack_checkpoint_close(ctx->checkpoint);
     free(ctx);
 
     LOGI("Stacking context released");
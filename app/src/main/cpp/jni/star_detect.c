@@ -0,0 +1,367 @@
+#include <android/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "astrometry/simplexy.h"
+#include "astrometry/image2xy.h"
+#include "star_detect.h"
+
+#define LOG_TAG "AstrometryNative"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+static int compare_floats(const void *a, const void *b) {
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    if (fa < fb) return -1;
+    if (fa > fb) return 1;
+    return 0;
+}
+
+float* detect_stars_u8(const unsigned char* pixels, int width, int height,
+                       float plim, float dpsf, int downsample, int* out_num_stars)
+{
+    *out_num_stars = 0;
+
+    // Convert u8 grayscale to float, matching solve-field's code path.
+    // solve-field reads BITPIX=8 FITS as TFLOAT via cfitsio, so image2xy_run
+    // always receives float data. Using image_u8 produces different detection
+    // results (different star count and order).
+    int npix = width * height;
+    float* image_f = (float*)malloc(npix * sizeof(float));
+    if (!image_f) {
+        LOGE("Failed to allocate float image (%dx%d)", width, height);
+        return NULL;
+    }
+    for (int i = 0; i < npix; i++) {
+        image_f[i] = (float)pixels[i];
+    }
+
+    // Set up simplexy parameters
+    simplexy_t params;
+    memset(&params, 0, sizeof(simplexy_t));
+    simplexy_fill_in_defaults(&params);
+
+    params.image = image_f;
+    params.nx = width;
+    params.ny = height;
+    params.dpsf = dpsf;
+    params.plim = plim;
+    params.dlim = 1.0;
+    params.saddle = 5.0;
+    params.maxper = 1000;
+    params.maxnpeaks = 100000;
+    params.maxsize = 2000;
+    params.halfbox = 100;
+
+    LOGI("Running image2xy on %dx%d image (float), downsample=%d, plim=%.1f, dpsf=%.1f",
+         width, height, downsample, plim, dpsf);
+
+    // Adaptive plim retry: if too few stars detected, retry with lower threshold.
+    // plim=8 is conservative; astrometry.net's u8 default is plim=4.
+    float plim_values[3];
+    int num_plim = 0;
+    plim_values[num_plim++] = plim;
+    if (6.0f < plim) plim_values[num_plim++] = 6.0f;
+    if (4.0f < plim) plim_values[num_plim++] = 4.0f;
+    int MIN_STARS_RETRY = 30;
+
+    float* current_image = image_f;  // Track current image buffer for cleanup
+    int prev_npeaks = 0;
+
+    for (int attempt = 0; attempt < num_plim; attempt++) {
+        if (attempt > 0) {
+            prev_npeaks = params.npeaks;
+            // Re-copy float image since simplexy modifies it internally
+            simplexy_free_contents(&params);  // Also frees params.image (== current_image)
+            memset(&params, 0, sizeof(simplexy_t));
+            simplexy_fill_in_defaults(&params);
+            float* image_f2 = (float*)malloc(npix * sizeof(float));
+            if (!image_f2) {
+                LOGE("Failed to allocate float image for retry");
+                return NULL;
+            }
+            for (int i = 0; i < npix; i++) {
+                image_f2[i] = (float)pixels[i];
+            }
+            current_image = image_f2;
+            params.image = image_f2;
+            params.nx = width;
+            params.ny = height;
+            params.dpsf = dpsf;
+            params.plim = plim_values[attempt];
+            params.dlim = 1.0;
+            params.saddle = 5.0;
+            params.maxper = 1000;
+            params.maxnpeaks = 100000;
+            params.maxsize = 2000;
+            params.halfbox = 100;
+            LOGI("Retry %d: plim=%.1f (previous had %d stars < %d)",
+                 attempt, plim_values[attempt], prev_npeaks, MIN_STARS_RETRY);
+        }
+
+        int result = image2xy_run(&params, downsample, 0);
+        if (result != 0) {
+            LOGE("Star detection failed (result=%d)", result);
+            simplexy_free_contents(&params);
+            return NULL;
+        }
+
+        if (params.npeaks >= MIN_STARS_RETRY || attempt == num_plim - 1) {
+            break;
+        }
+    }
+
+    if (params.npeaks == 0) {
+        LOGE("No stars found after all plim attempts");
+        simplexy_free_contents(&params);
+        return NULL;
+    }
+
+    LOGI("Detected %d stars (plim=%.1f)", params.npeaks, params.plim);
+
+    // Filter detections: reject edge stars and hot pixels
+    {
+        int N_raw = params.npeaks;
+        int MIN_REMAIN = 30;
+
+        // Edge margin: max(10px, 1% of dimension)
+        float margin_x = width * 0.01f;
+        if (margin_x < 10.0f) margin_x = 10.0f;
+        float margin_y = height * 0.01f;
+        if (margin_y < 10.0f) margin_y = 10.0f;
+
+        // Compute median flux via partial sort (selection algorithm)
+        float* flux_copy = malloc(N_raw * sizeof(float));
+        if (!flux_copy) {
+            LOGE("flux_copy malloc failed (%d floats), skipping edge/hot-pixel filter", N_raw);
+        } else {
+            memcpy(flux_copy, params.flux, N_raw * sizeof(float));
+            qsort(flux_copy, N_raw, sizeof(float), compare_floats);
+            float median_flux = flux_copy[N_raw / 2];
+            float hot_threshold = 50.0f * median_flux;
+            free(flux_copy);
+
+            // Single-pass filter with array compaction
+            int kept = 0;
+            for (int i = 0; i < N_raw; i++) {
+                // Edge check
+                if (params.x[i] < margin_x || params.x[i] > width - margin_x ||
+                    params.y[i] < margin_y || params.y[i] > height - margin_y) {
+                    continue;
+                }
+                // Hot pixel check
+                if (median_flux > 0 && params.flux[i] > hot_threshold) {
+                    continue;
+                }
+                // Safety floor: stop filtering if we'd go below minimum
+                // (count remaining unfiltered stars)
+                if (kept < MIN_REMAIN && (N_raw - i + kept) <= MIN_REMAIN) {
+                    // Keep all remaining to avoid going below floor
+                    for (int j = i; j < N_raw && kept < N_raw; j++) {
+                        if (j != kept) {
+                            params.x[kept] = params.x[j];
+                            params.y[kept] = params.y[j];
+                            params.flux[kept] = params.flux[j];
+                            if (params.background) params.background[kept] = params.background[j];
+                        }
+                        kept++;
+                    }
+                    break;
+                }
+                if (i != kept) {
+                    params.x[kept] = params.x[i];
+                    params.y[kept] = params.y[i];
+                    params.flux[kept] = params.flux[i];
+                    if (params.background) params.background[kept] = params.background[i];
+                }
+                kept++;
+            }
+            int filtered = N_raw - kept;
+            if (filtered > 0) {
+                LOGI("Filtered %d detections (edge/hot pixel), %d remaining", filtered, kept);
+                params.npeaks = kept;
+            }
+        }
+    }
+
+    int N = params.npeaks;
+
+    // Resort stars using solve-field's interleaved merge algorithm
+    // (from resort-xylist.c). This interleaves two orderings:
+    // 1. Sorted by background-subtracted flux (descending)
+    // 2. Sorted by raw flux (flux + background) (descending)
+    // This ensures the brightest stars appear first in the list,
+    // which is critical for the solver's depth iteration.
+    int* perm1 = malloc(N * sizeof(int));  // flux-sorted indices
+    int* perm2 = malloc(N * sizeof(int));  // raw-signal-sorted indices
+    float* rawsignal = malloc(N * sizeof(float));
+    unsigned char* used = calloc(N, 1);
+    int* output_order = malloc(N * sizeof(int));
+
+    if (!perm1 || !perm2 || !rawsignal || !used || !output_order) {
+        LOGE("Failed to allocate resort buffers");
+        free(perm1); free(perm2); free(rawsignal); free(used); free(output_order);
+        simplexy_free_contents(&params);
+        return NULL;
+    }
+
+    // Initialize permutation arrays as identity
+    for (int i = 0; i < N; i++) {
+        perm1[i] = i;
+        perm2[i] = i;
+        rawsignal[i] = params.flux[i] + params.background[i];
+    }
+
+    // Sort perm1 by flux descending (simple insertion sort, N is small ~700)
+    for (int i = 1; i < N; i++) {
+        int key = perm1[i];
+        float keyval = params.flux[key];
+        int j = i - 1;
+        while (j >= 0 && params.flux[perm1[j]] < keyval) {
+            perm1[j + 1] = perm1[j];
+            j--;
+        }
+        perm1[j + 1] = key;
+    }
+
+    // Sort perm2 by rawsignal descending
+    for (int i = 1; i < N; i++) {
+        int key = perm2[i];
+        float keyval = rawsignal[key];
+        int j = i - 1;
+        while (j >= 0 && rawsignal[perm2[j]] < keyval) {
+            perm2[j + 1] = perm2[j];
+            j--;
+        }
+        perm2[j + 1] = key;
+    }
+
+    // Interleave: for each rank, emit perm1[i] then perm2[i] (skip used)
+    int out_idx = 0;
+    for (int i = 0; i < N && out_idx < N; i++) {
+        if (!used[perm1[i]]) {
+            used[perm1[i]] = 1;
+            output_order[out_idx++] = perm1[i];
+        }
+        if (out_idx < N && !used[perm2[i]]) {
+            used[perm2[i]] = 1;
+            output_order[out_idx++] = perm2[i];
+        }
+    }
+
+    LOGI("Resorted %d stars (interleaved flux/rawsignal)", out_idx);
+
+    // Uniformize: spatially distribute stars across grid bins (matching
+    // solve-field's uniformize.py). Round-robin interleaves bins so that
+    // early stars span the entire field, enabling the solver to form
+    // field-spanning quads immediately instead of clustering in one area.
+    {
+        float xmin = params.x[output_order[0]], xmax = xmin;
+        float ymin = params.y[output_order[0]], ymax = ymin;
+        for (int i = 1; i < N; i++) {
+            int s = output_order[i];
+            if (params.x[s] < xmin) xmin = params.x[s];
+            if (params.x[s] > xmax) xmax = params.x[s];
+            if (params.y[s] < ymin) ymin = params.y[s];
+            if (params.y[s] > ymax) ymax = params.y[s];
+        }
+        float Wf = xmax - xmin;
+        float Hf = ymax - ymin;
+
+        if (Wf > 0 && Hf > 0) {
+            int UNIFORMIZE_N = 10;
+            int NX = (int)(Wf / sqrtf(Wf * Hf / (float)UNIFORMIZE_N) + 0.5f);
+            if (NX < 1) NX = 1;
+            int NY = (int)((float)UNIFORMIZE_N / (float)NX + 0.5f);
+            if (NY < 1) NY = 1;
+            int nbins = NX * NY;
+
+            LOGI("Uniformize: %dx%d bins", NX, NY);
+
+            int* bin_counts = calloc(nbins, sizeof(int));
+            int* bin_assign = malloc(N * sizeof(int));
+
+            for (int i = 0; i < N; i++) {
+                int s = output_order[i];
+                int ix = (int)((params.x[s] - xmin) / Wf * NX);
+                int iy = (int)((params.y[s] - ymin) / Hf * NY);
+                if (ix >= NX) ix = NX - 1;
+                if (iy >= NY) iy = NY - 1;
+                if (ix < 0) ix = 0;
+                if (iy < 0) iy = 0;
+                bin_assign[i] = iy * NX + ix;
+                bin_counts[bin_assign[i]]++;
+            }
+
+            int maxlen = 0;
+            for (int b = 0; b < nbins; b++)
+                if (bin_counts[b] > maxlen) maxlen = bin_counts[b];
+
+            int** bin_lists = malloc(nbins * sizeof(int*));
+            int* bin_pos = calloc(nbins, sizeof(int));
+            for (int b = 0; b < nbins; b++)
+                bin_lists[b] = malloc(bin_counts[b] * sizeof(int));
+            for (int i = 0; i < N; i++) {
+                int b = bin_assign[i];
+                bin_lists[b][bin_pos[b]++] = i;
+            }
+
+            int* uniform_order = malloc(N * sizeof(int));
+            int u_idx = 0;
+            int* thisrow = malloc(nbins * sizeof(int));
+            for (int round = 0; round < maxlen; round++) {
+                int rowlen = 0;
+                for (int b = 0; b < nbins; b++) {
+                    if (round < bin_counts[b])
+                        thisrow[rowlen++] = bin_lists[b][round];
+                }
+                // Sort by resort index (preserves brightness ordering within round)
+                for (int i = 1; i < rowlen; i++) {
+                    int key = thisrow[i];
+                    int j = i - 1;
+                    while (j >= 0 && thisrow[j] > key) { thisrow[j+1] = thisrow[j]; j--; }
+                    thisrow[j+1] = key;
+                }
+                for (int i = 0; i < rowlen; i++)
+                    uniform_order[u_idx++] = output_order[thisrow[i]];
+            }
+
+            for (int i = 0; i < N; i++)
+                output_order[i] = uniform_order[i];
+
+            free(uniform_order);
+            free(thisrow);
+            for (int b = 0; b < nbins; b++) free(bin_lists[b]);
+            free(bin_lists);
+            free(bin_pos);
+            free(bin_counts);
+            free(bin_assign);
+        }
+    }
+
+    // Create result array: [x0, y0, flux0, x1, y1, flux1, ...]
+    float* buffer = malloc(N * 3 * sizeof(float));
+    if (!buffer) {
+        free(perm1); free(perm2); free(rawsignal); free(used); free(output_order);
+        simplexy_free_contents(&params);
+        return NULL;
+    }
+    for (int i = 0; i < N; i++) {
+        int src = output_order[i];
+        buffer[i * 3] = params.x[src];
+        buffer[i * 3 + 1] = params.y[src];
+        buffer[i * 3 + 2] = params.flux[src];
+    }
+
+    free(perm1);
+    free(perm2);
+    free(rawsignal);
+    free(used);
+    free(output_order);
+    simplexy_free_contents(&params);
+
+    *out_num_stars = N;
+    return buffer;
+}
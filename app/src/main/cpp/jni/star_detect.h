@@ -0,0 +1,15 @@
+#ifndef STAR_DETECT_H
+#define STAR_DETECT_H
+
+// Star detection on an 8-bit grayscale image (row-major, width*height bytes),
+// following solve-field's pipeline: image2xy on float data with adaptive plim
+// retry, edge/hot-pixel filtering, interleaved flux/raw-signal resort and
+// spatial uniformization.
+//
+// Returns a malloc'd array [x0, y0, flux0, x1, y1, flux1, ...] of
+// *out_num_stars stars (caller frees), or NULL on failure / no stars.
+// Safe to call from any thread (simplexy is built with SIMPLEXY_REENTRANT).
+float* detect_stars_u8(const unsigned char* pixels, int width, int height,
+                       float plim, float dpsf, int downsample, int* out_num_stars);
+
+#endif
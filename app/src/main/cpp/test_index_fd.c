@@ -0,0 +1,257 @@
+/*
+ * Native test for loading indexes in place from a container file - runs
+ * without JNI/Android.
+ *
+ * Usage: test_index_fd index.fits [index.fits ...]
+ * Concatenates the given index files into one container (after an odd-sized
+ * header, with odd-sized gaps between them, the way assets sit in an APK),
+ * opens each one with index_load_fd() and checks it against index_load() of
+ * the original file.  Then does the same through the metadata files of
+ * index_set_meta_cache_dir(), including stale and damaged ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "astrometry/include/astrometry/index.h"
+#include "astrometry/include/astrometry/kdtree.h"
+#include "astrometry/include/astrometry/starkd.h"
+#include "astrometry/include/astrometry/quadfile.h"
+#include "astrometry/include/astrometry/log.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do {                   \
+        if (!(cond)) {                          \
+            printf("FAIL: " __VA_ARGS__);       \
+            printf("\n");                       \
+            failures++;                         \
+        }                                       \
+    } while (0)
+
+static int append_file(FILE* out, const char* path, long* length) {
+    char buf[65536];
+    size_t n;
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    *length = 0;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+        *length += n;
+    }
+    fclose(in);
+    return 0;
+}
+
+// Junk between members. It starts right after a FITS block boundary of the
+// preceding member, so a reader that ignores the member's length would take
+// it for another extension.
+static void append_junk(FILE* out, int n) {
+    for (int i = 0; i < n; i++) {
+        fputc("XTENSION= "[i % 10], out);
+    }
+}
+
+static void compare_trees(const char* what, const kdtree_t* a, const kdtree_t* b) {
+    if (a->ndata != b->ndata || a->ndim != b->ndim || a->nnodes != b->nnodes) {
+        CHECK(0, "%s: shape differs", what);
+        return;
+    }
+    CHECK(!memcmp(a->data.any, b->data.any, kdtree_sizeof_data(a)),
+          "%s: data differs", what);
+    CHECK((!a->perm && !b->perm) ||
+          (a->perm && b->perm && !memcmp(a->perm, b->perm, sizeof(u32) * a->ndata)),
+          "%s: permutation differs", what);
+}
+
+static void compare_indexes(const char* path, const index_t* a, const index_t* b) {
+    CHECK(a->indexid == b->indexid, "%s: index id %d vs %d", path, a->indexid, b->indexid);
+    CHECK(a->healpix == b->healpix && a->hpnside == b->hpnside, "%s: healpix differs", path);
+    CHECK(a->nstars == b->nstars && a->nquads == b->nquads, "%s: sizes differ", path);
+    CHECK(a->index_scale_lower == b->index_scale_lower &&
+          a->index_scale_upper == b->index_scale_upper, "%s: scale differs", path);
+    CHECK(a->circle == b->circle && a->cx_less_than_dx == b->cx_less_than_dx,
+          "%s: code flags differ", path);
+    if (a->fits->Nexts != b->fits->Nexts || a->nstars != b->nstars ||
+        a->nquads != b->nquads || a->dimquads != b->dimquads) {
+        CHECK(0, "%s: structure differs (%d vs %d extensions)", path,
+              a->fits->Nexts, b->fits->Nexts);
+        return;
+    }
+    for (int e = 0; e < a->fits->Nexts; e++) {
+        CHECK(anqfits_data_start(a->fits, e) == anqfits_data_start(b->fits, e) &&
+              anqfits_data_size(a->fits, e) == anqfits_data_size(b->fits, e),
+              "%s: extension %d differs", path, e);
+    }
+    compare_trees("star tree", a->starkd->tree, b->starkd->tree);
+    compare_trees("code tree", a->codekd->tree, b->codekd->tree);
+    CHECK(!memcmp(a->quads->quadarray, b->quads->quadarray,
+                  sizeof(u32) * a->dimquads * a->nquads), "%s: quads differ", path);
+
+    // A search touches the mapped tree nodes, not just the data.
+    double xyz[3];
+    startree_get(a->starkd, 0, xyz);
+    kdtree_qres_t* ra = kdtree_rangesearch(a->starkd->tree, xyz, 1e-3);
+    kdtree_qres_t* rb = kdtree_rangesearch(b->starkd->tree, xyz, 1e-3);
+    CHECK(ra && rb && ra->nres == rb->nres && ra->nres > 0, "%s: star search differs", path);
+    kdtree_free_query(ra);
+    kdtree_free_query(rb);
+}
+
+// Truncates every metadata file in "dir".
+static int truncate_meta_files(const char* dir) {
+    char path[1024];
+    struct dirent* de;
+    int n = 0;
+    DIR* d = opendir(dir);
+    if (!d)
+        return 0;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (truncate(path, 100) == 0)
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+// Loads each member of the container with metadata files in "dir", and
+// checks it against a plain index_load() of the original.  Loads that use a
+// metadata file never parse the kd-tree headers, so the code tree has no
+// header.
+static void check_meta_loads(const char* dir, int fd, int n, char** paths,
+                             long* offsets, long* lengths, const char* what,
+                             int expect_meta) {
+    for (int i = 0; i < n; i++) {
+        const char* path = paths[i];
+        index_set_meta_cache_dir(NULL);
+        index_t* ref = index_load(path, 0, NULL);
+        index_set_meta_cache_dir(dir);
+        index_t* idx = index_load_fd(fd, offsets[i], lengths[i], path, 0, NULL);
+        index_t* meta = index_load_fd(fd, offsets[i], lengths[i], path,
+                                      INDEX_ONLY_LOAD_METADATA, NULL);
+        CHECK(ref && idx && meta, "%s: %s: load failed", path, what);
+        if (ref && idx && meta) {
+            CHECK((idx->codekd->header == NULL) == expect_meta,
+                  "%s: %s: metadata file %s", path, what,
+                  expect_meta ? "not used" : "used");
+            compare_indexes(path, ref, idx);
+            CHECK(meta->indexid == ref->indexid && meta->nquads == ref->nquads &&
+                  meta->index_jitter == ref->index_jitter &&
+                  meta->cutnside == ref->cutnside &&
+                  (meta->cutband ? (ref->cutband && !strcmp(meta->cutband, ref->cutband))
+                   : !ref->cutband) &&
+                  meta->meanx_less_than_half == ref->meanx_less_than_half &&
+                  !meta->starkd, "%s: %s: metadata-only load differs", path, what);
+            CHECK(index_reload(meta) == 0, "%s: %s: reload failed", path, what);
+            if (meta->starkd)
+                compare_trees("reloaded star tree", meta->starkd->tree,
+                              ref->starkd->tree);
+            CHECK(index_prefetch(idx, INDEX_PREFETCH_TOUCH) == 0,
+                  "%s: %s: prefetch failed", path, what);
+        }
+        index_free(ref);
+        index_free(idx);
+        index_free(meta);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s index.fits [index.fits ...]\n", argv[0]);
+        return 1;
+    }
+    log_init(LOG_MSG);
+
+    char container[] = "/tmp/test_index_fd_XXXXXX";
+    int cfd = mkstemp(container);
+    FILE* out = (cfd < 0) ? NULL : fdopen(cfd, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to create container\n");
+        return 1;
+    }
+    int n = argc - 1;
+    long offsets[n], lengths[n];
+    append_junk(out, 1234);
+    for (int i = 0; i < n; i++) {
+        offsets[i] = ftell(out);
+        if (append_file(out, argv[i + 1], &lengths[i])) {
+            fclose(out);
+            unlink(container);
+            return 1;
+        }
+        // The last member runs to the end of the file.
+        if (i < n - 1) {
+            append_junk(out, 4093 + 2880 * i);
+        }
+    }
+    fclose(out);
+
+    int fd = open(container, O_RDONLY);
+    // The container is only reachable through fd from now on.
+    unlink(container);
+
+    for (int i = 0; i < n; i++) {
+        const char* path = argv[i + 1];
+        int before = failures;
+        index_t* ref = index_load(path, 0, NULL);
+        index_t* idx = index_load_fd(fd, offsets[i], lengths[i], path, 0, NULL);
+        CHECK(ref != NULL, "%s: index_load failed", path);
+        CHECK(idx != NULL, "%s: index_load_fd failed", path);
+        if (ref && idx) {
+            compare_indexes(path, ref, idx);
+            CHECK(index_prefetch(idx, INDEX_PREFETCH_TOUCH) == 0, "%s: prefetch failed", path);
+        }
+        printf("%s: at %ld, %ld bytes: %s\n", path, offsets[i], lengths[i],
+               failures > before ? "FAIL" : "ok");
+        index_free(ref);
+        index_free(idx);
+    }
+
+    // Without a length, the data run to the end of the file.
+    index_t* last = index_load_fd(fd, offsets[n - 1], -1, NULL, INDEX_ONLY_LOAD_METADATA, NULL);
+    CHECK(last != NULL, "open to end of file failed");
+    if (last) {
+        CHECK(index_reload(last) == 0, "reload from descriptor failed");
+        index_free(last);
+    }
+
+    char metadir[] = "/tmp/test_index_meta_XXXXXX";
+    if (!mkdtemp(metadir)) {
+        fprintf(stderr, "Failed to create metadata directory\n");
+        return 1;
+    }
+    // Nothing there yet: parse, and write the metadata.
+    check_meta_loads(metadir, fd, n, argv + 1, offsets, lengths, "first load", 0);
+    check_meta_loads(metadir, fd, n, argv + 1, offsets, lengths, "from metadata", 1);
+    // A changed container makes the metadata stale...
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { 1234567890, 0 } };
+    CHECK(futimens(fd, times) == 0, "futimens failed");
+    check_meta_loads(metadir, fd, n, argv + 1, offsets, lengths, "stale metadata", 0);
+    check_meta_loads(metadir, fd, n, argv + 1, offsets, lengths, "rewritten metadata", 1);
+    // ... and damaged metadata is ignored, too.
+    CHECK(truncate_meta_files(metadir) == n, "expected %i metadata files", n);
+    check_meta_loads(metadir, fd, n, argv + 1, offsets, lengths, "damaged metadata", 0);
+    printf("metadata files: %s\n", failures ? "FAIL" : "ok");
+    index_set_meta_cache_dir(NULL);
+    {
+        char cmd[256];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", metadir);
+        if (system(cmd))
+            fprintf(stderr, "Failed to remove %s\n", metadir);
+    }
+    close(fd);
+
+    printf("STATUS: %s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
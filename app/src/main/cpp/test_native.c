@@ -1,6 +1,11 @@
 /*
  * Native test for astrometry star detection - runs without JNI/Android
  * Compile: gcc -o test_native test_native.c ... -lm
+ *
+ * Usage: test_native <image> [scaleLow scaleHigh index.fits ...]
+ * With index files, the detected stars are also solved (with the same
+ * settings and depth iteration as solveFieldNative) and the solver's
+ * per-depth, per-index statistics are printed.
  */
 
 #include <stdio.h>
@@ -14,6 +19,118 @@
 #include "astrometry/include/astrometry/simplexy.h"
 #include "astrometry/include/astrometry/image2xy.h"
 #include "astrometry/include/astrometry/log.h"
+#include "astrometry/include/astrometry/permutedsort.h"
+#include "astrometry/include/astrometry/solver.h"
+#include "astrometry/include/astrometry/index.h"
+#include "astrometry/include/astrometry/starxy.h"
+#include "astrometry/include/astrometry/tic.h"
+
+// Solves the detected stars and prints where the time went.
+static int solve_and_print_stats(const simplexy_t* params, int width, int height,
+                                 double scale_low, double scale_high,
+                                 char** index_paths, int num_indexes) {
+    solver_t* solver = solver_new();
+    int* perm;
+    int n = params->npeaks;
+
+    // Brightest first, as the solver expects.
+    perm = permuted_sort(params->flux, sizeof(float), compare_floats_desc, NULL, n);
+    starxy_t* field = starxy_new(n, TRUE, FALSE);
+    for (int i = 0; i < n; i++) {
+        starxy_set(field, i, params->x[perm[i]], params->y[perm[i]]);
+        starxy_set_flux(field, i, params->flux[perm[i]]);
+    }
+    free(perm);
+
+    // Same settings as solveFieldNative
+    solver->funits_lower = scale_low;
+    solver->funits_upper = scale_high;
+    solver_set_quad_size_fraction(solver, 0.1, 1.0);
+    solver_set_field_bounds(solver, 0, width, 0, height);
+    solver_set_field(solver, field);
+    solver->verify_pix = 1.0;
+    solver->distractor_ratio = 0.25;
+    solver->codetol = 0.01;
+    solver->parity = PARITY_BOTH;
+    solver->logratio_tokeep = 20.0;
+    solver->logratio_totune = log(1e6);
+    solver->do_tweak = TRUE;
+    solver->distance_from_quad_bonus = TRUE;
+    solver->tweak_aborder = 2;
+    solver->tweak_abporder = 2;
+    solver->collect_stats = TRUE;
+
+    index_t* indexes[num_indexes];
+    int nloaded = 0;
+    for (int i = 0; i < num_indexes; i++) {
+        indexes[nloaded] = index_load(index_paths[i], 0, NULL);
+        if (!indexes[nloaded]) {
+            fprintf(stderr, "Failed to load index: %s\n", index_paths[i]);
+            continue;
+        }
+        solver_add_index(solver, indexes[nloaded]);
+        nloaded++;
+    }
+
+    printf("\n=== SOLVE ===\n");
+    double t0 = timenow();
+    int solved = 0;
+    int lasthi = 0;
+    for (int depth = 10; depth <= 200 && !solved && lasthi < n; depth += 10) {
+        solver->startobj = lasthi;
+        solver->endobj = (depth > n) ? n : depth;
+        lasthi = depth;
+        solver_reset_counters(solver);
+        solver_reset_best_match(solver);
+        solver_run(solver);
+        solved = solver_did_solve(solver);
+    }
+    double elapsed = timenow() - t0;
+
+    if (solved) {
+        MatchObj* mo = solver_get_best_match(solver);
+        printf("SOLVED: RA=%.4f, Dec=%.4f, scale=%.3f arcsec/pix, logodds=%.1f, index %d\n",
+               mo->wcstan.crval[0], mo->wcstan.crval[1], mo->scale, mo->logodds, mo->indexid);
+    } else {
+        printf("NOT SOLVED\n");
+    }
+    printf("Wall time: %.3f s\n", elapsed);
+
+    printf("\n=== SOLVER STATS ===\n");
+    printf("%-9s %6s %7s %8s %7s %8s %8s %9s %9s %9s %9s\n", "objects", "index",
+           "quads", "matches", "scaleok", "verified", "prefilt",
+           "quads ms", "search ms", "fit ms", "verify ms");
+    solver_stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < solver_n_stats(solver); i++) {
+        const solver_stats_t* st = solver_get_stats(solver, i);
+        printf("%3d-%-5d %6d %7d %8d %7d %8d %8d %9.2f %9.2f %9.2f %9.2f\n",
+               st->startobj + 1, st->endobj, st->indexid, st->numtries, st->nummatches,
+               st->numscaleok, st->num_verified, st->num_prefilter_rejected,
+               st->time_quads * 1e3, st->time_search * 1e3,
+               st->time_fit * 1e3, st->time_verify * 1e3);
+        total.numtries += st->numtries;
+        total.nummatches += st->nummatches;
+        total.numscaleok += st->numscaleok;
+        total.num_verified += st->num_verified;
+        total.num_prefilter_rejected += st->num_prefilter_rejected;
+        total.time_quads += st->time_quads;
+        total.time_search += st->time_search;
+        total.time_fit += st->time_fit;
+        total.time_verify += st->time_verify;
+    }
+    printf("%-9s %6s %7d %8d %7d %8d %8d %9.2f %9.2f %9.2f %9.2f\n", "total", "",
+           total.numtries, total.nummatches, total.numscaleok, total.num_verified,
+           total.num_prefilter_rejected, total.time_quads * 1e3, total.time_search * 1e3,
+           total.time_fit * 1e3, total.time_verify * 1e3);
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (int i = 0; i < nloaded; i++) {
+        index_free(indexes[i]);
+    }
+    return solved;
+}
 
 int main(int argc, char** argv) {
     const char* image_path = "/mnt/d/Download/DIP/img.png";
@@ -113,6 +230,13 @@ int main(int argc, char** argv) {
         printf("STATUS: CHECK - more than 100 stars difference\n");
     }
 
+    if (argc > 4) {
+        // Solving logs a lot at LOG_VERB.
+        log_init(LOG_MSG);
+        solve_and_print_stats(&params, width, height, atof(argv[2]), atof(argv[3]),
+                              argv + 4, argc - 4);
+    }
+
     // Cleanup
     simplexy_free_contents(&params);
     free(grayscale);
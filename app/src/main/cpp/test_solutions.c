@@ -0,0 +1,203 @@
+/*
+ * Native test for the solver's list of best distinct solutions - runs
+ * without JNI/Android.
+ *
+ * Usage: test_solutions index.fits [index.fits ...]
+ * Synthesizes a field from the stars of the first index and solves it
+ * twice: once with an unreachable keep threshold, so that every recorded
+ * solution is a runner-up that never passed verification, and once
+ * normally.  Checks the log-odds and match/conflict/distractor counts of
+ * the recorded solutions, and that no two of them are the same solution.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "astrometry/include/astrometry/solver.h"
+#include "astrometry/include/astrometry/index.h"
+#include "astrometry/include/astrometry/starkd.h"
+#include "astrometry/include/astrometry/starutil.h"
+#include "astrometry/include/astrometry/starxy.h"
+#include "astrometry/include/astrometry/sip.h"
+#include "astrometry/include/astrometry/log.h"
+
+#define FIELD_W 1600
+#define FIELD_H 1200
+#define FIELD_SCALE 30.0  // arcsec/pixel
+#define MAX_STARS 60
+
+// solver.c's criteria for two matches being the same solution.
+#define SAME_RADIUS 0.1  // fraction of the field radius
+#define SAME_ANGLE 5.0   // degrees
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do {                   \
+        if (!(cond)) {                          \
+            printf("FAIL: " __VA_ARGS__);       \
+            printf("\n");                       \
+            failures++;                         \
+        }                                       \
+    } while (0)
+
+// Projects the index stars around (ra, dec) into a FIELD_W x FIELD_H image,
+// brightest (in index order) first.
+static starxy_t* make_field(const index_t* index, double ra, double dec) {
+    tan_t wcs;
+    double s = FIELD_SCALE / 3600.0;
+    double xyz[3];
+    double r;
+    double* starxyz = NULL;
+    int nstars = 0;
+    int n = 0;
+
+    memset(&wcs, 0, sizeof(wcs));
+    wcs.crval[0] = ra;
+    wcs.crval[1] = dec;
+    wcs.crpix[0] = FIELD_W / 2.0;
+    wcs.crpix[1] = FIELD_H / 2.0;
+    wcs.cd[0][0] = -s;
+    wcs.cd[1][1] = s;
+    wcs.imagew = FIELD_W;
+    wcs.imageh = FIELD_H;
+
+    radecdeg2xyzarr(ra, dec, xyz);
+    r = deg2rad(hypot(FIELD_W, FIELD_H) / 2.0 * s);
+    startree_search_for(index->starkd, xyz, r * r, &starxyz, NULL, NULL, &nstars);
+
+    starxy_t* field = starxy_new(MAX_STARS, TRUE, FALSE);
+    for (int i = 0; i < nstars && n < MAX_STARS; i++) {
+        double x, y;
+        if (!tan_xyzarr2pixelxy(&wcs, starxyz + 3 * i, &x, &y))
+            continue;
+        if (x < 0 || y < 0 || x >= FIELD_W || y >= FIELD_H)
+            continue;
+        starxy_set(field, n, x, y);
+        starxy_set_flux(field, n, MAX_STARS - n);
+        n++;
+    }
+    field->N = n;
+    free(starxyz);
+    return field;
+}
+
+// Solves "field" against "indexes"; returns whether it solved.  The solver
+// takes ownership of "field".
+static int solve(solver_t* solver, starxy_t* field, index_t** indexes, int n,
+                 double logratio_tokeep) {
+    int nstars = field->N;
+    solver->funits_lower = FIELD_SCALE * 0.8;
+    solver->funits_upper = FIELD_SCALE * 1.25;
+    solver_set_quad_size_fraction(solver, 0.1, 1.0);
+    solver_set_field_bounds(solver, 0, FIELD_W, 0, FIELD_H);
+    solver_set_field(solver, field);
+    solver->verify_pix = 1.0;
+    solver->distractor_ratio = 0.25;
+    solver->codetol = 0.01;
+    solver->parity = PARITY_BOTH;
+    solver->logratio_toprint = log(1e6);
+    solver->logratio_totune = log(1e6);
+    solver->logratio_tokeep = logratio_tokeep;
+    solver->distance_from_quad_bonus = TRUE;
+    for (int i = 0; i < n; i++)
+        solver_add_index(solver, indexes[i]);
+    solver->startobj = 0;
+    solver->endobj = nstars;
+    solver_run(solver);
+    return solver_did_solve(solver);
+}
+
+static int same_solution(const MatchObj* m1, const MatchObj* m2) {
+    double r, d2 = 0, dangle;
+    if (m1->parity != m2->parity)
+        return 0;
+    r = SAME_RADIUS * fmax(m1->radius, m2->radius);
+    for (int k = 0; k < 3; k++)
+        d2 += (m1->center[k] - m2->center[k]) * (m1->center[k] - m2->center[k]);
+    if (d2 > r * r)
+        return 0;
+    dangle = fabs(remainder(tan_get_orientation(&m1->wcstan) -
+                            tan_get_orientation(&m2->wcstan), 360.0));
+    return dangle <= SAME_ANGLE;
+}
+
+// Checks the recorded solutions; returns how many there are.
+static int check_solutions(const solver_t* solver, const char* what) {
+    MatchObj sols[DEFAULT_MAX_SOLUTIONS];
+    int n = solver_get_solutions(solver, sols, DEFAULT_MAX_SOLUTIONS);
+    for (int i = 0; i < n; i++) {
+        const MatchObj* mo = sols + i;
+        printf("%s: solution %d: logodds %.1f, %d matches, %d conflicts, %d distractors\n",
+               what, i, mo->logodds, mo->nmatch, mo->nconflict, mo->ndistractor);
+        CHECK(mo->logodds >= solver->logratio_toprint,
+              "%s: solution %d below the print threshold", what, i);
+        CHECK(i == 0 || mo->logodds <= sols[i - 1].logodds,
+              "%s: solution %d out of order", what, i);
+        // Only matched stars raise the log-odds above zero.
+        CHECK(mo->nmatch > 0, "%s: solution %d has no matches", what, i);
+        // Verification counts the field stars other than the quad's own.
+        CHECK(mo->nconflict >= 0 && mo->ndistractor >= 0 &&
+              mo->nmatch + mo->nconflict + mo->ndistractor <= mo->nfield - mo->dimquads,
+              "%s: solution %d has bad counts", what, i);
+        for (int j = 0; j < i; j++)
+            CHECK(!same_solution(sols + j, mo),
+                  "%s: solutions %d and %d are the same solution", what, j, i);
+    }
+    return n;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s index.fits [index.fits ...]\n", argv[0]);
+        return 1;
+    }
+    log_init(LOG_ERROR);
+
+    int n = argc - 1;
+    index_t* indexes[n];
+    for (int i = 0; i < n; i++) {
+        indexes[i] = index_load(argv[i + 1], 0, NULL);
+        if (!indexes[i]) {
+            fprintf(stderr, "Failed to load index: %s\n", argv[i + 1]);
+            return 1;
+        }
+    }
+
+    // Center the field on a star of the first index.
+    double ra, dec;
+    startree_get_radec(indexes[0]->starkd, 0, &ra, &dec);
+    starxy_t* field = make_field(indexes[0], ra, dec);
+    printf("field: %d stars around %.3f, %.3f\n", field->N, ra, dec);
+    CHECK(field->N >= 10, "too few field stars");
+
+    // Nothing passes: the solutions are all runners-up.
+    solver_t* solver = solver_new();
+    CHECK(!solve(solver, field, indexes, n, log(1e300)), "solved without a keepable hit");
+    CHECK(check_solutions(solver, "runners-up") > 0, "no runners-up recorded");
+    solver_clear_indexes(solver);
+    solver_free(solver);
+
+    // The best solution is the accepted match.
+    solver = solver_new();
+    CHECK(solve(solver, make_field(indexes[0], ra, dec), indexes, n, log(1e9)), "not solved");
+    if (check_solutions(solver, "solved") > 0) {
+        MatchObj best;
+        MatchObj* mo = solver_get_best_match(solver);
+        solver_get_solutions(solver, &best, 1);
+        CHECK(best.logodds == mo->logodds && best.nmatch == mo->nmatch &&
+              best.nconflict == mo->nconflict && best.ndistractor == mo->ndistractor,
+              "best solution differs from the best match");
+    } else {
+        CHECK(0, "no solutions recorded");
+    }
+    solver_clear_indexes(solver);
+    solver_free(solver);
+
+    for (int i = 0; i < n; i++)
+        index_free(indexes[i]);
+
+    printf("STATUS: %s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
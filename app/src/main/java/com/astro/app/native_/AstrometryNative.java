@@ -3,8 +3,10 @@ package com.astro.app.native_;
 import android.graphics.Bitmap;
 import android.util.Log;
 
+import java.io.File;
 import java.util.ArrayList;
 import java.util.List;
+import java.util.concurrent.atomic.AtomicBoolean;
 
 /**
  * JNI interface to astrometry.net C library for star detection and plate solving.
@@ -12,6 +14,10 @@ import java.util.List;
 public class AstrometryNative {
     private static final String TAG = "AstrometryNative";
     private static boolean libraryLoaded = false;
+    // The index metadata directory passed to native code, if any.
+    private static String indexCacheDir = null;
+    // Set once the index prefetch has been started in this process.
+    private static final AtomicBoolean indexesPrefetched = new AtomicBoolean(false);
 
     static {
         try {
@@ -53,7 +59,8 @@ public class AstrometryNative {
      * @param scaleLow Lower pixel scale bound (arcsec/pixel)
      * @param scaleHigh Upper pixel scale bound (arcsec/pixel)
      * @param logOddsThreshold Minimum log-odds to accept solution
-     * @return Array [solved, ra, dec, crpixX, crpixY, cd11, cd12, cd21, cd22, pixelScale, rotation, logOdds]
+     * @return Array [solved, ra, dec, crpixX, crpixY, cd11, cd12, cd21, cd22, pixelScale, rotation, logOdds,
+     *         numSolutions, then numSolutions blocks of {@link Solution#STRIDE} values]
      */
     public static native double[] solveFieldNative(
         float[] starXY, int numStars,
@@ -63,6 +70,27 @@ public class AstrometryNative {
         double logOddsThreshold
     );
 
+    /**
+     * Per-index, per-depth statistics of the most recent solve.
+     * @return {@link SolveStats#STRIDE} values per entry (see {@link SolveStats}), or an empty array
+     */
+    public static native double[] getLastSolveStatsNative();
+
+    /**
+     * Start reading the given index files into the page cache on a background
+     * thread, so the first solve does not stall on page faults. Returns immediately.
+     * @param indexPaths Paths to index files
+     */
+    public static native void prefetchIndexesNative(String[] indexPaths);
+
+    /**
+     * Keep a small metadata file per index in the given directory, so that loading an
+     * index (once per solve) skips parsing its FITS headers. Call before solving or
+     * prefetching; stale files are detected and rewritten.
+     * @param cacheDir Existing directory for the metadata files, or null to stop using one
+     */
+    public static native void setIndexCacheDirNative(String cacheDir);
+
     /**
      * Compute downsample factor based on image resolution.
      * &lt;2M pixels: 1, 2M-8M: 2, &gt;8M: 4.
@@ -147,6 +175,159 @@ public class AstrometryNative {
         return grayscale;
     }
 
+    /**
+     * One distinct candidate solution of a field, as found during the search.
+     */
+    public static class Solution {
+        /** Number of values per solution in the native result array. */
+        public static final int STRIDE = 14;
+
+        public final double ra;           // Right ascension in degrees
+        public final double dec;          // Declination in degrees
+        public final double crpixX;       // Reference pixel X
+        public final double crpixY;       // Reference pixel Y
+        public final double[] cd;         // CD matrix [4] = {cd11, cd12, cd21, cd22}
+        public final double pixelScale;   // Arcseconds per pixel
+        public final double rotation;     // Field rotation in degrees
+        public final double logOdds;      // Confidence measure
+        public final int numMatched;      // Index stars matched to field stars
+        public final int numConflicts;    // Field stars matched by more than one index star
+        public final int indexId;         // Index that produced the match (e.g. 4115)
+
+        Solution(double[] result, int offset) {
+            this.ra = result[offset];
+            this.dec = result[offset + 1];
+            this.crpixX = result[offset + 2];
+            this.crpixY = result[offset + 3];
+            this.cd = new double[] {result[offset + 4], result[offset + 5],
+                                    result[offset + 6], result[offset + 7]};
+            this.pixelScale = result[offset + 8];
+            this.rotation = result[offset + 9];
+            this.logOdds = result[offset + 10];
+            this.numMatched = (int) result[offset + 11];
+            this.numConflicts = (int) result[offset + 12];
+            this.indexId = (int) result[offset + 13];
+        }
+    }
+
+    /**
+     * Where the solver spent its effort on one index over one depth window
+     * (field objects startObj+1 .. endObj). Times are in seconds.
+     */
+    public static class SolveStats {
+        /** Number of values per entry in the native stats array. */
+        public static final int STRIDE = 17;
+
+        public final int indexId;
+        public final int healpix;
+        public final int startObj;
+        public final int endObj;
+        public final int quadsTried;
+        public final int quadsMatched;
+        public final int scaleOk;
+        public final int cxdxSkipped;
+        public final int meanxSkipped;
+        public final int radecSkipped;
+        public final int abscaleSkipped;
+        public final int prefilterRejected;
+        public final int verified;
+        public final double timeQuads;    // Building quads and codes
+        public final double timeSearch;   // Code tree searches
+        public final double timeFit;      // Fitting WCS to matched quads
+        public final double timeVerify;   // Verification (incl. prefilter and tuning)
+
+        SolveStats(double[] stats, int offset) {
+            this.indexId = (int) stats[offset];
+            this.healpix = (int) stats[offset + 1];
+            this.startObj = (int) stats[offset + 2];
+            this.endObj = (int) stats[offset + 3];
+            this.quadsTried = (int) stats[offset + 4];
+            this.quadsMatched = (int) stats[offset + 5];
+            this.scaleOk = (int) stats[offset + 6];
+            this.cxdxSkipped = (int) stats[offset + 7];
+            this.meanxSkipped = (int) stats[offset + 8];
+            this.radecSkipped = (int) stats[offset + 9];
+            this.abscaleSkipped = (int) stats[offset + 10];
+            this.prefilterRejected = (int) stats[offset + 11];
+            this.verified = (int) stats[offset + 12];
+            this.timeQuads = stats[offset + 13];
+            this.timeSearch = stats[offset + 14];
+            this.timeFit = stats[offset + 15];
+            this.timeVerify = stats[offset + 16];
+        }
+
+        public double totalTime() {
+            return timeQuads + timeSearch + timeFit + timeVerify;
+        }
+    }
+
+    /**
+     * Statistics of the most recent solve, one entry per index per depth window.
+     * @return List of stats (empty if none or the library is not loaded)
+     */
+    public static List<SolveStats> getLastSolveStats() {
+        List<SolveStats> list = new ArrayList<>();
+        if (!libraryLoaded) {
+            return list;
+        }
+        double[] stats = getLastSolveStatsNative();
+        if (stats == null) {
+            return list;
+        }
+        for (int i = 0; i + SolveStats.STRIDE <= stats.length; i += SolveStats.STRIDE) {
+            list.add(new SolveStats(stats, i));
+        }
+        return list;
+    }
+
+    /**
+     * Index path for an index stored as {@code length} bytes at byte {@code offset} of
+     * {@code container} (e.g. an uncompressed asset inside the APK). Such indexes are
+     * mapped in place by the native code instead of being copied out first.
+     * @param container Path of the file holding the index
+     * @param offset Byte offset of the index within the file
+     * @param length Length of the index in bytes
+     * @return Path usable wherever index file paths are accepted
+     */
+    public static String indexInContainer(String container, long offset, long length) {
+        return container + "#" + offset + ":" + length;
+    }
+
+    /**
+     * Use the given directory for index metadata files (see {@link #setIndexCacheDirNative}),
+     * creating it if needed. Does nothing if the library is not loaded, or if this
+     * directory is already in use: every activity calls this from onCreate, and the
+     * directory is set once per process.
+     */
+    public static synchronized void setIndexCacheDir(File cacheDir) {
+        String path = cacheDir.getAbsolutePath();
+        if (!libraryLoaded || path.equals(indexCacheDir)) {
+            return;
+        }
+        if (!cacheDir.isDirectory() && !cacheDir.mkdirs()) {
+            Log.w(TAG, "Failed to create index cache directory: " + cacheDir);
+            return;
+        }
+        setIndexCacheDirNative(path);
+        indexCacheDir = path;
+    }
+
+    /**
+     * Warm up the given index files in the background (see {@link #prefetchIndexesNative}),
+     * once per process: later calls (from activities being recreated, for instance) do
+     * nothing, since the first one already put the files in the page cache.
+     * Does nothing if the library is not loaded.
+     */
+    public static void prefetchIndexes(List<String> indexPaths) {
+        if (!libraryLoaded || indexPaths.isEmpty()) {
+            return;
+        }
+        if (!indexesPrefetched.compareAndSet(false, true)) {
+            return;
+        }
+        prefetchIndexesNative(indexPaths.toArray(new String[0]));
+    }
+
     /**
      * Result of plate solving operation.
      */
@@ -160,6 +341,9 @@ public class AstrometryNative {
         public final double pixelScale;   // Arcseconds per pixel
         public final double rotation;     // Field rotation in degrees
         public final double logOdds;      // Confidence measure
+        // The best distinct solutions seen (best first), including the
+        // accepted one; may be non-empty even if the field did not solve.
+        public final List<Solution> solutions;
 
         public SolveResult(double[] result) {
             this.solved = result[0] > 0.5;
@@ -171,6 +355,15 @@ public class AstrometryNative {
             this.pixelScale = result[9];
             this.rotation = result[10];
             this.logOdds = result[11];
+
+            List<Solution> sols = new ArrayList<>();
+            if (result.length > 12) {
+                int n = (int) result[12];
+                for (int i = 0; i < n && 13 + (i + 1) * Solution.STRIDE <= result.length; i++) {
+                    sols.add(new Solution(result, 13 + i * Solution.STRIDE));
+                }
+            }
+            this.solutions = sols;
         }
 
         public static SolveResult failed() {
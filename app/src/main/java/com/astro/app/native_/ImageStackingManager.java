@@ -3,15 +3,26 @@ package com.astro.app.native_;
 import android.graphics.Bitmap;
 import android.util.Log;
 
+import java.io.File;
+import java.util.Map;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.ConcurrentHashMap;
+
 /**
  * Orchestrates multi-frame image stacking pipeline.
- * Combines star detection, triangle asterism matching, and averaging to improve SNR.
+ * Combines star detection, triangle asterism matching, and mean or median
+ * combining to improve SNR.
  *
  * Usage:
  * 1. startSession(firstFrame, callback) - initialize with reference frame
  * 2. addFrame(frame) - align and stack additional frames
  * 3. getResult() - retrieve current stacked image
  * 4. release() - clean up native resources
+ *
+ * Pipelined usage (detection of frame N+1 overlaps the warp of frame N):
+ * 1. startAsyncSession(width, height, callback, ...) - start native worker threads
+ * 2. addFrameAsync(frame) - queue frames; blocks only while the pipeline is full
+ * 3. finishAsync() - wait for queued frames, then getResult() / release()
  */
 public class ImageStackingManager {
     private static final String TAG = "ImageStackingManager";
@@ -20,6 +31,7 @@ public class ImageStackingManager {
     private static final float PLIM = 8.0f;
     private static final float DPSF = 1.0f;
     private static final int MIN_STARS = 20;  // Minimum stars needed for alignment
+    private static final int PIPELINE_QUEUE_DEPTH = 2;  // Frames buffered ahead of each native stage
 
     // Reasonable image size limits
     private static final int MIN_DIMENSION = 100;
@@ -30,8 +42,17 @@ public class ImageStackingManager {
     private int width = 0;
     private int height = 0;
     private float[] referenceStars = null;  // First frame's stars (x, y, flux triplets)
-    private int frameCount = 0;
+    private volatile int frameCount = 0;  // Updated from the native warp thread in pipelined sessions
     private StackingCallback callback = null;
+    private int alignModel = StackingNative.ALIGN_AFFINE;
+    private File checkpointFile = null;  // Non-null: sessions are checkpointed here
+    private int checkpointMaxFrames = 0;
+
+    // Pipelined session state
+    private volatile boolean pipelineRunning = false;
+    private int nextSequence = 0;
+    private final Map<Integer, CompletableFuture<StackingNative.FrameResult>> pendingFrames =
+            new ConcurrentHashMap<>();
 
     /**
      * Callback interface for stacking progress and errors
@@ -61,6 +82,48 @@ public class ImageStackingManager {
         void onStarDetectionFailed(int frameNumber, int starCount);
     }
 
+    /**
+     * Set the alignment model used by sessions started afterwards.
+     * @param model StackingNative.ALIGN_AFFINE, ALIGN_HOMOGRAPHY or ALIGN_POLYNOMIAL
+     */
+    public void setAlignmentModel(int model) {
+        this.alignModel = model;
+    }
+
+    private void applyAlignmentModel(long handle) {
+        if (alignModel != StackingNative.ALIGN_AFFINE
+                && !StackingNative.setAlignmentModel(handle, alignModel)) {
+            Log.w(TAG, "Alignment model " + alignModel + " rejected, using affine");
+        }
+    }
+
+    /**
+     * Checkpoint sessions started afterwards to a memory-mapped file, so they
+     * can be reopened with resumeAsyncSession() if the process is killed.
+     * @param file checkpoint file (null disables checkpointing)
+     * @param maxFrames maximum number of frames in a session
+     */
+    public void setCheckpoint(File file, int maxFrames) {
+        this.checkpointFile = file;
+        this.checkpointMaxFrames = maxFrames;
+    }
+
+    /**
+     * Delete the checkpoint files once the stacked result has been retrieved.
+     */
+    public void discardCheckpoint() {
+        if (checkpointFile != null) {
+            StackingNative.deleteCheckpoint(checkpointFile.getAbsolutePath());
+        }
+    }
+
+    private void applyCheckpoint(long handle) {
+        if (checkpointFile != null && !StackingNative.enableCheckpoint(handle,
+                checkpointFile.getAbsolutePath(), checkpointMaxFrames)) {
+            Log.w(TAG, "Checkpointing unavailable, session is memory-only");
+        }
+    }
+
     /**
      * Start a new stacking session with the first frame
      * @param firstFrame first frame bitmap (grayscale or color)
@@ -68,6 +131,20 @@ public class ImageStackingManager {
      * @return true if session started successfully
      */
     public boolean startSession(Bitmap firstFrame, StackingCallback callback) {
+        return startSession(firstFrame, callback, StackingNative.COMBINE_MEAN, 0, null);
+    }
+
+    /**
+     * Start a new stacking session with the first frame and a combine mode
+     * @param firstFrame first frame bitmap (grayscale or color)
+     * @param callback progress callback (nullable)
+     * @param combineMode StackingNative.COMBINE_MEAN or StackingNative.COMBINE_MEDIAN
+     * @param maxFrames maximum number of frames in the session (COMBINE_MEDIAN only)
+     * @param scratchDir directory for the median frame store (COMBINE_MEDIAN only)
+     * @return true if session started successfully
+     */
+    public boolean startSession(Bitmap firstFrame, StackingCallback callback,
+                                int combineMode, int maxFrames, File scratchDir) {
         // Check libraries loaded
         if (!AstrometryNative.isLibraryLoaded()) {
             Log.e(TAG, "startSession failed: AstrometryNative library not loaded");
@@ -133,7 +210,8 @@ public class ImageStackingManager {
         // Initialize native stacking context (grayscale only)
         long handle;
         try {
-            handle = StackingNative.initStacking(w, h, false);
+            handle = StackingNative.initStacking(w, h, false, combineMode, maxFrames,
+                    scratchDir != null ? scratchDir.getAbsolutePath() : null);
         } catch (Exception | Error e) {
             Log.e(TAG, "startSession failed: native initialization crashed", e);
             return false;
@@ -142,6 +220,8 @@ public class ImageStackingManager {
             Log.e(TAG, "startSession failed: native initialization failed");
             return false;
         }
+        applyAlignmentModel(handle);
+        applyCheckpoint(handle);
 
         // Add first frame (null refStars for reference frame)
         StackingNative.AlignmentResult result;
@@ -282,7 +362,233 @@ public class ImageStackingManager {
         return true;
     }
 
-        /**
+    /**
+     * Start a pipelined stacking session. Frames are queued with addFrameAsync();
+     * star detection and alignment run on dedicated native threads. The first
+     * frame with enough stars becomes the reference.
+     * @param w frame width (all frames must match)
+     * @param h frame height (all frames must match)
+     * @param callback progress callback (nullable); invoked on a native worker thread
+     * @param combineMode StackingNative.COMBINE_MEAN or StackingNative.COMBINE_MEDIAN
+     * @param maxFrames maximum number of frames in the session (COMBINE_MEDIAN only)
+     * @param scratchDir directory for the median frame store (COMBINE_MEDIAN only)
+     * @return true if session started successfully
+     */
+    public boolean startAsyncSession(int w, int h, StackingCallback callback,
+                                     int combineMode, int maxFrames, File scratchDir) {
+        if (!StackingNative.isLibraryLoaded()) {
+            Log.e(TAG, "startAsyncSession failed: StackingNative library not loaded");
+            return false;
+        }
+
+        if (isActive()) {
+            Log.e(TAG, "startAsyncSession failed: a session is already active");
+            return false;
+        }
+
+        if (w < MIN_DIMENSION || h < MIN_DIMENSION || w > MAX_DIMENSION || h > MAX_DIMENSION) {
+            Log.e(TAG, "startAsyncSession failed: invalid dimensions " + w + "x" + h);
+            return false;
+        }
+
+        long handle;
+        try {
+            handle = StackingNative.initStacking(w, h, false, combineMode, maxFrames,
+                    scratchDir != null ? scratchDir.getAbsolutePath() : null);
+        } catch (Exception | Error e) {
+            Log.e(TAG, "startAsyncSession failed: native initialization crashed", e);
+            return false;
+        }
+        if (handle == 0) {
+            Log.e(TAG, "startAsyncSession failed: native initialization failed");
+            return false;
+        }
+        applyAlignmentModel(handle);
+        applyCheckpoint(handle);
+
+        this.callback = callback;
+        int ds = AstrometryNative.computeDownsample(w, h);
+        if (!StackingNative.startPipeline(handle, PIPELINE_QUEUE_DEPTH, PLIM, DPSF, ds,
+                MIN_STARS, this::onFrameProcessed)) {
+            StackingNative.release(handle);
+            this.callback = null;
+            return false;
+        }
+
+        this.nativeHandle = handle;
+        this.width = w;
+        this.height = h;
+        this.frameCount = 0;
+        this.nextSequence = 0;
+        this.pipelineRunning = true;
+
+        Log.i(TAG, "Pipelined stacking session started: " + w + "x" + h);
+        return true;
+    }
+
+    /**
+     * Reopen a checkpointed session (see setCheckpoint) as a pipelined session.
+     * Frames stacked before the process died are kept; further frames are
+     * queued with addFrameAsync() as usual.
+     * @param checkpoint checkpoint file of the interrupted session
+     * @param callback progress callback (nullable); invoked on a native worker thread
+     * @return true if the session was resumed
+     */
+    public boolean resumeAsyncSession(File checkpoint, StackingCallback callback) {
+        if (!StackingNative.isLibraryLoaded()) {
+            Log.e(TAG, "resumeAsyncSession failed: StackingNative library not loaded");
+            return false;
+        }
+
+        if (isActive()) {
+            Log.e(TAG, "resumeAsyncSession failed: a session is already active");
+            return false;
+        }
+
+        long handle;
+        try {
+            handle = StackingNative.resumeStacking(checkpoint.getAbsolutePath());
+        } catch (Exception | Error e) {
+            Log.e(TAG, "resumeAsyncSession failed: native resume crashed", e);
+            return false;
+        }
+        if (handle == 0) {
+            Log.e(TAG, "resumeAsyncSession failed: no usable checkpoint at " + checkpoint);
+            return false;
+        }
+        StackingNative.SessionInfo info = StackingNative.getSessionInfo(handle);
+        if (info == null) {
+            Log.e(TAG, "resumeAsyncSession failed: session info unavailable");
+            StackingNative.release(handle);
+            return false;
+        }
+
+        this.callback = callback;
+        int ds = AstrometryNative.computeDownsample(info.width, info.height);
+        if (!StackingNative.startPipeline(handle, PIPELINE_QUEUE_DEPTH, PLIM, DPSF, ds,
+                MIN_STARS, this::onFrameProcessed)) {
+            StackingNative.release(handle);
+            this.callback = null;
+            return false;
+        }
+
+        this.nativeHandle = handle;
+        this.width = info.width;
+        this.height = info.height;
+        this.frameCount = info.frameCount;
+        this.nextSequence = 0;
+        this.pipelineRunning = true;
+        this.checkpointFile = checkpoint;
+
+        Log.i(TAG, "Resumed stacking session: " + info.width + "x" + info.height
+                + ", " + info.frameCount + " frames");
+        return true;
+    }
+
+    /**
+     * Queue a frame on a pipelined session. Grayscale conversion runs on the
+     * calling thread; the call blocks only while the native queues are full.
+     * Must be called from a single thread.
+     * @param frame bitmap to add (must match session dimensions); may be recycled on return
+     * @return future completed (on a native worker thread) with the frame's result
+     */
+    public CompletableFuture<StackingNative.FrameResult> addFrameAsync(Bitmap frame) {
+        int sequence = nextSequence;
+
+        if (!pipelineRunning) {
+            Log.e(TAG, "addFrameAsync failed: no pipelined session");
+            return CompletableFuture.completedFuture(StackingNative.FrameResult.failed(sequence));
+        }
+
+        if (frame == null || frame.getWidth() != width || frame.getHeight() != height) {
+            Log.e(TAG, "addFrameAsync failed: null bitmap or dimension mismatch");
+            return CompletableFuture.completedFuture(StackingNative.FrameResult.failed(sequence));
+        }
+
+        byte[] grayData = AstrometryNative.bitmapToGrayscale(frame);
+        if (grayData == null) {
+            Log.e(TAG, "addFrameAsync failed: grayscale conversion failed");
+            return CompletableFuture.completedFuture(StackingNative.FrameResult.failed(sequence));
+        }
+
+        // Register before submitting: the result may arrive before submitFrame returns
+        CompletableFuture<StackingNative.FrameResult> future = new CompletableFuture<>();
+        pendingFrames.put(sequence, future);
+
+        int submitted;
+        try {
+            submitted = StackingNative.submitFrame(nativeHandle, grayData);
+        } catch (Exception | Error e) {
+            Log.e(TAG, "addFrameAsync failed: native submitFrame crashed", e);
+            submitted = -1;
+        }
+        if (submitted != sequence) {
+            Log.e(TAG, "addFrameAsync failed: frame " + (sequence + 1) + " was not queued");
+            pendingFrames.remove(sequence);
+            future.complete(StackingNative.FrameResult.failed(sequence));
+            return future;
+        }
+
+        nextSequence++;
+        return future;
+    }
+
+    /**
+     * Wait until every queued frame has been processed and stop the pipeline
+     * threads. No-op for synchronous sessions.
+     */
+    public void finishAsync() {
+        if (!pipelineRunning) {
+            return;
+        }
+
+        try {
+            StackingNative.finishPipeline(nativeHandle);
+        } catch (Exception | Error e) {
+            Log.e(TAG, "finishAsync failed: native finishPipeline crashed", e);
+        }
+        pipelineRunning = false;
+
+        // Anything not reported by now was dropped by the native side
+        for (Map.Entry<Integer, CompletableFuture<StackingNative.FrameResult>> e : pendingFrames.entrySet()) {
+            e.getValue().complete(StackingNative.FrameResult.failed(e.getKey()));
+        }
+        pendingFrames.clear();
+
+        Log.i(TAG, "Pipelined session finished: " + frameCount + " frames stacked");
+    }
+
+    // Called on the native warp thread, in submission order
+    private void onFrameProcessed(int sequence, double[] result) {
+        StackingNative.FrameResult frameResult = new StackingNative.FrameResult(sequence, result);
+        StackingNative.AlignmentResult align = frameResult.alignment;
+        int frameNumber = sequence + 1;
+
+        if (frameResult.status == StackingNative.FRAME_STACKED) {
+            frameCount = align.frameCount;
+            if (callback != null) {
+                callback.onFrameStacked(frameNumber, align.frameCount, align.inliers, align.rmsError);
+            }
+        } else if (frameResult.status == StackingNative.FRAME_DETECTION_FAILED) {
+            Log.w(TAG, "Frame " + frameNumber + ": too few stars (" + frameResult.starCount + ")");
+            if (callback != null) {
+                callback.onStarDetectionFailed(frameNumber, frameResult.starCount);
+            }
+        } else {
+            Log.w(TAG, "Frame " + frameNumber + " alignment failed (status " + frameResult.status + ")");
+            if (callback != null) {
+                callback.onAlignmentFailed(frameNumber, frameResult.status == StackingNative.FRAME_ERROR
+                        ? "Native error" : "Insufficient inliers (" + align.inliers + ")");
+            }
+        }
+
+        CompletableFuture<StackingNative.FrameResult> future = pendingFrames.remove(sequence);
+        if (future != null) {
+            future.complete(frameResult);
+        }
+    }
+
+    /**
      * Get the current stacked result
      * @return stacked image as bitmap, or null if no frames stacked
      */
@@ -292,6 +598,9 @@ public class ImageStackingManager {
             return null;
         }
 
+        // The accumulator is owned by the warp thread until the pipeline drains
+        finishAsync();
+
         if (frameCount == 0) {
             Log.e(TAG, "getResult failed: no frames stacked");
             return null;
@@ -350,6 +659,8 @@ public class ImageStackingManager {
      * Release native resources and reset session state
      */
     public void release() {
+        finishAsync();
+
         if (nativeHandle != 0) {
             try {
                 StackingNative.release(nativeHandle);
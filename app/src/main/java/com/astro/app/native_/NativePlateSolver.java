@@ -1,6 +1,7 @@
 package com.astro.app.native_;
 
 import android.content.Context;
+import android.content.res.AssetFileDescriptor;
 import android.graphics.Bitmap;
 import android.util.Log;
 
@@ -156,7 +157,8 @@ public class NativePlateSolver {
     }
 
     /**
-     * Loads index files from assets to internal storage.
+     * Registers the index files in an asset directory. Assets stored uncompressed in
+     * the APK are used in place; others are first copied to internal storage.
      * @param assetDir Asset directory containing index files
      * @return Number of index files loaded
      */
@@ -181,6 +183,18 @@ public class NativePlateSolver {
             if (asset.endsWith(".fits")) {
                 File outFile = new File(indexDir, asset);
 
+                String inPlace = indexInApk(assetDir + "/" + asset);
+                if (inPlace != null) {
+                    // A copy left by an older version is no longer needed.
+                    if (outFile.exists() && outFile.delete()) {
+                        Log.i(TAG, "Deleted copied index: " + outFile.getAbsolutePath());
+                    }
+                    addIndexPath(inPlace);
+                    Log.i(TAG, "Added index path: " + inPlace);
+                    count++;
+                    continue;
+                }
+
                 // Copy if not exists
                 if (!outFile.exists()) {
                     Log.i(TAG, "Copying " + asset + " to " + outFile.getAbsolutePath());
@@ -196,9 +210,25 @@ public class NativePlateSolver {
         }
 
         Log.i(TAG, "Loaded " + count + " index files. Total paths: " + indexPaths.size());
+        AstrometryNative.setIndexCacheDir(new File(context.getCacheDir(), "index-meta"));
+        AstrometryNative.prefetchIndexes(indexPaths);
         return count;
     }
 
+    /**
+     * Returns an index path referring to the asset inside the APK, or null if the
+     * asset is compressed (and so cannot be mapped in place).
+     */
+    private String indexInApk(String assetPath) {
+        try (AssetFileDescriptor afd = context.getAssets().openFd(assetPath)) {
+            return AstrometryNative.indexInContainer(context.getApplicationInfo().sourceDir,
+                    afd.getStartOffset(), afd.getLength());
+        } catch (IOException e) {
+            Log.d(TAG, "Asset " + assetPath + " is compressed: " + e.getMessage());
+            return null;
+        }
+    }
+
     private void copyAssetFile(String assetPath, File outFile) throws IOException {
         try (InputStream in = context.getAssets().open(assetPath);
              FileOutputStream out = new FileOutputStream(outFile)) {
@@ -2,12 +2,56 @@ package com.astro.app.native_;
 
 import android.util.Log;
 
+import java.io.File;
+
 /**
  * JNI interface to native image stacking library.
- * Provides triangle asterism matching, RANSAC alignment, and mean accumulation.
+ * Provides triangle asterism matching, RANSAC alignment (optionally refined to a
+ * homography or polynomial), and mean or median combining.
  */
 public class StackingNative {
     private static final String TAG = "StackingNative";
+
+    /** Per-pixel mean of all aligned frames (running accumulator, constant memory). */
+    public static final int COMBINE_MEAN = 0;
+
+    /**
+     * Per-pixel median of all aligned frames. Warped frames are kept in a
+     * disk-backed scratch file, so the number of frames is fixed at session start.
+     */
+    public static final int COMBINE_MEDIAN = 1;
+
+    /** Align frames with the RANSAC affine transform only. */
+    public static final int ALIGN_AFFINE = 0;
+    /** Refine the affine alignment to a homography (projective transform). */
+    public static final int ALIGN_HOMOGRAPHY = 1;
+    /**
+     * Refine the affine alignment to a SIP-style polynomial (up to 3rd order),
+     * which follows wide-angle lens distortion. Falls back to a homography or
+     * the affine transform when too few stars match to constrain it.
+     */
+    public static final int ALIGN_POLYNOMIAL = 2;
+
+    /** Pipelined frame status: aligned and accumulated. */
+    public static final int FRAME_STACKED = 0;
+    /** Pipelined frame status: too few stars detected. */
+    public static final int FRAME_DETECTION_FAILED = 1;
+    /** Pipelined frame status: stars detected but alignment failed. */
+    public static final int FRAME_ALIGNMENT_FAILED = 2;
+    /** Pipelined frame status: native error (allocation or reference setup). */
+    public static final int FRAME_ERROR = 3;
+
+    /**
+     * Receives per-frame results from a pipelined session.
+     * Called on the native warp thread, in submission order.
+     */
+    public interface FrameListener {
+        /**
+         * @param sequence 0-based submission index returned by submitFrame
+         * @param result [success, inliers, rmsError, frameCount, status, starCount]
+         */
+        void onFrameProcessed(int sequence, double[] result);
+    }
     private static boolean libraryLoaded = false;
 
     static {
@@ -30,9 +74,22 @@ public class StackingNative {
      * @param width Image width in pixels
      * @param height Image height in pixels
      * @param isColor True for RGB, false for grayscale (currently only grayscale supported)
+     * @param combineMode COMBINE_MEAN or COMBINE_MEDIAN
+     * @param maxFrames Frame store capacity (COMBINE_MEDIAN only)
+     * @param scratchDir Directory for the frame store scratch file (COMBINE_MEDIAN only)
      * @return Native handle (jlong), or 0 on failure
      */
-    private static native long initStackingNative(int width, int height, boolean isColor);
+    private static native long initStackingNative(int width, int height, boolean isColor,
+                                                  int combineMode, int maxFrames,
+                                                  String scratchDir);
+
+    /**
+     * Select the alignment model for subsequent frames.
+     * @param handle Native stacking context handle
+     * @param model ALIGN_AFFINE, ALIGN_HOMOGRAPHY or ALIGN_POLYNOMIAL
+     * @return true if the model was accepted
+     */
+    private static native boolean setAlignmentModelNative(long handle, int model);
 
     /**
      * Add frame to stack.
@@ -45,10 +102,39 @@ public class StackingNative {
     private static native double[] addFrameNative(long handle, byte[] imageData,
                                                   float[] stars, float[] refStars);
 
+    /**
+     * Start detection and warp threads for a pipelined session.
+     * @param handle Native stacking context handle
+     * @param queueDepth Frames buffered ahead of each stage (back-pressure bound)
+     * @param plim Detection threshold
+     * @param dpsf PSF sigma
+     * @param downsample Detection downsample factor
+     * @param minStars Minimum stars for a frame to be aligned
+     * @param listener Per-frame result listener
+     * @return true if the pipeline started
+     */
+    private static native boolean startPipelineNative(long handle, int queueDepth,
+                                                      float plim, float dpsf, int downsample,
+                                                      int minStars, FrameListener listener);
+
+    /**
+     * Queue a grayscale frame; blocks while the pipeline is full.
+     * @param handle Native stacking context handle
+     * @param imageData Grayscale image byte array (width*height), copied before return
+     * @return Frame sequence number, or -1 on failure
+     */
+    private static native int submitFrameNative(long handle, byte[] imageData);
+
+    /**
+     * Wait for all queued frames to be processed and stop the pipeline threads.
+     * @param handle Native stacking context handle
+     */
+    private static native void finishPipelineNative(long handle);
+
     /**
      * Get stacked result image.
      * @param handle Native stacking context handle
-     * @return Averaged grayscale byte array, or null on failure
+     * @return Combined (mean or median) grayscale byte array, or null on failure
      */
     private static native byte[] getStackedImageNative(long handle);
 
@@ -59,6 +145,29 @@ public class StackingNative {
      */
     private static native int getFrameCountNative(long handle);
 
+    /**
+     * Move a fresh session's accumulator into a memory-mapped checkpoint file.
+     * @param handle Native stacking context handle (no frames added yet)
+     * @param path Checkpoint file path
+     * @param maxFrames Frame capacity (the median store's capacity is used for COMBINE_MEDIAN)
+     * @return true if checkpointing is enabled
+     */
+    private static native boolean enableCheckpointNative(long handle, String path, int maxFrames);
+
+    /**
+     * Reopen a session from its checkpoint file.
+     * @param path Checkpoint file path
+     * @return Native handle, or 0 on failure
+     */
+    private static native long resumeStackingNative(String path);
+
+    /**
+     * Get session geometry and settings.
+     * @param handle Native stacking context handle
+     * @return [width, height, frameCount, combineMode, alignModel], or null on failure
+     */
+    private static native int[] getSessionInfoNative(long handle);
+
     /**
      * Release native stacking context and free memory.
      * @param handle Native stacking context handle
@@ -93,6 +202,51 @@ public class StackingNative {
         }
     }
 
+    /**
+     * Geometry and settings of a (possibly resumed) session.
+     */
+    public static class SessionInfo {
+        public final int width;
+        public final int height;
+        public final int frameCount;
+        public final int combineMode;
+        public final int alignModel;
+
+        public SessionInfo(int[] info) {
+            this.width = info[0];
+            this.height = info[1];
+            this.frameCount = info[2];
+            this.combineMode = info[3];
+            this.alignModel = info[4];
+        }
+    }
+
+    /**
+     * Result of one frame processed by a pipelined session.
+     */
+    public static class FrameResult {
+        public final int sequence;
+        public final int status;
+        public final int starCount;
+        public final AlignmentResult alignment;
+
+        public FrameResult(int sequence, double[] result) {
+            this.sequence = sequence;
+            this.alignment = new AlignmentResult(result);
+            if (result == null || result.length < 6) {
+                this.status = FRAME_ERROR;
+                this.starCount = 0;
+            } else {
+                this.status = (int) result[4];
+                this.starCount = (int) result[5];
+            }
+        }
+
+        public static FrameResult failed(int sequence) {
+            return new FrameResult(sequence, null);
+        }
+    }
+
     /**
      * Initialize stacking session.
      * @param width Image width in pixels
@@ -101,22 +255,74 @@ public class StackingNative {
      * @return Native handle (jlong), or 0 on failure
      */
     public static long initStacking(int width, int height, boolean isColor) {
+        return initStacking(width, height, isColor, COMBINE_MEAN, 0, null);
+    }
+
+    /**
+     * Initialize stacking session with an explicit combine mode.
+     * @param width Image width in pixels
+     * @param height Image height in pixels
+     * @param isColor True for RGB, false for grayscale (currently only grayscale supported)
+     * @param combineMode COMBINE_MEAN or COMBINE_MEDIAN
+     * @param maxFrames Maximum number of frames kept for COMBINE_MEDIAN (ignored for mean)
+     * @param scratchDir Directory for the median frame store, e.g. Context.getCacheDir()
+     * @return Native handle (jlong), or 0 on failure
+     */
+    public static long initStacking(int width, int height, boolean isColor,
+                                    int combineMode, int maxFrames, String scratchDir) {
         if (!libraryLoaded) {
             Log.e(TAG, "Native library not loaded");
             return 0;
         }
 
-        long handle = initStackingNative(width, height, isColor);
+        if (combineMode != COMBINE_MEAN && combineMode != COMBINE_MEDIAN) {
+            Log.e(TAG, "Invalid combine mode: " + combineMode);
+            return 0;
+        }
+
+        if (combineMode == COMBINE_MEDIAN && (maxFrames <= 0 || scratchDir == null)) {
+            Log.e(TAG, "Median combine requires maxFrames > 0 and a scratch directory");
+            return 0;
+        }
+
+        long handle = initStackingNative(width, height, isColor, combineMode, maxFrames, scratchDir);
         if (handle == 0) {
             Log.e(TAG, "Failed to initialize stacking context");
         } else {
             Log.i(TAG, "Stacking context initialized: " + width + "x" + height +
-                  (isColor ? " (color)" : " (grayscale)"));
+                  (isColor ? " (color)" : " (grayscale)") +
+                  (combineMode == COMBINE_MEDIAN ? ", median of up to " + maxFrames + " frames" : ", mean"));
         }
 
         return handle;
     }
 
+    /**
+     * Select how frames are aligned to the reference. Affects frames added
+     * afterwards; must not be called while a pipeline is running.
+     * @param handle Native stacking context handle
+     * @param model ALIGN_AFFINE, ALIGN_HOMOGRAPHY or ALIGN_POLYNOMIAL
+     * @return true if the model was accepted
+     */
+    public static boolean setAlignmentModel(long handle, int model) {
+        if (!libraryLoaded) {
+            Log.e(TAG, "Native library not loaded");
+            return false;
+        }
+
+        if (handle == 0) {
+            Log.e(TAG, "Invalid stacking context handle");
+            return false;
+        }
+
+        if (model != ALIGN_AFFINE && model != ALIGN_HOMOGRAPHY && model != ALIGN_POLYNOMIAL) {
+            Log.e(TAG, "Invalid alignment model: " + model);
+            return false;
+        }
+
+        return setAlignmentModelNative(handle, model);
+    }
+
     /**
      * Add frame to stack with alignment.
      * @param handle Native stacking context handle
@@ -165,10 +371,76 @@ public class StackingNative {
         return alignResult;
     }
 
+    /**
+     * Start a pipelined session: star detection and warping run on dedicated
+     * native threads, so detection of frame N+1 overlaps the warp of frame N.
+     * The first frame with enough stars becomes the reference.
+     * @param handle Native stacking context handle (no frames added yet)
+     * @param queueDepth Frames buffered ahead of each stage
+     * @param plim Detection threshold
+     * @param dpsf PSF sigma
+     * @param downsample Detection downsample factor
+     * @param minStars Minimum stars for a frame to be aligned
+     * @param listener Per-frame result listener (called on a native thread)
+     * @return true if the pipeline started
+     */
+    public static boolean startPipeline(long handle, int queueDepth, float plim, float dpsf,
+                                        int downsample, int minStars, FrameListener listener) {
+        if (!libraryLoaded) {
+            Log.e(TAG, "Native library not loaded");
+            return false;
+        }
+
+        if (handle == 0 || listener == null) {
+            Log.e(TAG, "Invalid stacking context handle or listener");
+            return false;
+        }
+
+        boolean started = startPipelineNative(handle, queueDepth, plim, dpsf, downsample,
+                minStars, listener);
+        if (!started) {
+            Log.e(TAG, "Failed to start stacking pipeline");
+        }
+        return started;
+    }
+
+    /**
+     * Queue a frame on a pipelined session. Blocks while the pipeline is full.
+     * @param handle Native stacking context handle
+     * @param imageData Grayscale image byte array (copied; may be reused after return)
+     * @return Frame sequence number, or -1 on failure
+     */
+    public static int submitFrame(long handle, byte[] imageData) {
+        if (!libraryLoaded) {
+            Log.e(TAG, "Native library not loaded");
+            return -1;
+        }
+
+        if (handle == 0 || imageData == null) {
+            Log.e(TAG, "Invalid stacking context handle or image data");
+            return -1;
+        }
+
+        return submitFrameNative(handle, imageData);
+    }
+
+    /**
+     * Wait until every submitted frame has been reported, then stop the
+     * pipeline threads. Must be called before getStackedImage.
+     * @param handle Native stacking context handle
+     */
+    public static void finishPipeline(long handle) {
+        if (!libraryLoaded || handle == 0) {
+            return;
+        }
+
+        finishPipelineNative(handle);
+    }
+
     /**
      * Get stacked result image.
      * @param handle Native stacking context handle
-     * @return Averaged grayscale byte array, or null on failure
+     * @return Combined (mean or median) grayscale byte array, or null on failure
      */
     public static byte[] getStackedImage(long handle) {
         if (!libraryLoaded) {
@@ -210,6 +482,80 @@ public class StackingNative {
         return getFrameCountNative(handle);
     }
 
+    /**
+     * Keep the session in a memory-mapped checkpoint file so it survives the
+     * process being killed. The accumulator, reference stars and frame
+     * footprints live in the file; the OS may page them out. For
+     * COMBINE_MEDIAN the frame store moves to {@code path + ".frames"}.
+     * Must be called before the first frame is added.
+     * @param handle Native stacking context handle
+     * @param path Checkpoint file path (e.g. under Context.getFilesDir())
+     * @param maxFrames Maximum number of frames in the session (ignored for COMBINE_MEDIAN)
+     * @return true if checkpointing is enabled
+     */
+    public static boolean enableCheckpoint(long handle, String path, int maxFrames) {
+        if (!libraryLoaded) {
+            Log.e(TAG, "Native library not loaded");
+            return false;
+        }
+
+        if (handle == 0 || path == null) {
+            Log.e(TAG, "Invalid stacking context handle or checkpoint path");
+            return false;
+        }
+
+        return enableCheckpointNative(handle, path, maxFrames);
+    }
+
+    /**
+     * Reopen a checkpointed session, e.g. after the process was killed.
+     * A frame that was interrupted mid-stack is completed from the checkpoint.
+     * @param path Checkpoint file path passed to enableCheckpoint
+     * @return Native handle, or 0 if there is no usable checkpoint
+     */
+    public static long resumeStacking(String path) {
+        if (!libraryLoaded) {
+            Log.e(TAG, "Native library not loaded");
+            return 0;
+        }
+
+        if (path == null || !new File(path).isFile()) {
+            return 0;
+        }
+
+        long handle = resumeStackingNative(path);
+        if (handle == 0) {
+            Log.e(TAG, "Failed to resume stacking session from " + path);
+        }
+        return handle;
+    }
+
+    /**
+     * Delete a checkpoint and its frame store, once the session is finished.
+     * @param path Checkpoint file path passed to enableCheckpoint
+     */
+    public static void deleteCheckpoint(String path) {
+        if (path == null) {
+            return;
+        }
+        new File(path).delete();
+        new File(path + ".frames").delete();
+    }
+
+    /**
+     * Get session geometry and settings.
+     * @param handle Native stacking context handle
+     * @return SessionInfo, or null on failure
+     */
+    public static SessionInfo getSessionInfo(long handle) {
+        if (!libraryLoaded || handle == 0) {
+            return null;
+        }
+
+        int[] info = getSessionInfoNative(handle);
+        return (info != null && info.length >= 5) ? new SessionInfo(info) : null;
+    }
+
     /**
      * Release native stacking context and free memory.
      * Should be called when stacking session is complete.
@@ -41,6 +41,7 @@ import com.astro.app.native_.AstrometryNative;
 import com.astro.app.native_.ConstellationOverlay;
 import com.astro.app.native_.ImageStackingManager;
 import com.astro.app.native_.NativePlateSolver;
+import com.astro.app.native_.StackingNative;
 import com.astro.app.ui.skybrightness.BortleScaleView;
 import com.astro.app.ui.skybrightness.SkyBrightnessAnalyzer;
 import com.google.android.material.button.MaterialButton;
@@ -65,6 +66,7 @@ public class ImageStackingActivity extends AppCompatActivity {
     private static final String TAG = "ImageStackingActivity";
     private static final int MAX_FRAMES = 10;
     private static final int MAX_PROCESSING_DIMENSION = 4096;
+    private static final String CHECKPOINT_FILE = "stacking.ckpt";
     private static final String PREFS_NAME = "astro_settings";
     private static final String KEY_HAS_SEEN_CAMERA_TIPS = "has_seen_camera_tips_stacking";
 
@@ -570,10 +572,13 @@ public class ImageStackingActivity extends AppCompatActivity {
         int targetW = 0, targetH = 0;
         boolean sessionOk = false;
 
+        // Pipelined session: decoding frame N+1 here overlaps native star
+        // detection and warping of earlier frames.
         for (int i = 0; i < uris.size(); i++) {
             if (isDestroyed || isCancelled) {
                 if (isCancelled) {
                     stackingManager.release();
+                    stackingManager.discardCheckpoint();
                     runOnUiThread(() -> tvStatus.setText("Stacking cancelled."));
                 }
                 return null;
@@ -598,26 +603,35 @@ public class ImageStackingActivity extends AppCompatActivity {
                 bitmap = scaled;
             }
 
-            boolean ok;
             if (!sessionOk) {
-                ok = stackingManager.startSession(bitmap, createCallback());
-                sessionOk = ok;
-            } else {
-                ok = stackingManager.addFrame(bitmap);
+                // Small stacks: median rejects satellites, planes and hot pixels.
+                // Phone lenses are wide-angle; follow their distortion when aligning.
+                stackingManager.setAlignmentModel(StackingNative.ALIGN_POLYNOMIAL);
+                stackingManager.setCheckpoint(new File(getFilesDir(), CHECKPOINT_FILE), MAX_FRAMES);
+                sessionOk = stackingManager.startAsyncSession(targetW, targetH, createCallback(),
+                        StackingNative.COMBINE_MEDIAN, MAX_FRAMES, getCacheDir());
+                if (!sessionOk) {
+                    Log.w(TAG, "Failed to start stacking session");
+                    bitmap.recycle();
+                    return null;
+                }
             }
+
+            // Grayscale copy is taken before return; results arrive via the callback
+            stackingManager.addFrameAsync(bitmap);
             bitmap.recycle();
             bitmap = null;
             System.gc(); // Hint to reclaim bitmap memory before next frame
-
-            if (!ok) {
-                Log.w(TAG, "Stacking failed for frame " + i);
-            }
         }
 
-        if (sessionOk && stackingManager.getFrameCount() > 0) {
-            Bitmap result = stackingManager.getResult();
-            stackingManager.release(); // Free native accumulator memory promptly
-            return result;
+        if (sessionOk) {
+            stackingManager.finishAsync();
+            if (stackingManager.getFrameCount() > 0) {
+                Bitmap result = stackingManager.getResult();
+                stackingManager.release(); // Free native accumulator memory promptly
+                stackingManager.discardCheckpoint();
+                return result;
+            }
         }
         return null;
     }